@@ -47,12 +47,19 @@ void DebugScene::SetupShaders(VulkanContext& vulkanContext, ModelManager& modelM
         {ResourcePathManager::GetShaderPath("basic.frag.spv"), VK_SHADER_STAGE_FRAGMENT_BIT}
 	};
 
+	// The renderer draws pbr models with this one when bindless materials are on
+	std::vector<std::pair<std::string, VkShaderStageFlagBits>> bindlessShaderPaths = {
+		{ResourcePathManager::GetShaderPath("bindless.vert.spv"), VK_SHADER_STAGE_VERTEX_BIT},
+        {ResourcePathManager::GetShaderPath("bindless.frag.spv"), VK_SHADER_STAGE_FRAGMENT_BIT}
+	};
+
 	std::vector<std::pair<std::string, VkShaderStageFlagBits>> gridShaderPaths = {
 		{ResourcePathManager::GetShaderPath("grid.vert.spv"),   VK_SHADER_STAGE_VERTEX_BIT},
         {ResourcePathManager::GetShaderPath("grid.frag.spv"), VK_SHADER_STAGE_FRAGMENT_BIT}
 	};
 
 	modelManager.CreatePipeline("pbr", vulkanContext, shaderManager, descriptorManager, meshShaderPaths, true);
+	modelManager.CreatePipeline("pbr_bindless", vulkanContext, shaderManager, descriptorManager, bindlessShaderPaths, true);
 
 	// Set up the shared descriptor set pair (Grabbing it from the basic descriptors)
 	descriptorManager.CreateSharedDescriptorSet(modelManager.GetPipelines()["pbr"].descriptorSetLayouts[0]);
@@ -69,16 +76,18 @@ void DebugScene::InitializeDebugObjects(VulkanContext& vulkanContext, ModelManag
 	light.SetColor(glm::vec3(0.98f, 0.506f, 0.365f));
 	m_entityManager.AddEntity(lightEntity);
 
+    vkb::DispatchTable& disp = vulkanContext.GetDispatchTable();
+    VkQueue graphicsQueue = vulkanContext.GetGraphicsQueue();
+    VkCommandPool commandPool = vulkanContext.GetCommandPool();
     VmaAllocator allocator = vulkanContext.GetAllocator();
     auto debugMesh = modelManager.CreateCube(allocator);
-    modelManager.CreateBuffersForMesh(allocator, *debugMesh);
-	debugMesh->pipelineName = "pbr";
+    modelManager.CreateBuffersForMesh(disp, graphicsQueue, commandPool, allocator, *debugMesh);
 
 	auto bunnyMesh = modelManager.LoadModel("stanford-bunny.obj", "pbr");
-	modelManager.CreateBuffersForMesh(allocator, *bunnyMesh);
+	modelManager.CreateBuffersForMesh(disp, graphicsQueue, commandPool, allocator, *bunnyMesh);
 
 	auto groundPlane = modelManager.CreatePlane(allocator, 50.0f, 25);
-	modelManager.CreateBuffersForMesh(allocator, *groundPlane);
+	modelManager.CreateBuffersForMesh(disp, graphicsQueue, commandPool, allocator, *groundPlane);
 
 	// Create the groundPlane
 	Entity ground = Entity("Ground");
@@ -166,41 +175,7 @@ void DebugScene::Render()
 
 void DebugScene::Exit(VulkanContext& vulkanContext, ModelManager& modelManager)
 {
-	// Cleanup debug material
-	for (auto& material: m_pbrMaterials)
-	{
-		vmaDestroyBuffer(vulkanContext.GetAllocator(), material->configBuffer, material->configAllocation);
-	}
-
-	// Cleanup basic material
-	for (auto& material: m_basicMaterials)
-	{
-		vmaDestroyBuffer(vulkanContext.GetAllocator(), material->configBuffer, material->configAllocation);
-	}
-
-	// Clean up lights
-	std::vector<std::shared_ptr<Entity>> lightEntities = m_entityManager.GetEntitiesWithComponents<PointLight>();
-	for (const auto& entity: lightEntities)
-	{
-		PointLight& light = entity->GetComponent<PointLight>();
-		vmaDestroyBuffer(vulkanContext.GetAllocator(), light.buffer, light.allocation);
-	}
-
-	lightEntities = m_entityManager.GetEntitiesWithComponents<DirectionalLight>();
-	for (const auto& entity: lightEntities)
-	{
-		DirectionalLight& light = entity->GetComponent<DirectionalLight>();
-		vmaDestroyBuffer(vulkanContext.GetAllocator(), light.buffer, light.allocation);
-	}
-
-	// Clean up cameras
-	std::vector<std::shared_ptr<Entity>> cameraEntities = m_entityManager.GetEntitiesWithComponents<Camera>();
-	for (const auto& entity: cameraEntities)
-	{
-		Camera& camera = entity->GetComponent<Camera>();
-		camera.DestroyCameraUBOBuffer(vulkanContext.GetAllocator());
-	}
-
+	// Camera, light and material data lives in the renderer's per frame upload buffer
 	modelManager.CleanUpAllPipelines(vulkanContext.GetDispatchTable());
 }
 
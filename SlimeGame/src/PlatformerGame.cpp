@@ -73,24 +73,34 @@ void PlatformerGame::SetupShaders(VulkanContext& vulkanContext, ModelManager& mo
 	};
 	modelManager.CreatePipeline("pbr", vulkanContext, shaderManager, descriptorManager, pbrShaderPaths, true);
 
+	// The renderer draws pbr models with this one when bindless materials are on
+	std::vector<std::pair<std::string, VkShaderStageFlagBits>> bindlessShaderPaths = {
+		{ResourcePathManager::GetShaderPath("bindless.vert.spv"),   VK_SHADER_STAGE_VERTEX_BIT},
+        {ResourcePathManager::GetShaderPath("bindless.frag.spv"), VK_SHADER_STAGE_FRAGMENT_BIT}
+	};
+	modelManager.CreatePipeline("pbr_bindless", vulkanContext, shaderManager, descriptorManager, bindlessShaderPaths, true);
+
 	// Set up the shared descriptor set pair (Grabbing it from the basic descriptors)
 	descriptorManager.CreateSharedDescriptorSet(modelManager.GetPipelines()["pbr"].descriptorSetLayouts[0]);
 }
 
 void PlatformerGame::InitializeGameObjects(VulkanContext& vulkanContext, ModelManager& modelManager)
 {
+	vkb::DispatchTable& disp = vulkanContext.GetDispatchTable();
+	VkQueue graphicsQueue = vulkanContext.GetGraphicsQueue();
+	VkCommandPool commandPool = vulkanContext.GetCommandPool();
 	VmaAllocator allocator = vulkanContext.GetAllocator();
 	std::string pipelineName = "pbr";
 
 	// Create Model Resources
 	auto bunnyMesh = modelManager.LoadModel("stanford-bunny.obj", pipelineName);
-	modelManager.CreateBuffersForMesh(allocator, *bunnyMesh);
+	modelManager.CreateBuffersForMesh(disp, graphicsQueue, commandPool, allocator, *bunnyMesh);
 
 	auto suzanneMesh = modelManager.LoadModel("suzanne.obj", pipelineName);
-	modelManager.CreateBuffersForMesh(allocator, *suzanneMesh);
+	modelManager.CreateBuffersForMesh(disp, graphicsQueue, commandPool, allocator, *suzanneMesh);
 
 	auto groundCubeModel = modelManager.CreatePlane(allocator, 30.0f, 10.0f);
-	modelManager.CreateBuffersForMesh(allocator, *groundCubeModel);
+	modelManager.CreateBuffersForMesh(disp, graphicsQueue, commandPool, allocator, *groundCubeModel);
 
 	// Initialize player
 	m_player->AddComponent<Model>(bunnyMesh);
@@ -149,6 +159,7 @@ void PlatformerGame::Update(float dt, VulkanContext& vulkanContext, const InputM
 
 	UpdateCollectibles(dt);
 	UpdateMovingPlatforms(dt);
+	m_entityManager.UpdateSpatialIndex();
 	CheckCollectibleCollisions();
 	UpdatePowerUp(dt);
 }
@@ -168,27 +179,7 @@ void PlatformerGame::Render()
 
 void PlatformerGame::Exit(VulkanContext& vulkanContext, ModelManager& modelManager)
 {
-	// Cleanup debug material
-	for (auto& material: m_pbrMaterials)
-	{
-		vmaDestroyBuffer(vulkanContext.GetAllocator(), material->configBuffer, material->configAllocation);
-	}
-
-	std::vector<std::shared_ptr<Entity>> lightEntities = m_entityManager.GetEntitiesWithComponents<DirectionalLight>();
-	for (const auto& entity: lightEntities)
-	{
-		DirectionalLight& light = entity->GetComponent<DirectionalLight>();
-		vmaDestroyBuffer(vulkanContext.GetAllocator(), light.buffer, light.allocation);
-	}
-
-	// Clean up cameras
-	std::vector<std::shared_ptr<Entity>> cameraEntities = m_entityManager.GetEntitiesWithComponents<Camera>();
-	for (const auto& entity: cameraEntities)
-	{
-		Camera& camera = entity->GetComponent<Camera>();
-		camera.DestroyCameraUBOBuffer(vulkanContext.GetAllocator());
-	}
-
+	// Camera, light and material data lives in the renderer's per frame upload buffer
 	modelManager.CleanUpAllPipelines(vulkanContext.GetDispatchTable());
 }
 
@@ -392,12 +383,13 @@ void PlatformerGame::SpawnCollectibles(VulkanContext& vulkanContext, ModelManage
 {
 	// Create a simple collectible model (e.g., a sphere)
 	auto collectibleMesh = modelManager.CreateSphere(vulkanContext.GetAllocator(), 0.5f);
-	modelManager.CreateBuffersForMesh(vulkanContext.GetAllocator(), *collectibleMesh);
+	modelManager.CreateBuffersForMesh(vulkanContext.GetDispatchTable(), vulkanContext.GetGraphicsQueue(), vulkanContext.GetCommandPool(), vulkanContext.GetAllocator(), *collectibleMesh);
 
 	// Spawn collectibles at random positions
 	for (int i = 0; i < 10; ++i)
 	{
 		auto collectible = std::make_shared<Entity>("Collectible" + std::to_string(i));
+		collectible->AddTag("Collectible");
 		collectible->AddComponent<Model>(collectibleMesh);
 		collectible->AddComponent<PBRMaterial>(m_pbrMaterials[0]);
 		auto& transform = collectible->AddComponent<Transform>();
@@ -421,7 +413,7 @@ void PlatformerGame::UpdateCollectibles(float dt)
 void PlatformerGame::SpawnMovingPlatforms(VulkanContext& vulkanContext, ModelManager& modelManager)
 {
 	auto platformMesh = modelManager.CreateCube(vulkanContext.GetAllocator(), 2.0f);
-	modelManager.CreateBuffersForMesh(vulkanContext.GetAllocator(), *platformMesh);
+	modelManager.CreateBuffersForMesh(vulkanContext.GetDispatchTable(), vulkanContext.GetGraphicsQueue(), vulkanContext.GetCommandPool(), vulkanContext.GetAllocator(), *platformMesh);
 
 	for (int i = 0; i < 3; ++i)
 	{
@@ -452,22 +444,34 @@ void PlatformerGame::CheckCollectibleCollisions()
 	auto& playerTransform = m_player->GetComponent<Transform>();
 	auto playerPos = playerTransform.position;
 
-	for (auto it = m_collectibles.begin(); it != m_collectibles.end();)
+	// Only look at what the spatial index says is near the player
+	m_entityManager.GetSpatialIndex().QuerySphere(playerPos, 1.0f, m_nearbyEntities);
+
+	for (Entity* entity: m_nearbyEntities)
 	{
-		auto& collectibleTransform = (*it)->GetComponent<Transform>();
-		if (glm::distance(playerPos, collectibleTransform.position) < 1.0f)
+		if (!entity->HasTag("Collectible"))
+		{
+			continue;
+		}
+
+		auto& collectibleTransform = entity->GetComponent<Transform>();
+		if (glm::distance(playerPos, collectibleTransform.position) >= 1.0f)
 		{
-			m_score += 10;
-			m_hasPowerUp = true;
-			m_powerUpTimer = 5.0f; // 5 seconds power-up duration
-			spdlog::info("Collected! Score: {}", m_score);
-			m_entityManager.RemoveEntity((*it));
-			it = m_collectibles.erase(it);
+			continue;
 		}
-		else
+
+		auto it = std::find_if(m_collectibles.begin(), m_collectibles.end(), [entity](const auto& collectible) { return collectible.get() == entity; });
+		if (it == m_collectibles.end())
 		{
-			++it;
+			continue;
 		}
+
+		m_score += 10;
+		m_hasPowerUp = true;
+		m_powerUpTimer = 5.0f; // 5 seconds power-up duration
+		spdlog::info("Collected! Score: {}", m_score);
+		m_entityManager.RemoveEntity((*it));
+		m_collectibles.erase(it);
 	}
 }
 
@@ -76,6 +76,7 @@ private:
 
 	std::vector<std::shared_ptr<Entity>> m_collectibles;
 	std::vector<std::shared_ptr<Entity>> m_movingPlatforms;
+	std::vector<Entity*> m_nearbyEntities; // Reused spatial query results
 	int m_score = 0;
 	float m_powerUpTimer = 0.0f;
 	bool m_hasPowerUp = false;
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_core.h>
+
+#include <glm/glm.hpp>
+
+class ClusteredLights;
+class EntityManager;
+class VulkanDebugUtils;
+struct PBRMaterialResource;
+struct TextureResource;
+
+namespace vkb
+{
+	struct DispatchTable;
+} // namespace vkb
+
+// Descriptor sets 1 and 2 of the bindless pbr pipeline. Every PBR material of the frame is written into a
+// storage buffer and every texture they use into one update after bind sampler array, so the sets never
+// change between draws and instances of different materials can share a draw. Instances find their
+// material through InstanceData::materialIndex, which the batcher copies from the material's bindlessIndex.
+//
+// Like the instance buffer the material buffer has one region per frame in flight, and texture slots are
+// only ever appended so a slot is never rewritten while a previous frame may be sampling it.
+class BindlessMaterials
+{
+public:
+	// Matches Material (set 2, binding 0, std430) in bindless.frag
+	struct GPUMaterial
+	{
+		glm::vec3 albedo;
+		float metallic;
+		float roughness;
+		float ao;
+		uint32_t albedoTex; // MISSING_TEXTURE when the material has none
+		uint32_t normalTex;
+		uint32_t metallicTex;
+		uint32_t roughnessTex;
+		uint32_t aoTex;
+		uint32_t padding;
+	};
+
+	struct Stats
+	{
+		uint32_t materials = 0; // This frame
+		uint32_t textures = 0;  // Slots in use
+		uint32_t capacity = 0;  // Materials per frame
+	};
+
+	// Texture index of maps a material doesn't have, the shader uses neutral values for them instead
+	static constexpr uint32_t MISSING_TEXTURE = 0xFFFFFFFF;
+
+	void Cleanup(vkb::DispatchTable& disp, VmaAllocator allocator);
+
+	// Gathers the PBR materials in the scene, writes this frame's copy of each and points their bindlessIndex
+	// at it. Call before batching so the instance data picks the indices up. The layouts are sets 1 and 2
+	// of the bindless pipeline, the descriptor sets are allocated from them on first use.
+	void Update(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, EntityManager& entityManager, VkDescriptorSetLayout lightLayout, VkDescriptorSetLayout materialLayout, uint32_t frameIndex, uint32_t frameCount);
+
+	// Only writes descriptors when the buffer or image changed
+	void BindLightBuffer(vkb::DispatchTable& disp, VkBuffer buffer, VkDeviceSize range);
+	// The cascades and their EVSM moments, if any, go into the light set
+	void BindShadowMap(vkb::DispatchTable& disp, const TextureResource& shadowMap, const TextureResource& shadowMoments);
+	// The point lights, their clusters and light lists, and the atlas their shadows are in
+	void BindPointLights(vkb::DispatchTable& disp, const ClusteredLights& clusteredLights, const TextureResource& pointShadowAtlas);
+
+	// Sets 1 and 2, bound together with the light's dynamic offset
+	const VkDescriptorSet* GetDescriptorSets() const
+	{
+		return m_sets;
+	}
+
+	const Stats& GetStats() const
+	{
+		return m_stats;
+	}
+
+	void ImGuiDebug() const;
+
+private:
+	void CreateDescriptorSets(vkb::DispatchTable& disp, VkDescriptorSetLayout lightLayout, VkDescriptorSetLayout materialLayout);
+	bool EnsureCapacity(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, uint32_t materialCount, uint32_t frameCount);
+	uint32_t GetTextureSlot(vkb::DispatchTable& disp, const TextureResource* texture);
+	void WriteTexture(vkb::DispatchTable& disp, uint32_t slot, const TextureResource& texture);
+
+	VkDescriptorPool m_pool = VK_NULL_HANDLE;
+	VkDescriptorSet m_sets[2] = { VK_NULL_HANDLE, VK_NULL_HANDLE };
+
+	// Rebuilt every frame from the scene so a freed material is never touched
+	std::vector<PBRMaterialResource*> m_materials;
+	std::unordered_map<const PBRMaterialResource*, uint32_t> m_materialSlots;
+
+	std::unordered_map<const TextureResource*, uint32_t> m_textureSlots;
+	std::vector<VkImageView> m_slotViews; // What each slot was written with
+
+	VkBuffer m_buffer = VK_NULL_HANDLE;
+	VmaAllocation m_allocation = VK_NULL_HANDLE;
+	GPUMaterial* m_mappedData = nullptr;
+	uint32_t m_capacity = 0;
+	uint32_t m_frameCount = 0;
+
+	VkBuffer m_boundLightBuffer = VK_NULL_HANDLE;
+	VkImageView m_boundShadowMap = VK_NULL_HANDLE;
+	VkImageView m_boundShadowMoments = VK_NULL_HANDLE;
+	VkBuffer m_boundPointLightBuffers[3] = { VK_NULL_HANDLE, VK_NULL_HANDLE, VK_NULL_HANDLE };
+	VkImageView m_boundPointShadowAtlas = VK_NULL_HANDLE;
+
+	Stats m_stats;
+};
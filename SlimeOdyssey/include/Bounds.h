@@ -0,0 +1,164 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <glm/glm.hpp>
+
+// Axis aligned bounding box, an inverted (invalid) box by default so Expand() can grow it from nothing
+struct AABB
+{
+	glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+	glm::vec3 max = glm::vec3(std::numeric_limits<float>::lowest());
+
+	AABB() = default;
+
+	AABB(const glm::vec3& min, const glm::vec3& max)
+	      : min(min), max(max){};
+
+	bool IsValid() const
+	{
+		return min.x <= max.x && min.y <= max.y && min.z <= max.z;
+	}
+
+	glm::vec3 GetCenter() const
+	{
+		return (min + max) * 0.5f;
+	}
+
+	glm::vec3 GetExtents() const
+	{
+		return (max - min) * 0.5f;
+	}
+
+	float GetSurfaceArea() const
+	{
+		glm::vec3 d = max - min;
+		return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	void Expand(const glm::vec3& point)
+	{
+		min = glm::min(min, point);
+		max = glm::max(max, point);
+	}
+
+	AABB Inflate(float margin) const
+	{
+		return AABB(min - glm::vec3(margin), max + glm::vec3(margin));
+	}
+
+	bool Contains(const AABB& other) const
+	{
+		return glm::all(glm::lessThanEqual(min, other.min)) && glm::all(glm::greaterThanEqual(max, other.max));
+	}
+
+	bool Overlaps(const AABB& other) const
+	{
+		return min.x <= other.max.x && max.x >= other.min.x && min.y <= other.max.y && max.y >= other.min.y && min.z <= other.max.z && max.z >= other.min.z;
+	}
+
+	bool OverlapsSphere(const glm::vec3& center, float radius) const
+	{
+		glm::vec3 closest = glm::clamp(center, min, max);
+		glm::vec3 d = closest - center;
+		return glm::dot(d, d) <= radius * radius;
+	}
+
+	static AABB Union(const AABB& a, const AABB& b)
+	{
+		return AABB(glm::min(a.min, b.min), glm::max(a.max, b.max));
+	}
+
+	// Bounds of this box after an affine transform (Arvo's method, no need to transform all 8 corners)
+	AABB Transform(const glm::mat4& matrix) const
+	{
+		glm::vec3 translation = glm::vec3(matrix[3]);
+		AABB result(translation, translation);
+		for (int col = 0; col < 3; ++col)
+		{
+			glm::vec3 a = glm::vec3(matrix[col]) * min[col];
+			glm::vec3 b = glm::vec3(matrix[col]) * max[col];
+			result.min += glm::min(a, b);
+			result.max += glm::max(a, b);
+		}
+		return result;
+	}
+};
+
+struct Ray
+{
+	glm::vec3 origin = glm::vec3(0.0f);
+	glm::vec3 direction = glm::vec3(0.0f, 0.0f, 1.0f);
+
+	// Slab test, invDirection is 1 / direction (infinities are fine). Returns the entry distance in tHit
+	static bool IntersectAABB(const glm::vec3& origin, const glm::vec3& invDirection, const AABB& box, float maxDistance, float& tHit)
+	{
+		glm::vec3 t0 = (box.min - origin) * invDirection;
+		glm::vec3 t1 = (box.max - origin) * invDirection;
+		glm::vec3 tSmall = glm::min(t0, t1);
+		glm::vec3 tBig = glm::max(t0, t1);
+
+		float tMin = std::max(std::max(tSmall.x, tSmall.y), std::max(tSmall.z, 0.0f));
+		float tMax = std::min(std::min(tBig.x, tBig.y), std::min(tBig.z, maxDistance));
+
+		tHit = tMin;
+		return tMin <= tMax;
+	}
+};
+
+// Six normalised planes (xyz = normal pointing inwards, w = distance)
+struct Frustum
+{
+	enum Plane
+	{
+		Left,
+		Right,
+		Bottom,
+		Top,
+		Near,
+		Far,
+		Count
+	};
+
+	glm::vec4 planes[Count];
+
+	// Gribb/Hartmann extraction. Camera::GetProjectionMatrix uses glm's default -1..1 clip depth
+	static Frustum FromMatrix(const glm::mat4& viewProjection)
+	{
+		glm::vec4 row0 = glm::vec4(viewProjection[0][0], viewProjection[1][0], viewProjection[2][0], viewProjection[3][0]);
+		glm::vec4 row1 = glm::vec4(viewProjection[0][1], viewProjection[1][1], viewProjection[2][1], viewProjection[3][1]);
+		glm::vec4 row2 = glm::vec4(viewProjection[0][2], viewProjection[1][2], viewProjection[2][2], viewProjection[3][2]);
+		glm::vec4 row3 = glm::vec4(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+
+		Frustum frustum;
+		frustum.planes[Left] = row3 + row0;
+		frustum.planes[Right] = row3 - row0;
+		frustum.planes[Bottom] = row3 + row1;
+		frustum.planes[Top] = row3 - row1;
+		frustum.planes[Near] = row3 + row2;
+		frustum.planes[Far] = row3 - row2;
+
+		for (auto& plane: frustum.planes)
+		{
+			plane /= glm::length(glm::vec3(plane));
+		}
+
+		return frustum;
+	}
+
+	bool Intersects(const AABB& box) const
+	{
+		for (const auto& plane: planes)
+		{
+			// Test the corner furthest along the plane normal
+			glm::vec3 positive = glm::vec3(plane.x >= 0.0f ? box.max.x : box.min.x, plane.y >= 0.0f ? box.max.y : box.min.y, plane.z >= 0.0f ? box.max.z : box.min.z);
+			if (glm::dot(glm::vec3(plane), positive) + plane.w < 0.0f)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+};
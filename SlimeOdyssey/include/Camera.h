@@ -41,13 +41,9 @@ public:
 	// Camera properties
 	void SetAspectRatio(float aspect);
 
-	// Vulkan stuff
-	void CreateCameraUBO(VmaAllocator allocator);
-	void DestroyCameraUBOBuffer(VmaAllocator allocator);
-	void UpdateCameraUBO(VmaAllocator allocator);
+	// Vulkan stuff, the renderer uploads the UBO every frame
+	void UpdateCameraUBO();
 	CameraUBO& GetCameraUBO();
-	VkBuffer GetCameraUBOBuffer() const { return m_cameraUBOBBuffer; }
-	VmaAllocation GetCameraUBOAllocation() const { return m_cameraUBOAllocation; }
 
 	void ImGuiDebug();
 
@@ -73,8 +69,6 @@ private:
 
 	// Vulkan stuff
 	CameraUBO m_cameraUBO;
-	VkBuffer m_cameraUBOBBuffer = VK_NULL_HANDLE;
-	VmaAllocation m_cameraUBOAllocation = VK_NULL_HANDLE;
 
 public:
 	float GetNearZ() const;
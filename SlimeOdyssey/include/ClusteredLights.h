@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_core.h>
+
+#include <glm/glm.hpp>
+
+#include "Light.h"
+
+class Camera;
+class VulkanDebugUtils;
+
+namespace vkb
+{
+	struct DispatchTable;
+} // namespace vkb
+
+// Clustered forward shading for point lights. The view frustum is cut into a grid of clusters, tiles in screen
+// space and exponential slices in depth, and every frame each light is binned into the clusters its sphere
+// touches. A fragment looks its cluster up from its view space position and only loops over the lights in it,
+// so a scene with hundreds of point lights costs about as much per pixel as the lights actually near it.
+//
+// Binning runs on the CPU, four lights at a time against the planes between the tiles and slices, then a count
+// pass and a prefix sum lay the light lists out back to back. The lights, clusters and lists go into storage
+// buffers with one region per frame in flight, like the instance buffer, and every index the shaders read is
+// absolute so the descriptors only change when a buffer grows.
+class ClusteredLights
+{
+public:
+	// CLUSTER_X, CLUSTER_Y and CLUSTER_Z in the shaders have to match
+	static constexpr uint32_t CLUSTER_X = 16;
+	static constexpr uint32_t CLUSTER_Y = 9;
+	static constexpr uint32_t CLUSTER_Z = 24;
+	static constexpr uint32_t CLUSTER_COUNT = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+
+	// Appended to the light uniform buffer, matches the cluster fields of LightUBO (set 1, binding 0)
+	struct GPUParams
+	{
+		glm::vec2 tanHalfFov = glm::vec2(1.0f); // Horizontal and vertical
+		float depthScale = 0.0f;                // slice = log(depth) * depthScale + depthBias
+		float depthBias = 0.0f;
+		uint32_t clusterBase = 0;               // This frame's first cluster
+		uint32_t lightCount = 0;
+		uint32_t padding[2] = { 0, 0 };
+	};
+
+	// Matches ClusterBuffer (set 1, binding 3, std430), a range of the light index buffer
+	struct Cluster
+	{
+		uint32_t offset;
+		uint32_t count;
+	};
+
+	struct Stats
+	{
+		uint32_t lights = 0;
+		uint32_t culledLights = 0;    // Outside of the view frustum
+		uint32_t lightIndices = 0;    // Summed over every cluster
+		uint32_t maxClusterLights = 0;
+		uint32_t occupiedClusters = 0;
+		double assignMilliseconds = 0.0;
+	};
+
+	void Cleanup(VmaAllocator allocator);
+
+	// Bins the spheres (xyz center in world space, w radius) into the clusters of the view. Only touches CPU
+	// memory, Update calls it with the scene's point lights. fovY is in degrees like Camera::GetFOV.
+	void Assign(const glm::mat4& view, float fovY, float aspect, float nearZ, float farZ, const std::vector<glm::vec4>& spheres);
+
+	// Assigns the point lights among lights to the camera's clusters and uploads this frame's copy of the lights,
+	// clusters and light lists. Returns true if a buffer was recreated, the device has been waited on by then.
+	// Call after the ShadowSystem has placed the point lights in its atlas.
+	bool Update(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, const std::vector<std::shared_ptr<Light>>& lights, const Camera& camera, uint32_t frameIndex, uint32_t frameCount);
+
+	// The cluster holding a view space position, the same lookup the fragment shaders do
+	uint32_t GetClusterIndex(const glm::vec3& viewPosition) const;
+
+	// Relative to this frame, the uploaded clusters and indices are offset by the frame's region
+	const std::vector<Cluster>& GetClusters() const
+	{
+		return m_clusters;
+	}
+
+	const std::vector<uint32_t>& GetLightIndices() const
+	{
+		return m_lightIndices;
+	}
+
+	const GPUParams& GetParams() const
+	{
+		return m_params;
+	}
+
+	VkBuffer GetLightBuffer() const
+	{
+		return m_lightBuffer.buffer;
+	}
+
+	VkBuffer GetClusterBuffer() const
+	{
+		return m_clusterBuffer.buffer;
+	}
+
+	VkBuffer GetIndexBuffer() const
+	{
+		return m_indexBuffer.buffer;
+	}
+
+	const Stats& GetStats() const
+	{
+		return m_stats;
+	}
+
+	void ImGuiDebug() const;
+
+private:
+	// A persistently mapped storage buffer with one region of capacity elements per frame in flight
+	struct FrameBuffer
+	{
+		const char* name;
+		size_t elementSize;
+		VkBuffer buffer = VK_NULL_HANDLE;
+		VmaAllocation allocation = VK_NULL_HANDLE;
+		uint8_t* mappedData = nullptr;
+		uint32_t capacity = 0;
+		uint32_t frameCount = 0;
+
+		bool EnsureCapacity(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, uint32_t count, uint32_t minCapacity, uint32_t frames);
+		void Cleanup(VmaAllocator allocator);
+	};
+
+	// Which clusters a light touches, inclusive ranges
+	struct LightRange
+	{
+		uint8_t x0, x1, y0, y1, z0, z1;
+		bool visible;
+	};
+
+	void BinLights(uint32_t lightCount);
+
+	// View space lights split by component, padded to a multiple of four
+	std::vector<float> m_lightX;
+	std::vector<float> m_lightY;
+	std::vector<float> m_lightDepth;
+	std::vector<float> m_lightRadius;
+	std::vector<LightRange> m_lightRanges;
+
+	// Plane normals (x or y, then depth) of the boundaries between the tiles, and the depth each slice starts at
+	float m_columnPlanes[CLUSTER_X + 1][2] = {};
+	float m_rowPlanes[CLUSTER_Y + 1][2] = {};
+	float m_sliceDepths[CLUSTER_Z + 1] = {};
+
+	std::vector<Cluster> m_clusters = std::vector<Cluster>(CLUSTER_COUNT);
+	std::vector<uint32_t> m_lightIndices;
+	std::vector<glm::vec4> m_spheres;
+	std::vector<PointLight*> m_pointLights;
+
+	FrameBuffer m_lightBuffer{ "Point Light Buffer", sizeof(PointLight::BindingData) };
+	FrameBuffer m_clusterBuffer{ "Light Cluster Buffer", sizeof(Cluster) };
+	FrameBuffer m_indexBuffer{ "Light Index Buffer", sizeof(uint32_t) };
+
+	GPUParams m_params;
+	Stats m_stats;
+};
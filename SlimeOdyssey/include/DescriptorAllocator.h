@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+#include "VkBootstrapDispatch.h"
+
+// Hands out descriptor sets from a chain of pools, adding a pool whenever the ones it has run out instead of
+// failing. Each new pool holds twice the sets of the last (up to MAX_SETS_PER_POOL), so even thousands of
+// materials only need a handful of pools.
+//
+// Persistent allocators free sets one at a time and hand a pool out again once it has room. Transient ones
+// never free single sets, the whole chain is reset at once when the frame that used it is done, which is
+// cheaper and can't fragment.
+class DescriptorAllocator
+{
+public:
+	// Descriptors of a type per set in a pool
+	struct PoolSizeRatio
+	{
+		VkDescriptorType type;
+		float ratio;
+	};
+
+	struct Stats
+	{
+		uint32_t pools = 0;       // Pools are kept until Cleanup, so every one past the first is a time it grew
+		uint32_t setCapacity = 0; // Summed over every pool
+		uint32_t liveSets = 0;    // Allocated and not freed or reset
+		uint32_t allocations = 0; // Since the last reset, or ever for persistent allocators
+		uint32_t resets = 0;
+	};
+
+	static constexpr uint32_t MAX_SETS_PER_POOL = 4096;
+
+	void Init(const vkb::DispatchTable& disp, const char* name, uint32_t initialSets, const std::vector<PoolSizeRatio>& ratios, bool transient);
+	void Cleanup();
+
+	// VK_NULL_HANDLE only if a brand new pool can't fit the set either
+	VkDescriptorSet Allocate(VkDescriptorSetLayout layout, const void* pNext = nullptr);
+
+	// Persistent allocators only
+	void Free(VkDescriptorSet descriptorSet);
+
+	// Transient allocators only, every set from them is invalid afterwards
+	void Reset();
+
+	const Stats& GetStats() const
+	{
+		return m_stats;
+	}
+
+	void ImGuiDebug() const;
+
+private:
+	VkDescriptorPool GetPool();
+	VkDescriptorPool CreatePool(uint32_t setCount);
+
+	const vkb::DispatchTable* m_disp = nullptr;
+	const char* m_name = "";
+	bool m_transient = false;
+	std::vector<PoolSizeRatio> m_ratios;
+
+	uint32_t m_nextPoolSets = 0;
+	std::vector<VkDescriptorPool> m_readyPools; // May have room, the last one is allocated from
+	std::vector<VkDescriptorPool> m_fullPools;
+	std::unordered_map<VkDescriptorSet, VkDescriptorPool> m_owners; // Persistent allocators only
+
+	Stats m_stats;
+};
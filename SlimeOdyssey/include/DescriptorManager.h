@@ -4,6 +4,8 @@
 #include <unordered_map>
 #include <vector>
 #include <vulkan/vulkan.h>
+#include "DescriptorAllocator.h"
+#include "DescriptorWriter.h"
 #include "Model.h"
 #include "VkBootstrapDispatch.h"
 #include <memory>
@@ -15,6 +17,13 @@ class ModelManager;
 class DescriptorManager
 {
 public:
+	struct UpdateStats
+	{
+		uint32_t updates = 0;         // Driver calls
+		uint32_t writes = 0;          // Descriptors written by them
+		uint32_t templateUpdates = 0; // Of the updates, ones that went through an update template
+	};
+
 	// Constructors and Destructor
 	DescriptorManager() = default;
 	explicit DescriptorManager(const vkb::DispatchTable& disp);
@@ -22,18 +31,28 @@ public:
 
 	// Descriptor Set Management
 	VkDescriptorSet AllocateDescriptorSet(VkDescriptorSetLayout descriptorLayout);
+	// Only valid for the frame it was allocated in, freed all at once when that frame index comes round again
+	VkDescriptorSet AllocateTransientDescriptorSet(VkDescriptorSetLayout descriptorLayout);
 	VkDescriptorSet GetDescriptorSet(uint32_t layoutIndex);
 	size_t AddDescriptorSetLayout(VkDescriptorSetLayout layout);
 	size_t AddDescriptorSetLayouts(const std::vector<VkDescriptorSetLayout>& descriptorSetLayouts);
 	void FreeDescriptorSet(VkDescriptorSet descriptorSet);
 
 	// Resource Binding
-	void BindBuffer(VkDescriptorSet descriptorSet, uint32_t binding, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range);
+	// Applies and clears every write in the writer with one driver call. Given the set's layout, writers with
+	// the same signature share a descriptor update template made the first time it is seen.
+	void UpdateDescriptorSet(VkDescriptorSet descriptorSet, DescriptorWriter& writer, VkDescriptorSetLayout layout = VK_NULL_HANDLE);
+	void BindBuffer(VkDescriptorSet descriptorSet, uint32_t binding, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range, VkDescriptorType type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
 	void BindImage(VkDescriptorSet descriptorSet, uint32_t binding, VkImageView imageView, VkSampler sampler);
 
+	// Call once the frame's fence has signalled, resets the transient sets handed out the last time it ran
+	void BeginFrame(uint32_t frameIndex);
+
 	// Cleanup
 	void Cleanup();
 
+	void ImGuiDebug();
+
 	std::pair<VkDescriptorSet, VkDescriptorSetLayout> GetSharedDescriptorSet();
 	void CreateSharedDescriptorSet(VkDescriptorSetLayout descriptorsetLayout);
 
@@ -44,15 +63,34 @@ public:
 	std::shared_ptr<BasicMaterialResource> CopyBasicMaterial(VulkanContext& vulkanContext, ModelManager& modelManager, std::string name, std::shared_ptr<BasicMaterialResource> inMaterial);
 
 private:
-	// Private Methods
-	void CreateDescriptorPool();
-
 	// Member Variables
 	const vkb::DispatchTable& m_disp;
 
 	std::pair<VkDescriptorSet, VkDescriptorSetLayout> m_sharedDescriptorSet;
 
-	VkDescriptorPool m_descriptorPool = VK_NULL_HANDLE;
+	DescriptorAllocator m_persistentAllocator;
+	std::vector<DescriptorAllocator> m_frameAllocators; // One per frame in flight, created as frames first start
+	uint32_t m_frameIndex = 0;
+
+	struct UpdateTemplate
+	{
+		VkDescriptorSetLayout layout;
+		std::vector<VkDescriptorUpdateTemplateEntry> entries; // Compared in full, the hash alone can collide
+		VkDescriptorUpdateTemplate handle;
+	};
+
+	// Keyed by a hash of the layout and the writer signature, every template with that hash
+	std::unordered_map<uint64_t, std::vector<UpdateTemplate>> m_updateTemplates;
+	uint32_t m_updateTemplateCount = 0;
+	std::vector<VkDescriptorUpdateTemplateEntry> m_templateEntries;
+	bool m_useUpdateTemplates = true;
+
+	DescriptorWriter m_bindWriter; // For the single write Bind calls
+	UpdateStats m_updateStats;
+	UpdateStats m_lastFrameUpdateStats;
 	std::vector<VkDescriptorSetLayout> m_descriptorSetLayouts;
 	std::unordered_map<uint32_t, VkDescriptorSet> m_descriptorSets;
+
+	// Material ids start at 1, 0 means the material was created elsewhere
+	uint32_t m_nextMaterialId = 1;
 };
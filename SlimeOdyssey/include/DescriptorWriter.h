@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+// Collects the descriptor writes for a set and applies them with a single driver call. The buffer and
+// image infos are kept in their own vectors and only pointed to when the writes are built, so adding
+// more writes can reallocate them freely.
+//
+// Writes are applied either as plain VkWriteDescriptorSets or, through DescriptorManager, with a descriptor
+// update template. The template path packs the infos into one blob in write order, see PackTemplateData.
+class DescriptorWriter
+{
+public:
+	void WriteBuffer(uint32_t binding, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range, VkDescriptorType type);
+	void WriteImage(uint32_t binding, VkImageView imageView, VkSampler sampler, VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VkDescriptorType type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+
+	// Keeps the capacity so a writer reused every frame stops allocating
+	void Clear();
+
+	bool Empty() const
+	{
+		return m_entries.empty();
+	}
+
+	// The VkWriteDescriptorSets for the set, they point into this writer so don't Clear or add writes while using them
+	const std::vector<VkWriteDescriptorSet>& BuildWrites(VkDescriptorSet descriptorSet);
+
+	// Template entries for the pending writes, one per write, with offsets into PackTemplateData's blob.
+	// Writers with the same signature produce the same entries so they can share a template.
+	void BuildTemplateEntries(std::vector<VkDescriptorUpdateTemplateEntry>& entries) const;
+	const void* PackTemplateData();
+
+	// Binding, type and kind of each write, equal for writers that can share an update template
+	uint64_t GetSignature() const;
+
+	uint32_t GetWriteCount() const
+	{
+		return static_cast<uint32_t>(m_entries.size());
+	}
+
+private:
+	struct Entry
+	{
+		uint32_t binding;
+		VkDescriptorType type;
+		bool image;
+		uint32_t infoIndex; // Into m_bufferInfos or m_imageInfos
+	};
+
+	std::vector<Entry> m_entries;
+	std::vector<VkDescriptorBufferInfo> m_bufferInfos;
+	std::vector<VkDescriptorImageInfo> m_imageInfos;
+
+	std::vector<VkWriteDescriptorSet> m_writes;
+	std::vector<uint8_t> m_templateData;
+};
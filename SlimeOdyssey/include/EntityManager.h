@@ -9,6 +9,8 @@
 #include <unordered_map>
 #include <vector>
 
+#include "SpatialIndex.h"
+
 class Entity;
 
 // Maximum number of component types
@@ -94,6 +96,12 @@ public:
 	// Update component masks when an entity's components change
 	void OnEntityComponentChanged(const Entity& entity);
 
+	// Refit the spatial index for any Transform + Model entities that moved, call once per frame
+	void UpdateSpatialIndex();
+
+	// Bounds queries over Transform + Model entities (as of the last UpdateSpatialIndex)
+	const SpatialIndex& GetSpatialIndex() const;
+
 	// Shows a window of all entities and their components
 	void ImGuiDebug();
 
@@ -136,5 +144,5 @@ private:
 	mutable std::unordered_map<std::type_index, std::uint64_t> m_componentTypeIndices;
 	mutable std::uint64_t m_nextComponentTypeIndex = 0;
 
-	;
+	SpatialIndex m_spatialIndex;
 };
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_core.h>
+
+class VulkanDebugUtils;
+
+namespace vkb
+{
+	struct DispatchTable;
+} // namespace vkb
+
+// Linear allocator over a persistently mapped uniform buffer with one region per frame in flight. Per frame
+// constants are pushed into the current frame's region and bound through dynamic uniform buffer offsets,
+// so the descriptors never change and the CPU never writes data a previous frame is still reading.
+class FrameUploadBuffer
+{
+public:
+	struct Stats
+	{
+		VkDeviceSize used = 0;     // This frame
+		VkDeviceSize capacity = 0; // Per frame
+		uint32_t allocations = 0;  // This frame
+	};
+
+	explicit FrameUploadBuffer(const char* name = "Frame Upload Buffer")
+	      : m_name(name){};
+
+	void Cleanup(VmaAllocator allocator);
+
+	// Starts allocating from the start of frameIndex's region, growing it to fit allocationCount allocations of
+	// up to maxAllocationSize bytes. Returns true if the buffer was recreated and has to be rebound.
+	bool BeginFrame(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, uint32_t allocationCount, VkDeviceSize maxAllocationSize, uint32_t frameIndex, uint32_t frameCount);
+
+	// Copies data into the current frame's region and returns its offset from the start of the buffer. Throws if
+	// the frame pushes more than BeginFrame made room for.
+	uint32_t Push(const void* data, VkDeviceSize size);
+
+	template<typename T>
+	uint32_t Push(const T& data)
+	{
+		return Push(&data, sizeof(T));
+	}
+
+	// Makes this frame's writes visible to the device, call once everything for the frame is pushed
+	void Flush(VmaAllocator allocator) const;
+
+	VkBuffer GetBuffer() const
+	{
+		return m_buffer;
+	}
+
+	const Stats& GetStats() const
+	{
+		return m_stats;
+	}
+
+	void ImGuiDebug() const;
+
+private:
+	// Size an allocation takes up once padded to the device's dynamic offset alignment
+	VkDeviceSize AlignedSize(VkDeviceSize size) const
+	{
+		return (size + m_alignment - 1) & ~(m_alignment - 1);
+	}
+
+	bool EnsureCapacity(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, VkDeviceSize size, uint32_t frameCount);
+
+	const char* m_name;
+
+	VkBuffer m_buffer = VK_NULL_HANDLE;
+	VmaAllocation m_allocation = VK_NULL_HANDLE;
+	void* m_mappedData = nullptr;
+
+	VkDeviceSize m_alignment = 0; // minUniformBufferOffsetAlignment, looked up on first use
+	VkDeviceSize m_capacity = 0;  // Per frame
+	uint32_t m_frameCount = 0;
+
+	VkDeviceSize m_frameStart = 0;
+	VkDeviceSize m_offset = 0; // Relative to m_frameStart
+
+	Stats m_stats;
+};
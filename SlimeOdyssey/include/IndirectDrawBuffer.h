@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_core.h>
+
+#include "InstanceBatcher.h"
+
+class VulkanDebugUtils;
+
+namespace vkb
+{
+	struct DispatchTable;
+} // namespace vkb
+
+// Consecutive indirect commands that share a pipeline, material and MeshBuffer, submitted with one draw call
+struct IndirectDrawRun
+{
+	const InstanceBatch* firstBatch = nullptr; // Pipeline and material of every command in the run
+	uint32_t firstCommand = 0;                 // Absolute index into the command buffer, includes the frame offset
+	uint32_t commandCount = 0;
+};
+
+// Turns instance batches into VkDrawIndexedIndirectCommands, one per batch. The commands read from the
+// shared MeshBuffer and the instance buffer, so the CPU cost is one draw call per run rather than per mesh.
+// The draw count comes from a buffer so a culling compute pass can write it later instead of the CPU.
+class IndirectDrawBuffer
+{
+public:
+	explicit IndirectDrawBuffer(const char* name = "Indirect Draw Buffer")
+	      : m_name(name){};
+
+	void Cleanup(VmaAllocator allocator);
+
+	// Writes the commands for frameIndex. When splitByMaterial is false (depth only passes) every batch
+	// with the same pipeline lands in a single run. Returns true if the buffers were recreated.
+	bool Build(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, const std::vector<InstanceBatch>& batches, bool splitByMaterial, uint32_t frameIndex, uint32_t frameCount);
+
+	// Expects the run's MeshBuffer to be bound
+	void Draw(vkb::DispatchTable& disp, VkCommandBuffer cmd, const IndirectDrawRun& run) const;
+
+	const std::vector<IndirectDrawRun>& GetRuns() const
+	{
+		return m_runs;
+	}
+
+	uint32_t GetCommandCount() const
+	{
+		return m_commandCount;
+	}
+
+private:
+	bool EnsureCapacity(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, uint32_t commandCount, uint32_t frameCount);
+
+	const char* m_name;
+	std::vector<IndirectDrawRun> m_runs;
+	uint32_t m_commandCount = 0;
+
+	// Commands and counts both hold one region per frame in flight
+	VkBuffer m_commandBuffer = VK_NULL_HANDLE;
+	VmaAllocation m_commandAllocation = VK_NULL_HANDLE;
+	VkDrawIndexedIndirectCommand* m_commands = nullptr;
+
+	VkBuffer m_countBuffer = VK_NULL_HANDLE;
+	VmaAllocation m_countAllocation = VK_NULL_HANDLE;
+	uint32_t* m_counts = nullptr;
+
+	uint32_t m_capacity = 0;
+	uint32_t m_frameCount = 0;
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_core.h>
+
+#include <glm/glm.hpp>
+
+#include "Bounds.h"
+
+class Entity;
+class EntityManager;
+class VulkanDebugUtils;
+struct MaterialResource;
+struct ModelResource;
+
+namespace vkb
+{
+	struct DispatchTable;
+} // namespace vkb
+
+// Per instance data, matches the InstanceBuffer (set 0, binding 1, std430) in the vertex shaders
+struct InstanceData
+{
+	glm::mat4 model;
+	glm::mat4 normalMatrix;  // mat3 padded to a mat4 for std430
+	uint32_t materialIndex;  // Into the bindless material buffer, see BindlessMaterials
+	uint32_t padding[3];     // std430 rounds the struct up to 16 bytes
+};
+
+// One instanced draw: every entity sharing a pipeline, mesh and material. Batches are sorted by
+// pipeline, material, mesh buffer, then mesh so state changes are rare and indirect runs are long.
+struct InstanceBatch
+{
+	uint32_t pipelineId = 0; // INVALID_PIPELINE_ID for shadow batches, they all use the shadow map pipeline
+	ModelResource* model = nullptr;
+	const MaterialResource* material = nullptr;
+	Entity* firstEntity = nullptr; // Used to resolve the material descriptor sets of the batch
+	uint32_t firstInstance = 0;    // Absolute index into the instance buffer, already includes the frame offset
+	uint32_t instanceCount = 0;
+};
+
+// Groups visible entities into instanced draws and writes their transforms into a persistently mapped
+// storage buffer. The buffer holds one region per frame in flight so the CPU never writes data the GPU
+// is still reading, and since firstInstance carries the region offset the descriptor never changes.
+//
+// Both passes go through one render queue of packets with a 64 bit sort key, radix sorted:
+//   pass (4) | pipeline id, or shadow view (10) | material id (16) | mesh (16) | view depth (18)
+// Everything is resolved to integers at load time, so building the queue does no string compares and,
+// once the vectors have grown to the scene, no allocations.
+class InstanceBatcher
+{
+public:
+	enum class Pass : uint8_t
+	{
+		Camera,
+		Shadow,
+		StaticShadow // Casters the SpatialIndex classes as static, drawn into a view's cached depth
+	};
+
+	// A shadow map (or one cascade of it) rendered this frame
+	struct ShadowView
+	{
+		Frustum frustum;
+		bool staticCached = false; // The static casters are already in the view's cached depth, so they are skipped
+	};
+
+	struct Stats
+	{
+		size_t visibleEntities = 0;
+		size_t instances = 0;
+		size_t batches = 0;
+		size_t shadowInstances = 0;
+		size_t shadowBatches = 0;
+		size_t shadowViews = 0;
+		size_t staticShadowInstances = 0;
+		size_t cachedShadowCasters = 0; // Static casters skipped since their views are cached
+		uint32_t capacity = 0; // Instances per frame
+	};
+
+	void Cleanup(VmaAllocator allocator);
+
+	// Gathers the entities inside the frustum (and the shadow casters of every shadow view), batches them and
+	// uploads the instance data for frameIndex. Returns true if the buffer was recreated and has to be rebound.
+	// Instances of a batch are ordered front to back from viewPosition. Queries the entity manager's spatial
+	// index as it is, call UpdateSpatialIndex first.
+	bool Build(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, EntityManager& entityManager, const Frustum& frustum, const glm::vec3& viewPosition, uint32_t frameIndex, uint32_t frameCount);
+
+	// Batches of this pipeline read their material from the instance data, so they only break on the mesh and
+	// carry no material. INVALID_PIPELINE_ID (the default) turns that off.
+	void SetBindlessPipeline(uint32_t pipelineId)
+	{
+		m_bindlessPipelineId = pipelineId;
+	}
+
+	// One per shadow map (or cascade of one) rendered this frame, casters are culled against each frustum and
+	// batched per view, static and dynamic ones apart. Without any views there is a single one that every
+	// caster lands in as dynamic. Set before Build.
+	void SetShadowViews(const std::vector<ShadowView>& views);
+
+	static uint64_t MakeSortKey(Pass pass, uint32_t pipelineId, uint32_t materialId, const ModelResource& model, float viewDistanceSquared);
+
+	const std::vector<InstanceBatch>& GetBatches() const
+	{
+		return m_batches;
+	}
+
+	// Shadow casters are not culled against the camera, they can cast into view from outside of it
+	const std::vector<InstanceBatch>& GetShadowBatches(uint32_t view = 0) const
+	{
+		return m_shadowBatches[view];
+	}
+
+	// Empty for views whose static casters are cached
+	const std::vector<InstanceBatch>& GetStaticShadowBatches(uint32_t view) const
+	{
+		return m_staticShadowBatches[view];
+	}
+
+	uint32_t GetShadowViewCount() const
+	{
+		return static_cast<uint32_t>(m_shadowBatches.size());
+	}
+
+	VkBuffer GetBuffer() const
+	{
+		return m_buffer;
+	}
+
+	const Stats& GetStats() const
+	{
+		return m_stats;
+	}
+
+	void ImGuiDebug() const;
+
+private:
+	struct DrawPacket
+	{
+		uint64_t key;
+		ModelResource* model;
+		const MaterialResource* material;
+		Entity* entity;
+	};
+
+	void FormBatches(uint32_t instanceIndex);
+	bool EnsureCapacity(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, uint32_t instanceCount, uint32_t frameCount);
+
+	// Reused every frame to avoid reallocating
+	std::vector<Entity*> m_visibleEntities;
+	std::vector<DrawPacket> m_queue;
+	std::vector<DrawPacket> m_sortScratch;
+	std::vector<InstanceBatch> m_batches;
+	std::vector<std::vector<InstanceBatch>> m_shadowBatches = std::vector<std::vector<InstanceBatch>>(1); // Per shadow view
+	std::vector<std::vector<InstanceBatch>> m_staticShadowBatches = std::vector<std::vector<InstanceBatch>>(1);
+	std::vector<ShadowView> m_shadowViews;
+	uint32_t m_bindlessPipelineId = UINT32_MAX;
+
+	VkBuffer m_buffer = VK_NULL_HANDLE;
+	VmaAllocation m_allocation = VK_NULL_HANDLE;
+	InstanceData* m_mappedData = nullptr;
+	uint32_t m_capacity = 0;
+	uint32_t m_frameCount = 0;
+
+	Stats m_stats;
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+#include "VkBootstrapDispatch.h"
+
+// Owns every descriptor set layout and pipeline layout, deduplicated by what they describe. Asking twice for
+// the same bindings or the same sets and push constants gives back the same handle, so pipelines with
+// compatible layouts share one and equal handles can be taken to mean identical layouts when deciding
+// which descriptor sets stay bound across a pipeline change.
+//
+// Not thread safe, layouts are created on the main thread while setting up pipelines.
+class LayoutRegistry
+{
+public:
+	struct Stats
+	{
+		uint32_t setLayouts = 0;
+		uint32_t setLayoutHits = 0;
+		uint32_t pipelineLayouts = 0;
+		uint32_t pipelineLayoutHits = 0;
+	};
+
+	// Binding order doesn't matter, the bindings are sorted by binding number
+	VkDescriptorSetLayout GetDescriptorSetLayout(const vkb::DispatchTable& disp, const std::vector<VkDescriptorSetLayoutBinding>& bindings, const std::vector<VkDescriptorBindingFlags>& bindingFlags);
+	VkPipelineLayout GetPipelineLayout(const vkb::DispatchTable& disp, const std::vector<VkDescriptorSetLayout>& setLayouts, const std::vector<VkPushConstantRange>& pushConstantRanges);
+
+	// Destroys everything, nothing created with these layouts may still be in use
+	void Cleanup(vkb::DispatchTable& disp);
+
+	const Stats& GetStats() const
+	{
+		return m_stats;
+	}
+
+	// The binary descriptions the registry is keyed by, exposed so they can be checked without a device
+	static std::vector<uint32_t> DescribeSetLayout(const std::vector<VkDescriptorSetLayoutBinding>& bindings, const std::vector<VkDescriptorBindingFlags>& bindingFlags);
+	static std::vector<uint32_t> DescribePipelineLayout(const std::vector<VkDescriptorSetLayout>& setLayouts, const std::vector<VkPushConstantRange>& pushConstantRanges);
+
+private:
+	// FNV-1a over the description, equal hashes are still compared word by word
+	struct DescriptionHash
+	{
+		size_t operator()(const std::vector<uint32_t>& description) const;
+	};
+
+	std::unordered_map<std::vector<uint32_t>, VkDescriptorSetLayout, DescriptionHash> m_setLayouts;
+	std::unordered_map<std::vector<uint32_t>, VkPipelineLayout, DescriptionHash> m_pipelineLayouts;
+	Stats m_stats;
+};
@@ -8,6 +8,16 @@
 
 constexpr float PADDING = 420.0f;
 
+// Cascades a directional light's shadow map can be split into, MAX_SHADOW_CASCADES in the shaders has to match
+constexpr uint32_t MAX_SHADOW_CASCADES = 4;
+
+// How a directional light's shadow map is filtered, SHADOW_FILTER_* in the shaders have to match
+enum class ShadowFilter : uint32_t
+{
+	PCF = 0,  // Depth compared over a 3x3 kernel
+	EVSM = 1, // Exponential variance shadow map, blurred moments with mips sampled once
+};
+
 enum class LightType
 {
 	Undefined,
@@ -62,9 +72,6 @@ public:
 
 	virtual void ImGuiDebug() = 0;
 
-	VkBuffer buffer = VK_NULL_HANDLE;
-	VmaAllocation allocation = VK_NULL_HANDLE;
-
 protected:
 	LightType m_lightType = LightType::Undefined;
 	LightData m_data;
@@ -82,12 +89,23 @@ public:
 	const LightData& GetData() const;
 	void SetData(const LightData& data);
 
+	// Set by the ShadowSystem every frame. splitDepths is the view depth each cascade reaches to.
+	void SetShadowCascades(const glm::mat4* matrices, const float* splitDepths, uint32_t count);
+	// Also set by the ShadowSystem, lightBleedReduction only matters to EVSM
+	void SetShadowFilter(ShadowFilter filter, float lightBleedReduction);
+
 	// Get the binding data
 	struct BindingData
 	{
 		LightData data;
 		glm::vec3 direction;
 		float padding1 = PADDING;
+		glm::mat4 cascadeMatrices[MAX_SHADOW_CASCADES];
+		glm::vec4 cascadeSplits; // View depth where each cascade ends
+		uint32_t cascadeCount;
+		ShadowFilter shadowFilter;
+		float lightBleedReduction; // Cuts off the low end of the EVSM visibility
+		float padding2 = PADDING;
 	};
 	BindingData GetBindingData();
 	size_t GetBindingDataSize() const;
@@ -97,6 +115,12 @@ public:
 private:
 	glm::vec3 m_direction = glm::normalize(glm::vec3(-20.0f, 15.0f, 20.0f));
 	float m_padding3 = PADDING;
+
+	glm::mat4 m_cascadeMatrices[MAX_SHADOW_CASCADES] = {};
+	glm::vec4 m_cascadeSplits = glm::vec4(0.0f);
+	uint32_t m_cascadeCount = 0;
+	ShadowFilter m_shadowFilter = ShadowFilter::PCF;
+	float m_lightBleedReduction = 0.0f;
 };
 
 // Point Light
@@ -114,12 +138,17 @@ public:
 	const LightData& GetData() const;
 	void SetData(const LightData& data);
 
+	// Set by the ShadowSystem every frame. Where the light's faces are in the shadow atlas, offset in xy and
+	// size in zw as a fraction of the atlas, all zero when the light has no shadow this frame.
+	void SetShadowAtlasRect(const glm::vec4& atlasRect);
+
 	// Get the binding data
 	struct BindingData
 	{
 		LightData data;
 		glm::vec3 position;
 		float radius;
+		glm::vec4 shadowAtlasRect;
 	};
 	BindingData GetBindingData();
 	size_t GetBindingDataSize() const;
@@ -128,4 +157,5 @@ public:
 private:
 	glm::vec3 m_position = glm::vec3(-6.0f, 6.0f, 6.0f);
 	float m_radius = 50.0f; // Light's influence radius
+	glm::vec4 m_shadowAtlasRect = glm::vec4(0.0f);
 };
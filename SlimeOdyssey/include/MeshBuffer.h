@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_core.h>
+
+#include "OffsetAllocator.h"
+
+struct ModelResource;
+
+namespace vkb
+{
+	struct DispatchTable;
+} // namespace vkb
+
+// Where the mesh data ended up, ReBAR is device local memory the CPU can write to directly
+enum class MeshMemory
+{
+	DeviceLocal,
+	HostVisible,
+	ReBAR
+};
+
+const char* MeshMemoryName(MeshMemory memory);
+
+// Vertex and index buffers shared by every mesh. Each mesh gets a sub-range from an OffsetAllocator and
+// only differs by its vertexOffset/firstIndex, so the buffers are bound once per pass and draws can be
+// merged into indirect draws.
+//
+// Static buffers are device local and filled through a staging buffer. Dynamic buffers stay mapped and are
+// written directly, they land in ReBAR memory when the GPU has it and in host memory read over PCIe
+// otherwise. Meshes are only written when uploaded: rewriting one in place would race the frames in flight
+// still drawing it, that needs a copy per frame in flight first.
+class MeshBuffer
+{
+public:
+	// Starting capacity in elements, 14 MB of vertices and 4 MB of indices. Doubles when full.
+	static constexpr uint32_t INITIAL_VERTEX_CAPACITY = 1u << 18;
+	static constexpr uint32_t INITIAL_INDEX_CAPACITY = 1u << 20;
+
+	struct Stats
+	{
+		OffsetAllocator::Stats vertices;
+		OffsetAllocator::Stats indices;
+		uint32_t growCount = 0;
+	};
+
+	explicit MeshBuffer(bool dynamic = false)
+	      : m_dynamic(dynamic){};
+
+	// Copies the mesh into the shared buffers and stores where it went on the model. Blocks until the
+	// copy is done. Returns false if the buffers could not grow to fit it.
+	bool Upload(vkb::DispatchTable& disp, VkQueue graphicsQueue, VkCommandPool commandPool, VmaAllocator allocator, ModelResource& model);
+
+	// Returns the model's ranges to the free list, the GPU must be done drawing it
+	void Free(ModelResource& model);
+
+	void Bind(vkb::DispatchTable& disp, VkCommandBuffer cmd) const;
+	void Cleanup(VmaAllocator allocator);
+
+	VkBuffer GetVertexBuffer() const
+	{
+		return m_vertices.buffer;
+	}
+
+	VkBuffer GetIndexBuffer() const
+	{
+		return m_indices.buffer;
+	}
+
+	bool IsDynamic() const
+	{
+		return m_dynamic;
+	}
+
+	MeshMemory GetMemory() const
+	{
+		return m_memory;
+	}
+
+	Stats GetStats() const;
+	void ImGuiDebug() const;
+
+private:
+	struct Storage
+	{
+		VkBuffer buffer = VK_NULL_HANDLE;
+		VmaAllocation allocation = VK_NULL_HANDLE;
+		void* mappedData = nullptr; // Only for dynamic buffers
+	};
+
+	Storage CreateStorage(VmaAllocator allocator, const char* name, VkDeviceSize size, VkBufferUsageFlags usage);
+	void Grow(vkb::DispatchTable& disp, VkQueue graphicsQueue, VkCommandPool commandPool, VmaAllocator allocator, uint32_t vertexCapacity, uint32_t indexCapacity);
+	void Write(VmaAllocator allocator, const ModelResource& model, uint32_t vertexOffset, uint32_t firstIndex);
+
+	bool m_dynamic;
+	MeshMemory m_memory = MeshMemory::DeviceLocal;
+
+	Storage m_vertices;
+	Storage m_indices;
+
+	// In vertices and indices, not bytes
+	OffsetAllocator m_vertexRanges;
+	OffsetAllocator m_indexRanges;
+	uint32_t m_growCount = 0;
+};
@@ -1,9 +1,11 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <vulkan/vulkan_core.h>
 
+#include "Bounds.h"
 #include "Component.h"
 #include "vk_mem_alloc.h"
 
@@ -12,6 +14,11 @@
 
 #include <memory>
 
+class MeshBuffer;
+
+// Pipeline ids index ModelManager's pipeline registry, see ModelManager::GetPipelineId
+constexpr uint32_t INVALID_PIPELINE_ID = UINT32_MAX;
+
 struct Vertex
 {
 	glm::vec3 pos;
@@ -31,13 +38,31 @@ struct ModelResource
 	std::vector<Vertex> vertices;
 	std::vector<uint32_t> indices;
 
-	VkBuffer vertexBuffer = VK_NULL_HANDLE;
-	VmaAllocation vertexAllocation = VK_NULL_HANDLE;
+	// Dynamic meshes go in a host visible MeshBuffer so they can be rewritten, set before uploading
+	bool dynamic = false;
 
-	VkBuffer indexBuffer = VK_NULL_HANDLE;
-	VmaAllocation indexAllocation = VK_NULL_HANDLE;
+	// Where the mesh lives in the shared MeshBuffer, meshBuffer stays null until it is uploaded
+	const MeshBuffer* meshBuffer = nullptr;
+	int32_t vertexOffset = 0;
+	uint32_t firstIndex = 0;
+	uint32_t indexCount = 0;
+	uint32_t meshId = 0; // Assigned on upload, only used to sort draws
 
+	// Resolved to pipelineId when the mesh is uploaded so drawing never looks pipelines up by name
 	std::string pipelineName;
+	uint32_t pipelineId = INVALID_PIPELINE_ID;
+
+	// Local space bounds of the vertices
+	AABB bounds;
+
+	void CalculateBounds()
+	{
+		bounds = AABB();
+		for (const auto& vertex: vertices)
+		{
+			bounds.Expand(vertex.pos);
+		}
+	}
 };
 
 struct TextureResource
@@ -54,10 +79,11 @@ struct TextureResource
 
 struct MaterialResource
 {
-	VmaAllocation configAllocation;
-	VkBuffer configBuffer;
-
+	uint32_t id = 0; // Assigned by the DescriptorManager, only used to sort draws
 	bool disposed = false;
+
+	// Where this frame's copy lives in the bindless material buffer, rewritten by BindlessMaterials every frame
+	uint32_t bindlessIndex = 0;
 };
 
 struct BasicMaterialResource : public MaterialResource
@@ -81,11 +107,14 @@ struct PBRMaterialResource : public MaterialResource
 		glm::vec2 padding;
 	};
 
-	TextureResource* albedoTex;
-	TextureResource* normalTex;
-	TextureResource* metallicTex;
-	TextureResource* roughnessTex;
-	TextureResource* aoTex;
+	TextureResource* albedoTex = nullptr;
+	TextureResource* normalTex = nullptr;
+	TextureResource* metallicTex = nullptr;
+	TextureResource* roughnessTex = nullptr;
+	TextureResource* aoTex = nullptr;
+
+	// Skips the shadow lookup through a shader variant, like a missing normal or AO map does
+	bool receiveShadows = true;
 
 	Config config;
 };
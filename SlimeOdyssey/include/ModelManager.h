@@ -1,11 +1,17 @@
 #pragma once
 
+#include <chrono>
+#include <future>
+#include <map>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "MeshBuffer.h"
 #include "Model.h"
 #include "PipelineGenerator.h"
+#include "ShaderVariants.h"
 #include "tiny_obj_loader.h"
 
 class DescriptorManager;
@@ -28,6 +34,8 @@ public:
 	ModelResource* CreateSphere(VmaAllocator allocator, float radius = 1.0f, int segments = 16, int rings = 16);
 	ModelResource* CreateCylinder(VmaAllocator allocator, float radius = 0.5f, float height = 2.0f, int segments = 16);
 
+	// Both return once the layouts exist, the pipeline itself compiles on a worker thread. GetPipeline
+	// returns null for it until WaitForPipelines has collected it.
 	void CreateShadowMapPipeline(VulkanContext& vulkanContext, ShaderManager& shaderManager, DescriptorManager& descriptorManager);
 	void CreatePipeline(
 	        const std::string& pipelineName, VulkanContext& vulkanContext, ShaderManager& shaderManager, DescriptorManager& descriptorManager, const std::vector<std::pair<std::string, VkShaderStageFlagBits>>& shaderPaths, bool depthTestEnabled, VkCullModeFlags cullMode = VK_CULL_MODE_BACK_BIT, VkPolygonMode polygonMode = VK_POLYGON_MODE_FILL);
@@ -37,18 +45,162 @@ public:
 	void UnloadAllResources(vkb::DispatchTable& disp, VmaAllocator allocator);
 	void BindTexture(vkb::DispatchTable& disp, const std::string& name, uint32_t binding, VkDescriptorSet set);
 	void TransitionImageLayout(vkb::DispatchTable& disp, VkQueue graphicsQueue, VkCommandPool commandPool, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout);
-	int DrawModel(vkb::DispatchTable& disp, VkCommandBuffer& cmd, const ModelResource& model);
-	void CreateBuffersForMesh(VmaAllocator allocator, ModelResource& model);
+	// Expects the MeshBuffer to be bound
+	int DrawModel(vkb::DispatchTable& disp, VkCommandBuffer& cmd, const ModelResource& model, uint32_t instanceCount = 1, uint32_t firstInstance = 0);
+	void CreateBuffersForMesh(vkb::DispatchTable& disp, VkQueue graphicsQueue, VkCommandPool commandPool, VmaAllocator allocator, ModelResource& model);
+	// Releases the model and its range in the MeshBuffer, the GPU must be done drawing it
+	void UnloadModel(const std::string& name);
 	TextureResource* CopyTexture(const std::string& name, TextureResource* texture);
 
 	std::map<std::string, PipelineConfig>& GetPipelines();
 
+	// Draw sort keys have room for this many pipelines
+	static constexpr uint32_t MAX_PIPELINE_IDS = 1024;
+
+	// Maps a pipeline name to a small integer id, registering it if needed so meshes can resolve their
+	// pipeline before it is created. Ids survive CleanUpAllPipelines and pipeline recreation.
+	uint32_t GetPipelineId(const std::string& pipelineName);
+	// Null if the pipeline behind the id hasn't been created (yet)
+	PipelineConfig* GetPipeline(uint32_t pipelineId) const;
+
+	// Blocks until every pipeline still compiling is done and makes them available, cheap when there are none
+	void WaitForPipelines();
+	bool HasPendingPipelines() const
+	{
+		return !m_pendingPipelines.empty();
+	}
+
+	// Rebuilds every pipeline that uses one of the given .spv files, from the same settings it was created
+	// with. The old pipeline keeps drawing until the new one has compiled, see UpdateReloadedPipelines.
+	void ReloadShaders(VulkanContext& vulkanContext, ShaderManager& shaderManager, const std::vector<std::string>& spirvPaths);
+	// Call at a frame boundary: swaps in rebuilt pipelines that are done compiling and destroys the ones they
+	// replaced once no frame in flight can still use them
+	void UpdateReloadedPipelines(vkb::DispatchTable& disp);
+
+	// The variant of a pipeline built for these ShaderKeywords. Until it has compiled, and for pipelines whose
+	// shaders declare none of them, that's the pipeline itself, which has every keyword on. The first call for
+	// a combination queues it, UpdatePipelineVariants builds it.
+	uint32_t GetPipelineVariant(uint32_t pipelineId, uint32_t keywords);
+	// Queues variants before anything draws with them, for scenes that know their materials up front
+	void PrecompileVariants(const std::string& pipelineName, const std::vector<uint32_t>& keywordSets);
+	// Call at a frame boundary: starts compiling queued variants on worker threads and makes the finished ones
+	// available, never waits for either
+	void UpdatePipelineVariants(VulkanContext& vulkanContext, ShaderManager& shaderManager);
+
+	const ShaderVariants& GetShaderVariants() const
+	{
+		return m_shaderVariants;
+	}
+
+	const MeshBuffer& GetMeshBuffer() const
+	{
+		return m_meshBuffer;
+	}
+
+	const MeshBuffer& GetDynamicMeshBuffer() const
+	{
+		return m_dynamicMeshBuffer;
+	}
+
 	void CleanUpAllPipelines(vkb::DispatchTable& disp);
 
 private:
 	std::unordered_map<std::string, ModelResource> m_modelResources;
 	std::unordered_map<std::string, TextureResource> m_textures;
 	std::map<std::string, PipelineConfig> m_pipelines;
+	std::unordered_map<std::string, uint32_t> m_pipelineIds;
+	std::vector<PipelineConfig*> m_pipelinesById;
+
+	// What a pipeline was created from, kept so it can be rebuilt when one of its shaders changes
+	struct PipelineRecipe
+	{
+		std::vector<std::pair<std::string, VkShaderStageFlagBits>> shaderPaths; // A lone compute stage makes it a compute pipeline
+		bool depthOnly = false; // The shadow map pass, no colour attachment and regular Z
+		VkFormat depthFormat = VK_FORMAT_D32_SFLOAT;
+		uint32_t viewMask = 0; // Multiview, renders into one layer per set bit
+		bool depthTestEnabled = true;
+		VkCullModeFlags cullMode = VK_CULL_MODE_BACK_BIT;
+		VkPolygonMode polygonMode = VK_POLYGON_MODE_FILL;
+		uint32_t keywords = ALL_SHADER_KEYWORDS; // Which variant of the shaders, shaderPaths are already its SPIR-V
+		std::string variantOf;                   // The base pipeline, for variants
+	};
+	std::map<std::string, PipelineRecipe> m_pipelineRecipes;
+
+	struct PendingPipeline
+	{
+		std::string name;
+		std::unique_ptr<PipelineGenerator> generator; // Owns the state the compile reads
+		std::future<VkPipeline> pipeline;
+	};
+	std::vector<PendingPipeline> m_pendingPipelines;
+
+	// A hot reloaded pipeline compiling next to the one it replaces
+	struct ReloadingPipeline
+	{
+		PendingPipeline pending;
+		PipelineConfig config; // The live config is only touched when swapping
+		std::chrono::high_resolution_clock::time_point start;
+	};
+	std::vector<ReloadingPipeline> m_reloadingPipelines;
+
+	// Replaced pipelines wait here until the frames that may still use them are done
+	struct RetiredPipeline
+	{
+		VkPipeline pipeline;
+		uint32_t framesLeft;
+	};
+	std::vector<RetiredPipeline> m_retiredPipelines;
+
+	// Variant ids by base pipeline id (high bits) and keywords, INVALID_PIPELINE_ID while one is being built or
+	// if it failed. Variants live in m_pipelines as "<base>#<keywords>".
+	std::unordered_map<uint64_t, uint32_t> m_variantIds;
+
+	struct VariantRequest
+	{
+		uint64_t key;
+		std::string baseName;
+	};
+	std::vector<VariantRequest> m_variantRequests;
+
+	struct VariantBuild
+	{
+		uint64_t key;
+		std::string name;
+		PipelineRecipe recipe;
+		std::unique_ptr<PipelineGenerator> generator;
+		PipelineConfig config;
+		std::future<VkPipeline> pipeline;
+	};
+	// A shader variant's SPIR-V, built for all queued variants at once so no file is compiled twice
+	struct VariantSpirv
+	{
+		std::string spirvPath;
+		uint32_t compiledKeywords;
+		uint32_t compiledMask;
+		ShaderVariants::BuildResult result = ShaderVariants::BuildResult::Failed;
+		double milliseconds = 0.0;
+		std::string log;
+	};
+	std::vector<VariantBuild> m_variantSpirvBuilds; // Waiting for m_variantSpirv
+	std::future<std::vector<VariantSpirv>> m_variantSpirv;
+	std::vector<VariantBuild> m_variantBuilds; // Pipelines compiling
+	ShaderVariants m_shaderVariants;
+
+	// Loads the recipe's shaders and sets up a generator for it, layouts included
+	std::unique_ptr<PipelineGenerator> CreatePipelineGenerator(const std::string& pipelineName, VulkanContext& vulkanContext, ShaderManager& shaderManager, const PipelineRecipe& recipe);
+	// Creates the layout now and starts compiling the pipeline
+	void CompilePipelineAsync(const std::string& pipelineName, std::unique_ptr<PipelineGenerator> generator);
+	// Blocks until all reloads have compiled, dropping those whose pipeline is about to be replaced anyway
+	void FinishReloadingPipelines(vkb::DispatchTable& disp, const std::vector<std::string>& discard);
+	void RequestVariant(uint64_t key, const std::string& baseName);
+	// The keywords a stage builds in as SPIR-V variants, those backed by a specialization constant left out
+	uint32_t GetCompiledKeywordMask(VulkanContext& vulkanContext, ShaderManager& shaderManager, const std::string& spirvPath, VkShaderStageFlagBits stage);
+	// Forgets every variant of the given base pipelines (all of them when empty): built ones are retired, ones
+	// still compiling are waited for and destroyed. Returns the variant SPIR-V the built ones were created from.
+	std::vector<std::pair<std::string, VkShaderStageFlagBits>> DropPipelineVariants(vkb::DispatchTable& disp, const std::vector<std::string>& baseNames);
+	uint32_t m_nextMeshId = 0;
+	MeshBuffer m_meshBuffer;
+	MeshBuffer m_dynamicMeshBuffer{ true };
 
 	void CenterModel(std::vector<Vertex>& vector);
 	void CalculateTexCoords(std::vector<Vertex>& vector, const std::vector<unsigned int>& indices);
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <utility>
+
+// Hands out sub-ranges of a fixed size range (in elements, not bytes) with a best fit free list.
+// Freed ranges merge with their free neighbours so the list stays short. Only offsets are tracked,
+// whatever owns the memory decides what an element is.
+class OffsetAllocator
+{
+public:
+	static constexpr uint32_t INVALID_OFFSET = UINT32_MAX;
+
+	struct Stats
+	{
+		uint32_t capacity = 0;
+		uint32_t used = 0;
+		uint32_t allocations = 0;
+		uint32_t freeRanges = 0;
+		uint32_t largestFreeRange = 0;
+
+		// 0 when all free space is one range, approaches 1 as it gets split into small pieces
+		float Fragmentation() const
+		{
+			uint32_t free = capacity - used;
+			return free == 0 ? 0.0f : 1.0f - static_cast<float>(largestFreeRange) / static_cast<float>(free);
+		}
+	};
+
+	OffsetAllocator() = default;
+	explicit OffsetAllocator(uint32_t capacity);
+
+	// Drops every allocation
+	void Reset(uint32_t capacity);
+
+	// Adds space at the end, existing offsets stay valid
+	void Grow(uint32_t newCapacity);
+
+	// Returns INVALID_OFFSET if no free range is large enough
+	uint32_t Allocate(uint32_t size);
+	void Free(uint32_t offset);
+
+	// Size of the allocation at offset, 0 if there is none
+	uint32_t GetAllocationSize(uint32_t offset) const;
+
+	uint32_t GetCapacity() const
+	{
+		return m_capacity;
+	}
+
+	Stats GetStats() const;
+
+private:
+	void InsertFreeRange(uint32_t offset, uint32_t size);
+	std::map<uint32_t, uint32_t>::iterator EraseFreeRange(std::map<uint32_t, uint32_t>::iterator it);
+
+	uint32_t m_capacity = 0;
+	uint32_t m_used = 0;
+
+	std::map<uint32_t, uint32_t> m_freeByOffset;          // offset -> size, to find neighbours when freeing
+	std::set<std::pair<uint32_t, uint32_t>> m_freeBySize; // (size, offset), to find the best fit
+	std::unordered_map<uint32_t, uint32_t> m_allocations; // offset -> size
+};
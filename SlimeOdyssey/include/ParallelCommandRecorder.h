@@ -0,0 +1,106 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+namespace vkb
+{
+	struct DispatchTable;
+} // namespace vkb
+
+// Records a range of draws in parallel into secondary command buffers that continue a dynamic rendering
+// pass of the primary. The calling thread records the first chunk and a fixed set of workers the rest.
+//
+// Command pools can only be used from one thread at a time, so every thread has its own pool per frame in
+// flight. Those are reset in BeginFrame, which is why it has to wait for the frame's fence.
+class ParallelCommandRecorder
+{
+public:
+	// Called once per chunk with its own command buffer, has to set every dynamic state and bind everything
+	// it uses since secondary command buffers don't inherit any of it
+	using RecordFunction = std::function<void(VkCommandBuffer cmd, uint32_t firstItem, uint32_t itemCount)>;
+
+	struct Stats
+	{
+		uint32_t chunks = 0;
+		uint32_t items = 0;
+		uint32_t commandBuffers = 0; // Allocated over all pools
+		double recordMs = 0.0;
+	};
+
+	// One thread per core, the calling thread included
+	static uint32_t DefaultThreadCount();
+
+	ParallelCommandRecorder() = default;
+	~ParallelCommandRecorder();
+
+	ParallelCommandRecorder(const ParallelCommandRecorder&) = delete;
+	ParallelCommandRecorder& operator=(const ParallelCommandRecorder&) = delete;
+
+	void Init(vkb::DispatchTable& disp, uint32_t queueFamilyIndex, uint32_t frameCount, uint32_t threadCount = DefaultThreadCount());
+	void Cleanup(vkb::DispatchTable& disp);
+
+	// Makes the command buffers of frameIndex reusable, the GPU must be done with them
+	void BeginFrame(vkb::DispatchTable& disp, uint32_t frameIndex);
+
+	// Splits [0, itemCount) into contiguous chunks of at least minChunkSize items, one per thread at most, and
+	// blocks until all are recorded. renderingInfo has to match the flags and formats the primary passed to
+	// cmdBeginRendering. The returned buffers are in item order, ready for cmdExecuteCommands, and stay valid
+	// until the next Record.
+	const std::vector<VkCommandBuffer>& Record(vkb::DispatchTable& disp, const VkCommandBufferInheritanceRenderingInfo& renderingInfo, uint32_t itemCount, uint32_t minChunkSize, const RecordFunction& record);
+
+	bool IsInitialized() const
+	{
+		return !m_pools.empty();
+	}
+
+	uint32_t GetThreadCount() const
+	{
+		return m_threadCount;
+	}
+
+	const Stats& GetStats() const
+	{
+		return m_stats;
+	}
+
+private:
+	struct ThreadPool
+	{
+		VkCommandPool pool = VK_NULL_HANDLE;
+		std::vector<VkCommandBuffer> buffers;
+		uint32_t used = 0;
+	};
+
+	void WorkerLoop(uint32_t threadIndex);
+	void RecordChunk(uint32_t chunkIndex);
+	VkCommandBuffer AcquireCommandBuffer(uint32_t threadIndex);
+	void StopWorkers();
+
+	std::vector<std::vector<ThreadPool>> m_pools; // [frame][thread]
+	uint32_t m_frameIndex = 0;
+	uint32_t m_threadCount = 0;
+
+	// The current job, written before the workers are woken up
+	vkb::DispatchTable* m_disp = nullptr;
+	const RecordFunction* m_record = nullptr;
+	VkCommandBufferInheritanceRenderingInfo m_renderingInfo = {};
+	uint32_t m_itemCount = 0;
+	uint32_t m_chunkCount = 0;
+	std::vector<VkCommandBuffer> m_commandBuffers;
+
+	std::vector<std::thread> m_workers;
+	std::mutex m_mutex;
+	std::condition_variable m_workReady;
+	std::condition_variable m_workDone;
+	uint64_t m_generation = 0;
+	uint32_t m_pendingChunks = 0;
+	bool m_stopping = false;
+
+	Stats m_stats;
+};
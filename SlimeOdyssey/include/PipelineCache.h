@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+namespace vkb
+{
+	struct DispatchTable;
+} // namespace vkb
+
+// The VkPipelineCache every pipeline is created with, kept on disk between runs so a warm start skips the
+// shader compiles the driver already did.
+//
+// Drivers reject foreign cache data on their own, but a blob that only partly matches (a driver update,
+// another GPU in the machine) is allowed to behave badly. The file therefore starts with our own header
+// naming the exact device and driver it came from plus a checksum, and anything that doesn't match all of
+// it is thrown away before the driver sees it.
+class PipelineCache
+{
+public:
+	// Everything that has to match for a saved cache to be used
+	struct DeviceIdentity
+	{
+		uint32_t vendorID = 0;
+		uint32_t deviceID = 0;
+		uint32_t driverVersion = 0;
+		uint8_t driverUUID[VK_UUID_SIZE] = {};
+		uint8_t pipelineCacheUUID[VK_UUID_SIZE] = {};
+	};
+
+	struct Stats
+	{
+		size_t loadedBytes = 0;
+		size_t savedBytes = 0;
+		std::string loadResult; // Why a file on disk was or wasn't used
+	};
+
+	void Init(const vkb::DispatchTable& disp, const DeviceIdentity& identity, const std::string& path);
+	// Writes the cache to disk, call once no more pipelines are being created
+	void Save(const vkb::DispatchTable& disp);
+	void Cleanup(const vkb::DispatchTable& disp);
+
+	VkPipelineCache Get() const
+	{
+		return m_cache;
+	}
+
+	const Stats& GetStats() const
+	{
+		return m_stats;
+	}
+
+	// The file format, exposed so it can be checked without a device
+	static std::vector<uint8_t> Serialize(const DeviceIdentity& identity, const std::vector<uint8_t>& cacheData);
+	// On success cacheData holds the driver's blob, otherwise error says what didn't match
+	static bool Deserialize(const std::vector<uint8_t>& file, const DeviceIdentity& identity, std::vector<uint8_t>& cacheData, std::string& error);
+
+private:
+	VkPipelineCache m_cache = VK_NULL_HANDLE;
+	DeviceIdentity m_identity;
+	std::string m_path;
+	Stats m_stats;
+};
@@ -1,12 +1,14 @@
 #pragma once
 
 #include <functional>
+#include <map>
 #include <optional>
 #include <vector>
 #include <vulkan/vulkan.h>
 
 #include "ShaderManager.h"
 
+class LayoutRegistry;
 class VulkanContext;
 
 struct PipelineConfig
@@ -15,14 +17,24 @@ struct PipelineConfig
 	VkPipelineLayout pipelineLayout;
 	VkPipeline pipeline;
 	std::vector<VkDescriptorSetLayout> descriptorSetLayouts;
+	std::vector<VkPushConstantRange> pushConstantRanges;
+	uint32_t variantKeywords = 0; // ShaderKeywords its shaders can be built without, see ModelManager::GetPipelineVariant
 };
 
+// Builds a graphics pipeline from its fixed function state, or a compute pipeline when the only shader
+// stage set is a compute one. The arrays the create infos point to (vertex
+// input, blend attachments, dynamic states, attachment formats) are copied into the generator, so once set
+// up it doesn't depend on the caller's locals and can be compiled on another thread. It must not be moved
+// or copied after that, it is heap allocated when compiled asynchronously.
 class PipelineGenerator
 {
 public:
 	explicit PipelineGenerator(VulkanContext& vulkanContext);
 	~PipelineGenerator() = default;
 
+	PipelineGenerator(const PipelineGenerator&) = delete;
+	PipelineGenerator& operator=(const PipelineGenerator&) = delete;
+
 	// Builder methods
 	PipelineGenerator& SetName(const std::string& name);
 	PipelineGenerator& SetShaderStages(const std::vector<VkPipelineShaderStageCreateInfo>& stages);
@@ -35,6 +47,8 @@ public:
 	PipelineGenerator& SetColorBlendState(const VkPipelineColorBlendStateCreateInfo& colorBlending);
 	PipelineGenerator& SetDynamicState(const VkPipelineDynamicStateCreateInfo& dynamicState);
 	PipelineGenerator& SetLayout(VkPipelineLayout layout);
+	// Takes the pipeline layout from the registry instead of creating one, the registry then owns it
+	PipelineGenerator& SetLayoutRegistry(LayoutRegistry& layoutRegistry);
 	PipelineGenerator& SetRenderPass(VkRenderPass renderPass, uint32_t subpass);
 	PipelineGenerator& SetBasePipeline(VkPipeline basePipeline, int32_t basePipelineIndex);
 	PipelineGenerator& SetRenderingInfo(VkPipelineRenderingCreateInfo renderingInfo);
@@ -63,9 +77,15 @@ public:
 	// Descriptor set and push constant configuration
 	PipelineGenerator& SetDescriptorSetLayouts(const std::vector<VkDescriptorSetLayout>& layouts);
 	PipelineGenerator& SetPushConstantRanges(const std::vector<VkPushConstantRange>& ranges);
+	// Specialization constants for one of the shader stages, the entries' offsets point into data
+	PipelineGenerator& SetSpecialization(VkShaderStageFlagBits stage, const std::vector<VkSpecializationMapEntry>& entries, const std::vector<uint8_t>& data);
 
 	// Build methods
 	PipelineConfig Build();
+	// Build split in two: the layout on the calling thread, then the pipeline itself, which only touches the
+	// generator and the thread safe pipeline cache so any thread can run it
+	PipelineConfig BuildLayout();
+	VkPipeline CompilePipeline();
 	void Reset();
 
 private:
@@ -85,6 +105,7 @@ private:
 	std::optional<VkPipelineDynamicStateCreateInfo> m_dynamicState;
 	std::optional<VkPipelineRenderingCreateInfo> m_renderingInfo;
 	VkPipelineLayout m_layout = VK_NULL_HANDLE;
+	LayoutRegistry* m_layoutRegistry = nullptr;
 	VkRenderPass m_renderPass = VK_NULL_HANDLE;
 	uint32_t m_subpass = 0;
 	VkPipeline m_basePipeline = VK_NULL_HANDLE;
@@ -93,7 +114,20 @@ private:
 	std::vector<VkDescriptorSetLayout> m_descriptorSetLayouts;
 	std::vector<VkPushConstantRange> m_pushConstantRanges;
 
+	// What the create infos above point to
+	std::vector<VkVertexInputBindingDescription> m_vertexBindings;
+	std::vector<VkVertexInputAttributeDescription> m_vertexAttributes;
+	std::vector<VkPipelineColorBlendAttachmentState> m_colorBlendAttachments;
+	std::vector<VkDynamicState> m_dynamicStates;
+	std::vector<VkFormat> m_colorAttachmentFormats;
+
+	struct Specialization
+	{
+		std::vector<VkSpecializationMapEntry> entries;
+		std::vector<uint8_t> data;
+	};
+	std::map<VkShaderStageFlagBits, Specialization> m_specializations;
+
 	// Helper methods
 	void CreatePipelineLayout();
-	void CreatePipeline();
 };
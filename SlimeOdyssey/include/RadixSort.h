@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Stable LSD radix sort on a 64 bit `key` member, one byte per pass. Bytes that are the same for every
+// item (unused pipeline bits, a single material, ...) are skipped, so typical scenes take 3-5 passes.
+// scratch is resized to match items and can be kept around to avoid allocating every frame.
+template<typename T>
+void RadixSort(std::vector<T>& items, std::vector<T>& scratch)
+{
+	constexpr int DIGIT_COUNT = sizeof(uint64_t);
+	const size_t count = items.size();
+	if (count < 2)
+	{
+		return;
+	}
+
+	// All eight histograms in one read over the keys
+	std::array<std::array<uint32_t, 256>, DIGIT_COUNT> histograms = {};
+	for (const T& item: items)
+	{
+		for (int digit = 0; digit < DIGIT_COUNT; digit++)
+		{
+			histograms[digit][(item.key >> (digit * 8)) & 0xFF]++;
+		}
+	}
+
+	scratch.resize(count);
+	std::vector<T>* source = &items;
+	std::vector<T>* destination = &scratch;
+
+	for (int digit = 0; digit < DIGIT_COUNT; digit++)
+	{
+		std::array<uint32_t, 256>& histogram = histograms[digit];
+		if (histogram[(items[0].key >> (digit * 8)) & 0xFF] == count)
+		{
+			continue;
+		}
+
+		// Turn the counts into starting offsets
+		uint32_t offset = 0;
+		for (uint32_t& bucket: histogram)
+		{
+			uint32_t bucketCount = bucket;
+			bucket = offset;
+			offset += bucketCount;
+		}
+
+		for (const T& item: *source)
+		{
+			(*destination)[histogram[(item.key >> (digit * 8)) & 0xFF]++] = item;
+		}
+
+		std::swap(source, destination);
+	}
+
+	if (source != &items)
+	{
+		items.swap(scratch);
+	}
+}
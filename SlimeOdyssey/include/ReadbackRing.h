@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_core.h>
+
+class VulkanDebugUtils;
+
+namespace vkb
+{
+	struct DispatchTable;
+} // namespace vkb
+
+// GPU to CPU readbacks without stalling. Copies are recorded into the frame's own command buffer into a
+// persistently mapped buffer per frame in flight, and their callbacks run once that frame's fence has
+// signaled. Every BeginFrame polls the fences of the frames still in flight, so a result usually arrives a
+// frame or two later instead of waiting for its buffer to come round again. Callbacks always run in the
+// order the frames were submitted.
+//
+// Anything that ends in a buffer copy works: image texels (ReadImage), query results copied with
+// cmdCopyQueryPoolResults, or buffer ranges, through Request.
+class ReadbackRing
+{
+public:
+	// Only valid during the call, copy out what has to be kept
+	using Callback = std::function<void(const void* data, VkDeviceSize size)>;
+
+	// Where a requested copy has to land
+	struct Region
+	{
+		VkBuffer buffer = VK_NULL_HANDLE;
+		VkDeviceSize offset = 0;
+	};
+
+	struct Stats
+	{
+		uint32_t requests = 0;  // This frame
+		uint32_t refused = 0;   // This frame, the buffer was full
+		uint32_t delivered = 0; // Since the last frame started
+		VkDeviceSize capacity = 0;
+	};
+
+	explicit ReadbackRing(const char* name = "Readback Buffer")
+	      : m_name(name){};
+
+	// Drops anything still pending without calling back, the device has to be idle
+	void Cleanup(VmaAllocator allocator);
+
+	// Call once frameIndex's fence has been waited on, before recording. Delivers what that frame and any
+	// other finished frame read back, then hands out space for this frame's copies. frameFence is the fence
+	// the frame is submitted with, it is polled from the next frame on.
+	void BeginFrame(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, VkFence frameFence, uint32_t frameIndex, uint32_t frameCount);
+
+	// Space for a copy of size bytes, recorded by the caller into this frame's command buffer. False if the
+	// frame's buffer is full, it grows to fit before the frame index is used again so asking again works.
+	bool Request(VkDeviceSize size, Callback callback, Region& region);
+
+	// Records a copy of part of one layer of image, which has to be in TRANSFER_SRC_OPTIMAL. The callback gets
+	// the texels tightly packed, texelSize bytes each.
+	bool ReadImage(vkb::DispatchTable& disp, VkCommandBuffer cmd, VkImage image, VkImageAspectFlags aspectMask, uint32_t layer, VkOffset3D offset, VkExtent3D extent, VkDeviceSize texelSize, Callback callback);
+
+	const Stats& GetStats() const
+	{
+		return m_stats;
+	}
+
+	void ImGuiDebug() const;
+
+private:
+	struct Pending
+	{
+		VkDeviceSize offset;
+		VkDeviceSize size;
+		Callback callback;
+	};
+
+	struct Frame
+	{
+		VkBuffer buffer = VK_NULL_HANDLE;
+		VmaAllocation allocation = VK_NULL_HANDLE;
+		uint8_t* mappedData = nullptr;
+		VkDeviceSize capacity = 0;
+		VkDeviceSize used = 0;
+		VkFence fence = VK_NULL_HANDLE; // Signals once the copies below are done
+		std::vector<Pending> pending;
+	};
+
+	void Deliver(VmaAllocator allocator, Frame& frame);
+
+	const char* m_name;
+
+	std::vector<Frame> m_frames;
+	uint32_t m_frameIndex = 0;
+	VkDeviceSize m_requiredCapacity = 0; // What the last refused request needed, frames grow to it
+
+	Stats m_stats;
+};
@@ -11,9 +11,18 @@
 #include <vk_mem_alloc.h>
 #include <vulkan/vulkan_core.h>
 
+#include "BindlessMaterials.h"
+#include "ClusteredLights.h"
+#include "DescriptorWriter.h"
+#include "FrameUploadBuffer.h"
+#include "IndirectDrawBuffer.h"
+#include "InstanceBatcher.h"
 #include "Model.h"
+#include "ParallelCommandRecorder.h"
 #include "PipelineGenerator.h"
+#include "ReadbackRing.h"
 #include "ShadowSystem.h"
+#include "VulkanUtil.h"
 
 // Forward declarations
 class Camera;
@@ -21,6 +30,7 @@ class DescriptorManager;
 class Entity;
 class EntityManager;
 class Model;
+class MeshBuffer;
 class ModelManager;
 class Scene;
 class VulkanContext;
@@ -32,31 +42,9 @@ namespace vkb
 	struct Swapchain;
 } // namespace vkb
 
-// Custom hash functions for material configurations
+// Custom hash functions
 namespace std
 {
-	template<>
-	struct hash<BasicMaterialResource::Config>
-	{
-		size_t operator()(const BasicMaterialResource::Config& config) const
-		{
-			return hash<glm::vec4>()(config.albedo);
-		}
-	};
-
-	template<>
-	struct hash<PBRMaterialResource::Config>
-	{
-		size_t operator()(const PBRMaterialResource::Config& config) const
-		{
-			size_t h1 = hash<glm::vec3>()(config.albedo);
-			size_t h2 = hash<float>()(config.metallic);
-			size_t h3 = hash<float>()(config.roughness);
-			size_t h4 = hash<float>()(config.ao);
-			return h1 ^ (h2 << 1) ^ (h3 << 2) ^ (h4 << 3);
-		}
-	};
-
 	template<>
 	struct hash<DirectionalLight>
 	{
@@ -76,7 +64,7 @@ public:
 	Renderer() = default;
 	~Renderer() = default;
 
-	void SetUp(vkb::DispatchTable& disp, VmaAllocator allocator, vkb::Swapchain swapchain, VulkanDebugUtils& debugUtils);
+	void SetUp(vkb::DispatchTable& disp, VmaAllocator allocator, vkb::Swapchain swapchain, VulkanDebugUtils& debugUtils, uint32_t graphicsQueueFamily);
 	void CleanUp(vkb::DispatchTable& disp, VmaAllocator allocator);
 
 	int Draw(vkb::DispatchTable& disp,
@@ -84,65 +72,205 @@ public:
 	        ModelManager& modelManager,
 	        DescriptorManager& descriptorManager,
 	        VmaAllocator allocator,
-	        VkCommandPool commandPool,
-	        VkQueue graphicsQueue,
 	        VulkanDebugUtils& debugUtils,
 	        vkb::Swapchain swapchain,
 	        std::vector<VkImage>& swapchainImages,
 	        std::vector<VkImageView>& swapchainImageViews,
 	        uint32_t imageIndex,
+	        uint32_t frameIndex,
+	        VkFence frameFence,
 	        Scene* scene);
 
 	void SetupViewportAndScissor(vkb::Swapchain swapchain, vkb::DispatchTable disp, VkCommandBuffer& cmd);
-	void DrawModelsForShadowMap(vkb::DispatchTable disp, VulkanDebugUtils& debugUtils, VkCommandBuffer& cmd, ModelManager& modelManager, Scene* scene);
-	void DrawModels(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ModelManager& modelManager, DescriptorManager& descriptorManager, VmaAllocator allocator, VkCommandPool commandPool, VkQueue graphicsQueue, VulkanDebugUtils& debugUtils, Scene* scene);
+	void DrawModelsForShadowMap(vkb::DispatchTable disp, VulkanDebugUtils& debugUtils, VkCommandBuffer& cmd, ModelManager& modelManager, const ShadowSystem::ShadowPass& pass, uint32_t view, bool staticCasters);
+	// Updates the per frame buffers and resolves the pipeline and descriptor sets of every draw, recording them
+	// afterwards only reads so it can happen on several threads
+	void PrepareDraws(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ModelManager& modelManager, DescriptorManager& descriptorManager, VmaAllocator allocator, VulkanDebugUtils& debugUtils, Scene* scene, uint32_t frameIndex);
+	void DrawModels(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ModelManager& modelManager, VulkanDebugUtils& debugUtils, Scene* scene, bool recordDraws);
 
-	void DrawImguiDebugger(vkb::DispatchTable& disp, VmaAllocator allocator, VkCommandPool commandPool, VkQueue graphicsQueue, ModelManager& modelManager, VulkanDebugUtils& debugUtils);
+	void DrawImguiDebugger(vkb::DispatchTable& disp, VmaAllocator allocator, ModelManager& modelManager, DescriptorManager& descriptorManager, VulkanDebugUtils& debugUtils);
 
 	void CreateDepthImage(vkb::DispatchTable& disp, VmaAllocator allocator, vkb::Swapchain swapchain, VulkanDebugUtils& debugUtils);
 
 private:
-	// Push Constant
-	struct MVP
-	{
-		glm::mat4 model;
-		glm::mat3 normalMatrix;
-	} m_mvp;
-
 	bool m_forceInvalidateDecriptorSets = false;
 	glm::vec4 m_clearColour = glm::vec4(0.98f, 0.506f, 0.365f, 1.0f);
 
 	void UpdateCommonBuffers(VulkanDebugUtils& debugUtils, VmaAllocator allocator, VkCommandBuffer& cmd, Scene* scene);
-	void UpdateLightBuffer(EntityManager& entityManager, VmaAllocator allocator);
-	void UpdateCameraBuffer(EntityManager& entityManager, VmaAllocator allocator);
-	PipelineConfig* BindPipeline(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ModelManager& modelManager, const std::string& pipelineName, VulkanDebugUtils& debugUtils);
-	void UpdatePushConstants(vkb::DispatchTable& disp, VkCommandBuffer& cmd, PipelineConfig& pipelineConfig, Transform& transform, VulkanDebugUtils& debugUtils);
+	void UpdateLightBuffer(EntityManager& entityManager);
+	void UpdateCameraBuffer(EntityManager& entityManager);
+	PipelineConfig* BindPipeline(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ModelManager& modelManager, uint32_t pipelineId, VulkanDebugUtils& debugUtils);
 	void DrawInfiniteGrid(vkb::DispatchTable& disp, VkCommandBuffer commandBuffer, const Camera& camera, VkPipeline gridPipeline, VkPipelineLayout gridPipelineLayout);
 
 	void UpdateSharedDescriptors(DescriptorManager& descriptorManager, VkDescriptorSet sharedSet, VkDescriptorSetLayout setLayout, EntityManager& entityManager, VmaAllocator allocator);
 
+	//
+	/// INSTANCING ///////////////////////////////////
+	//
+	InstanceBatcher m_instanceBatcher;
+
+	// Looked up by name once, the ids stay valid when the pipelines are recreated
+	uint32_t m_shadowMapPipelineId = INVALID_PIPELINE_ID;
+	uint32_t m_pointShadowPipelineId = INVALID_PIPELINE_ID;
+	uint32_t m_shadowMomentsPipelineId = INVALID_PIPELINE_ID;
+	uint32_t m_gridPipelineId = INVALID_PIPELINE_ID;
+
+	// GPU driven path, one cmdDrawIndexedIndirectCount per pipeline/material/mesh buffer run instead of a draw per batch
+	bool m_useIndirectDraws = true;
+	IndirectDrawBuffer m_indirectDraws{ "Indirect Draw Buffer" };
+	std::vector<IndirectDrawBuffer> m_shadowIndirectDraws; // One per shadow view
+	std::vector<IndirectDrawBuffer> m_staticShadowIndirectDraws;
+
+	// The instance buffer only has to be rebound when it is recreated or the sets change (scene switch)
+	VkBuffer m_boundInstanceBuffer = VK_NULL_HANDLE;
+	VkDescriptorSet m_boundSharedSet = VK_NULL_HANDLE;
+	VkDescriptorSet m_shadowInstanceSet = VK_NULL_HANDLE;
+	VkDescriptorSetLayout m_shadowInstanceSetLayout = VK_NULL_HANDLE;
+
+	void UpdateInstanceDescriptors(ModelManager& modelManager, DescriptorManager& descriptorManager, VulkanDebugUtils& debugUtils, bool bufferRecreated);
+	static void BindMeshBuffer(vkb::DispatchTable& disp, VkCommandBuffer cmd, const MeshBuffer* meshBuffer, const MeshBuffer*& boundMeshBuffer);
+
+	//
+	/// COMMAND RECORDING ///////////////////////////////////
+	//
+	struct PreparedDraw
+	{
+		PipelineConfig* pipeline;
+		const InstanceBatch* batch;
+		const IndirectDrawRun* run; // Only set with indirect draws
+		uint32_t firstSet;          // Material sets (set 1 and up) in m_preparedSets
+		uint32_t setCount;
+		uint32_t firstOffset; // Dynamic offsets of those sets in m_preparedOffsets
+		uint32_t offsetCount;
+	};
+
+	// True if the draws use the same sets and dynamic offsets, so the second doesn't have to bind them again
+	bool SharesDescriptorSets(const PreparedDraw& a, const PreparedDraw& b) const;
+	// How many sets, from set 0, stay bound when switching from the bound pipeline to the next one
+	static uint32_t CompatibleSetCount(const PipelineConfig* bound, const PipelineConfig* next);
+
+	std::vector<PreparedDraw> m_preparedDraws;
+	std::vector<VkDescriptorSet> m_preparedSets;
+	std::vector<uint32_t> m_preparedOffsets;
+	VkDescriptorSet m_preparedSharedSet = VK_NULL_HANDLE;
+
+	// Draws are split into chunks of at least this many, below that a thread isn't worth waking up
+	static constexpr uint32_t MIN_DRAWS_PER_CHUNK = 64;
+	bool m_parallelRecording = true;
+	ParallelCommandRecorder m_commandRecorder;
+
+	void RecordDraws(vkb::DispatchTable& disp, VkCommandBuffer cmd, ModelManager& modelManager, VulkanDebugUtils& debugUtils, uint32_t firstDraw, uint32_t drawCount);
+	void RecordDrawsInParallel(vkb::DispatchTable& disp, VkCommandBuffer cmd, ModelManager& modelManager, VulkanDebugUtils& debugUtils, const vkb::Swapchain& swapchain, VkRenderingFlags renderingFlags);
+
+	//
+	/// PER FRAME UNIFORMS ///////////////////////////////////
+	//
+	// Every uniform buffer is a region of this ring, written once per frame and bound with a dynamic offset
+	FrameUploadBuffer m_uniformUploads{ "Uniform Upload Buffer" };
+	VkBuffer m_boundUniformBuffer = VK_NULL_HANDLE;
+	VkDescriptorSet m_boundCameraSet = VK_NULL_HANDLE;
+
+	uint32_t m_cameraOffset = 0;
+	uint32_t m_lightOffset = 0;
+	// Each material is pushed once a frame. Indexed by material id, NO_MATERIAL_OFFSET until it is pushed, and only
+	// grown when a material with a higher id shows up.
+	static constexpr uint32_t NO_MATERIAL_OFFSET = UINT32_MAX;
+	std::vector<uint32_t> m_materialOffsets;
+
+	SlimeUtil::MappedUploadStats m_uploadStats; // Last frame's writes through mapped pointers, for the debugger
+
+	//
+	/// READBACK ///////////////////////////////////
+	//
+	// GPU to CPU copies recorded into the frame, delivered once its fence has signaled
+	ReadbackRing m_readbacks{ "Readback Buffer" };
+
+	uint32_t GetMaterialOffset(Entity* entity);
+	// The offset of the uniform buffer in setIndex, false if the set doesn't have one
+	bool GetDynamicOffset(Entity* entity, int setIndex, uint32_t& offset);
+
+	//
+	/// BINDLESS ///////////////////////////////////
+	//
+	// Draws of the pbr pipeline go through pbr_bindless when the scene created it, with every material and
+	// texture in two sets bound once per pipeline bind
+	bool m_useBindless = true;
+	bool m_bindlessActive = false; // This frame, m_useBindless and the pipeline exists
+	uint32_t m_pbrPipelineId = INVALID_PIPELINE_ID;
+	uint32_t m_bindlessPipelineId = INVALID_PIPELINE_ID;
+	BindlessMaterials m_bindlessMaterials;
+
 	//
 	/// MATERIALS ///////////////////////////////////
 	//
+	// Everything a material set is written with, see GetMaterialSetKey
+	struct MaterialSetKey
+	{
+		VkDescriptorSetLayout layout;
+		VkBuffer buffer;               // Holds the config, read through a dynamic offset
+		VkImageView imageViews[5];     // PBR textures in binding order, null for missing ones
+		VkSampler samplers[5];
+
+		bool operator==(const MaterialSetKey& other) const = default;
+	};
+
+	struct MaterialSetKeyHash
+	{
+		size_t operator()(const MaterialSetKey& key) const;
+	};
+
 	struct LRUCacheEntry
 	{
-		size_t hash;
+		MaterialSetKey key;
 		VkDescriptorSet descriptorSet;
+		uint64_t lastUsedFrame; // m_materialCacheFrame of the last frame that bound it
+	};
+
+	struct MaterialCacheStats
+	{
+		uint32_t hits = 0;
+		uint32_t misses = 0;
+		uint32_t evictions = 0;
 	};
 
 	std::list<LRUCacheEntry> m_lruList;
-	std::unordered_map<size_t, std::list<LRUCacheEntry>::iterator> m_materialDescriptorCache;
-	const size_t MAX_CACHE_SIZE = 75;
+	std::unordered_map<MaterialSetKey, std::list<LRUCacheEntry>::iterator, MaterialSetKeyHash> m_materialDescriptorCache;
+	// Past this many sets the least recently used ones are freed, but only once no frame in flight can still
+	// bind them. Until then the cache keeps growing, so a scene with more materials only costs memory.
+	const size_t MATERIAL_CACHE_SOFT_LIMIT = 1024;
+	uint64_t m_materialCacheFrame = 0;
+	MaterialCacheStats m_materialCacheStats;
+	MaterialCacheStats m_lastMaterialCacheStats; // Shown in the debugger, which draws before the frame is done
+
+	// The pbr set 1 (light and shadow map) of this frame per layout, from the transient descriptor pool
+	std::vector<std::pair<VkDescriptorSetLayout, VkDescriptorSet>> m_frameLightSets;
+
+	DescriptorWriter m_descriptorWriter; // Reused for every material set so its storage stops growing
 
 	VkDescriptorSet GetOrUpdateDescriptorSet(EntityManager& entityManager, Entity* entity, PipelineConfig* pipelineConfig, DescriptorManager& descriptorManager, VmaAllocator allocator, VulkanDebugUtils& debugUtils, int setIndex);
-	void UpdateBasicMaterialDescriptors(EntityManager& entityManager, DescriptorManager& descriptorManager, VkDescriptorSet materialSet, Entity* entity, VmaAllocator allocator, int setIndex);
-	void UpdatePBRMaterialDescriptors(EntityManager& entityManager, DescriptorManager& descriptorManager, VkDescriptorSet descSet, Entity* entity, VmaAllocator allocator, int setIndex);
+	MaterialSetKey GetMaterialSetKey(const Entity* entity, VkDescriptorSetLayout layout) const;
+	VkDescriptorSet GetFrameLightSet(EntityManager& entityManager, DescriptorManager& descriptorManager, VkDescriptorSetLayout layout, VulkanDebugUtils& debugUtils);
+	void UpdateBasicMaterialDescriptors(DescriptorWriter& writer, int setIndex);
+	void UpdatePBRMaterialDescriptors(DescriptorWriter& writer, Entity* entity, int setIndex);
 
 	//
 	/// SHADOWS ///////////////////////////////////
 	//
 	ShadowSystem m_shadowSystem;
 
+	//
+	/// LIGHTS ///////////////////////////////////
+	//
+	// Matches LightUBO (set 1, binding 0) in basic.frag and bindless.frag
+	struct LightUBO
+	{
+		DirectionalLight::BindingData directional;
+		ClusteredLights::GPUParams clusters;
+	};
+
+	// Point lights binned into the camera's clusters, read through set 1 of the pbr pipelines
+	ClusteredLights m_clusteredLights;
+
 	//
 	/// DEPTH TESTING ///////////////////////////////////
 	//
@@ -150,6 +278,4 @@ private:
 	VkImage m_depthImage = VK_NULL_HANDLE;
 	VkImageView m_depthImageView = VK_NULL_HANDLE;
 	VmaAllocation m_depthImageAllocation;
-
-	size_t GenerateDescriptorHash(const Entity* entity, int setIndex);
 };
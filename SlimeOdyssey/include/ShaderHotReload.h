@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Watches the shader directory and recompiles GLSL sources as they are saved, on its own thread and with the
+// same glslc the build uses. The main thread collects the rebuilt .spv paths at a frame boundary and hands
+// them to ModelManager::ReloadShaders, which rebuilds only the pipelines using them.
+//
+// On Linux changes come from inotify, elsewhere the sources' write times are polled.
+class ShaderHotReload
+{
+public:
+	struct Stats
+	{
+		uint32_t compiled = 0;
+		uint32_t failed = 0;
+		double lastCompileMs = 0.0;
+		std::string lastError; // glslc's output for the last failure
+	};
+
+	ShaderHotReload() = default;
+	~ShaderHotReload();
+
+	ShaderHotReload(const ShaderHotReload&) = delete;
+	ShaderHotReload& operator=(const ShaderHotReload&) = delete;
+
+	// False when there is no compiler or the directory can't be watched, hot reload is then simply off
+	bool Start(const std::string& shaderDirectory);
+	void Stop();
+
+	bool IsRunning() const
+	{
+		return m_running;
+	}
+
+	// The .spv files rebuilt since the last call, successful compiles only
+	std::vector<std::string> TakeCompiledShaders();
+	Stats GetStats() const;
+
+	static bool IsShaderSource(const std::string& path);
+	// Compiles path to path.spv, through a temporary file so a reader never sees half a module
+	static bool CompileShader(const std::string& sourcePath, std::string& log);
+	// Same, to another file and with -D defines on top, for shader variants
+	static bool CompileShader(const std::string& sourcePath, const std::string& outputPath, const std::vector<std::string>& defines, std::string& log);
+
+private:
+	void WatchLoop();
+	void CompileChanged(const std::vector<std::string>& sourcePaths);
+
+	std::string m_directory;
+	std::thread m_thread;
+	std::atomic<bool> m_running = false;
+
+	mutable std::mutex m_mutex;
+	std::vector<std::string> m_compiled;
+	Stats m_stats;
+
+#ifdef __linux__
+	int m_inotify = -1;
+#else
+	std::unordered_map<std::string, std::filesystem::file_time_type> m_writeTimes;
+#endif
+};
@@ -4,20 +4,28 @@
 
 #pragma once
 
+#include <cstdint>
 #include <map>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include <vulkan/vulkan.h>
 
+#include "LayoutRegistry.h"
 #include "spirv_common.hpp"
 #include "VkBootstrapDispatch.h"
 
+// Descriptor count of unsized sampler arrays (sampler2D textures[]), which are reflected as partially bound,
+// update after bind bindings with a variable count
+constexpr uint32_t BINDLESS_DESCRIPTOR_CAPACITY = 4096;
+
 struct ShaderModule
 {
 	VkShaderModule handle;
 	std::vector<uint32_t> spirvCode;
 	VkShaderStageFlagBits stage;
+	std::string path;       // The .spv it was loaded from, reflection is cached next to it
+	uint64_t spirvHash = 0; // ShaderManager::HashSpirv of spirvCode
 
 	ShaderModule(VkShaderModule _handle, std::vector<uint32_t> _spirvCode, VkShaderStageFlagBits _stage)
 	      : handle(_handle), spirvCode(std::move(_spirvCode)), stage(_stage)
@@ -39,10 +47,30 @@ public:
 		{
 			uint32_t set;
 			VkDescriptorSetLayoutBinding binding;
+			VkDescriptorBindingFlags flags = 0;
 		};
 
 		std::vector<DescriptorSetLayoutBinding> descriptorSetLayoutBindings;
 		std::vector<VkPushConstantRange> pushConstantRanges;
+
+		// Specialization constants named after a ShaderKeyword, that keyword is toggled through the constant
+		// instead of compiling another variant. Per stage, CombineResources leaves them out.
+		struct KeywordConstant
+		{
+			uint32_t constantId;
+			uint32_t keyword;
+		};
+
+		std::vector<KeywordConstant> keywordConstants;
+	};
+
+	// Where ParseShader's results came from since startup
+	struct ReflectionStats
+	{
+		uint32_t reflected = 0;   // Ran spirv_cross
+		uint32_t memoryHits = 0;  // Already reflected this run
+		uint32_t sidecarHits = 0; // Read back from a .refl file next to the .spv
+		double reflectMilliseconds = 0.0;
 	};
 
 	ShaderManager() = default;
@@ -51,21 +79,54 @@ public:
 	void CleanUp(vkb::DispatchTable disp);
 
 	ShaderModule LoadShader(vkb::DispatchTable disp, const std::string& path, VkShaderStageFlagBits stage);
+	// Reads the file again and replaces the cached module. Pipelines already created from the old module keep
+	// working, but nothing may still be compiling from it.
+	ShaderModule ReloadShader(vkb::DispatchTable disp, const std::string& path, VkShaderStageFlagBits stage);
+	// Destroys the cached module if there is one, with the same rules as ReloadShader
+	void UnloadShader(vkb::DispatchTable disp, const std::string& path);
+	// Reflects the module once per SPIR-V hash and stage, and keeps the result on disk in <path>.refl so
+	// later runs skip spirv_cross entirely until the shader is recompiled
 	ShaderResources ParseShader(const ShaderModule& shaderModule);
+	// Always runs spirv_cross, bypassing both caches
+	ShaderResources Reflect(const ShaderModule& shaderModule);
 	ShaderResources CombineResources(const std::vector<ShaderModule>& shaderModules);
 
+	// One layout per set, shared with every other pipeline declaring an identical set
 	std::vector<VkDescriptorSetLayout> CreateDescriptorSetLayouts(vkb::DispatchTable disp, const ShaderResources& resources);
 
+	// Owns the descriptor set layouts above and the pipeline layouts built from them
+	LayoutRegistry& GetLayoutRegistry()
+	{
+		return m_layoutRegistry;
+	}
+
 	void CleanupShaderModules(vkb::DispatchTable disp);
 	void CleanupDescriptorSetLayouts(vkb::DispatchTable disp);
 
+	const ReflectionStats& GetReflectionStats() const
+	{
+		return m_reflectionStats;
+	}
+
+	static uint64_t HashSpirv(const std::vector<uint32_t>& spirvCode);
+
+	// The sidecar format, exposed so it can be checked and timed without a device
+	static std::vector<uint8_t> SerializeResources(uint64_t spirvHash, VkShaderStageFlagBits stage, const ShaderResources& resources);
+	// Fails if the data is damaged or was written for other SPIR-V
+	static bool DeserializeResources(const std::vector<uint8_t>& data, uint64_t spirvHash, VkShaderStageFlagBits stage, ShaderResources& resources);
+
 private:
 	std::unordered_map<std::string, ShaderModule> m_shaderModules;
-	std::unordered_map<std::string, VkDescriptorSetLayout> m_descriptorSetLayouts;
+	LayoutRegistry m_layoutRegistry;
 	std::map<uint32_t, uint32_t> bindingOffsets;
 
+	// Keyed by SPIR-V hash mixed with the stage, vertex inputs are only reflected for vertex shaders
+	std::unordered_map<uint64_t, ShaderResources> m_reflectionCache;
+	ReflectionStats m_reflectionStats;
+
 	std::vector<uint32_t> ReadFile(const std::string& filename);
 	VkShaderModule CreateShaderModule(vkb::DispatchTable disp, const std::vector<uint32_t>& code);
+	static std::string GetSidecarPath(const std::string& spirvPath);
 	VkFormat GetVkFormat(const spirv_cross::SPIRType& type);
 	uint32_t GetFormatSize(VkFormat format);
 };
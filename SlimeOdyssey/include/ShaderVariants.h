@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Features a shader can be built with or without. A shader lists the ones it responds to on a line
+// "// @keywords NORMAL_MAP AO_MAP" in its GLSL source. A keyword the shader also declares as a specialization
+// constant of the same name is toggled through that constant on the same SPIR-V, every other one is an
+// #ifdef and each combination of those is a separate SPIR-V variant. The plain build (no SLIME_VARIANT
+// define) has every keyword on.
+enum ShaderKeyword : uint32_t
+{
+	SHADER_KEYWORD_NORMAL_MAP = 1u << 0,
+	SHADER_KEYWORD_AO_MAP = 1u << 1,
+	SHADER_KEYWORD_RECEIVE_SHADOWS = 1u << 2,
+};
+
+constexpr uint32_t SHADER_KEYWORD_COUNT = 3;
+constexpr uint32_t ALL_SHADER_KEYWORDS = (1u << SHADER_KEYWORD_COUNT) - 1;
+
+// Finds and builds the SPIR-V of shader variants. Variants are compiled with the glslc the build uses into
+// <shader dir>/variants/<shader>.<keywords>.spv and reused from there on later runs while they are newer
+// than their source.
+class ShaderVariants
+{
+public:
+	struct Stats
+	{
+		uint32_t requested = 0; // Pipeline variants asked for
+		uint32_t created = 0;   // Pipeline variants ready to draw with
+		uint32_t compiled = 0;  // SPIR-V variants built by glslc
+		uint32_t diskHits = 0;  // SPIR-V variants already on disk and up to date
+		uint32_t failed = 0;
+		double compileMilliseconds = 0.0;
+	};
+
+	enum class BuildResult
+	{
+		DiskHit,
+		Compiled,
+		Failed
+	};
+
+	// The keyword's name in GLSL, or 0 / null when there is no such keyword
+	static const char* GetKeywordName(uint32_t keyword);
+	static uint32_t GetKeyword(const std::string& name);
+	// Keywords on the source's "// @keywords" line, unknown names are ignored
+	static uint32_t ParseDeclaredKeywords(const std::string& source);
+
+	// Keywords the GLSL source of the given .spv declares, read once per path
+	uint32_t GetDeclaredKeywords(const std::string& spirvPath);
+
+	// The SPIR-V built with exactly compiledKeywords out of the shader's compiledMask, the .spv itself when
+	// they are all on
+	static std::string GetVariantPath(const std::string& spirvPath, uint32_t compiledKeywords, uint32_t compiledMask);
+	// The defines glslc needs for that variant
+	static std::vector<std::string> GetVariantDefines(uint32_t compiledKeywords);
+	// Makes sure the variant on disk is up to date, compiling it if not. Touches no state, any thread can run it.
+	static BuildResult BuildVariant(const std::string& spirvPath, uint32_t compiledKeywords, uint32_t compiledMask, std::string& log);
+
+	void RecordBuild(BuildResult result, double milliseconds);
+	Stats& GetStats()
+	{
+		return m_stats;
+	}
+	const Stats& GetStats() const
+	{
+		return m_stats;
+	}
+
+	void ImGuiDebug() const;
+
+private:
+	std::unordered_map<std::string, uint32_t> m_declaredKeywords;
+	Stats m_stats;
+};
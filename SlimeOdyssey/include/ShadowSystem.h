@@ -10,13 +10,18 @@
 #include <vk_mem_alloc.h>
 #include <vulkan/vulkan_core.h>
 
+#include "Bounds.h"
 #include "Camera.h"
+#include "DescriptorWriter.h"
+#include "InstanceBatcher.h"
 #include "Light.h"
 #include "Model.h"
 #include "ModelManager.h"
+#include "ReadbackRing.h"
 
 class VulkanDebugUtils;
 class ModelManager;
+class DescriptorManager;
 class Scene;
 
 namespace vkb
@@ -25,86 +30,282 @@ namespace vkb
 	struct Swapchain;
 } // namespace vkb
 
+// Shadow maps of the directional lights, split into cascades along the camera's view. Each light has one
+// layered depth image with a layer per cascade. Cascade ranges follow the practical split scheme (a blend of
+// logarithmic and uniform splits) and each is fitted with a sphere around its slice of the camera frustum,
+// moved in whole texels, so its projection doesn't change as the camera turns or shimmer as it moves.
+//
+// Every cascade is a shadow view: UpdateShadowMaps fits them before batching so the InstanceBatcher can cull
+// casters per view, RecordShadowMaps then draws each view's casters into its layer.
+//
+// Casters the SpatialIndex classes as static are drawn into a second, cached depth image. Each frame a
+// cascade's cached depth is copied into its layer and only the dynamic casters are drawn on top. The cache
+// is redrawn when the light turns, the static casters change, or the cascade is refitted. Cascades are fitted
+// with some padding and kept while their slice of the view stays inside, so moving the camera refits rarely.
+//
+// Point lights share one shadow atlas, a depth image with a layer per cube face. Each light gets a square tile,
+// the same in every layer, sized by how much of the screen its sphere covers, and all six faces are drawn into
+// it at once with multiview. The atlas never grows: when the tiles don't fit they are shrunk, the least
+// important lights first, and those are dropped once every tile is down to the smallest size.
+//
+// Directional lights can use EVSM instead of PCF, see SetShadowFilter. Their cascades are still rendered and
+// cached as depth, then a compute pass warps the depth into exponential moments and blurs them, horizontally
+// into a scratch image and vertically into the light's moment map, which gets a full mip chain. Shading
+// samples that once with trilinear filtering, so soft edges come from the prefiltered moments rather than
+// from wide PCF kernels and smaller cascades hold up.
 class ShadowSystem
 {
 public:
 	ShadowSystem() = default;
 	~ShadowSystem() = default;
 
+	// What a shadow view's casters are drawn with
+	struct ShadowPass
+	{
+		glm::mat4 lightSpaceMatrix = glm::mat4(1.0f);    // A cascade's projection
+		glm::vec4 lightPositionRadius = glm::vec4(0.0f); // A point light's, all six faces are drawn at once
+		bool pointLight = false;
+	};
+
+	// What shadow_moments.comp is pushed
+	struct MomentBlurConstants
+	{
+		glm::ivec2 direction;
+		int32_t radius;
+		uint32_t warpDepth;
+	};
+
+	// Draws the static or the dynamic casters of one shadow view
+	using DrawShadowCasters = std::function<void(vkb::DispatchTable, VulkanDebugUtils&, VkCommandBuffer&, ModelManager&, const ShadowPass& pass, uint32_t view, bool staticCasters)>;
+
+	struct Cascade
+	{
+		glm::mat4 lightSpaceMatrix; // Vulkan clip space, what the shadow pass and the shaders use
+		glm::mat4 cullingMatrix;    // The same volume with glm's -1..1 clip depth, for Frustum::FromMatrix
+	};
+
+	// A point light's square in the shadow atlas, in texels. Size 0 when the light didn't fit.
+	struct AtlasTile
+	{
+		uint32_t x = 0;
+		uint32_t y = 0;
+		uint32_t size = 0;
+	};
+
+	// Near plane of the point lights' faces, the light's radius is the far plane
+	static constexpr float POINT_SHADOW_NEAR = 0.05f;
+
 	void Initialize(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils);
 	void Cleanup(vkb::DispatchTable& disp, VmaAllocator allocator);
 
-	bool UpdateShadowMaps(vkb::DispatchTable& disp,
-	        VkCommandBuffer& cmd,
-	        ModelManager& modelManager,
-	        VmaAllocator allocator,
-	        VkCommandPool commandPool,
-	        VkQueue graphicsQueue,
-	        VulkanDebugUtils& debugUtils,
-	        Scene* scene,
-	        std::function<void(vkb::DispatchTable, VulkanDebugUtils&, VkCommandBuffer&, ModelManager&, Scene*)> drawModels,
-	        const std::vector<std::shared_ptr<Light>>& lights,
-	        std::shared_ptr<Camera> camera);
+	// The ShadowMoments compute pipeline, every frame before UpdateShadowMaps. Without it EVSM lights fall back to PCF.
+	void SetMomentsPipeline(const PipelineConfig* pipeline)
+	{
+		m_momentsPipeline = pipeline;
+	}
+
+	// Where the descriptor sets of the moment blur come from, set before UpdateShadowMaps and kept until Cleanup
+	void SetDescriptorManager(DescriptorManager* descriptorManager)
+	{
+		m_descriptorManager = descriptorManager;
+	}
+
+	// Creates or rebuilds the shadow maps and fits the cascades of every light to the camera. The cached static
+	// depth is dropped whenever staticCasterVersion (SpatialIndex::GetStaticVersion) changes. Returns true if
+	// shadow maps were rebuilt and descriptors pointing at them have to be written again.
+	bool UpdateShadowMaps(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, const std::vector<std::shared_ptr<Light>>& lights, std::shared_ptr<Camera> camera, uint32_t staticCasterVersion);
+	// Also records the copy of the texel asked for through GetShadowMapPixelValue into readbacks
+	void RecordShadowMaps(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ModelManager& modelManager, VulkanDebugUtils& debugUtils, ReadbackRing& readbacks, const DrawShadowCasters& drawCasters);
 
+	// In the order of the shadow views, for InstanceBatcher::SetShadowViews
+	const std::vector<InstanceBatcher::ShadowView>& GetShadowViews() const
+	{
+		return m_casterViews;
+	}
+
+	// Every cascade as one array view
 	TextureResource GetShadowMap(const std::shared_ptr<Light> light) const;
+	// Every cascade's moments with all of their mips, empty unless the light uses EVSM
+	TextureResource GetShadowMoments(const std::shared_ptr<Light> light) const;
+	// A single cascade as a 2D view
+	TextureResource GetShadowCascade(const std::shared_ptr<Light> light, uint32_t cascade) const;
 	glm::mat4 GetLightSpaceMatrix(const std::shared_ptr<Light> light) const;
+	// Every point light's faces, one layer per face, see PointLight::SetShadowAtlasRect
+	TextureResource GetPointShadowAtlas() const
+	{
+		return m_pointShadowAtlas;
+	}
 
+	// Resolution of each cascade
 	void SetShadowMapResolution(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, uint32_t width, uint32_t height, bool reconstructImmediately = false);
 	void ReconstructShadowMaps(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils);
 
+	// Takes effect when the shadow maps are rebuilt at the start of the next frame
+	void SetCascadeCount(uint32_t count);
+	// 0 splits the range evenly, 1 logarithmically
+	void SetCascadeSplitLambda(float lambda);
+
 	void SetShadowNearPlane(float near);
 	void SetShadowFarPlane(float far);
 
+	// Per directional light, the light's shadow map is rebuilt for it at the start of the next frame
+	void SetShadowFilter(const std::shared_ptr<Light> light, ShadowFilter filter);
+	ShadowFilter GetShadowFilter(const std::shared_ptr<Light> light) const;
+	// Filter of lights SetShadowFilter wasn't called for
+	void SetDefaultShadowFilter(ShadowFilter filter);
+
+	// Taps on each side of the EVSM blur, per pass
+	void SetMomentBlurRadius(uint32_t radius);
+	// 0 to just below 1, trades light bleeding for thinner soft edges
+	void SetLightBleedReduction(float reduction);
+
+	// How far towards the light casters are kept, beyond the slice of the view a cascade covers
 	void SetDirectionalLightDistance(float distance);
 	float GetDirectionalLightDistance() const;
 
-	float GetShadowMapPixelValue(vkb::DispatchTable& disp, VmaAllocator allocator, VkCommandPool commandPool, VkQueue graphicsQueue, const std::shared_ptr<Light> light, int x, int y) const;
+	// Asks for the depth of a texel, copied out when the cascade is next rendered and there a few frames later.
+	// Returns false until the texel asked for has arrived, value is left alone then.
+	bool GetShadowMapPixelValue(const std::shared_ptr<Light> light, uint32_t cascade, int x, int y, float& value);
+
+	void RenderShadowMapInspector(vkb::DispatchTable& disp, VmaAllocator allocator, ModelManager& modelManager, VulkanDebugUtils& debugUtils);
+
+	// View depth each cascade reaches to, the last one ends at far
+	static void CalculateCascadeSplits(float near, float far, uint32_t count, float lambda, float* splitDepths);
+	// Orthographic projection around the slice of the view with these corners, casterDistance further towards
+	// the light. The slice's bounding sphere, grown by padding times its radius, is snapped to whole texels of a
+	// width x height map.
+	static Cascade FitCascade(const glm::vec3& lightDirection, const std::vector<glm::vec3>& sliceCorners, uint32_t width, uint32_t height, float casterDistance, float padding = 0.0f);
+	// Whether a cascade still covers the slice of the view with these corners
+	static bool CascadeContains(const glm::mat4& cullingMatrix, const std::vector<glm::vec3>& sliceCorners);
+
+	// How much of the screen's height a point light's sphere covers, 1 when the camera is inside it
+	static float CalculatePointLightImportance(const glm::vec3& lightPosition, float radius, const glm::vec3& cameraPosition, float fov);
+	// The tile size a light of this importance asks for, a power of two between minTileSize and maxTileSize
+	static uint32_t CalculatePointShadowTileSize(float importance, uint32_t minTileSize, uint32_t maxTileSize);
+	// Packs tiles of the requested sizes into an atlasSize square, returned in the order of the requests.
+	// Sizes and the atlas are powers of two, no tile is smaller than minTileSize. Over budget, tiles are halved
+	// from the least important up until they fit, and once they are all down to minTileSize the least important
+	// are dropped.
+	static std::vector<AtlasTile> AllocateAtlasTiles(const std::vector<uint32_t>& tileSizes, const std::vector<float>& importance, uint32_t atlasSize, uint32_t minTileSize);
 
-	void RenderShadowMapInspector(vkb::DispatchTable& disp, VmaAllocator allocator, VkCommandPool commandPool, VkQueue graphicsQueue, ModelManager& modelManager, VulkanDebugUtils& debugUtils);
+	static std::vector<glm::vec3> CalculateFrustumCorners(float fov, float aspect, float near, float far, const glm::vec3& position, const glm::vec3& forward, const glm::vec3& up, const glm::vec3& right);
+	static void CalculateFrustumSphere(const std::vector<glm::vec3>& frustumCorners, glm::vec3& center, float& radius);
 
 private:
 	struct ShadowData
 	{
-		ImTextureID textureId = 0;
-		TextureResource shadowMap;
-		glm::mat4 lightSpaceMatrix;
-		VkBuffer stagingBuffer = VK_NULL_HANDLE;
-		VmaAllocation stagingBufferAllocation = VK_NULL_HANDLE;
-		VkDeviceSize stagingBufferSize = 0;
-
-		// For optimizing the recalculations
-		glm::vec3 lastCameraPosition;
-		float frustumRadius;
+		TextureResource shadowMap;                           // Array view of every cascade, sampled by the shaders
+		VkImageView cascadeViews[MAX_SHADOW_CASCADES] = {};  // One layer each, rendered into
+		ImTextureID textureIds[MAX_SHADOW_CASCADES] = {};    // The inspector's views of each cascade
+		uint32_t cascadeCount = 0;
+		glm::mat4 cascadeMatrices[MAX_SHADOW_CASCADES];
+		glm::mat4 cullingMatrices[MAX_SHADOW_CASCADES];
+		float cascadeSplits[MAX_SHADOW_CASCADES];
+		glm::vec3 fittedLightDirection = glm::vec3(0.0f); // What the cascades were fitted for, zero until they are
+
+		// Depth of the static casters only, one layer per cascade, copied into shadowMap every frame
+		VkImage staticImage = VK_NULL_HANDLE;
+		VmaAllocation staticAllocation = VK_NULL_HANDLE;
+		VkImageView staticCascadeViews[MAX_SHADOW_CASCADES] = {};
+		bool staticCached[MAX_SHADOW_CASCADES] = {};
+		uint32_t staticCasterVersion = 0;
+
+		// EVSM only, moments of every cascade with a full mip chain, rewritten every frame
+		ShadowFilter filter = ShadowFilter::PCF;
+		TextureResource moments;                                // Every layer and mip, sampled by the shaders
+		VkImageView momentLayerViews[MAX_SHADOW_CASCADES] = {}; // Mip 0 of one layer, the vertical pass writes it
+		uint32_t momentMipLevels = 0;
+		VkImage blurImage = VK_NULL_HANDLE;                     // Horizontal pass output, shared by the cascades
+		VmaAllocation blurAllocation = VK_NULL_HANDLE;
+		VkImageView blurView = VK_NULL_HANDLE;
+		VkDescriptorSet blurSets[MAX_SHADOW_CASCADES][2] = {}; // Horizontal and vertical pass of each cascade
+	};
+
+	// A single depth texel of a cascade, for the inspector
+	struct PixelReadback
+	{
+		const Light* light = nullptr;
+		uint32_t cascade = 0;
+		int x = 0;
+		int y = 0;
+		float value = 1.0f;
+		bool valid = false; // Requests have value unused, deliveries once it has been copied
+	};
+
+	// One cascade of one light, rendered with its own culled casters
+	struct ShadowView
+	{
+		std::shared_ptr<Light> light;
+		uint32_t cascade;
+	};
+
+	// A point light with a tile this frame, rendered as its own shadow view
+	struct PointShadow
+	{
+		std::shared_ptr<PointLight> light;
+		AtlasTile tile;
+		uint32_t view;
 	};
 
 	std::unordered_map<std::shared_ptr<Light>, ShadowData> m_shadowData;
+	std::vector<ShadowView> m_views;
+	std::vector<InstanceBatcher::ShadowView> m_casterViews;
+	std::vector<PointShadow> m_pointShadows; // Their views come after every cascade's
+
+	// 6 layers of 2048x2048 16 bit depth, 48MB however many point lights there are
+	TextureResource m_pointShadowAtlas;
+	uint32_t m_pointShadowAtlasSize = 2048;
+	uint32_t m_minPointShadowTile = 64;
+	uint32_t m_maxPointShadowTile = 1024;
+	uint32_t m_droppedPointShadows = 0; // Visible point lights that didn't fit into the atlas last frame
+
+	bool m_cacheStaticCasters = true;
+	bool m_refitCascades = false;    // Settings changed, refit even if the old cascades still cover the view
+	float m_cascadePadding = 0.15f;  // Grows each cascade by this much of its radius, so it is kept for longer
+	uint32_t m_staticRedraws = 0;    // Cascades whose static casters were drawn last frame
 
 	float m_directionalLightDistance = 100.0f;
 
-	uint32_t m_pendingShadowMapWidth = 0;
-	uint32_t m_pendingShadowMapHeight = 0;
+	std::unordered_map<std::shared_ptr<Light>, ShadowFilter> m_shadowFilters; // Only what was set explicitly
+	ShadowFilter m_defaultShadowFilter = ShadowFilter::PCF;
+	const PipelineConfig* m_momentsPipeline = nullptr;
+	DescriptorManager* m_descriptorManager = nullptr;
+	DescriptorWriter m_blurWriter;
+	uint32_t m_momentBlurRadius = 3;
+	float m_lightBleedReduction = 0.3f;
+
+	PixelReadback m_pixelRequest; // Copied out in the next RecordShadowMaps when valid
+	PixelReadback m_pixelValue;   // The last one that arrived
+
+	// Applied when the shadow maps are rebuilt
+	uint32_t m_pendingShadowMapWidth = 2048;
+	uint32_t m_pendingShadowMapHeight = 2048;
+	uint32_t m_pendingCascadeCount = 3;
 	bool m_shadowMapNeedsReconstruction = false;
 
-	uint32_t m_shadowMapWidth = 4096;
-	uint32_t m_shadowMapHeight = 4096;
+	// Three 2048 cascades hold fewer texels than the single 4096 map did, with far more of them near the camera
+	uint32_t m_shadowMapWidth = 2048;
+	uint32_t m_shadowMapHeight = 2048;
+	uint32_t m_cascadeCount = 3;
+	float m_cascadeSplitLambda = 0.75f;
 	float m_shadowNear = 0.1f;
 	float m_shadowFar = 120.0f;
 
 	void CreateShadowMap(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, const std::shared_ptr<Light> light);
 	void CleanupShadowMap(vkb::DispatchTable& disp, VmaAllocator allocator, const std::shared_ptr<Light> light);
-	void GenerateShadowMap(vkb::DispatchTable& disp,
-	        VkCommandBuffer& cmd,
-	        ModelManager& modelManager,
-	        VmaAllocator allocator,
-	        VkCommandPool commandPool,
-	        VkQueue graphicsQueue,
-	        VulkanDebugUtils& debugUtils,
-	        Scene* scene,
-	        std::function<void(vkb::DispatchTable, VulkanDebugUtils&, VkCommandBuffer&, ModelManager&, Scene*)> drawModels,
-	        const std::shared_ptr<Light> light,
-	        const std::shared_ptr<Camera> camera);
-	void CalculateLightSpaceMatrix(const std::shared_ptr<Light> light, const std::shared_ptr<Camera> camera);
-
-	std::vector<glm::vec3> CalculateFrustumCorners(float fov, float aspect, float near, float far, const glm::vec3& position, const glm::vec3& forward, const glm::vec3& up, const glm::vec3& right) const;
-	void CalculateFrustumSphere(const std::vector<glm::vec3>& frustumCorners, glm::vec3& center, float& radius) const;
-};
+	// Cleanup and create again, along with the inspector's textures. The device has to be idle.
+	void RebuildShadowMap(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, const std::shared_ptr<Light> light);
+	void CalculateCascades(const std::shared_ptr<Light> light, const std::shared_ptr<Camera> camera);
+	// The filter the light is rendered with this frame, EVSM needs the compute pipeline
+	ShadowFilter GetEffectiveShadowFilter(const std::shared_ptr<Light> light) const;
+	void CreateShadowMoments(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, ShadowData& shadowData);
+	// Warps and blurs every cascade of the light into its moments and builds their mips, after the cascades are drawn
+	void RecordMomentBlur(vkb::DispatchTable& disp, VkCommandBuffer& cmd, VulkanDebugUtils& debugUtils, ShadowData& shadowData);
+	void CreatePointShadowAtlas(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils);
+	// Gives the point lights in view their tiles, after the cascades so their views come last
+	void AllocatePointShadows(const std::vector<std::shared_ptr<Light>>& lights, const std::shared_ptr<Camera> camera);
+	// Copies the texel of m_pixelRequest out of a cascade that was just drawn to, in place of the transition to
+	// SHADER_READ_ONLY_OPTIMAL it would get otherwise
+	void RecordPixelReadback(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ReadbackRing& readbacks, const ShadowData& shadowData, uint32_t cascade);
+	void RecordPointShadows(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ModelManager& modelManager, VulkanDebugUtils& debugUtils, const DrawShadowCasters& drawCasters);
+};
\ No newline at end of file
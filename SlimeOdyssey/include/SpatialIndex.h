@@ -0,0 +1,267 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "Bounds.h"
+
+class Entity;
+class EntityManager;
+struct ModelResource;
+
+// Dynamic AABB tree (incrementally balanced BVH). Leaves store a fattened box so small movements
+// don't touch the tree, and the insertion uses the surface area heuristic to pick a sibling.
+class AABBTree
+{
+public:
+	static constexpr int NULL_NODE = -1;
+
+	explicit AABBTree(float fatMargin = 0.1f);
+
+	int CreateProxy(const AABB& aabb, uint32_t userData);
+	void DestroyProxy(int proxyId);
+
+	// Returns true if the proxy had to be reinserted, false if its fat box still contains the new box
+	bool MoveProxy(int proxyId, const AABB& aabb);
+
+	void Clear();
+
+	uint32_t GetUserData(int proxyId) const
+	{
+		return m_nodes[proxyId].userData;
+	}
+
+	const AABB& GetFatAABB(int proxyId) const
+	{
+		return m_nodes[proxyId].aabb;
+	}
+
+	int GetHeight() const
+	{
+		return m_root == NULL_NODE ? 0 : m_nodes[m_root].height;
+	}
+
+	size_t GetProxyCount() const
+	{
+		return m_proxyCount;
+	}
+
+	size_t GetNodeCount() const
+	{
+		return m_nodeCount;
+	}
+
+	// Sum of all internal node areas over the root area, lower is a tighter tree
+	float GetAreaRatio() const;
+
+	// func(userData, proxyId) -> bool, return false to stop the query
+	template<typename Func>
+	void Query(const AABB& aabb, Func&& func) const
+	{
+		Traverse([&aabb](const AABB& box) { return box.Overlaps(aabb); }, func);
+	}
+
+	template<typename Func>
+	void QuerySphere(const glm::vec3& center, float radius, Func&& func) const
+	{
+		Traverse([&center, radius](const AABB& box) { return box.OverlapsSphere(center, radius); }, func);
+	}
+
+	template<typename Func>
+	void QueryFrustum(const Frustum& frustum, Func&& func) const
+	{
+		Traverse([&frustum](const AABB& box) { return frustum.Intersects(box); }, func);
+	}
+
+	// func(userData, proxyId, tEnter) -> float. The return value clips the ray: return maxDistance to
+	// keep going, the hit distance to only look for closer hits, or 0 to stop.
+	template<typename Func>
+	void Raycast(const Ray& ray, float maxDistance, Func&& func) const
+	{
+		if (m_root == NULL_NODE)
+		{
+			return;
+		}
+
+		glm::vec3 invDirection = 1.0f / ray.direction;
+
+		int stack[STACK_CAPACITY];
+		int stackSize = 0;
+		stack[stackSize++] = m_root;
+
+		while (stackSize > 0)
+		{
+			int index = stack[--stackSize];
+			const Node& node = m_nodes[index];
+
+			float t;
+			if (!Ray::IntersectAABB(ray.origin, invDirection, node.aabb, maxDistance, t))
+			{
+				continue;
+			}
+
+			if (node.IsLeaf())
+			{
+				maxDistance = func(node.userData, index, t);
+				if (maxDistance <= 0.0f)
+				{
+					return;
+				}
+				continue;
+			}
+
+			assert(stackSize + 2 <= STACK_CAPACITY);
+			stack[stackSize++] = node.child1;
+			stack[stackSize++] = node.child2;
+		}
+	}
+
+private:
+	// A balanced tree of a million proxies is ~30 deep, this leaves plenty of room
+	static constexpr int STACK_CAPACITY = 256;
+
+	struct Node
+	{
+		AABB aabb;
+		int parent = NULL_NODE;
+		int child1 = NULL_NODE;
+		int child2 = NULL_NODE;
+		int next = NULL_NODE; // Free list link
+		int height = -1;      // Leaf = 0, free = -1
+		uint32_t userData = 0;
+
+		bool IsLeaf() const
+		{
+			return child1 == NULL_NODE;
+		}
+	};
+
+	template<typename NodeTest, typename Func>
+	void Traverse(NodeTest&& test, Func& func) const
+	{
+		if (m_root == NULL_NODE)
+		{
+			return;
+		}
+
+		int stack[STACK_CAPACITY];
+		int stackSize = 0;
+		stack[stackSize++] = m_root;
+
+		while (stackSize > 0)
+		{
+			int index = stack[--stackSize];
+			const Node& node = m_nodes[index];
+			if (!test(node.aabb))
+			{
+				continue;
+			}
+
+			if (node.IsLeaf())
+			{
+				if (!func(node.userData, index))
+				{
+					return;
+				}
+				continue;
+			}
+
+			assert(stackSize + 2 <= STACK_CAPACITY);
+			stack[stackSize++] = node.child1;
+			stack[stackSize++] = node.child2;
+		}
+	}
+
+	int AllocateNode();
+	void FreeNode(int index);
+	void InsertLeaf(int leaf);
+	void RemoveLeaf(int leaf);
+	int Balance(int index);
+
+	std::vector<Node> m_nodes;
+	int m_root = NULL_NODE;
+	int m_freeList = NULL_NODE;
+	size_t m_nodeCount = 0;
+	size_t m_proxyCount = 0;
+	float m_fatMargin;
+};
+
+// Keeps an AABBTree in sync with every entity that has a Transform and a Model.
+// Entities are refitted only when their transform or mesh changed since the last Update.
+//
+// An entity that stays put for STATIC_AFTER_UPDATES updates is classed as static, until it moves again.
+// Dynamic meshes never are. Work cached from the static entities (the static shadow casters) is stale
+// whenever GetStaticVersion changes.
+class SpatialIndex
+{
+public:
+	static constexpr uint32_t STATIC_AFTER_UPDATES = 60;
+
+	struct Stats
+	{
+		size_t inserted = 0;
+		size_t removed = 0;
+		size_t refitted = 0;    // Transform changed, world bounds recomputed
+		size_t reinserted = 0;  // Left its fat box, tree was modified
+		size_t staticEntities = 0;
+	};
+
+	// Sync with the entity manager, call once per frame after gameplay has moved things
+	void Update(EntityManager& entityManager);
+
+	void Remove(unsigned int entityId);
+	void Clear();
+
+	// Results are tested against the tight world bounds, outResults is cleared first
+	void QueryBox(const AABB& box, std::vector<Entity*>& outResults) const;
+	void QuerySphere(const glm::vec3& center, float radius, std::vector<Entity*>& outResults) const;
+	void QueryFrustum(const Frustum& frustum, std::vector<Entity*>& outResults) const;
+
+	// Closest entity whose world bounds the ray hits, nullptr if nothing within maxDistance
+	Entity* Raycast(const Ray& ray, float maxDistance, float* outDistance = nullptr) const;
+
+	const AABB* GetWorldBounds(unsigned int entityId) const;
+
+	bool IsStatic(unsigned int entityId) const;
+
+	// Bumped when an entity becomes static, or a static one moves or is removed
+	uint32_t GetStaticVersion() const
+	{
+		return m_staticVersion;
+	}
+
+	const AABBTree& GetTree() const
+	{
+		return m_tree;
+	}
+
+	const Stats& GetStats() const
+	{
+		return m_stats;
+	}
+
+	void ImGuiDebug() const;
+
+private:
+	struct Proxy
+	{
+		int proxyId = AABBTree::NULL_NODE;
+		Entity* entity = nullptr;
+		ModelResource* modelResource = nullptr;
+		glm::vec3 position;
+		glm::vec3 rotation;
+		glm::vec3 scale;
+		AABB worldBounds;
+		uint32_t stamp = 0;
+		uint32_t movedStamp = 0; // Update it was inserted or last moved in
+		bool isStatic = false;
+	};
+
+	AABBTree m_tree;
+	std::unordered_map<unsigned int, Proxy> m_proxies;
+	uint32_t m_stamp = 0;
+	uint32_t m_staticVersion = 0;
+	Stats m_stats;
+};
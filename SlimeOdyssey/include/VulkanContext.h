@@ -7,6 +7,8 @@
 #include <vector>
 #include <vk_mem_alloc.h>
 
+#include "PipelineCache.h"
+#include "ShaderHotReload.h"
 #include "VulkanDebugUtils.h"
 #include "Renderer.h"
 #include "SlimeWindow.h"
@@ -19,6 +21,8 @@ class ModelManager;
 
 struct GLFWwindow;
 
+#define MAX_FRAMES_IN_FLIGHT 2
+
 class VulkanContext
 {
 public:
@@ -26,7 +30,7 @@ public:
 	~VulkanContext();
 
 	int CreateContext(SlimeWindow* window);
-	int RenderFrame(ModelManager& modelManager, DescriptorManager& descriptorManager, SlimeWindow* window, Scene* scene);
+	int RenderFrame(ModelManager& modelManager, ShaderManager& shaderManager, DescriptorManager& descriptorManager, SlimeWindow* window, Scene* scene);
 	int Cleanup(ShaderManager& shaderManager, ModelManager& modelManager, DescriptorManager& descriptorManager);
 
 	// Getters
@@ -38,6 +42,7 @@ public:
 	VkCommandPool GetCommandPool() const;
 	VmaAllocator GetAllocator() const;
 	vkb::DispatchTable& GetDispatchTable();
+	VkPipelineCache GetPipelineCache() const;
 
 	// Helper methods
 	int CreateSwapchain(SlimeWindow* window); // Needs to be public for window resize callback
@@ -61,6 +66,8 @@ private:
 	VmaAllocator m_allocator{};
 	VkCommandPool m_commandPool = VK_NULL_HANDLE;
 	VkDescriptorPool m_imguiDescriptorPool = VK_NULL_HANDLE;
+	PipelineCache m_pipelineCache;
+	ShaderHotReload m_shaderHotReload;
 
 	// Render data
 	VkQueue m_graphicsQueue = VK_NULL_HANDLE;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstring>
 #include <signal.h>
 #include <spdlog/spdlog.h>
 #include <VkBootstrap.h>
@@ -89,6 +90,38 @@ namespace SlimeUtil
 		spdlog::debug("Created Buffer: {}", name);
 	}
 
+	// Creates a buffer that stays mapped until it is destroyed and returns the mapped pointer. Defaults to
+	// sequential writes, pass VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT for buffers the host reads back.
+	inline void* CreateMappedBuffer(const char* name,
+	        VmaAllocator allocator,
+	        VkDeviceSize size,
+	        VkBufferUsageFlags usage,
+	        VkBuffer& buffer,
+	        VmaAllocation& allocation,
+	        VmaAllocationCreateFlags hostAccess = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT)
+	{
+		VkBufferCreateInfo bufferInfo{};
+		bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+		bufferInfo.size = size;
+		bufferInfo.usage = usage;
+		bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+		VmaAllocationCreateInfo allocInfo{};
+		allocInfo.usage = VMA_MEMORY_USAGE_AUTO;
+		allocInfo.flags = hostAccess | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+		VmaAllocationInfo allocationInfo{};
+		if (vmaCreateBuffer(allocator, &bufferInfo, &allocInfo, &buffer, &allocation, &allocationInfo) != VK_SUCCESS)
+		{
+			spdlog::critical("failed to create buffer: {}", name);
+			return nullptr;
+		}
+
+		vmaSetAllocationName(allocator, allocation, name);
+		spdlog::debug("Created Mapped Buffer: {}", name);
+		return allocationInfo.pMappedData;
+	}
+
 	inline void CreateImage(const char* name, VmaAllocator allocator, uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VmaMemoryUsage memoryUsage, VkImage& image, VmaAllocation& allocation)
 	{
 		VkImageCreateInfo imageInfo{};
@@ -140,13 +173,82 @@ namespace SlimeUtil
 		return 0;
 	}
 
+	// Records a layout transition of layerCount layers from baseArrayLayer into cmd, of the first mip unless
+	// levelCount and baseMipLevel say otherwise
+	inline void ImageBarrier(const vkb::DispatchTable& disp,
+	        VkCommandBuffer cmd,
+	        VkImage image,
+	        VkImageAspectFlags aspectMask,
+	        VkImageLayout oldLayout,
+	        VkImageLayout newLayout,
+	        VkPipelineStageFlags2 srcStage,
+	        VkAccessFlags2 srcAccess,
+	        VkPipelineStageFlags2 dstStage,
+	        VkAccessFlags2 dstAccess,
+	        uint32_t layerCount = 1,
+	        uint32_t baseArrayLayer = 0,
+	        uint32_t levelCount = 1,
+	        uint32_t baseMipLevel = 0)
+	{
+		VkImageMemoryBarrier2 barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+		barrier.srcStageMask = srcStage;
+		barrier.srcAccessMask = srcAccess;
+		barrier.dstStageMask = dstStage;
+		barrier.dstAccessMask = dstAccess;
+		barrier.oldLayout = oldLayout;
+		barrier.newLayout = newLayout;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.image = image;
+		barrier.subresourceRange = { aspectMask, baseMipLevel, levelCount, baseArrayLayer, layerCount };
+
+		VkDependencyInfo dependencyInfo = {};
+		dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+		dependencyInfo.imageMemoryBarrierCount = 1;
+		dependencyInfo.pImageMemoryBarriers = &barrier;
+
+		disp.cmdPipelineBarrier2(cmd, &dependencyInfo);
+	}
+
+	// Writes and flushes through persistently mapped buffers this frame. Every write used to be a map/unmap
+	// pair, the renderer shows these in its debugger and resets them at the start of each frame.
+	struct MappedUploadStats
+	{
+		uint32_t writes = 0;
+		uint32_t flushes = 0;
+		VkDeviceSize bytes = 0;
+	};
+
+	inline MappedUploadStats& GetMappedUploadStats()
+	{
+		static MappedUploadStats stats;
+		return stats;
+	}
+
+	// Copies into a persistently mapped buffer. The memory may be write combined, so only ever write it
+	// front to back and never read it back.
+	inline void WriteMapped(void* mappedData, VkDeviceSize offset, const void* data, VkDeviceSize size)
+	{
+		memcpy(static_cast<uint8_t*>(mappedData) + offset, data, size);
+
+		MappedUploadStats& stats = GetMappedUploadStats();
+		stats.writes++;
+		stats.bytes += size;
+	}
+
 	template<typename T>
-	void CopyStructToBuffer(T& data, VmaAllocator allocator, VmaAllocation allocation)
+	void CopyStructToBuffer(const T& data, void* mappedData, VkDeviceSize offset = 0)
+	{
+		WriteMapped(mappedData, offset, &data, sizeof(T));
+	}
+
+	// Makes host writes visible to the device, call once per range after writing it
+	inline void FlushMapped(VmaAllocator allocator, VmaAllocation allocation, VkDeviceSize offset, VkDeviceSize size)
 	{
-		void* mappedData;
-		vmaMapMemory(allocator, allocation, &mappedData);
-		memcpy(mappedData, &data, sizeof(T));
-		vmaUnmapMemory(allocator, allocation);
+		// No-op on host coherent memory
+		vmaFlushAllocation(allocator, allocation, offset, size);
+		GetMappedUploadStats().flushes++;
 	}
 
 	inline void SetupDepthTestingAndLineWidth(const vkb::DispatchTable& disp, VkCommandBuffer& cmd)
@@ -14,13 +14,6 @@ layout(location = 1) out vec3 Normal;
 layout(location = 2) out vec2 TexCoords;
 layout(location = 3) out vec3 Tangent;
 layout(location = 4) out vec3 Bitangent;
-layout(location = 5) out vec4 FragPosLightSpace;
-
-// Push constant for per-object transform
-layout(push_constant) uniform TransformUBO {
-    mat4 model;
-    mat3 normalMatrix;
-} transform;
 
 // Camera uniforms (set = 0)
 layout(set = 0, binding = 0, scalar) uniform CameraUBO {
@@ -30,36 +23,32 @@ layout(set = 0, binding = 0, scalar) uniform CameraUBO {
     vec3 viewPos;
 } camera;
 
-// Light uniforms (set = 1)
-layout(set = 1, binding = 0, scalar) uniform LightUBO {
-    vec3 direction;
-    float ambientStrength;
-    vec3 color;
-    float padding1;  // Add padding to ensure 16-byte alignment
-    mat4 lightSpaceMatrix;
-} light;
+// Per-instance data (set = 0), gl_InstanceIndex includes the batch's firstInstance
+struct InstanceData {
+    mat4 model;
+    mat4 normalMatrix;
+    uint materialIndex;
+};
 
-const mat4 bias = mat4( // Bias matrix to transform NDC space [-1,1] to texture space [0,1]
-  0.5, 0.0, 0.0, 0.0,
-  0.0, 0.5, 0.0, 0.0,
-  0.0, 0.0, 1.0, 0.0,
-  0.5, 0.5, 0.0, 1.0 );
+layout(set = 0, binding = 1, std430) readonly buffer InstanceBuffer {
+    InstanceData instances[];
+};
 
 void main() {
+    InstanceData instance = instances[gl_InstanceIndex];
+    mat3 normalMatrix = mat3(instance.normalMatrix);
+
     // Calculate vertex position in world space
-    FragPos = vec3(transform.model * vec4(inPosition, 1.0));
+    FragPos = vec3(instance.model * vec4(inPosition, 1.0));
     
     // Transform normal, tangent, and bitangent to world space
-    Normal = normalize(transform.normalMatrix * inNormal);
-    Tangent = normalize(transform.normalMatrix * inTangent);
-    Bitangent = normalize(transform.normalMatrix * inBitangent);
+    Normal = normalize(normalMatrix * inNormal);
+    Tangent = normalize(normalMatrix * inTangent);
+    Bitangent = normalize(normalMatrix * inBitangent);
     
     // Pass texture coordinates to fragment shader
     TexCoords = inTexCoords;
     
-    // Calculate fragment position in light space for shadow mapping
-    FragPosLightSpace = bias * light.lightSpaceMatrix * vec4(FragPos, 1.0);
-    
     // Calculate final vertex position
     gl_Position = camera.viewProjection * vec4(FragPos, 1.0);
 }
\ No newline at end of file
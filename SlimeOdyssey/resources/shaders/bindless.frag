@@ -0,0 +1,416 @@
+#version 450
+#extension GL_EXT_scalar_block_layout : enable
+#extension GL_EXT_nonuniform_qualifier : enable
+
+// basic.frag for the bindless pipeline, materials and textures are indexed instead of bound per draw
+
+// Input from vertex shader
+layout(location = 0) in vec3 FragPos;
+layout(location = 1) in vec3 Normal;
+layout(location = 2) in vec2 TexCoords;
+layout(location = 3) in vec3 Tangent;
+layout(location = 4) in vec3 Bitangent;
+layout(location = 5) flat in uint MaterialIndex;
+
+// Output
+layout(location = 0) out vec4 FragColor;
+
+// Camera uniforms (set = 0)
+layout(set = 0, binding = 0, scalar) uniform CameraUBO {
+    mat4 view;
+    mat4 projection;
+    mat4 viewProjection;
+    vec3 viewPos;
+} camera;
+
+// Matches MAX_SHADOW_CASCADES in Light.h
+const uint MAX_SHADOW_CASCADES = 4;
+
+// Light uniforms (set = 1)
+layout(set = 1, binding = 0, scalar) uniform LightUBO {
+    vec3 color;
+    float padding1;
+    float ambientStrength;
+    float specularStrength;
+    vec2 padding2;
+    mat4 lightSpaceMatrix;
+    vec3 direction;
+    float padding3;
+    mat4 cascadeMatrices[MAX_SHADOW_CASCADES];
+    vec4 cascadeSplits; // View depth each cascade reaches to
+    uint cascadeCount;
+    uint shadowFilter;         // SHADOW_FILTER_*
+    float lightBleedReduction; // EVSM only
+    float padding4;
+    // Matches ClusteredLights::GPUParams
+    vec2 clusterTanHalfFov;
+    float clusterDepthScale; // slice = log(depth) * scale + bias
+    float clusterDepthBias;
+    uint clusterBase;        // This frame's first cluster
+    uint pointLightCount;
+} light;
+
+// Every cascade of the shadow map (set = 1)
+layout(set = 1, binding = 1) uniform sampler2DArray shadowMap;
+
+// Point lights of the frame (set = 1), matches PointLight::BindingData
+struct PointLight {
+    vec3 color;
+    float padding1;
+    float ambientStrength;
+    float specularStrength;
+    vec2 padding2;
+    mat4 lightSpaceMatrix;
+    vec3 position;
+    float radius;
+    vec4 shadowAtlasRect; // xy offset, zw size, zero without a shadow
+};
+
+layout(set = 1, binding = 2, std430) readonly buffer PointLightBuffer {
+    PointLight pointLights[];
+};
+
+// Offset and count into the light indices per cluster, see ClusteredLights (set = 1)
+layout(set = 1, binding = 3, std430) readonly buffer ClusterBuffer {
+    uvec2 clusters[];
+};
+
+layout(set = 1, binding = 4, std430) readonly buffer LightIndexBuffer {
+    uint lightIndices[];
+};
+
+// Six layers, one per cube face, every point light has a tile in each (set = 1)
+layout(set = 1, binding = 5) uniform sampler2DArray pointShadowAtlas;
+
+// Blurred exponential moments of every cascade with mips, the shadow map stands in unless the light is EVSM (set = 1)
+layout(set = 1, binding = 6) uniform sampler2DArray shadowMoments;
+
+// Match ShadowFilter in Light.h
+const uint SHADOW_FILTER_PCF = 0;
+const uint SHADOW_FILTER_EVSM = 1;
+
+// Same as shadow_moments.comp
+const float EVSM_POSITIVE_EXPONENT = 5.0;
+const float EVSM_NEGATIVE_EXPONENT = 5.0;
+
+// Match ClusteredLights::CLUSTER_X, CLUSTER_Y and CLUSTER_Z
+const uint CLUSTER_X = 16;
+const uint CLUSTER_Y = 9;
+const uint CLUSTER_Z = 24;
+
+// Same faces as shadowmap_point.vert, +X, -X, +Y, -Y, +Z, -Z
+const float POINT_SHADOW_NEAR = 0.05;
+const vec3 FACE_FORWARD[6] = vec3[](vec3(1.0, 0.0, 0.0), vec3(-1.0, 0.0, 0.0), vec3(0.0, 1.0, 0.0), vec3(0.0, -1.0, 0.0), vec3(0.0, 0.0, 1.0), vec3(0.0, 0.0, -1.0));
+const vec3 FACE_UP[6] = vec3[](vec3(0.0, 1.0, 0.0), vec3(0.0, 1.0, 0.0), vec3(0.0, 0.0, -1.0), vec3(0.0, 0.0, 1.0), vec3(0.0, 1.0, 0.0), vec3(0.0, 1.0, 0.0));
+
+// Every material of the frame (set = 2), matches BindlessMaterials::GPUMaterial
+struct Material {
+    vec3 albedo;
+    float metallic;
+    float roughness;
+    float ao;
+    uint albedoTex;
+    uint normalTex;
+    uint metallicTex;
+    uint roughnessTex;
+    uint aoTex;
+    uint padding;
+};
+
+layout(set = 2, binding = 0, std430) readonly buffer MaterialBuffer {
+    Material materials[];
+};
+
+// Every texture any material uses (set = 2)
+layout(set = 2, binding = 1) uniform sampler2D textures[];
+
+// Matches BindlessMaterials::MISSING_TEXTURE, the map's neutral value is used instead
+const uint MISSING_TEXTURE = 0xFFFFFFFFu;
+
+const float PI = 3.14159265359;
+
+// Function declarations
+float DistributionGGX(vec3 N, vec3 H, float roughness);
+float GeometrySchlickGGX(float NdotV, float roughness);
+float GeometrySmith(vec3 N, vec3 V, vec3 L, float roughness);
+vec3 fresnelSchlick(float cosTheta, vec3 F0);
+vec3 BRDF(vec3 N, vec3 V, vec3 L, vec3 albedo, float metallic, float roughness, vec3 F0);
+float ShadowCalculation(vec3 fragPos);
+float EVSMShadow(vec4 moments, float depth);
+vec3 PointLighting(vec3 fragPos, vec3 N, vec3 V, vec3 albedo, float metallic, float roughness, vec3 F0);
+float PointShadowCalculation(PointLight pointLight, vec3 lightToFrag);
+vec4 SampleMaterialTexture(uint index, vec4 missing, vec2 uvDx, vec2 uvDy);
+
+void main()
+{
+    Material material = materials[MaterialIndex];
+
+    // Sample textures, the index can differ between instances of one draw. Missing maps leave the material's
+    // factors as they are, like the variants of basic.frag built without them.
+    vec2 uvDx = dFdx(TexCoords);
+    vec2 uvDy = dFdy(TexCoords);
+    vec3 albedo = SampleMaterialTexture(material.albedoTex, vec4(1.0), uvDx, uvDy).rgb * material.albedo;
+    float metallic = SampleMaterialTexture(material.metallicTex, vec4(1.0), uvDx, uvDy).r * material.metallic;
+    float roughness = SampleMaterialTexture(material.roughnessTex, vec4(1.0), uvDx, uvDy).r * material.roughness;
+    float ao = SampleMaterialTexture(material.aoTex, vec4(1.0), uvDx, uvDy).r * material.ao;
+
+    // Normal mapping
+    vec3 normal = normalize(Normal);
+    vec3 tangent = normalize(Tangent);
+    vec3 bitangent = normalize(Bitangent);
+    mat3 TBN = mat3(tangent, bitangent, normal);
+    // A flat normal keeps the interpolated one
+    vec3 normalMap = SampleMaterialTexture(material.normalTex, vec4(0.5, 0.5, 1.0, 1.0), uvDx, uvDy).rgb * 2.0 - 1.0;
+    vec3 N = normalize(TBN * normalMap);
+
+    // Debug normals
+    // FragColor = vec4(N * 0.5 + 0.5, 1.0);
+    // return;
+
+    // Correct view and light vectors
+    vec3 V = normalize(camera.viewPos - FragPos);
+    vec3 L = normalize(-light.direction);
+
+    // Calculate reflectance at normal incidence
+    vec3 F0 = vec3(0.04);
+    F0 = mix(F0, albedo, metallic);
+
+    // Calculate shadow
+    float shadow = ShadowCalculation(FragPos);
+
+    // Combine lighting, the directional light and then the point lights in this fragment's cluster
+    vec3 Lo = BRDF(N, V, L, albedo, metallic, roughness, F0) * light.color * (1.0 - shadow);
+    Lo += PointLighting(FragPos, N, V, albedo, metallic, roughness, F0);
+    Lo *= ao;
+    vec3 ambient = light.ambientStrength * albedo * ao;
+
+    vec3 color = ambient + Lo;
+
+    // HDR tonemapping and gamma correction
+    color = color / (color + vec3(1.0));
+    color = pow(color, vec3(1.0/2.2));
+
+    FragColor = vec4(color, 1.0);
+}
+
+float DistributionGGX(vec3 N, vec3 H, float roughness)
+{
+    float a = roughness*roughness;
+    float a2 = a*a;
+    float NdotH = max(dot(N, H), 0.0);
+    float NdotH2 = NdotH*NdotH;
+
+    float num = a2;
+    float denom = (NdotH2 * (a2 - 1.0) + 1.0);
+    denom = PI * denom * denom;
+
+    return num / denom;
+}
+
+float GeometrySchlickGGX(float NdotV, float roughness)
+{
+    float r = (roughness + 1.0);
+    float k = (r*r) / 8.0;
+
+    float num = NdotV;
+    float denom = NdotV * (1.0 - k) + k;
+
+    return num / denom;
+}
+
+float GeometrySmith(vec3 N, vec3 V, vec3 L, float roughness)
+{
+    float NdotV = max(dot(N, V), 0.0);
+    float NdotL = max(dot(N, L), 0.0);
+    float ggx2 = GeometrySchlickGGX(NdotV, roughness);
+    float ggx1 = GeometrySchlickGGX(NdotL, roughness);
+
+    return ggx1 * ggx2;
+}
+
+vec3 fresnelSchlick(float cosTheta, vec3 F0) {
+    return F0 + (1.0 - F0) * pow(max(1.0 - cosTheta, 0.0), 5.0);
+}
+
+// Cook-Torrance, what reaches the eye per unit of the light's radiance
+vec3 BRDF(vec3 N, vec3 V, vec3 L, vec3 albedo, float metallic, float roughness, vec3 F0)
+{
+    vec3 H = normalize(V + L);
+
+    float NDF = DistributionGGX(N, H, roughness);
+    float G = GeometrySmith(N, V, L, roughness);
+    vec3 F = fresnelSchlick(max(dot(H, V), 0.0), F0);
+
+    vec3 numerator = NDF * G * F;
+    float denominator = 4.0 * max(dot(N, V), 0.0) * max(dot(N, L), 0.0) + 0.0001;
+    vec3 specular = numerator / denominator;
+
+    vec3 kS = F;
+    vec3 kD = vec3(1.0) - kS;
+    kD *= 1.0 - metallic;
+
+    float NdotL = max(dot(N, L), 0.0);
+    return (kD * albedo / PI + specular) * NdotL;
+}
+
+// Only the lights binned into the fragment's cluster, the lookup matches ClusteredLights::GetClusterIndex
+vec3 PointLighting(vec3 fragPos, vec3 N, vec3 V, vec3 albedo, float metallic, float roughness, vec3 F0)
+{
+    vec3 viewPosition = (camera.view * vec4(fragPos, 1.0)).xyz;
+    float depth = max(-viewPosition.z, 1e-4);
+    vec2 tile = floor((viewPosition.xy / (depth * light.clusterTanHalfFov) * 0.5 + 0.5) * vec2(CLUSTER_X, CLUSTER_Y));
+    float slice = floor(log(depth) * light.clusterDepthScale + light.clusterDepthBias);
+    uint x = uint(clamp(tile.x, 0.0, float(CLUSTER_X - 1)));
+    uint y = uint(clamp(tile.y, 0.0, float(CLUSTER_Y - 1)));
+    uint z = uint(clamp(slice, 0.0, float(CLUSTER_Z - 1)));
+    uvec2 cluster = clusters[light.clusterBase + (z * CLUSTER_Y + y) * CLUSTER_X + x];
+
+    vec3 Lo = vec3(0.0);
+    for (uint i = cluster.x; i < cluster.x + cluster.y; i++)
+    {
+        PointLight pointLight = pointLights[lightIndices[i]];
+        vec3 toLight = pointLight.position - fragPos;
+        float lightDistance = length(toLight);
+        if (lightDistance >= pointLight.radius)
+        {
+            continue;
+        }
+
+        // Inverse square, windowed to reach zero at the radius
+        float falloff = lightDistance / pointLight.radius;
+        falloff *= falloff;
+        float window = clamp(1.0 - falloff * falloff, 0.0, 1.0);
+        float attenuation = window * window / (lightDistance * lightDistance + 1.0);
+
+        float shadow = PointShadowCalculation(pointLight, -toLight);
+        Lo += BRDF(N, V, toLight / lightDistance, albedo, metallic, roughness, F0) * pointLight.color * attenuation * (1.0 - shadow);
+    }
+    return Lo;
+}
+
+// Projects onto the cube face the fragment is on the same way shadowmap_point.vert rendered it
+float PointShadowCalculation(PointLight pointLight, vec3 lightToFrag)
+{
+    if (pointLight.shadowAtlasRect.z == 0.0)
+    {
+        return 0.0;
+    }
+
+    vec3 a = abs(lightToFrag);
+    uint face;
+    if (a.x >= a.y && a.x >= a.z)
+    {
+        face = lightToFrag.x > 0.0 ? 0u : 1u;
+    }
+    else if (a.y >= a.z)
+    {
+        face = lightToFrag.y > 0.0 ? 2u : 3u;
+    }
+    else
+    {
+        face = lightToFrag.z > 0.0 ? 4u : 5u;
+    }
+
+    vec3 forward = FACE_FORWARD[face];
+    vec3 up = FACE_UP[face];
+    vec3 right = cross(forward, up);
+    vec3 projected = vec3(dot(lightToFrag, right), -dot(lightToFrag, up), dot(lightToFrag, forward));
+
+    // Kept off the tile's edges so filtering doesn't pull in the neighbouring tile
+    vec2 uv = clamp(projected.xy / projected.z * 0.5 + 0.5, 0.001, 0.999);
+    vec2 atlasUV = pointLight.shadowAtlasRect.xy + uv * pointLight.shadowAtlasRect.zw;
+
+    float far = pointLight.radius;
+    float currentDepth = far / (far - POINT_SHADOW_NEAR) * (1.0 - POINT_SHADOW_NEAR / projected.z);
+    float bias = 0.002;
+
+    float closestDepth = texture(pointShadowAtlas, vec3(atlasUV, face)).r;
+    return currentDepth - bias > closestDepth ? 1.0 : 0.0;
+}
+
+// Picks the cascade by view depth, fragments past the last one are lit
+float ShadowCalculation(vec3 fragPos)
+{
+    // Taken before branching on the cascade, EVSM picks its mip from how fast the shadow map's UVs change
+    vec3 fragPosDx = dFdx(fragPos);
+    vec3 fragPosDy = dFdy(fragPos);
+
+    float viewDepth = -(camera.view * vec4(fragPos, 1.0)).z;
+    uint cascade = 0;
+    while (cascade < light.cascadeCount && viewDepth > light.cascadeSplits[cascade])
+    {
+        cascade++;
+    }
+    if (cascade >= light.cascadeCount)
+    {
+        return 0.0;
+    }
+
+    vec4 shadowCoords = light.cascadeMatrices[cascade] * vec4(fragPos, 1.0);
+    shadowCoords /= shadowCoords.w;
+    vec2 uv = shadowCoords.xy * 0.5 + 0.5;
+    float currentDepth = shadowCoords.z;
+
+    // One filtered fetch, the cascades are orthographic so the UV derivatives are the projected position's
+    if (light.shadowFilter == SHADOW_FILTER_EVSM)
+    {
+        mat3 cascadeMatrix = mat3(light.cascadeMatrices[cascade]);
+        vec2 uvDx = (cascadeMatrix * fragPosDx).xy * 0.5;
+        vec2 uvDy = (cascadeMatrix * fragPosDy).xy * 0.5;
+        vec4 moments = textureGrad(shadowMoments, vec3(uv, cascade), uvDx, uvDy);
+        return EVSMShadow(moments, currentDepth);
+    }
+
+    float bias = 0.0005;
+
+    // Apply PCF
+    float shadowSum = 0.0;
+    vec2 texelSize = 1.0 / vec2(textureSize(shadowMap, 0).xy);
+    for (int x = -1; x <= 1; ++x)
+    {
+        for (int y = -1; y <= 1; ++y)
+        {
+            float pcfDepth = texture(shadowMap, vec3(uv + vec2(x, y) * texelSize, cascade)).r;
+            shadowSum += currentDepth - bias > pcfDepth ? 1.0 : 0.0;
+        }
+    }
+
+    return shadowSum / 9.0;
+}
+
+// Upper bound on the fraction of the filtered area in front of the receiver, from the mean and variance
+float ChebyshevUpperBound(vec2 moments, float mean, float minVariance)
+{
+    float variance = max(moments.y - moments.x * moments.x, minVariance);
+    float d = mean - moments.x;
+    float pMax = variance / (variance + d * d);
+
+    // Light bleeding shows up as low visibility where there should be none, cut that part off
+    pMax = clamp((pMax - light.lightBleedReduction) / (1.0 - light.lightBleedReduction), 0.0, 1.0);
+    return mean <= moments.x ? 1.0 : pMax;
+}
+
+// moments are the positive warp, its square, the negative warp and its square, blurred
+float EVSMShadow(vec4 moments, float depth)
+{
+    depth = depth * 2.0 - 1.0;
+    vec2 warped = vec2(exp(EVSM_POSITIVE_EXPONENT * depth), -exp(-EVSM_NEGATIVE_EXPONENT * depth));
+
+    // Scaled with the warp's slope, a fixed minimum would be far too large or small at one end of it
+    vec2 depthScale = 0.0001 * vec2(EVSM_POSITIVE_EXPONENT, EVSM_NEGATIVE_EXPONENT) * warped;
+    vec2 minVariance = depthScale * depthScale;
+
+    float positive = ChebyshevUpperBound(moments.xy, warped.x, minVariance.x);
+    float negative = ChebyshevUpperBound(moments.zw, warped.y, minVariance.y);
+    return 1.0 - min(positive, negative);
+}
+
+// Gradients are taken before the branch, the index may differ between the invocations of a quad
+vec4 SampleMaterialTexture(uint index, vec4 missing, vec2 uvDx, vec2 uvDy)
+{
+    if (index == MISSING_TEXTURE)
+    {
+        return missing;
+    }
+    return textureGrad(textures[nonuniformEXT(index)], TexCoords, uvDx, uvDy);
+}
@@ -0,0 +1,60 @@
+#version 450
+#extension GL_EXT_scalar_block_layout : enable
+
+// basic.vert for the bindless pipeline, the material comes from the instance data instead of a descriptor set
+
+// Vertex attributes
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNormal;
+layout(location = 2) in vec2 inTexCoords;
+layout(location = 3) in vec3 inTangent;
+layout(location = 4) in vec3 inBitangent;
+
+// Outputs to fragment shader
+layout(location = 0) out vec3 FragPos;
+layout(location = 1) out vec3 Normal;
+layout(location = 2) out vec2 TexCoords;
+layout(location = 3) out vec3 Tangent;
+layout(location = 4) out vec3 Bitangent;
+layout(location = 5) flat out uint MaterialIndex;
+
+// Camera uniforms (set = 0)
+layout(set = 0, binding = 0, scalar) uniform CameraUBO {
+    mat4 view;
+    mat4 projection;
+    mat4 viewProjection;
+    vec3 viewPos;
+} camera;
+
+// Per-instance data (set = 0), gl_InstanceIndex includes the batch's firstInstance
+struct InstanceData {
+    mat4 model;
+    mat4 normalMatrix;
+    uint materialIndex;
+};
+
+layout(set = 0, binding = 1, std430) readonly buffer InstanceBuffer {
+    InstanceData instances[];
+};
+
+void main() {
+    InstanceData instance = instances[gl_InstanceIndex];
+    mat3 normalMatrix = mat3(instance.normalMatrix);
+
+    // Calculate vertex position in world space
+    FragPos = vec3(instance.model * vec4(inPosition, 1.0));
+    
+    // Transform normal, tangent, and bitangent to world space
+    Normal = normalize(normalMatrix * inNormal);
+    Tangent = normalize(normalMatrix * inTangent);
+    Bitangent = normalize(normalMatrix * inBitangent);
+    
+    // Pass texture coordinates to fragment shader
+    TexCoords = inTexCoords;
+    
+    // Index of this frame's copy of the material
+    MaterialIndex = instance.materialIndex;
+
+    // Calculate final vertex position
+    gl_Position = camera.viewProjection * vec4(FragPos, 1.0);
+}
\ No newline at end of file
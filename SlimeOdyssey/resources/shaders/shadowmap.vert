@@ -2,9 +2,19 @@
 
 layout(push_constant) uniform PushConstants {
 	mat4 lightSpaceMatrix;
-    mat4 modelMatrix;
 } pushConstants;
 
+// Per-instance data (set = 0), gl_InstanceIndex includes the batch's firstInstance
+struct InstanceData {
+    mat4 model;
+    mat4 normalMatrix;
+    uint materialIndex;
+};
+
+layout(set = 0, binding = 1, std430) readonly buffer InstanceBuffer {
+    InstanceData instances[];
+};
+
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inNormal;
 layout(location = 2) in vec2 inTexCoords;
@@ -12,5 +22,5 @@ layout(location = 3) in vec3 inTangent;
 layout(location = 4) in vec3 inBitangent;
 
 void main() {
-    gl_Position = pushConstants.lightSpaceMatrix * pushConstants.modelMatrix * vec4(inPosition, 1.0);
+    gl_Position = pushConstants.lightSpaceMatrix * instances[gl_InstanceIndex].model * vec4(inPosition, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,48 @@
+#version 450
+#extension GL_EXT_multiview : require
+
+// All six faces of a point light's cube in one pass, gl_ViewIndex is the face and the layer of the shadow atlas
+// it goes to. The light's tile in the atlas is set through the viewport.
+
+layout(push_constant) uniform PushConstants {
+	vec4 lightPositionRadius; // The radius is the far plane of every face
+} pushConstants;
+
+// Per-instance data (set = 0), gl_InstanceIndex includes the batch's firstInstance
+struct InstanceData {
+    mat4 model;
+    mat4 normalMatrix;
+    uint materialIndex;
+};
+
+layout(set = 0, binding = 1, std430) readonly buffer InstanceBuffer {
+    InstanceData instances[];
+};
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNormal;
+layout(location = 2) in vec2 inTexCoords;
+layout(location = 3) in vec3 inTangent;
+layout(location = 4) in vec3 inBitangent;
+
+// Same as ShadowSystem::POINT_SHADOW_NEAR, shaders sampling the atlas project with the same faces
+const float POINT_SHADOW_NEAR = 0.05;
+
+// +X, -X, +Y, -Y, +Z, -Z
+const vec3 FACE_FORWARD[6] = vec3[](vec3(1.0, 0.0, 0.0), vec3(-1.0, 0.0, 0.0), vec3(0.0, 1.0, 0.0), vec3(0.0, -1.0, 0.0), vec3(0.0, 0.0, 1.0), vec3(0.0, 0.0, -1.0));
+const vec3 FACE_UP[6] = vec3[](vec3(0.0, 1.0, 0.0), vec3(0.0, 1.0, 0.0), vec3(0.0, 0.0, -1.0), vec3(0.0, 0.0, 1.0), vec3(0.0, 1.0, 0.0), vec3(0.0, 1.0, 0.0));
+
+void main() {
+    vec3 toVertex = (instances[gl_InstanceIndex].model * vec4(inPosition, 1.0)).xyz - pushConstants.lightPositionRadius.xyz;
+
+    // A 90 degree square frustum along the face's axis
+    vec3 forward = FACE_FORWARD[gl_ViewIndex];
+    vec3 up = FACE_UP[gl_ViewIndex];
+    vec3 right = cross(forward, up);
+    vec3 face = vec3(dot(toVertex, right), -dot(toVertex, up), dot(toVertex, forward));
+
+    // Depth 0 at the near plane and 1 at the light's radius
+    float far = pushConstants.lightPositionRadius.w;
+    float depthScale = far / (far - POINT_SHADOW_NEAR);
+    gl_Position = vec4(face.x, face.y, depthScale * (face.z - POINT_SHADOW_NEAR), face.z);
+}
@@ -12,12 +12,6 @@ layout(location = 4) in vec3 inBitangent;
 layout(location = 0) out vec4 FragColour;
 
 
-// push constant Uniform buffer for transformation matrices
-layout(push_constant) uniform TransformUBO {
-	mat4 model;
-	mat3 normalMatrix;
-} transform;
-
 layout(set = 0, binding = 0, scalar) uniform CameraUBO {
     mat4 view;
     mat4 projection;
@@ -25,6 +19,17 @@ layout(set = 0, binding = 0, scalar) uniform CameraUBO {
     vec3 viewPos;
 } camera;
 
+// Per-instance data (set = 0), gl_InstanceIndex includes the batch's firstInstance
+struct InstanceData {
+    mat4 model;
+    mat4 normalMatrix;
+    uint materialIndex;
+};
+
+layout(set = 0, binding = 1, std430) readonly buffer InstanceBuffer {
+    InstanceData instances[];
+};
+
 layout(set = 1, binding = 0, scalar) uniform ConfigBuffer {
     vec4 color;
 } config;
@@ -32,6 +37,6 @@ layout(set = 1, binding = 0, scalar) uniform ConfigBuffer {
 void main() {
 	FragColour = config.color;
 	
-	vec3 FragPos = vec3(transform.model * vec4(inPosition, 1.0));
+	vec3 FragPos = vec3(instances[gl_InstanceIndex].model * vec4(inPosition, 1.0));
 	gl_Position = camera.projection * camera.view * vec4(FragPos, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,326 @@
+#include "BindlessMaterials.h"
+
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+#include "ClusteredLights.h"
+#include "Entity.h"
+#include "EntityManager.h"
+#include "imgui.h"
+#include "Model.h"
+#include "ShaderManager.h"
+#include "VulkanDebugUtils.h"
+#include "VulkanUtil.h"
+
+// Smallest per frame capacity, grows by doubling after that
+constexpr uint32_t MIN_BINDLESS_MATERIAL_CAPACITY = 64;
+
+void BindlessMaterials::Cleanup(vkb::DispatchTable& disp, VmaAllocator allocator)
+{
+	if (m_buffer != VK_NULL_HANDLE)
+	{
+		vmaDestroyBuffer(allocator, m_buffer, m_allocation);
+	}
+
+	if (m_pool != VK_NULL_HANDLE)
+	{
+		disp.destroyDescriptorPool(m_pool, nullptr);
+	}
+
+	m_buffer = VK_NULL_HANDLE;
+	m_allocation = VK_NULL_HANDLE;
+	m_mappedData = nullptr;
+	m_capacity = 0;
+	m_pool = VK_NULL_HANDLE;
+	m_sets[0] = VK_NULL_HANDLE;
+	m_sets[1] = VK_NULL_HANDLE;
+	m_textureSlots.clear();
+	m_slotViews.clear();
+	m_boundLightBuffer = VK_NULL_HANDLE;
+	m_boundShadowMap = VK_NULL_HANDLE;
+	m_boundShadowMoments = VK_NULL_HANDLE;
+	std::fill(std::begin(m_boundPointLightBuffers), std::end(m_boundPointLightBuffers), VK_NULL_HANDLE);
+	m_boundPointShadowAtlas = VK_NULL_HANDLE;
+}
+
+void BindlessMaterials::Update(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, EntityManager& entityManager, VkDescriptorSetLayout lightLayout, VkDescriptorSetLayout materialLayout, uint32_t frameIndex, uint32_t frameCount)
+{
+	if (m_pool == VK_NULL_HANDLE)
+	{
+		CreateDescriptorSets(disp, lightLayout, materialLayout);
+	}
+
+	m_materials.clear();
+	m_materialSlots.clear();
+	entityManager.ForEachEntityWith<PBRMaterial>(
+	        [this](Entity& entity)
+	        {
+		        PBRMaterialResource* material = entity.GetComponent<PBRMaterial>().materialResource;
+		        if (material && m_materialSlots.emplace(material, static_cast<uint32_t>(m_materials.size())).second)
+		        {
+			        m_materials.push_back(material);
+		        }
+	        });
+
+	uint32_t materialCount = static_cast<uint32_t>(m_materials.size());
+	EnsureCapacity(disp, allocator, debugUtils, materialCount, frameCount);
+
+	uint32_t frameBase = frameIndex * m_capacity;
+	for (uint32_t slot = 0; slot < materialCount; slot++)
+	{
+		PBRMaterialResource* material = m_materials[slot];
+		const PBRMaterialResource::Config& config = material->config;
+
+		// Built on the stack and stored in one go, the mapped memory may be write combined
+		GPUMaterial gpuMaterial = { config.albedo, config.metallic, config.roughness, config.ao };
+		gpuMaterial.albedoTex = GetTextureSlot(disp, material->albedoTex);
+		gpuMaterial.normalTex = GetTextureSlot(disp, material->normalTex);
+		gpuMaterial.metallicTex = GetTextureSlot(disp, material->metallicTex);
+		gpuMaterial.roughnessTex = GetTextureSlot(disp, material->roughnessTex);
+		gpuMaterial.aoTex = GetTextureSlot(disp, material->aoTex);
+		gpuMaterial.padding = 0;
+		m_mappedData[frameBase + slot] = gpuMaterial;
+
+		material->bindlessIndex = frameBase + slot;
+	}
+
+	if (materialCount > 0)
+	{
+		SlimeUtil::FlushMapped(allocator, m_allocation, frameBase * sizeof(GPUMaterial), materialCount * sizeof(GPUMaterial));
+	}
+
+	m_stats.materials = materialCount;
+	m_stats.textures = static_cast<uint32_t>(m_slotViews.size());
+	m_stats.capacity = m_capacity;
+}
+
+void BindlessMaterials::BindLightBuffer(vkb::DispatchTable& disp, VkBuffer buffer, VkDeviceSize range)
+{
+	if (buffer == m_boundLightBuffer || m_sets[0] == VK_NULL_HANDLE)
+	{
+		return;
+	}
+
+	VkDescriptorBufferInfo bufferInfo = { buffer, 0, range };
+
+	VkWriteDescriptorSet write = {};
+	write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	write.dstSet = m_sets[0];
+	write.dstBinding = 0;
+	write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	write.descriptorCount = 1;
+	write.pBufferInfo = &bufferInfo;
+	disp.updateDescriptorSets(1, &write, 0, nullptr);
+
+	m_boundLightBuffer = buffer;
+}
+
+void BindlessMaterials::BindShadowMap(vkb::DispatchTable& disp, const TextureResource& shadowMap, const TextureResource& shadowMoments)
+{
+	if (m_sets[0] == VK_NULL_HANDLE || shadowMap.imageView == VK_NULL_HANDLE || (m_boundShadowMap == shadowMap.imageView && m_boundShadowMoments == shadowMoments.imageView))
+	{
+		return;
+	}
+
+	// Shadow maps are only replaced after waiting for the device, nothing still reads the old ones. Lights
+	// without EVSM have no moments, the shadow map stands in so the binding stays valid.
+	const TextureResource& moments = shadowMoments.imageView != VK_NULL_HANDLE ? shadowMoments : shadowMap;
+	VkDescriptorImageInfo imageInfos[2] = {
+		{ shadowMap.sampler, shadowMap.imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL },
+		{   moments.sampler,   moments.imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL },
+	};
+
+	VkWriteDescriptorSet writes[2] = {};
+	for (uint32_t i = 0; i < 2; i++)
+	{
+		writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writes[i].dstSet = m_sets[0];
+		writes[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		writes[i].descriptorCount = 1;
+		writes[i].pImageInfo = &imageInfos[i];
+	}
+	writes[0].dstBinding = 1;
+	writes[1].dstBinding = 6;
+	disp.updateDescriptorSets(2, writes, 0, nullptr);
+
+	m_boundShadowMap = shadowMap.imageView;
+	m_boundShadowMoments = shadowMoments.imageView;
+}
+
+void BindlessMaterials::BindPointLights(vkb::DispatchTable& disp, const ClusteredLights& clusteredLights, const TextureResource& pointShadowAtlas)
+{
+	VkBuffer buffers[3] = { clusteredLights.GetLightBuffer(), clusteredLights.GetClusterBuffer(), clusteredLights.GetIndexBuffer() };
+	if (m_sets[0] == VK_NULL_HANDLE || buffers[0] == VK_NULL_HANDLE || pointShadowAtlas.imageView == VK_NULL_HANDLE)
+	{
+		return;
+	}
+
+	bool buffersChanged = !std::equal(std::begin(buffers), std::end(buffers), std::begin(m_boundPointLightBuffers));
+	bool atlasChanged = pointShadowAtlas.imageView != m_boundPointShadowAtlas;
+	if (!buffersChanged && !atlasChanged)
+	{
+		return;
+	}
+
+	// The light set isn't update after bind. Grown buffers were only replaced after waiting for the device, the
+	// atlas takes over from the stand-in while earlier frames may still be using the set.
+	if (atlasChanged && m_boundPointShadowAtlas != VK_NULL_HANDLE)
+	{
+		disp.deviceWaitIdle();
+	}
+
+	VkDescriptorBufferInfo bufferInfos[3];
+	VkWriteDescriptorSet writes[4] = {};
+	for (uint32_t i = 0; i < 3; i++)
+	{
+		bufferInfos[i] = { buffers[i], 0, VK_WHOLE_SIZE };
+
+		writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writes[i].dstSet = m_sets[0];
+		writes[i].dstBinding = 2 + i;
+		writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		writes[i].descriptorCount = 1;
+		writes[i].pBufferInfo = &bufferInfos[i];
+	}
+
+	VkDescriptorImageInfo imageInfo = { pointShadowAtlas.sampler, pointShadowAtlas.imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+	writes[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	writes[3].dstSet = m_sets[0];
+	writes[3].dstBinding = 5;
+	writes[3].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	writes[3].descriptorCount = 1;
+	writes[3].pImageInfo = &imageInfo;
+	disp.updateDescriptorSets(4, writes, 0, nullptr);
+
+	std::copy(std::begin(buffers), std::end(buffers), std::begin(m_boundPointLightBuffers));
+	m_boundPointShadowAtlas = pointShadowAtlas.imageView;
+}
+
+void BindlessMaterials::ImGuiDebug() const
+{
+	ImGui::Text("Bindless: %u materials (%u per frame), %u of %u texture slots", m_stats.materials, m_stats.capacity, m_stats.textures, BINDLESS_DESCRIPTOR_CAPACITY);
+}
+
+void BindlessMaterials::CreateDescriptorSets(vkb::DispatchTable& disp, VkDescriptorSetLayout lightLayout, VkDescriptorSetLayout materialLayout)
+{
+	VkDescriptorPoolSize poolSizes[] = {
+		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,                            1 },
+        {         VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,                            4 },
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, BINDLESS_DESCRIPTOR_CAPACITY + 3 }
+	};
+
+	VkDescriptorPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+	poolInfo.poolSizeCount = static_cast<uint32_t>(std::size(poolSizes));
+	poolInfo.pPoolSizes = poolSizes;
+	poolInfo.maxSets = 2;
+	VK_CHECK(disp.createDescriptorPool(&poolInfo, nullptr, &m_pool));
+
+	// Only the material set has a variable count binding, the count of the light set is ignored
+	uint32_t variableCounts[] = { 0, BINDLESS_DESCRIPTOR_CAPACITY };
+	VkDescriptorSetVariableDescriptorCountAllocateInfo variableCountInfo = {};
+	variableCountInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO;
+	variableCountInfo.descriptorSetCount = 2;
+	variableCountInfo.pDescriptorCounts = variableCounts;
+
+	VkDescriptorSetLayout layouts[] = { lightLayout, materialLayout };
+	VkDescriptorSetAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.pNext = &variableCountInfo;
+	allocInfo.descriptorPool = m_pool;
+	allocInfo.descriptorSetCount = 2;
+	allocInfo.pSetLayouts = layouts;
+	VK_CHECK(disp.allocateDescriptorSets(&allocInfo, m_sets));
+	m_slotViews.clear();
+}
+
+bool BindlessMaterials::EnsureCapacity(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, uint32_t materialCount, uint32_t frameCount)
+{
+	if (m_buffer != VK_NULL_HANDLE && materialCount <= m_capacity && frameCount == m_frameCount)
+	{
+		return false;
+	}
+
+	uint32_t capacity = std::max(m_capacity, MIN_BINDLESS_MATERIAL_CAPACITY);
+	while (capacity < materialCount)
+	{
+		capacity *= 2;
+	}
+
+	// The other frames in flight may still be reading the old buffer
+	if (m_buffer != VK_NULL_HANDLE)
+	{
+		disp.deviceWaitIdle();
+		vmaDestroyBuffer(allocator, m_buffer, m_allocation);
+	}
+
+	m_capacity = capacity;
+	m_frameCount = frameCount;
+
+	VkDeviceSize size = static_cast<VkDeviceSize>(m_capacity) * m_frameCount * sizeof(GPUMaterial);
+	m_mappedData = static_cast<GPUMaterial*>(SlimeUtil::CreateMappedBuffer("Bindless Material Buffer", allocator, size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, m_buffer, m_allocation));
+	debugUtils.SetObjectName(m_buffer, "Bindless Material Buffer");
+
+	VkDescriptorBufferInfo bufferInfo = { m_buffer, 0, VK_WHOLE_SIZE };
+
+	VkWriteDescriptorSet write = {};
+	write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	write.dstSet = m_sets[1];
+	write.dstBinding = 0;
+	write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	write.descriptorCount = 1;
+	write.pBufferInfo = &bufferInfo;
+	disp.updateDescriptorSets(1, &write, 0, nullptr);
+
+	spdlog::debug("Bindless material buffer resized to {} materials per frame", m_capacity);
+	return true;
+}
+
+uint32_t BindlessMaterials::GetTextureSlot(vkb::DispatchTable& disp, const TextureResource* texture)
+{
+	if (!texture || texture->imageView == VK_NULL_HANDLE)
+	{
+		return MISSING_TEXTURE;
+	}
+
+	auto it = m_textureSlots.find(texture);
+	if (it != m_textureSlots.end())
+	{
+		// A texture reloaded in place gets a new view, it can't still be in use since the old one is gone
+		if (m_slotViews[it->second] != texture->imageView)
+		{
+			WriteTexture(disp, it->second, *texture);
+		}
+		return it->second;
+	}
+
+	uint32_t slot = static_cast<uint32_t>(m_slotViews.size());
+	if (slot >= BINDLESS_DESCRIPTOR_CAPACITY)
+	{
+		spdlog::error("Out of bindless texture slots ({})", BINDLESS_DESCRIPTOR_CAPACITY);
+		return MISSING_TEXTURE;
+	}
+
+	m_slotViews.push_back(VK_NULL_HANDLE);
+	m_textureSlots[texture] = slot;
+	WriteTexture(disp, slot, *texture);
+	return slot;
+}
+
+void BindlessMaterials::WriteTexture(vkb::DispatchTable& disp, uint32_t slot, const TextureResource& texture)
+{
+	VkDescriptorImageInfo imageInfo = { texture.sampler, texture.imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+
+	VkWriteDescriptorSet write = {};
+	write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	write.dstSet = m_sets[1];
+	write.dstBinding = 1;
+	write.dstArrayElement = slot;
+	write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	write.descriptorCount = 1;
+	write.pImageInfo = &imageInfo;
+	disp.updateDescriptorSets(1, &write, 0, nullptr);
+
+	m_slotViews[slot] = texture.imageView;
+}
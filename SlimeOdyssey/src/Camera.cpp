@@ -76,31 +76,12 @@ void Camera::SetAspectRatio(float aspect)
 	m_aspect = aspect;
 }
 
-void Camera::CreateCameraUBO(VmaAllocator allocator)
+void Camera::UpdateCameraUBO()
 {
-	SlimeUtil::CreateBuffer("Camera UBO", allocator, sizeof(CameraUBO), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, m_cameraUBOBBuffer, m_cameraUBOAllocation);
-}
-
-void Camera::DestroyCameraUBOBuffer(VmaAllocator allocator)
-{
-	vmaDestroyBuffer(allocator, m_cameraUBOBBuffer, m_cameraUBOAllocation);
-}
-
-void Camera::UpdateCameraUBO(VmaAllocator allocator)
-{
-	if (m_cameraUBOBBuffer == VK_NULL_HANDLE)
-	{
-		CreateCameraUBO(allocator);
-		return;
-	}
-
 	m_cameraUBO.view = GetViewMatrix();
 	m_cameraUBO.projection = GetProjectionMatrix();
 	m_cameraUBO.viewProjection = m_cameraUBO.projection * m_cameraUBO.view;
 	m_cameraUBO.viewPos = glm::vec4(m_position, 1.0f);
-
-	// Copy to buffer
-	SlimeUtil::CopyStructToBuffer(m_cameraUBO, allocator, m_cameraUBOAllocation);
 }
 
 CameraUBO& Camera::GetCameraUBO()
@@ -0,0 +1,375 @@
+#include "ClusteredLights.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <spdlog/spdlog.h>
+
+#include "Camera.h"
+#include "imgui.h"
+#include "VulkanDebugUtils.h"
+#include "VulkanUtil.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define SLIME_CLUSTER_SSE2 1
+#else
+#define SLIME_CLUSTER_SSE2 0
+#endif
+
+// Smallest per frame capacities, they grow by doubling after that
+constexpr uint32_t MIN_POINT_LIGHT_CAPACITY = 64;
+constexpr uint32_t MIN_LIGHT_INDEX_CAPACITY = 4096;
+
+void ClusteredLights::Cleanup(VmaAllocator allocator)
+{
+	m_lightBuffer.Cleanup(allocator);
+	m_clusterBuffer.Cleanup(allocator);
+	m_indexBuffer.Cleanup(allocator);
+	m_pointLights.clear();
+}
+
+void ClusteredLights::Assign(const glm::mat4& view, float fovY, float aspect, float nearZ, float farZ, const std::vector<glm::vec4>& spheres)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	float tanY = std::tan(glm::radians(fovY) * 0.5f);
+	float tanX = tanY * aspect;
+	float depthRange = std::log(farZ / nearZ);
+	m_params.tanHalfFov = glm::vec2(tanX, tanY);
+	m_params.depthScale = CLUSTER_Z / depthRange;
+	m_params.depthBias = -(CLUSTER_Z * std::log(nearZ)) / depthRange;
+	m_params.lightCount = static_cast<uint32_t>(spheres.size());
+
+	// Boundary b between the tiles sits at x / (depth * tanX) = -1 + 2b / CLUSTER_X, so a point is on its right
+	// where x - slope * depth > 0. Normalized, that's the signed distance a sphere's radius compares against.
+	for (uint32_t b = 0; b <= CLUSTER_X; b++)
+	{
+		float slope = (-1.0f + 2.0f * b / CLUSTER_X) * tanX;
+		float invLength = 1.0f / std::sqrt(1.0f + slope * slope);
+		m_columnPlanes[b][0] = invLength;
+		m_columnPlanes[b][1] = -slope * invLength;
+	}
+	for (uint32_t b = 0; b <= CLUSTER_Y; b++)
+	{
+		float slope = (-1.0f + 2.0f * b / CLUSTER_Y) * tanY;
+		float invLength = 1.0f / std::sqrt(1.0f + slope * slope);
+		m_rowPlanes[b][0] = invLength;
+		m_rowPlanes[b][1] = -slope * invLength;
+	}
+	for (uint32_t k = 0; k <= CLUSTER_Z; k++)
+	{
+		m_sliceDepths[k] = nearZ * std::pow(farZ / nearZ, static_cast<float>(k) / CLUSTER_Z);
+	}
+
+	// Into view space, split by component so the binning can take four lights at once
+	uint32_t lightCount = static_cast<uint32_t>(spheres.size());
+	uint32_t paddedCount = (lightCount + 3) & ~3u;
+	m_lightX.assign(paddedCount, 0.0f);
+	m_lightY.assign(paddedCount, 0.0f);
+	m_lightDepth.assign(paddedCount, 0.0f);
+	m_lightRadius.assign(paddedCount, 0.0f);
+	for (uint32_t i = 0; i < lightCount; i++)
+	{
+		glm::vec4 viewPosition = view * glm::vec4(glm::vec3(spheres[i]), 1.0f);
+		m_lightX[i] = viewPosition.x;
+		m_lightY[i] = viewPosition.y;
+		m_lightDepth[i] = -viewPosition.z;
+		m_lightRadius[i] = spheres[i].w;
+	}
+
+	BinLights(lightCount);
+
+	// Count the lights of every cluster, lay the lists out back to back, then fill them
+	for (Cluster& cluster: m_clusters)
+	{
+		cluster = { 0, 0 };
+	}
+
+	m_stats = {};
+	m_stats.lights = lightCount;
+	for (uint32_t i = 0; i < lightCount; i++)
+	{
+		const LightRange& range = m_lightRanges[i];
+		if (!range.visible)
+		{
+			m_stats.culledLights++;
+			continue;
+		}
+
+		for (uint32_t z = range.z0; z <= range.z1; z++)
+		{
+			for (uint32_t y = range.y0; y <= range.y1; y++)
+			{
+				Cluster* row = &m_clusters[(z * CLUSTER_Y + y) * CLUSTER_X];
+				for (uint32_t x = range.x0; x <= range.x1; x++)
+				{
+					row[x].count++;
+				}
+			}
+		}
+	}
+
+	uint32_t offset = 0;
+	for (Cluster& cluster: m_clusters)
+	{
+		cluster.offset = offset;
+		offset += cluster.count;
+
+		m_stats.maxClusterLights = std::max(m_stats.maxClusterLights, cluster.count);
+		m_stats.occupiedClusters += cluster.count > 0 ? 1 : 0;
+		cluster.count = 0; // Counted up again while filling
+	}
+	m_stats.lightIndices = offset;
+
+	m_lightIndices.resize(offset);
+	for (uint32_t i = 0; i < lightCount; i++)
+	{
+		const LightRange& range = m_lightRanges[i];
+		if (!range.visible)
+		{
+			continue;
+		}
+
+		for (uint32_t z = range.z0; z <= range.z1; z++)
+		{
+			for (uint32_t y = range.y0; y <= range.y1; y++)
+			{
+				Cluster* row = &m_clusters[(z * CLUSTER_Y + y) * CLUSTER_X];
+				for (uint32_t x = range.x0; x <= range.x1; x++)
+				{
+					m_lightIndices[row[x].offset + row[x].count++] = i;
+				}
+			}
+		}
+	}
+
+	m_stats.assignMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void ClusteredLights::BinLights(uint32_t lightCount)
+{
+	m_lightRanges.resize(m_lightX.size());
+
+	// For each group of four: how many boundaries every light lies entirely past, and how many it reaches past.
+	// The boundaries are ordered, so those counts are the first and last tile, row and slice it touches.
+	alignas(16) int32_t counts[6][4];
+	for (uint32_t first = 0; first < lightCount; first += 4)
+	{
+#if SLIME_CLUSTER_SSE2
+		__m128 x = _mm_loadu_ps(&m_lightX[first]);
+		__m128 y = _mm_loadu_ps(&m_lightY[first]);
+		__m128 depth = _mm_loadu_ps(&m_lightDepth[first]);
+		__m128 radius = _mm_loadu_ps(&m_lightRadius[first]);
+		__m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), radius);
+
+		// Comparisons are all ones where true, subtracting them counts up
+		__m128i left = _mm_setzero_si128();
+		__m128i right = _mm_setzero_si128();
+		for (uint32_t b = 0; b <= CLUSTER_X; b++)
+		{
+			__m128 distance = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(m_columnPlanes[b][0])), _mm_mul_ps(depth, _mm_set1_ps(m_columnPlanes[b][1])));
+			left = _mm_sub_epi32(left, _mm_castps_si128(_mm_cmpgt_ps(distance, radius)));
+			right = _mm_sub_epi32(right, _mm_castps_si128(_mm_cmpgt_ps(distance, negativeRadius)));
+		}
+
+		__m128i bottom = _mm_setzero_si128();
+		__m128i top = _mm_setzero_si128();
+		for (uint32_t b = 0; b <= CLUSTER_Y; b++)
+		{
+			__m128 distance = _mm_add_ps(_mm_mul_ps(y, _mm_set1_ps(m_rowPlanes[b][0])), _mm_mul_ps(depth, _mm_set1_ps(m_rowPlanes[b][1])));
+			bottom = _mm_sub_epi32(bottom, _mm_castps_si128(_mm_cmpgt_ps(distance, radius)));
+			top = _mm_sub_epi32(top, _mm_castps_si128(_mm_cmpgt_ps(distance, negativeRadius)));
+		}
+
+		__m128 nearest = _mm_sub_ps(depth, radius);
+		__m128 farthest = _mm_add_ps(depth, radius);
+		__m128i sliceNear = _mm_setzero_si128();
+		__m128i sliceFar = _mm_setzero_si128();
+		for (uint32_t k = 1; k < CLUSTER_Z; k++)
+		{
+			__m128 sliceDepth = _mm_set1_ps(m_sliceDepths[k]);
+			sliceNear = _mm_sub_epi32(sliceNear, _mm_castps_si128(_mm_cmpgt_ps(nearest, sliceDepth)));
+			sliceFar = _mm_sub_epi32(sliceFar, _mm_castps_si128(_mm_cmpgt_ps(farthest, sliceDepth)));
+		}
+
+		_mm_store_si128(reinterpret_cast<__m128i*>(counts[0]), left);
+		_mm_store_si128(reinterpret_cast<__m128i*>(counts[1]), right);
+		_mm_store_si128(reinterpret_cast<__m128i*>(counts[2]), bottom);
+		_mm_store_si128(reinterpret_cast<__m128i*>(counts[3]), top);
+		_mm_store_si128(reinterpret_cast<__m128i*>(counts[4]), sliceNear);
+		_mm_store_si128(reinterpret_cast<__m128i*>(counts[5]), sliceFar);
+#else
+		for (uint32_t lane = 0; lane < 4; lane++)
+		{
+			float x = m_lightX[first + lane];
+			float y = m_lightY[first + lane];
+			float depth = m_lightDepth[first + lane];
+			float radius = m_lightRadius[first + lane];
+
+			counts[0][lane] = counts[1][lane] = 0;
+			for (uint32_t b = 0; b <= CLUSTER_X; b++)
+			{
+				float distance = x * m_columnPlanes[b][0] + depth * m_columnPlanes[b][1];
+				counts[0][lane] += distance > radius ? 1 : 0;
+				counts[1][lane] += distance > -radius ? 1 : 0;
+			}
+
+			counts[2][lane] = counts[3][lane] = 0;
+			for (uint32_t b = 0; b <= CLUSTER_Y; b++)
+			{
+				float distance = y * m_rowPlanes[b][0] + depth * m_rowPlanes[b][1];
+				counts[2][lane] += distance > radius ? 1 : 0;
+				counts[3][lane] += distance > -radius ? 1 : 0;
+			}
+
+			counts[4][lane] = counts[5][lane] = 0;
+			for (uint32_t k = 1; k < CLUSTER_Z; k++)
+			{
+				counts[4][lane] += depth - radius > m_sliceDepths[k] ? 1 : 0;
+				counts[5][lane] += depth + radius > m_sliceDepths[k] ? 1 : 0;
+			}
+		}
+#endif
+
+		for (uint32_t lane = 0; lane < 4; lane++)
+		{
+			uint32_t i = first + lane;
+			float depth = m_lightDepth[i];
+			float radius = m_lightRadius[i];
+
+			// Past every column boundary means right of the frustum, before the first means left of it
+			LightRange& range = m_lightRanges[i];
+			range.visible = counts[0][lane] <= static_cast<int32_t>(CLUSTER_X) && counts[1][lane] > 0 && counts[2][lane] <= static_cast<int32_t>(CLUSTER_Y) && counts[3][lane] > 0 && depth + radius >= m_sliceDepths[0] && depth - radius <= m_sliceDepths[CLUSTER_Z];
+			range.x0 = static_cast<uint8_t>(std::max(counts[0][lane] - 1, 0));
+			range.x1 = static_cast<uint8_t>(std::min(counts[1][lane] - 1, static_cast<int32_t>(CLUSTER_X - 1)));
+			range.y0 = static_cast<uint8_t>(std::max(counts[2][lane] - 1, 0));
+			range.y1 = static_cast<uint8_t>(std::min(counts[3][lane] - 1, static_cast<int32_t>(CLUSTER_Y - 1)));
+			range.z0 = static_cast<uint8_t>(counts[4][lane]);
+			range.z1 = static_cast<uint8_t>(counts[5][lane]);
+		}
+	}
+}
+
+bool ClusteredLights::Update(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, const std::vector<std::shared_ptr<Light>>& lights, const Camera& camera, uint32_t frameIndex, uint32_t frameCount)
+{
+	m_pointLights.clear();
+	m_spheres.clear();
+	for (const std::shared_ptr<Light>& light: lights)
+	{
+		if (light->GetType() == LightType::Point)
+		{
+			PointLight* pointLight = static_cast<PointLight*>(light.get());
+			m_pointLights.push_back(pointLight);
+			m_spheres.emplace_back(pointLight->GetPosition(), pointLight->GetRadius());
+		}
+	}
+
+	Assign(camera.GetViewMatrix(), camera.GetFOV(), camera.GetAspectRatio(), camera.GetNearZ(), camera.GetFarZ(), m_spheres);
+
+	uint32_t lightCount = static_cast<uint32_t>(m_pointLights.size());
+	uint32_t indexCount = static_cast<uint32_t>(m_lightIndices.size());
+	bool recreated = m_lightBuffer.EnsureCapacity(disp, allocator, debugUtils, lightCount, MIN_POINT_LIGHT_CAPACITY, frameCount);
+	recreated |= m_clusterBuffer.EnsureCapacity(disp, allocator, debugUtils, CLUSTER_COUNT, CLUSTER_COUNT, frameCount);
+	recreated |= m_indexBuffer.EnsureCapacity(disp, allocator, debugUtils, indexCount, MIN_LIGHT_INDEX_CAPACITY, frameCount);
+
+	// Every index goes up absolute, the shaders never need to know which frame they are in
+	uint32_t lightBase = frameIndex * m_lightBuffer.capacity;
+	uint32_t clusterBase = frameIndex * m_clusterBuffer.capacity;
+	uint32_t indexBase = frameIndex * m_indexBuffer.capacity;
+
+	PointLight::BindingData* gpuLights = reinterpret_cast<PointLight::BindingData*>(m_lightBuffer.mappedData) + lightBase;
+	for (uint32_t i = 0; i < lightCount; i++)
+	{
+		gpuLights[i] = m_pointLights[i]->GetBindingData();
+	}
+
+	Cluster* gpuClusters = reinterpret_cast<Cluster*>(m_clusterBuffer.mappedData) + clusterBase;
+	for (uint32_t i = 0; i < CLUSTER_COUNT; i++)
+	{
+		gpuClusters[i] = { indexBase + m_clusters[i].offset, m_clusters[i].count };
+	}
+
+	uint32_t* gpuIndices = reinterpret_cast<uint32_t*>(m_indexBuffer.mappedData) + indexBase;
+	for (uint32_t i = 0; i < indexCount; i++)
+	{
+		gpuIndices[i] = lightBase + m_lightIndices[i];
+	}
+
+	if (lightCount > 0)
+	{
+		SlimeUtil::FlushMapped(allocator, m_lightBuffer.allocation, lightBase * sizeof(PointLight::BindingData), lightCount * sizeof(PointLight::BindingData));
+	}
+	SlimeUtil::FlushMapped(allocator, m_clusterBuffer.allocation, clusterBase * sizeof(Cluster), CLUSTER_COUNT * sizeof(Cluster));
+	if (indexCount > 0)
+	{
+		SlimeUtil::FlushMapped(allocator, m_indexBuffer.allocation, indexBase * sizeof(uint32_t), indexCount * sizeof(uint32_t));
+	}
+
+	m_params.clusterBase = clusterBase;
+	return recreated;
+}
+
+uint32_t ClusteredLights::GetClusterIndex(const glm::vec3& viewPosition) const
+{
+	float depth = std::max(-viewPosition.z, 1e-4f);
+	float x = std::floor((viewPosition.x / (depth * m_params.tanHalfFov.x) * 0.5f + 0.5f) * CLUSTER_X);
+	float y = std::floor((viewPosition.y / (depth * m_params.tanHalfFov.y) * 0.5f + 0.5f) * CLUSTER_Y);
+	float z = std::floor(std::log(depth) * m_params.depthScale + m_params.depthBias);
+
+	uint32_t column = static_cast<uint32_t>(std::clamp(x, 0.0f, static_cast<float>(CLUSTER_X - 1)));
+	uint32_t row = static_cast<uint32_t>(std::clamp(y, 0.0f, static_cast<float>(CLUSTER_Y - 1)));
+	uint32_t slice = static_cast<uint32_t>(std::clamp(z, 0.0f, static_cast<float>(CLUSTER_Z - 1)));
+	return (slice * CLUSTER_Y + row) * CLUSTER_X + column;
+}
+
+void ClusteredLights::ImGuiDebug() const
+{
+	float averageLights = m_stats.occupiedClusters > 0 ? static_cast<float>(m_stats.lightIndices) / m_stats.occupiedClusters : 0.0f;
+	ImGui::Text("Clustered lights: %u point lights, %u culled, assigned in %.3f ms", m_stats.lights, m_stats.culledLights, m_stats.assignMilliseconds);
+	ImGui::Text("Clusters: %u of %u occupied, %.1f lights on average, %u at most", m_stats.occupiedClusters, CLUSTER_COUNT, averageLights, m_stats.maxClusterLights);
+}
+
+bool ClusteredLights::FrameBuffer::EnsureCapacity(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, uint32_t count, uint32_t minCapacity, uint32_t frames)
+{
+	if (buffer != VK_NULL_HANDLE && count <= capacity && frames == frameCount)
+	{
+		return false;
+	}
+
+	uint32_t newCapacity = std::max(capacity, minCapacity);
+	while (newCapacity < count)
+	{
+		newCapacity *= 2;
+	}
+
+	// The other frames in flight may still be reading the old buffer
+	if (buffer != VK_NULL_HANDLE)
+	{
+		disp.deviceWaitIdle();
+		vmaDestroyBuffer(allocator, buffer, allocation);
+	}
+
+	capacity = newCapacity;
+	frameCount = frames;
+
+	VkDeviceSize size = static_cast<VkDeviceSize>(capacity) * frameCount * elementSize;
+	mappedData = static_cast<uint8_t*>(SlimeUtil::CreateMappedBuffer(name, allocator, size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, buffer, allocation));
+	debugUtils.SetObjectName(buffer, name);
+
+	spdlog::debug("{} resized to {} elements per frame", name, capacity);
+	return true;
+}
+
+void ClusteredLights::FrameBuffer::Cleanup(VmaAllocator allocator)
+{
+	if (buffer != VK_NULL_HANDLE)
+	{
+		vmaDestroyBuffer(allocator, buffer, allocation);
+	}
+
+	buffer = VK_NULL_HANDLE;
+	allocation = VK_NULL_HANDLE;
+	mappedData = nullptr;
+	capacity = 0;
+}
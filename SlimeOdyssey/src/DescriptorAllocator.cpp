@@ -0,0 +1,181 @@
+#include "DescriptorAllocator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <spdlog/spdlog.h>
+
+#include "imgui.h"
+#include "VulkanUtil.h"
+
+void DescriptorAllocator::Init(const vkb::DispatchTable& disp, const char* name, uint32_t initialSets, const std::vector<PoolSizeRatio>& ratios, bool transient)
+{
+	m_disp = &disp;
+	m_name = name;
+	m_transient = transient;
+	m_ratios = ratios;
+	m_nextPoolSets = std::max(initialSets, 1u);
+
+	m_readyPools.push_back(CreatePool(m_nextPoolSets));
+}
+
+void DescriptorAllocator::Cleanup()
+{
+	if (!m_disp)
+	{
+		return;
+	}
+
+	for (VkDescriptorPool pool: m_readyPools)
+	{
+		m_disp->destroyDescriptorPool(pool, nullptr);
+	}
+	for (VkDescriptorPool pool: m_fullPools)
+	{
+		m_disp->destroyDescriptorPool(pool, nullptr);
+	}
+
+	m_readyPools.clear();
+	m_fullPools.clear();
+	m_owners.clear();
+	m_stats = {};
+	m_disp = nullptr;
+}
+
+VkDescriptorSet DescriptorAllocator::Allocate(VkDescriptorSetLayout layout, const void* pNext)
+{
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.pNext = pNext;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &layout;
+
+	VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+	while (true)
+	{
+		bool freshPool = m_readyPools.empty();
+		allocInfo.descriptorPool = GetPool();
+		VkResult result = m_disp->allocateDescriptorSets(&allocInfo, &descriptorSet);
+		if (result == VK_SUCCESS)
+		{
+			break;
+		}
+
+		// Recycled pools may be too fragmented or short of this layout's types, retire them until one fits
+		if (!freshPool && (result == VK_ERROR_OUT_OF_POOL_MEMORY || result == VK_ERROR_FRAGMENTED_POOL))
+		{
+			m_fullPools.push_back(m_readyPools.back());
+			m_readyPools.pop_back();
+			continue;
+		}
+
+		// A fresh pool can't fit it either, the layout needs more descriptors than the ratios give a pool
+		spdlog::error("{}: a new descriptor pool can't hold the set", m_name);
+		VK_CHECK(result);
+		return VK_NULL_HANDLE;
+	}
+
+	if (!m_transient)
+	{
+		m_owners[descriptorSet] = allocInfo.descriptorPool;
+	}
+
+	m_stats.liveSets++;
+	m_stats.allocations++;
+	return descriptorSet;
+}
+
+void DescriptorAllocator::Free(VkDescriptorSet descriptorSet)
+{
+	if (m_transient)
+	{
+		spdlog::error("{}: sets of a transient descriptor allocator are only freed by Reset", m_name);
+		return;
+	}
+
+	auto it = m_owners.find(descriptorSet);
+	if (it == m_owners.end())
+	{
+		spdlog::error("{}: freeing a descriptor set it didn't allocate", m_name);
+		return;
+	}
+
+	VkDescriptorPool pool = it->second;
+	m_owners.erase(it);
+	VK_CHECK(m_disp->freeDescriptorSets(pool, 1, &descriptorSet));
+	m_stats.liveSets--;
+
+	// The pool has room again, put it behind the current one so it is used once that fills up
+	auto full = std::find(m_fullPools.begin(), m_fullPools.end(), pool);
+	if (full != m_fullPools.end())
+	{
+		m_fullPools.erase(full);
+		m_readyPools.insert(m_readyPools.begin(), pool);
+	}
+}
+
+void DescriptorAllocator::Reset()
+{
+	if (!m_transient)
+	{
+		spdlog::error("{}: only transient descriptor allocators can be reset", m_name);
+		return;
+	}
+
+	for (VkDescriptorPool pool: m_readyPools)
+	{
+		m_disp->resetDescriptorPool(pool, 0);
+	}
+	for (VkDescriptorPool pool: m_fullPools)
+	{
+		m_disp->resetDescriptorPool(pool, 0);
+		m_readyPools.push_back(pool);
+	}
+	m_fullPools.clear();
+
+	m_stats.liveSets = 0;
+	m_stats.allocations = 0;
+	m_stats.resets++;
+}
+
+void DescriptorAllocator::ImGuiDebug() const
+{
+	ImGui::Text("%s: %u / %u sets in %u pools, %u allocations, %u resets", m_name, m_stats.liveSets, m_stats.setCapacity, m_stats.pools, m_stats.allocations, m_stats.resets);
+}
+
+VkDescriptorPool DescriptorAllocator::GetPool()
+{
+	if (m_readyPools.empty())
+	{
+		uint32_t setCount = m_nextPoolSets;
+		m_readyPools.push_back(CreatePool(setCount));
+		spdlog::debug("{} ran out of descriptor sets, chained pool {} with {} sets", m_name, m_stats.pools, setCount);
+	}
+
+	return m_readyPools.back();
+}
+
+VkDescriptorPool DescriptorAllocator::CreatePool(uint32_t setCount)
+{
+	std::vector<VkDescriptorPoolSize> poolSizes;
+	poolSizes.reserve(m_ratios.size());
+	for (const PoolSizeRatio& ratio: m_ratios)
+	{
+		poolSizes.push_back({ ratio.type, std::max(1u, static_cast<uint32_t>(std::ceil(ratio.ratio * setCount))) });
+	}
+
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.flags = m_transient ? 0 : VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+	poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+	poolInfo.pPoolSizes = poolSizes.data();
+	poolInfo.maxSets = setCount;
+
+	VkDescriptorPool pool = VK_NULL_HANDLE;
+	VK_CHECK(m_disp->createDescriptorPool(&poolInfo, nullptr, &pool));
+
+	m_stats.pools++;
+	m_stats.setCapacity += setCount;
+
+	m_nextPoolSets = std::min(setCount * 2, MAX_SETS_PER_POOL);
+	return pool;
+}
@@ -1,23 +1,91 @@
 #include "DescriptorManager.h"
 
+#include <algorithm>
 #include <stdexcept>
 
+#include "imgui.h"
 #include "ModelManager.h"
 #include "VulkanContext.h"
 #include "VulkanUtil.h"
 
+// Descriptors per set, roughly what a material set holds (a uniform buffer and a handful of textures)
+const std::vector<DescriptorAllocator::PoolSizeRatio> DESCRIPTOR_POOL_RATIOS = {
+	{         VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1.0f },
+	{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1.0f },
+	{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 6.0f },
+	{         VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 0.5f },
+	{          VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 0.25f } // The moment blur of EVSM shadows
+};
+
+// Sets in the first pool of each allocator, later pools double from there
+constexpr uint32_t PERSISTENT_DESCRIPTOR_SETS = 128;
+constexpr uint32_t TRANSIENT_DESCRIPTOR_SETS = 64;
+
+// Entries built by DescriptorWriter::BuildTemplateEntries, the offsets follow from the rest
+static bool SameTemplateEntries(const std::vector<VkDescriptorUpdateTemplateEntry>& a, const std::vector<VkDescriptorUpdateTemplateEntry>& b)
+{
+	return std::equal(a.begin(),
+	        a.end(),
+	        b.begin(),
+	        b.end(),
+	        [](const VkDescriptorUpdateTemplateEntry& x, const VkDescriptorUpdateTemplateEntry& y)
+	        { return x.dstBinding == y.dstBinding && x.dstArrayElement == y.dstArrayElement && x.descriptorCount == y.descriptorCount && x.descriptorType == y.descriptorType && x.stride == y.stride; });
+}
+
 DescriptorManager::DescriptorManager(const vkb::DispatchTable& disp)
       : m_disp(disp)
 {
-	CreateDescriptorPool();
+	m_persistentAllocator.Init(m_disp, "Persistent descriptors", PERSISTENT_DESCRIPTOR_SETS, DESCRIPTOR_POOL_RATIOS, false);
 }
 
 void DescriptorManager::Cleanup()
 {
-	if (m_descriptorPool != VK_NULL_HANDLE)
+	for (auto& [key, updateTemplates]: m_updateTemplates)
+	{
+		for (UpdateTemplate& updateTemplate: updateTemplates)
+		{
+			m_disp.destroyDescriptorUpdateTemplate(updateTemplate.handle, nullptr);
+		}
+	}
+	m_updateTemplates.clear();
+	m_updateTemplateCount = 0;
+
+	m_persistentAllocator.Cleanup();
+	for (DescriptorAllocator& frameAllocator: m_frameAllocators)
+	{
+		frameAllocator.Cleanup();
+	}
+	m_frameAllocators.clear();
+}
+
+void DescriptorManager::BeginFrame(uint32_t frameIndex)
+{
+	m_frameIndex = frameIndex;
+	m_lastFrameUpdateStats = m_updateStats;
+	m_updateStats = {};
+
+	if (frameIndex < m_frameAllocators.size())
+	{
+		m_frameAllocators[frameIndex].Reset();
+		return;
+	}
+
+	while (m_frameAllocators.size() <= frameIndex)
+	{
+		m_frameAllocators.emplace_back().Init(m_disp, "Frame descriptors", TRANSIENT_DESCRIPTOR_SETS, DESCRIPTOR_POOL_RATIOS, true);
+	}
+}
+
+void DescriptorManager::ImGuiDebug()
+{
+	m_persistentAllocator.ImGuiDebug();
+	if (m_frameIndex < m_frameAllocators.size())
 	{
-		m_disp.destroyDescriptorPool(m_descriptorPool, nullptr);
+		m_frameAllocators[m_frameIndex].ImGuiDebug();
 	}
+
+	ImGui::Checkbox("Descriptor Update Templates", &m_useUpdateTemplates);
+	ImGui::Text("Descriptor updates: %u calls (%u templated) writing %u descriptors, %u templates", m_lastFrameUpdateStats.updates, m_lastFrameUpdateStats.templateUpdates, m_lastFrameUpdateStats.writes, m_updateTemplateCount);
 }
 
 std::pair<VkDescriptorSet, VkDescriptorSetLayout> DescriptorManager::GetSharedDescriptorSet()
@@ -32,16 +100,17 @@ void DescriptorManager::CreateSharedDescriptorSet(VkDescriptorSetLayout descript
 
 VkDescriptorSet DescriptorManager::AllocateDescriptorSet(VkDescriptorSetLayout descriptorLayout)
 {
-	VkDescriptorSetAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-	allocInfo.descriptorPool = m_descriptorPool;
-	allocInfo.descriptorSetCount = 1;
-	allocInfo.pSetLayouts = &descriptorLayout;
+	return m_persistentAllocator.Allocate(descriptorLayout);
+}
 
-	VkDescriptorSet descriptorSet;
-	VK_CHECK(m_disp.allocateDescriptorSets(&allocInfo, &descriptorSet));
+VkDescriptorSet DescriptorManager::AllocateTransientDescriptorSet(VkDescriptorSetLayout descriptorLayout)
+{
+	if (m_frameIndex >= m_frameAllocators.size())
+	{
+		throw std::runtime_error("Transient descriptor set allocated before BeginFrame");
+	}
 
-	return descriptorSet;
+	return m_frameAllocators[m_frameIndex].Allocate(descriptorLayout);
 }
 
 VkDescriptorSet DescriptorManager::GetDescriptorSet(uint32_t layoutIndex)
@@ -69,62 +138,66 @@ size_t DescriptorManager::AddDescriptorSetLayouts(const std::vector<VkDescriptor
 
 void DescriptorManager::FreeDescriptorSet(VkDescriptorSet descriptorSet)
 {
-	VK_CHECK(m_disp.freeDescriptorSets(m_descriptorPool, 1, &descriptorSet));
+	m_persistentAllocator.Free(descriptorSet);
 }
 
-void DescriptorManager::BindBuffer(VkDescriptorSet descriptorSet, uint32_t binding, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range)
+void DescriptorManager::UpdateDescriptorSet(VkDescriptorSet descriptorSet, DescriptorWriter& writer, VkDescriptorSetLayout layout)
 {
-	VkDescriptorBufferInfo bufferInfo{};
-	bufferInfo.buffer = buffer;
-	bufferInfo.offset = offset;
-	bufferInfo.range = range;
+	if (writer.Empty())
+	{
+		return;
+	}
 
-	VkWriteDescriptorSet descriptorWrite{};
-	descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-	descriptorWrite.dstSet = descriptorSet;
-	descriptorWrite.dstBinding = binding;
-	descriptorWrite.dstArrayElement = 0;
-	descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	descriptorWrite.descriptorCount = 1;
-	descriptorWrite.pBufferInfo = &bufferInfo;
+	m_updateStats.updates++;
+	m_updateStats.writes += writer.GetWriteCount();
+
+	if (m_useUpdateTemplates && layout != VK_NULL_HANDLE)
+	{
+		uint64_t key = writer.GetSignature() ^ (reinterpret_cast<uint64_t>(layout) * 0x9E3779B97F4A7C15ull);
+		writer.BuildTemplateEntries(m_templateEntries);
+
+		std::vector<UpdateTemplate>& updateTemplates = m_updateTemplates[key];
+		auto it = std::find_if(updateTemplates.begin(),
+		        updateTemplates.end(),
+		        [&](const UpdateTemplate& updateTemplate) { return updateTemplate.layout == layout && SameTemplateEntries(updateTemplate.entries, m_templateEntries); });
+		if (it == updateTemplates.end())
+		{
+			VkDescriptorUpdateTemplateCreateInfo templateInfo{};
+			templateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO;
+			templateInfo.descriptorUpdateEntryCount = static_cast<uint32_t>(m_templateEntries.size());
+			templateInfo.pDescriptorUpdateEntries = m_templateEntries.data();
+			templateInfo.templateType = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET;
+			templateInfo.descriptorSetLayout = layout;
+
+			VkDescriptorUpdateTemplate updateTemplate = VK_NULL_HANDLE;
+			VK_CHECK(m_disp.createDescriptorUpdateTemplate(&templateInfo, nullptr, &updateTemplate));
+			updateTemplates.push_back({ layout, m_templateEntries, updateTemplate });
+			it = updateTemplates.end() - 1;
+			m_updateTemplateCount++;
+		}
+
+		m_disp.updateDescriptorSetWithTemplate(descriptorSet, it->handle, writer.PackTemplateData());
+		m_updateStats.templateUpdates++;
+	}
+	else
+	{
+		const std::vector<VkWriteDescriptorSet>& writes = writer.BuildWrites(descriptorSet);
+		m_disp.updateDescriptorSets(static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+	}
 
-	m_disp.updateDescriptorSets(1, &descriptorWrite, 0, nullptr);
+	writer.Clear();
 }
 
-void DescriptorManager::BindImage(VkDescriptorSet descriptorSet, uint32_t binding, VkImageView imageView, VkSampler sampler)
+void DescriptorManager::BindBuffer(VkDescriptorSet descriptorSet, uint32_t binding, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range, VkDescriptorType type)
 {
-	VkDescriptorImageInfo imageInfo{};
-	imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-	imageInfo.imageView = imageView;
-	imageInfo.sampler = sampler;
-
-	VkWriteDescriptorSet descriptorWrite{};
-	descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-	descriptorWrite.dstSet = descriptorSet;
-	descriptorWrite.dstBinding = binding;
-	descriptorWrite.dstArrayElement = 0;
-	descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-	descriptorWrite.descriptorCount = 1;
-	descriptorWrite.pImageInfo = &imageInfo;
-
-	m_disp.updateDescriptorSets(1, &descriptorWrite, 0, nullptr);
+	m_bindWriter.WriteBuffer(binding, buffer, offset, range, type);
+	UpdateDescriptorSet(descriptorSet, m_bindWriter);
 }
 
-void DescriptorManager::CreateDescriptorPool()
+void DescriptorManager::BindImage(VkDescriptorSet descriptorSet, uint32_t binding, VkImageView imageView, VkSampler sampler)
 {
-	VkDescriptorPoolSize poolSizes[] = {
-		{         VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 100 },
-        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 100 }
-	};
-
-	VkDescriptorPoolCreateInfo poolInfo{};
-	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-	poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
-	poolInfo.poolSizeCount = 2;
-	poolInfo.pPoolSizes = poolSizes;
-	poolInfo.maxSets = 100;
-
-	VK_CHECK(m_disp.createDescriptorPool(&poolInfo, nullptr, &m_descriptorPool));
+	m_bindWriter.WriteImage(binding, imageView, sampler);
+	UpdateDescriptorSet(descriptorSet, m_bindWriter);
 }
 
 std::shared_ptr<PBRMaterialResource> DescriptorManager::CreatePBRMaterial(VulkanContext& vulkanContext, ModelManager& modelManager, std::string name, std::string albedo, std::string normal, std::string metallic, std::string roughness, std::string ao)
@@ -137,14 +210,13 @@ std::shared_ptr<PBRMaterialResource> DescriptorManager::CreatePBRMaterial(Vulkan
 
 	auto mat = std::make_shared<PBRMaterialResource>();
 
-	SlimeUtil::CreateBuffer(name.c_str(), allocator, sizeof(PBRMaterialResource::Config), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, mat->configBuffer, mat->configAllocation);
-
 	mat->albedoTex = modelManager.LoadTexture(disp, graphicsQueue, commandPool, allocator, this, albedo);
 	mat->normalTex = modelManager.LoadTexture(disp, graphicsQueue, commandPool, allocator, this, normal);
 	mat->metallicTex = modelManager.LoadTexture(disp, graphicsQueue, commandPool, allocator, this, metallic);
 	mat->roughnessTex = modelManager.LoadTexture(disp, graphicsQueue, commandPool, allocator, this, roughness);
 	mat->aoTex = modelManager.LoadTexture(disp, graphicsQueue, commandPool, allocator, this, ao);
 
+	mat->id = m_nextMaterialId++;
 	mat->disposed = false;
 
 	return mat;
@@ -152,16 +224,9 @@ std::shared_ptr<PBRMaterialResource> DescriptorManager::CreatePBRMaterial(Vulkan
 
 std::shared_ptr<BasicMaterialResource> DescriptorManager::CreateBasicMaterial(VulkanContext& vulkanContext, ModelManager& modelManager, std::string name)
 {
-	VkDevice device = vulkanContext.GetDevice();
-	VkCommandPool commandPool = vulkanContext.GetCommandPool();
-	VmaAllocator allocator = vulkanContext.GetAllocator();
-	VkQueue graphicsQueue = vulkanContext.GetGraphicsQueue();
-	vkb::DispatchTable disp = vulkanContext.GetDispatchTable();
-
 	auto mat = std::make_shared<BasicMaterialResource>();
 
-	SlimeUtil::CreateBuffer(name.c_str(), allocator, sizeof(BasicMaterialResource::Config), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, mat->configBuffer, mat->configAllocation);
-
+	mat->id = m_nextMaterialId++;
 	mat->disposed = false;
 
 	return mat;
@@ -169,17 +234,16 @@ std::shared_ptr<BasicMaterialResource> DescriptorManager::CreateBasicMaterial(Vu
 
 std::shared_ptr<PBRMaterialResource> DescriptorManager::CopyPBRMaterial(VulkanContext& vulkanContext, ModelManager& modelManager, std::string name, std::shared_ptr<PBRMaterialResource> inMaterial)
 {
-	// We can re use alot from the passed in material, but we need to create new buffers for the config and textures to avoid conflicts
+	// We can re use alot from the passed in material, but we need to create new textures to avoid conflicts
 	auto mat = std::make_shared<PBRMaterialResource>();
 
-	SlimeUtil::CreateBuffer(name.c_str(), vulkanContext.GetAllocator(), sizeof(PBRMaterialResource::Config), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, mat->configBuffer, mat->configAllocation);
-
 	mat->albedoTex = modelManager.CopyTexture(name + "_albedo", inMaterial->albedoTex);
 	mat->normalTex = modelManager.CopyTexture(name + "_normal", inMaterial->normalTex);
 	mat->metallicTex = modelManager.CopyTexture(name + "_metallic", inMaterial->metallicTex);
 	mat->roughnessTex = modelManager.CopyTexture(name + "_roughness", inMaterial->roughnessTex);
 	mat->aoTex = modelManager.CopyTexture(name + "_ao", inMaterial->aoTex);
 
+	mat->id = m_nextMaterialId++;
 	mat->disposed = false;
 
 	return mat;
@@ -189,8 +253,7 @@ std::shared_ptr<BasicMaterialResource> DescriptorManager::CopyBasicMaterial(Vulk
 {
 	auto mat = std::make_shared<BasicMaterialResource>();
 
-	SlimeUtil::CreateBuffer(name.c_str(), vulkanContext.GetAllocator(), sizeof(BasicMaterialResource::Config), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, mat->configBuffer, mat->configAllocation);
-
+	mat->id = m_nextMaterialId++;
 	mat->disposed = false;
 
 	return mat;
@@ -0,0 +1,114 @@
+#include "DescriptorWriter.h"
+
+#include <cstring>
+
+void DescriptorWriter::WriteBuffer(uint32_t binding, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range, VkDescriptorType type)
+{
+	m_entries.push_back({ binding, type, false, static_cast<uint32_t>(m_bufferInfos.size()) });
+	m_bufferInfos.push_back({ buffer, offset, range });
+}
+
+void DescriptorWriter::WriteImage(uint32_t binding, VkImageView imageView, VkSampler sampler, VkImageLayout layout, VkDescriptorType type)
+{
+	m_entries.push_back({ binding, type, true, static_cast<uint32_t>(m_imageInfos.size()) });
+	m_imageInfos.push_back({ sampler, imageView, layout });
+}
+
+void DescriptorWriter::Clear()
+{
+	m_entries.clear();
+	m_bufferInfos.clear();
+	m_imageInfos.clear();
+	m_writes.clear();
+}
+
+const std::vector<VkWriteDescriptorSet>& DescriptorWriter::BuildWrites(VkDescriptorSet descriptorSet)
+{
+	m_writes.clear();
+	m_writes.reserve(m_entries.size());
+
+	// The infos are done growing, pointers into them stay valid until the next write or Clear
+	for (const Entry& entry: m_entries)
+	{
+		VkWriteDescriptorSet write{};
+		write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		write.dstSet = descriptorSet;
+		write.dstBinding = entry.binding;
+		write.dstArrayElement = 0;
+		write.descriptorType = entry.type;
+		write.descriptorCount = 1;
+		if (entry.image)
+		{
+			write.pImageInfo = &m_imageInfos[entry.infoIndex];
+		}
+		else
+		{
+			write.pBufferInfo = &m_bufferInfos[entry.infoIndex];
+		}
+		m_writes.push_back(write);
+	}
+
+	return m_writes;
+}
+
+void DescriptorWriter::BuildTemplateEntries(std::vector<VkDescriptorUpdateTemplateEntry>& entries) const
+{
+	entries.clear();
+	entries.reserve(m_entries.size());
+
+	size_t offset = 0;
+	for (const Entry& entry: m_entries)
+	{
+		size_t size = entry.image ? sizeof(VkDescriptorImageInfo) : sizeof(VkDescriptorBufferInfo);
+
+		VkDescriptorUpdateTemplateEntry templateEntry{};
+		templateEntry.dstBinding = entry.binding;
+		templateEntry.dstArrayElement = 0;
+		templateEntry.descriptorCount = 1;
+		templateEntry.descriptorType = entry.type;
+		templateEntry.offset = offset;
+		templateEntry.stride = size;
+		entries.push_back(templateEntry);
+
+		offset += size;
+	}
+}
+
+const void* DescriptorWriter::PackTemplateData()
+{
+	m_templateData.clear();
+
+	// Same layout as BuildTemplateEntries, every info right after the last in write order
+	for (const Entry& entry: m_entries)
+	{
+		const void* info = entry.image ? static_cast<const void*>(&m_imageInfos[entry.infoIndex]) : static_cast<const void*>(&m_bufferInfos[entry.infoIndex]);
+		size_t size = entry.image ? sizeof(VkDescriptorImageInfo) : sizeof(VkDescriptorBufferInfo);
+
+		size_t offset = m_templateData.size();
+		m_templateData.resize(offset + size);
+		std::memcpy(m_templateData.data() + offset, info, size);
+	}
+
+	return m_templateData.data();
+}
+
+uint64_t DescriptorWriter::GetSignature() const
+{
+	// FNV-1a over binding, type and kind, the handles don't matter to a template
+	uint64_t hash = 14695981039346656037ull;
+	auto mix = [&hash](uint64_t value)
+	{
+		hash ^= value;
+		hash *= 1099511628211ull;
+	};
+
+	for (const Entry& entry: m_entries)
+	{
+		mix(entry.binding);
+		mix(static_cast<uint64_t>(entry.type));
+		mix(entry.image ? 1 : 0);
+	}
+	mix(m_entries.size());
+
+	return hash;
+}
@@ -55,11 +55,13 @@ std::shared_ptr<Entity> EntityManager::AddEntity(Entity& entity)
 // Remove an entity from the manager
 void EntityManager::RemoveEntity(const Entity& entity)
 {
-	auto it = std::remove_if(m_entities.begin(), m_entities.end(), [&entity](const auto& e) { return e->GetId() == entity.GetId(); });
-	if (it != m_entities.end())
+	m_spatialIndex.Remove(entity.GetId());
+
+	// Look the index up before erasing so the mask that goes is the one that belonged to this entity
+	size_t entityIndex = GetEntityIndex(entity);
+	if (entityIndex < m_entities.size())
 	{
-		m_entities.erase(it, m_entities.end());
-		size_t entityIndex = GetEntityIndex(entity);
+		m_entities.erase(m_entities.begin() + entityIndex);
 		if (entityIndex < m_entityMasks.size())
 		{
 			m_entityMasks.erase(m_entityMasks.begin() + entityIndex);
@@ -112,6 +114,17 @@ void EntityManager::OnEntityComponentChanged(const Entity& entity)
 	UpdateEntityMask(entity);
 }
 
+// Refit the spatial index for any Transform + Model entities that moved
+void EntityManager::UpdateSpatialIndex()
+{
+	m_spatialIndex.Update(*this);
+}
+
+const SpatialIndex& EntityManager::GetSpatialIndex() const
+{
+	return m_spatialIndex;
+}
+
 // Shows a window of all entities and their components
 void EntityManager::ImGuiDebug()
 {
@@ -123,6 +136,7 @@ void EntityManager::ImGuiDebug()
 	ImGui::InputText("Search Entities", searchBuffer, IM_ARRAYSIZE(searchBuffer));
 	std::string searchStr = searchBuffer;
 	ImGui::Text("Total Entities: %zu", m_entities.size());
+	m_spatialIndex.ImGuiDebug();
 	ImGui::Separator();
 
 	// Calculate available height for split view
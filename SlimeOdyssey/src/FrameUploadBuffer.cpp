@@ -0,0 +1,107 @@
+#include "FrameUploadBuffer.h"
+
+#include <algorithm>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+
+#include "imgui.h"
+#include "VulkanDebugUtils.h"
+#include "VulkanUtil.h"
+
+// Smallest per frame capacity, grows by doubling after that
+constexpr VkDeviceSize MIN_UPLOAD_CAPACITY = 64 * 1024;
+
+void FrameUploadBuffer::Cleanup(VmaAllocator allocator)
+{
+	if (m_buffer != VK_NULL_HANDLE)
+	{
+		vmaDestroyBuffer(allocator, m_buffer, m_allocation);
+	}
+
+	m_buffer = VK_NULL_HANDLE;
+	m_allocation = VK_NULL_HANDLE;
+	m_mappedData = nullptr;
+	m_capacity = 0;
+}
+
+bool FrameUploadBuffer::BeginFrame(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, uint32_t allocationCount, VkDeviceSize maxAllocationSize, uint32_t frameIndex, uint32_t frameCount)
+{
+	if (m_alignment == 0)
+	{
+		const VkPhysicalDeviceProperties* properties;
+		vmaGetPhysicalDeviceProperties(allocator, &properties);
+		m_alignment = std::max<VkDeviceSize>(properties->limits.minUniformBufferOffsetAlignment, 16);
+	}
+
+	bool recreated = EnsureCapacity(disp, allocator, debugUtils, allocationCount * AlignedSize(maxAllocationSize), frameCount);
+
+	m_frameStart = frameIndex * m_capacity;
+	m_offset = 0;
+	m_stats = { 0, m_capacity, 0 };
+
+	return recreated;
+}
+
+uint32_t FrameUploadBuffer::Push(const void* data, VkDeviceSize size)
+{
+	VkDeviceSize alignedSize = AlignedSize(size);
+	if (m_offset + alignedSize > m_capacity)
+	{
+		// More allocations than BeginFrame was told about, every offset in the region is taken by this frame already
+		spdlog::error("{} is out of space ({} of {} bytes used)", m_name, m_offset, m_capacity);
+		throw std::runtime_error("Frame upload buffer pushed past the size given to BeginFrame");
+	}
+
+	VkDeviceSize offset = m_frameStart + m_offset;
+	SlimeUtil::WriteMapped(m_mappedData, offset, data, size);
+	m_offset += alignedSize;
+
+	m_stats.used = m_offset;
+	m_stats.allocations++;
+
+	return static_cast<uint32_t>(offset);
+}
+
+void FrameUploadBuffer::Flush(VmaAllocator allocator) const
+{
+	if (m_offset > 0)
+	{
+		SlimeUtil::FlushMapped(allocator, m_allocation, m_frameStart, m_offset);
+	}
+}
+
+void FrameUploadBuffer::ImGuiDebug() const
+{
+	ImGui::Text("%s: %llu / %llu bytes in %u allocations x %u frames", m_name, static_cast<unsigned long long>(m_stats.used), static_cast<unsigned long long>(m_stats.capacity), m_stats.allocations, m_frameCount);
+}
+
+bool FrameUploadBuffer::EnsureCapacity(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, VkDeviceSize size, uint32_t frameCount)
+{
+	if (m_buffer != VK_NULL_HANDLE && size <= m_capacity && frameCount == m_frameCount)
+	{
+		return false;
+	}
+
+	VkDeviceSize capacity = std::max(m_capacity, MIN_UPLOAD_CAPACITY);
+	while (capacity < size)
+	{
+		capacity *= 2;
+	}
+
+	// The other frames in flight may still be reading the old buffer
+	if (m_buffer != VK_NULL_HANDLE)
+	{
+		disp.deviceWaitIdle();
+		Cleanup(allocator);
+	}
+
+	// Regions start at a multiple of the capacity, keep that aligned too
+	m_capacity = AlignedSize(capacity);
+	m_frameCount = frameCount;
+
+	m_mappedData = SlimeUtil::CreateMappedBuffer(m_name, allocator, m_capacity * m_frameCount, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, m_buffer, m_allocation);
+	debugUtils.SetObjectName(m_buffer, m_name);
+
+	spdlog::debug("{} resized to {} bytes per frame", m_name, m_capacity);
+	return true;
+}
@@ -0,0 +1,123 @@
+#include "IndirectDrawBuffer.h"
+
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+#include "Model.h"
+#include "VulkanDebugUtils.h"
+#include "VulkanUtil.h"
+
+// Smallest per frame capacity, grows by doubling after that
+constexpr uint32_t MIN_INDIRECT_COMMAND_CAPACITY = 64;
+
+void IndirectDrawBuffer::Cleanup(VmaAllocator allocator)
+{
+	if (m_commandBuffer != VK_NULL_HANDLE)
+	{
+		vmaDestroyBuffer(allocator, m_commandBuffer, m_commandAllocation);
+	}
+
+	if (m_countBuffer != VK_NULL_HANDLE)
+	{
+		vmaDestroyBuffer(allocator, m_countBuffer, m_countAllocation);
+	}
+
+	m_commandBuffer = VK_NULL_HANDLE;
+	m_commandAllocation = VK_NULL_HANDLE;
+	m_commands = nullptr;
+	m_countBuffer = VK_NULL_HANDLE;
+	m_countAllocation = VK_NULL_HANDLE;
+	m_counts = nullptr;
+	m_capacity = 0;
+}
+
+bool IndirectDrawBuffer::Build(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, const std::vector<InstanceBatch>& batches, bool splitByMaterial, uint32_t frameIndex, uint32_t frameCount)
+{
+	m_runs.clear();
+	m_commandCount = static_cast<uint32_t>(batches.size());
+
+	bool recreated = EnsureCapacity(disp, allocator, debugUtils, m_commandCount, frameCount);
+
+	uint32_t frameBase = frameIndex * m_capacity;
+	for (uint32_t i = 0; i < m_commandCount; i++)
+	{
+		const InstanceBatch& batch = batches[i];
+		uint32_t commandIndex = frameBase + i;
+
+		// Stored whole, the mapped memory may be write combined
+		m_commands[commandIndex] = { batch.model->indexCount, batch.instanceCount, batch.model->firstIndex, batch.model->vertexOffset, batch.firstInstance };
+
+		// Batches come sorted by pipeline, material then mesh buffer, so a run breaks whenever one changes
+		IndirectDrawRun* run = m_runs.empty() ? nullptr : &m_runs.back();
+		bool samePipeline = run && run->firstBatch->pipelineId == batch.pipelineId;
+		bool sameMaterial = run && (!splitByMaterial || run->firstBatch->material == batch.material);
+		bool sameMeshBuffer = run && run->firstBatch->model->meshBuffer == batch.model->meshBuffer;
+		if (!samePipeline || !sameMaterial || !sameMeshBuffer)
+		{
+			m_runs.push_back({ &batch, commandIndex, 0 });
+			run = &m_runs.back();
+		}
+
+		run->commandCount++;
+	}
+
+	// The count of each run sits at the index of its first command
+	for (const IndirectDrawRun& run: m_runs)
+	{
+		m_counts[run.firstCommand] = run.commandCount;
+	}
+
+	if (m_commandCount > 0)
+	{
+		SlimeUtil::FlushMapped(allocator, m_commandAllocation, frameBase * sizeof(VkDrawIndexedIndirectCommand), m_commandCount * sizeof(VkDrawIndexedIndirectCommand));
+		SlimeUtil::FlushMapped(allocator, m_countAllocation, frameBase * sizeof(uint32_t), m_commandCount * sizeof(uint32_t));
+	}
+
+	return recreated;
+}
+
+void IndirectDrawBuffer::Draw(vkb::DispatchTable& disp, VkCommandBuffer cmd, const IndirectDrawRun& run) const
+{
+	disp.cmdDrawIndexedIndirectCount(cmd,
+	        m_commandBuffer,
+	        run.firstCommand * sizeof(VkDrawIndexedIndirectCommand),
+	        m_countBuffer,
+	        run.firstCommand * sizeof(uint32_t),
+	        run.commandCount,
+	        sizeof(VkDrawIndexedIndirectCommand));
+}
+
+bool IndirectDrawBuffer::EnsureCapacity(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, uint32_t commandCount, uint32_t frameCount)
+{
+	if (m_commandBuffer != VK_NULL_HANDLE && commandCount <= m_capacity && frameCount == m_frameCount)
+	{
+		return false;
+	}
+
+	uint32_t capacity = std::max(m_capacity, MIN_INDIRECT_COMMAND_CAPACITY);
+	while (capacity < commandCount)
+	{
+		capacity *= 2;
+	}
+
+	// The other frames in flight may still be reading the old buffers
+	if (m_commandBuffer != VK_NULL_HANDLE)
+	{
+		disp.deviceWaitIdle();
+		Cleanup(allocator);
+	}
+
+	m_capacity = capacity;
+	m_frameCount = frameCount;
+
+	VkDeviceSize commandSize = static_cast<VkDeviceSize>(m_capacity) * m_frameCount * sizeof(VkDrawIndexedIndirectCommand);
+	VkDeviceSize countSize = static_cast<VkDeviceSize>(m_capacity) * m_frameCount * sizeof(uint32_t);
+
+	m_commands = static_cast<VkDrawIndexedIndirectCommand*>(SlimeUtil::CreateMappedBuffer(m_name, allocator, commandSize, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, m_commandBuffer, m_commandAllocation));
+	m_counts = static_cast<uint32_t*>(SlimeUtil::CreateMappedBuffer(m_name, allocator, countSize, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, m_countBuffer, m_countAllocation));
+	debugUtils.SetObjectName(m_commandBuffer, std::string(m_name) + " Commands");
+	debugUtils.SetObjectName(m_countBuffer, std::string(m_name) + " Counts");
+
+	spdlog::debug("{} resized to {} commands per frame", m_name, m_capacity);
+	return true;
+}
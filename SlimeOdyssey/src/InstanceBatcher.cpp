@@ -0,0 +1,238 @@
+#include "InstanceBatcher.h"
+
+#include <algorithm>
+#include <cstring>
+#include <spdlog/spdlog.h>
+
+#include "Entity.h"
+#include "EntityManager.h"
+#include "imgui.h"
+#include "MeshBuffer.h"
+#include "Model.h"
+#include "RadixSort.h"
+#include "VulkanDebugUtils.h"
+#include "VulkanUtil.h"
+
+// Smallest per frame capacity, grows by doubling after that
+constexpr uint32_t MIN_INSTANCE_CAPACITY = 256;
+
+void InstanceBatcher::Cleanup(VmaAllocator allocator)
+{
+	if (m_buffer != VK_NULL_HANDLE)
+	{
+		vmaDestroyBuffer(allocator, m_buffer, m_allocation);
+	}
+
+	m_buffer = VK_NULL_HANDLE;
+	m_allocation = VK_NULL_HANDLE;
+	m_mappedData = nullptr;
+	m_capacity = 0;
+}
+
+bool InstanceBatcher::Build(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, EntityManager& entityManager, const Frustum& frustum, const glm::vec3& viewPosition, uint32_t frameIndex, uint32_t frameCount)
+{
+	m_queue.clear();
+	m_batches.clear();
+	size_t shadowViewCount = std::max<size_t>(m_shadowViews.size(), 1);
+	m_shadowBatches.resize(shadowViewCount);
+	m_staticShadowBatches.resize(shadowViewCount);
+	for (size_t view = 0; view < shadowViewCount; view++)
+	{
+		m_shadowBatches[view].clear();
+		m_staticShadowBatches[view].clear();
+	}
+
+	// Camera pass, only what the frustum can see
+	entityManager.GetSpatialIndex().QueryFrustum(frustum, m_visibleEntities);
+
+	for (Entity* entity: m_visibleEntities)
+	{
+		ModelResource* model = entity->GetComponent<Model>().modelResource;
+		if (!model || !model->meshBuffer)
+		{
+			continue;
+		}
+
+		const MaterialResource* material = nullptr;
+		if (PBRMaterial* pbrMaterial = entity->GetComponentPtr<PBRMaterial>())
+		{
+			material = pbrMaterial->materialResource;
+		}
+		else if (BasicMaterial* basicMaterial = entity->GetComponentPtr<BasicMaterial>())
+		{
+			material = basicMaterial->materialResource;
+		}
+		else
+		{
+			continue;
+		}
+
+		glm::vec3 toEntity = entity->GetComponent<Transform>().position - viewPosition;
+		uint32_t materialId = material && model->pipelineId != m_bindlessPipelineId ? material->id : 0;
+		uint64_t key = MakeSortKey(Pass::Camera, model->pipelineId, materialId, *model, glm::dot(toEntity, toEntity));
+		m_queue.push_back({ key, model, material, entity });
+	}
+	size_t cameraCount = m_queue.size();
+	size_t visibleCount = m_visibleEntities.size();
+
+	// Shadow pass, every caster uses the same pipeline and no material so only the view and mesh matter
+	if (m_shadowViews.empty())
+	{
+		entityManager.ForEachEntityWith<Model, Transform>(
+		        [this](Entity& entity)
+		        {
+			        ModelResource* model = entity.GetComponent<Model>().modelResource;
+			        if (model && model->meshBuffer)
+			        {
+				        m_queue.push_back({ MakeSortKey(Pass::Shadow, 0, 0, *model, 0.0f), model, nullptr, &entity });
+			        }
+		        });
+	}
+
+	// A caster is drawn into every view it overlaps, cascades mostly overlap at their borders
+	const SpatialIndex& spatialIndex = entityManager.GetSpatialIndex();
+	size_t cachedCasters = 0;
+	for (uint32_t view = 0; view < m_shadowViews.size(); view++)
+	{
+		spatialIndex.QueryFrustum(m_shadowViews[view].frustum, m_visibleEntities);
+		for (Entity* entity: m_visibleEntities)
+		{
+			ModelResource* model = entity->GetComponent<Model>().modelResource;
+			if (!model || !model->meshBuffer)
+			{
+				continue;
+			}
+
+			bool isStatic = spatialIndex.IsStatic(entity->GetId());
+			if (isStatic && m_shadowViews[view].staticCached)
+			{
+				cachedCasters++;
+				continue;
+			}
+			m_queue.push_back({ MakeSortKey(isStatic ? Pass::StaticShadow : Pass::Shadow, view, 0, *model, 0.0f), model, nullptr, entity });
+		}
+	}
+
+	uint32_t instanceCount = static_cast<uint32_t>(m_queue.size());
+	bool recreated = EnsureCapacity(disp, allocator, debugUtils, instanceCount, frameCount);
+
+	RadixSort(m_queue, m_sortScratch);
+	FormBatches(frameIndex * m_capacity);
+
+	if (instanceCount > 0)
+	{
+		VkDeviceSize frameOffset = static_cast<VkDeviceSize>(frameIndex) * m_capacity * sizeof(InstanceData);
+		SlimeUtil::FlushMapped(allocator, m_allocation, frameOffset, static_cast<VkDeviceSize>(instanceCount) * sizeof(InstanceData));
+	}
+
+	m_stats.visibleEntities = visibleCount;
+	m_stats.instances = cameraCount;
+	m_stats.batches = m_batches.size();
+	m_stats.shadowInstances = m_queue.size() - cameraCount;
+	m_stats.shadowBatches = 0;
+	m_stats.staticShadowInstances = 0;
+	for (size_t view = 0; view < shadowViewCount; view++)
+	{
+		m_stats.shadowBatches += m_shadowBatches[view].size() + m_staticShadowBatches[view].size();
+		for (const InstanceBatch& batch: m_staticShadowBatches[view])
+		{
+			m_stats.staticShadowInstances += batch.instanceCount;
+		}
+	}
+	m_stats.cachedShadowCasters = cachedCasters;
+	m_stats.shadowViews = m_shadowBatches.size();
+	m_stats.capacity = m_capacity;
+
+	return recreated;
+}
+
+void InstanceBatcher::SetShadowViews(const std::vector<ShadowView>& views)
+{
+	m_shadowViews = views;
+}
+
+uint64_t InstanceBatcher::MakeSortKey(Pass pass, uint32_t pipelineId, uint32_t materialId, const ModelResource& model, float viewDistanceSquared)
+{
+	// Meshes of the dynamic buffer get the top mesh bit so each MeshBuffer is bound once
+	uint64_t meshKey = (model.meshId & 0x7FFF) | (model.meshBuffer && model.meshBuffer->IsDynamic() ? 0x8000 : 0);
+
+	// Positive floats sort like their bit patterns, the top 18 bits are plenty to order instances
+	uint32_t depthBits;
+	std::memcpy(&depthBits, &viewDistanceSquared, sizeof(depthBits));
+	uint64_t depthKey = depthBits >> 14;
+
+	return (static_cast<uint64_t>(pass) & 0xF) << 60 | (static_cast<uint64_t>(pipelineId) & 0x3FF) << 50 | (static_cast<uint64_t>(materialId) & 0xFFFF) << 34 | meshKey << 18 | depthKey;
+}
+
+void InstanceBatcher::FormBatches(uint32_t instanceIndex)
+{
+	// Keys only group draws, batches still break on the actual model and material in case ids wrapped
+	for (const DrawPacket& packet: m_queue)
+	{
+		Transform& transform = packet.entity->GetComponent<Transform>();
+
+		// Built on the stack and stored in one go, the mapped memory may be write combined and must not be read
+		InstanceData instance = {};
+		instance.model = transform.GetModelMatrix();
+		instance.normalMatrix = glm::mat4(glm::transpose(glm::inverse(glm::mat3(instance.model))));
+		instance.materialIndex = packet.material ? packet.material->bindlessIndex : 0;
+		m_mappedData[instanceIndex] = instance;
+
+		// Shadow packets carry their view where the pipeline id would be
+		Pass pass = static_cast<Pass>(packet.key >> 60);
+		bool shadow = pass != Pass::Camera;
+		uint32_t view = static_cast<uint32_t>((packet.key >> 50) & 0x3FF);
+		std::vector<InstanceBatch>& batches = pass == Pass::StaticShadow ? m_staticShadowBatches[view] : shadow ? m_shadowBatches[view] : m_batches;
+		uint32_t pipelineId = shadow ? INVALID_PIPELINE_ID : packet.model->pipelineId;
+		const MaterialResource* material = pipelineId == m_bindlessPipelineId ? nullptr : packet.material;
+
+		InstanceBatch* batch = batches.empty() ? nullptr : &batches.back();
+		if (!batch || batch->pipelineId != pipelineId || batch->model != packet.model || batch->material != material)
+		{
+			batches.push_back({ pipelineId, packet.model, material, packet.entity, instanceIndex, 0 });
+			batch = &batches.back();
+		}
+
+		batch->instanceCount++;
+		instanceIndex++;
+	}
+}
+
+bool InstanceBatcher::EnsureCapacity(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, uint32_t instanceCount, uint32_t frameCount)
+{
+	if (m_buffer != VK_NULL_HANDLE && instanceCount <= m_capacity && frameCount == m_frameCount)
+	{
+		return false;
+	}
+
+	uint32_t capacity = std::max(m_capacity, MIN_INSTANCE_CAPACITY);
+	while (capacity < instanceCount)
+	{
+		capacity *= 2;
+	}
+
+	// The other frames in flight may still be reading the old buffer
+	if (m_buffer != VK_NULL_HANDLE)
+	{
+		disp.deviceWaitIdle();
+		Cleanup(allocator);
+	}
+
+	m_capacity = capacity;
+	m_frameCount = frameCount;
+
+	VkDeviceSize size = static_cast<VkDeviceSize>(m_capacity) * m_frameCount * sizeof(InstanceData);
+	m_mappedData = static_cast<InstanceData*>(SlimeUtil::CreateMappedBuffer("Instance Buffer", allocator, size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, m_buffer, m_allocation));
+	debugUtils.SetObjectName(m_buffer, "Instance Buffer");
+
+	spdlog::debug("Instance buffer resized to {} instances per frame", m_capacity);
+	return true;
+}
+
+void InstanceBatcher::ImGuiDebug() const
+{
+	ImGui::Text("Instancing: %zu visible, %zu instances in %zu batches", m_stats.visibleEntities, m_stats.instances, m_stats.batches);
+	ImGui::Text("Shadow casters: %zu instances in %zu batches over %zu views", m_stats.shadowInstances, m_stats.shadowBatches, m_stats.shadowViews);
+	ImGui::Text("Static shadow casters: %zu redrawn, %zu cached", m_stats.staticShadowInstances, m_stats.cachedShadowCasters);
+	ImGui::Text("Instance buffer: %u per frame x %u frames", m_stats.capacity, m_frameCount);
+}
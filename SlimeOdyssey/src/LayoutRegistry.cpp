@@ -0,0 +1,157 @@
+#include "LayoutRegistry.h"
+
+#include <algorithm>
+#include <numeric>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+
+#include "VulkanUtil.h"
+
+size_t LayoutRegistry::DescriptionHash::operator()(const std::vector<uint32_t>& description) const
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (uint32_t word: description)
+	{
+		hash ^= word;
+		hash *= 1099511628211ull;
+	}
+	return static_cast<size_t>(hash);
+}
+
+std::vector<uint32_t> LayoutRegistry::DescribeSetLayout(const std::vector<VkDescriptorSetLayoutBinding>& bindings, const std::vector<VkDescriptorBindingFlags>& bindingFlags)
+{
+	// Reflection doesn't use immutable samplers, so the binding's plain fields describe it completely
+	std::vector<uint32_t> description;
+	description.reserve(bindings.size() * 5);
+	for (size_t i = 0; i < bindings.size(); i++)
+	{
+		const VkDescriptorSetLayoutBinding& binding = bindings[i];
+		description.insert(description.end(), { binding.binding, static_cast<uint32_t>(binding.descriptorType), binding.descriptorCount, binding.stageFlags, i < bindingFlags.size() ? bindingFlags[i] : 0 });
+	}
+	return description;
+}
+
+std::vector<uint32_t> LayoutRegistry::DescribePipelineLayout(const std::vector<VkDescriptorSetLayout>& setLayouts, const std::vector<VkPushConstantRange>& pushConstantRanges)
+{
+	// Set layouts come from this registry, so their handles stand for their contents
+	std::vector<uint32_t> description;
+	description.reserve(2 + setLayouts.size() * 2 + pushConstantRanges.size() * 3);
+
+	description.push_back(static_cast<uint32_t>(setLayouts.size()));
+	for (VkDescriptorSetLayout setLayout: setLayouts)
+	{
+		uint64_t handle = reinterpret_cast<uint64_t>(setLayout);
+		description.push_back(static_cast<uint32_t>(handle));
+		description.push_back(static_cast<uint32_t>(handle >> 32));
+	}
+
+	description.push_back(static_cast<uint32_t>(pushConstantRanges.size()));
+	for (const VkPushConstantRange& range: pushConstantRanges)
+	{
+		description.insert(description.end(), { range.stageFlags, range.offset, range.size });
+	}
+	return description;
+}
+
+VkDescriptorSetLayout LayoutRegistry::GetDescriptorSetLayout(const vkb::DispatchTable& disp, const std::vector<VkDescriptorSetLayoutBinding>& bindings, const std::vector<VkDescriptorBindingFlags>& bindingFlags)
+{
+	std::vector<size_t> order(bindings.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&bindings](size_t a, size_t b) { return bindings[a].binding < bindings[b].binding; });
+
+	std::vector<VkDescriptorSetLayoutBinding> sortedBindings;
+	std::vector<VkDescriptorBindingFlags> sortedFlags;
+	for (size_t i: order)
+	{
+		sortedBindings.push_back(bindings[i]);
+		sortedFlags.push_back(i < bindingFlags.size() ? bindingFlags[i] : 0);
+	}
+
+	std::vector<uint32_t> description = DescribeSetLayout(sortedBindings, sortedFlags);
+	auto it = m_setLayouts.find(description);
+	if (it != m_setLayouts.end())
+	{
+		m_stats.setLayoutHits++;
+		return it->second;
+	}
+
+	VkDescriptorSetLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = static_cast<uint32_t>(sortedBindings.size());
+	layoutInfo.pBindings = sortedBindings.data();
+
+	// Sets with a bindless array have to come from an update after bind pool
+	VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsInfo{};
+	bindingFlagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+	bindingFlagsInfo.bindingCount = static_cast<uint32_t>(sortedFlags.size());
+	bindingFlagsInfo.pBindingFlags = sortedFlags.data();
+
+	if (std::any_of(sortedFlags.begin(), sortedFlags.end(), [](VkDescriptorBindingFlags flags) { return flags & VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT; }))
+	{
+		layoutInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+		layoutInfo.pNext = &bindingFlagsInfo;
+	}
+
+	VkDescriptorSetLayout setLayout;
+	if (disp.createDescriptorSetLayout(&layoutInfo, nullptr, &setLayout) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to create descriptor set layout!");
+	}
+
+	m_setLayouts.emplace(std::move(description), setLayout);
+	m_stats.setLayouts++;
+
+	spdlog::debug("Created descriptor set layout");
+	for (const auto& binding: sortedBindings)
+	{
+		spdlog::debug("  Binding {}: type {}, count {}, stage flags {}", binding.binding, static_cast<int>(binding.descriptorType), binding.descriptorCount, static_cast<int>(binding.stageFlags));
+	}
+
+	return setLayout;
+}
+
+VkPipelineLayout LayoutRegistry::GetPipelineLayout(const vkb::DispatchTable& disp, const std::vector<VkDescriptorSetLayout>& setLayouts, const std::vector<VkPushConstantRange>& pushConstantRanges)
+{
+	std::vector<uint32_t> description = DescribePipelineLayout(setLayouts, pushConstantRanges);
+	auto it = m_pipelineLayouts.find(description);
+	if (it != m_pipelineLayouts.end())
+	{
+		m_stats.pipelineLayoutHits++;
+		return it->second;
+	}
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = static_cast<uint32_t>(setLayouts.size());
+	pipelineLayoutInfo.pSetLayouts = setLayouts.data();
+	pipelineLayoutInfo.pushConstantRangeCount = static_cast<uint32_t>(pushConstantRanges.size());
+	pipelineLayoutInfo.pPushConstantRanges = pushConstantRanges.data();
+
+	VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+	VK_CHECK(disp.createPipelineLayout(&pipelineLayoutInfo, nullptr, &pipelineLayout));
+	if (pipelineLayout == VK_NULL_HANDLE)
+	{
+		return VK_NULL_HANDLE;
+	}
+
+	m_pipelineLayouts.emplace(std::move(description), pipelineLayout);
+	m_stats.pipelineLayouts++;
+	return pipelineLayout;
+}
+
+void LayoutRegistry::Cleanup(vkb::DispatchTable& disp)
+{
+	for (const auto& [description, pipelineLayout]: m_pipelineLayouts)
+	{
+		disp.destroyPipelineLayout(pipelineLayout, nullptr);
+	}
+	m_pipelineLayouts.clear();
+
+	for (const auto& [description, setLayout]: m_setLayouts)
+	{
+		disp.destroyDescriptorSetLayout(setLayout, nullptr);
+	}
+	m_setLayouts.clear();
+
+	m_stats = {};
+}
@@ -1,5 +1,7 @@
 #include "Light.h"
 
+#include <algorithm>
+
 #include "imgui.h"
 
 void PointLight::ImGuiDebug()
@@ -71,6 +73,12 @@ void DirectionalLight::ImGuiDebug()
 	{
 		ImGui::Text("%f %f %f %f", data.lightSpaceMatrix[i][0], data.lightSpaceMatrix[i][1], data.lightSpaceMatrix[i][2], data.lightSpaceMatrix[i][3]);
 	}
+
+	ImGui::Text("Shadow Cascades: %u", m_cascadeCount);
+	for (uint32_t i = 0; i < m_cascadeCount; i++)
+	{
+		ImGui::Text("  %u: up to %.2f", i, m_cascadeSplits[i]);
+	}
 }
 
 DirectionalLight::DirectionalLight()
@@ -99,9 +107,37 @@ void DirectionalLight::SetData(const LightData& data)
 	m_data = data;
 }
 
+void DirectionalLight::SetShadowCascades(const glm::mat4* matrices, const float* splitDepths, uint32_t count)
+{
+	m_cascadeCount = std::min(count, MAX_SHADOW_CASCADES);
+	for (uint32_t i = 0; i < m_cascadeCount; i++)
+	{
+		m_cascadeMatrices[i] = matrices[i];
+		m_cascadeSplits[i] = splitDepths[i];
+	}
+
+	// The first cascade stands in for the single light space matrix
+	if (m_cascadeCount > 0)
+	{
+		m_data.lightSpaceMatrix = m_cascadeMatrices[0];
+	}
+}
+
+void DirectionalLight::SetShadowFilter(ShadowFilter filter, float lightBleedReduction)
+{
+	m_shadowFilter = filter;
+	m_lightBleedReduction = lightBleedReduction;
+}
+
 DirectionalLight::BindingData DirectionalLight::GetBindingData()
 {
-	return { m_data, m_direction, m_padding3 };
+	BindingData bindingData = { m_data, m_direction, m_padding3 };
+	std::copy(std::begin(m_cascadeMatrices), std::end(m_cascadeMatrices), bindingData.cascadeMatrices);
+	bindingData.cascadeSplits = m_cascadeSplits;
+	bindingData.cascadeCount = m_cascadeCount;
+	bindingData.shadowFilter = m_shadowFilter;
+	bindingData.lightBleedReduction = m_lightBleedReduction;
+	return bindingData;
 }
 
 size_t DirectionalLight::GetBindingDataSize() const
@@ -144,9 +180,14 @@ void PointLight::SetData(const LightData& data)
 	m_data = data;
 }
 
+void PointLight::SetShadowAtlasRect(const glm::vec4& atlasRect)
+{
+	m_shadowAtlasRect = atlasRect;
+}
+
 PointLight::BindingData PointLight::GetBindingData()
 {
-	return { m_data, m_position, m_radius };
+	return { m_data, m_position, m_radius, m_shadowAtlasRect };
 }
 
 size_t PointLight::GetBindingDataSize() const
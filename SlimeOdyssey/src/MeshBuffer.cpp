@@ -0,0 +1,279 @@
+#include "MeshBuffer.h"
+
+#include <cstring>
+#include <spdlog/spdlog.h>
+
+#include "imgui.h"
+#include "Model.h"
+#include "VulkanUtil.h"
+
+// Makes the copies visible to vertex input in whatever is submitted next
+static void MeshBufferCopyBarrier(vkb::DispatchTable& disp, VkCommandBuffer cmd)
+{
+	VkMemoryBarrier2 barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+	barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+	barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+	barrier.dstStageMask = VK_PIPELINE_STAGE_2_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_COPY_BIT;
+	barrier.dstAccessMask = VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_2_INDEX_READ_BIT | VK_ACCESS_2_TRANSFER_READ_BIT;
+
+	VkDependencyInfo dependencyInfo = {};
+	dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+	dependencyInfo.memoryBarrierCount = 1;
+	dependencyInfo.pMemoryBarriers = &barrier;
+	disp.cmdPipelineBarrier2(cmd, &dependencyInfo);
+}
+
+const char* MeshMemoryName(MeshMemory memory)
+{
+	switch (memory)
+	{
+		case MeshMemory::DeviceLocal:
+			return "Device local";
+		case MeshMemory::HostVisible:
+			return "Host visible";
+		case MeshMemory::ReBAR:
+			return "ReBAR";
+	}
+	return "Unknown";
+}
+
+bool MeshBuffer::Upload(vkb::DispatchTable& disp, VkQueue graphicsQueue, VkCommandPool commandPool, VmaAllocator allocator, ModelResource& model)
+{
+	uint32_t vertexCount = static_cast<uint32_t>(model.vertices.size());
+	uint32_t indexCount = static_cast<uint32_t>(model.indices.size());
+
+	if (vertexCount == 0 || indexCount == 0)
+	{
+		spdlog::error("Can't upload an empty mesh");
+		return false;
+	}
+
+	if (m_vertices.buffer == VK_NULL_HANDLE)
+	{
+		m_vertexRanges.Reset(INITIAL_VERTEX_CAPACITY);
+		m_indexRanges.Reset(INITIAL_INDEX_CAPACITY);
+		m_vertices = CreateStorage(allocator, m_dynamic ? "Dynamic Mesh Vertex Buffer" : "Mesh Vertex Buffer", INITIAL_VERTEX_CAPACITY * sizeof(Vertex), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+		m_indices = CreateStorage(allocator, m_dynamic ? "Dynamic Mesh Index Buffer" : "Mesh Index Buffer", INITIAL_INDEX_CAPACITY * sizeof(uint32_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+	}
+
+	uint32_t vertexOffset = m_vertexRanges.Allocate(vertexCount);
+	uint32_t firstIndex = m_indexRanges.Allocate(indexCount);
+
+	if (vertexOffset == OffsetAllocator::INVALID_OFFSET || firstIndex == OffsetAllocator::INVALID_OFFSET)
+	{
+		// Grow whichever ran out until the mesh fits even if the free space at the end is in use
+		uint32_t vertexCapacity = m_vertexRanges.GetCapacity();
+		uint32_t indexCapacity = m_indexRanges.GetCapacity();
+		while (vertexOffset == OffsetAllocator::INVALID_OFFSET && vertexCapacity - m_vertexRanges.GetCapacity() < vertexCount)
+		{
+			vertexCapacity *= 2;
+		}
+		while (firstIndex == OffsetAllocator::INVALID_OFFSET && indexCapacity - m_indexRanges.GetCapacity() < indexCount)
+		{
+			indexCapacity *= 2;
+		}
+
+		if (static_cast<uint64_t>(vertexCapacity) * sizeof(Vertex) > UINT32_MAX)
+		{
+			spdlog::error("Mesh buffer can't grow to fit {} vertices and {} indices", vertexCount, indexCount);
+			return false;
+		}
+
+		Grow(disp, graphicsQueue, commandPool, allocator, vertexCapacity, indexCapacity);
+
+		if (vertexOffset == OffsetAllocator::INVALID_OFFSET)
+		{
+			vertexOffset = m_vertexRanges.Allocate(vertexCount);
+		}
+		if (firstIndex == OffsetAllocator::INVALID_OFFSET)
+		{
+			firstIndex = m_indexRanges.Allocate(indexCount);
+		}
+	}
+
+	if (m_dynamic)
+	{
+		Write(allocator, model, vertexOffset, firstIndex);
+	}
+	else
+	{
+		VkDeviceSize vertexSize = vertexCount * sizeof(Vertex);
+		VkDeviceSize indexSize = indexCount * sizeof(uint32_t);
+
+		// One staging buffer for both, vertices first
+		VkBuffer stagingBuffer;
+		VmaAllocation stagingAllocation;
+		void* data = SlimeUtil::CreateMappedBuffer("Mesh Staging Buffer", allocator, vertexSize + indexSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBuffer, stagingAllocation);
+		SlimeUtil::WriteMapped(data, 0, model.vertices.data(), vertexSize);
+		SlimeUtil::WriteMapped(data, vertexSize, model.indices.data(), indexSize);
+		SlimeUtil::FlushMapped(allocator, stagingAllocation, 0, VK_WHOLE_SIZE);
+
+		VkCommandBuffer commandBuffer = SlimeUtil::BeginSingleTimeCommands(disp, commandPool);
+
+		VkBufferCopy vertexCopy = { 0, vertexOffset * sizeof(Vertex), vertexSize };
+		VkBufferCopy indexCopy = { vertexSize, firstIndex * sizeof(uint32_t), indexSize };
+		disp.cmdCopyBuffer(commandBuffer, stagingBuffer, m_vertices.buffer, 1, &vertexCopy);
+		disp.cmdCopyBuffer(commandBuffer, stagingBuffer, m_indices.buffer, 1, &indexCopy);
+		MeshBufferCopyBarrier(disp, commandBuffer);
+
+		SlimeUtil::EndSingleTimeCommands(disp, graphicsQueue, commandPool, commandBuffer);
+
+		vmaDestroyBuffer(allocator, stagingBuffer, stagingAllocation);
+	}
+
+	model.vertexOffset = static_cast<int32_t>(vertexOffset);
+	model.firstIndex = firstIndex;
+	model.indexCount = indexCount;
+	model.meshBuffer = this;
+
+	return true;
+}
+
+void MeshBuffer::Free(ModelResource& model)
+{
+	if (model.meshBuffer != this)
+	{
+		return;
+	}
+
+	m_vertexRanges.Free(static_cast<uint32_t>(model.vertexOffset));
+	m_indexRanges.Free(model.firstIndex);
+
+	model.vertexOffset = 0;
+	model.firstIndex = 0;
+	model.indexCount = 0;
+	model.meshBuffer = nullptr;
+}
+
+void MeshBuffer::Bind(vkb::DispatchTable& disp, VkCommandBuffer cmd) const
+{
+	VkDeviceSize offsets[] = { 0 };
+	disp.cmdBindVertexBuffers(cmd, 0, 1, &m_vertices.buffer, offsets);
+	disp.cmdBindIndexBuffer(cmd, m_indices.buffer, 0, VK_INDEX_TYPE_UINT32);
+}
+
+void MeshBuffer::Cleanup(VmaAllocator allocator)
+{
+	if (m_vertices.buffer != VK_NULL_HANDLE)
+	{
+		vmaDestroyBuffer(allocator, m_vertices.buffer, m_vertices.allocation);
+		vmaDestroyBuffer(allocator, m_indices.buffer, m_indices.allocation);
+	}
+
+	m_vertices = {};
+	m_indices = {};
+	m_vertexRanges.Reset(0);
+	m_indexRanges.Reset(0);
+	m_growCount = 0;
+}
+
+MeshBuffer::Stats MeshBuffer::GetStats() const
+{
+	Stats stats;
+	stats.vertices = m_vertexRanges.GetStats();
+	stats.indices = m_indexRanges.GetStats();
+	stats.growCount = m_growCount;
+	return stats;
+}
+
+void MeshBuffer::ImGuiDebug() const
+{
+	Stats stats = GetStats();
+
+	ImGui::Text("%s mesh buffer: %s memory (grown %u times)", m_dynamic ? "Dynamic" : "Static", MeshMemoryName(m_memory), stats.growCount);
+	ImGui::Text("  Vertices: %u / %u in %u meshes, %u free ranges, largest %u, fragmentation %.1f%%",
+	        stats.vertices.used,
+	        stats.vertices.capacity,
+	        stats.vertices.allocations,
+	        stats.vertices.freeRanges,
+	        stats.vertices.largestFreeRange,
+	        stats.vertices.Fragmentation() * 100.0f);
+	ImGui::Text("  Indices: %u / %u, %u free ranges, largest %u, fragmentation %.1f%%",
+	        stats.indices.used,
+	        stats.indices.capacity,
+	        stats.indices.freeRanges,
+	        stats.indices.largestFreeRange,
+	        stats.indices.Fragmentation() * 100.0f);
+}
+
+MeshBuffer::Storage MeshBuffer::CreateStorage(VmaAllocator allocator, const char* name, VkDeviceSize size, VkBufferUsageFlags usage)
+{
+	Storage storage;
+
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.size = size;
+	bufferInfo.usage = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT; // TRANSFER_SRC to carry the contents over when growing
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	VmaAllocationCreateInfo allocInfo = {};
+	if (m_dynamic)
+	{
+		// Prefers memory that is both device local and mappable (ReBAR), falls back to host memory
+		allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+		allocInfo.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+	}
+	else
+	{
+		allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+	}
+
+	VmaAllocationInfo allocationInfo;
+	VK_CHECK(vmaCreateBuffer(allocator, &bufferInfo, &allocInfo, &storage.buffer, &storage.allocation, &allocationInfo));
+	vmaSetAllocationName(allocator, storage.allocation, name);
+	storage.mappedData = allocationInfo.pMappedData;
+
+	if (m_dynamic)
+	{
+		VkMemoryPropertyFlags memoryFlags;
+		vmaGetAllocationMemoryProperties(allocator, storage.allocation, &memoryFlags);
+		m_memory = (memoryFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) ? MeshMemory::ReBAR : MeshMemory::HostVisible;
+	}
+
+	spdlog::debug("Created {} ({} memory)", name, MeshMemoryName(m_memory));
+	return storage;
+}
+
+void MeshBuffer::Grow(vkb::DispatchTable& disp, VkQueue graphicsQueue, VkCommandPool commandPool, VmaAllocator allocator, uint32_t vertexCapacity, uint32_t indexCapacity)
+{
+	Storage vertices = CreateStorage(allocator, m_dynamic ? "Dynamic Mesh Vertex Buffer" : "Mesh Vertex Buffer", vertexCapacity * sizeof(Vertex), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+	Storage indices = CreateStorage(allocator, m_dynamic ? "Dynamic Mesh Index Buffer" : "Mesh Index Buffer", indexCapacity * sizeof(uint32_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+
+	// Offsets stay the same so the models don't need to know
+	VkCommandBuffer commandBuffer = SlimeUtil::BeginSingleTimeCommands(disp, commandPool);
+
+	VkBufferCopy vertexCopy = { 0, 0, m_vertexRanges.GetCapacity() * sizeof(Vertex) };
+	VkBufferCopy indexCopy = { 0, 0, m_indexRanges.GetCapacity() * sizeof(uint32_t) };
+	disp.cmdCopyBuffer(commandBuffer, m_vertices.buffer, vertices.buffer, 1, &vertexCopy);
+	disp.cmdCopyBuffer(commandBuffer, m_indices.buffer, indices.buffer, 1, &indexCopy);
+	MeshBufferCopyBarrier(disp, commandBuffer);
+
+	SlimeUtil::EndSingleTimeCommands(disp, graphicsQueue, commandPool, commandBuffer);
+
+	// Frames in flight may still be reading the old buffers
+	disp.deviceWaitIdle();
+	vmaDestroyBuffer(allocator, m_vertices.buffer, m_vertices.allocation);
+	vmaDestroyBuffer(allocator, m_indices.buffer, m_indices.allocation);
+
+	m_vertices = vertices;
+	m_indices = indices;
+
+	m_vertexRanges.Grow(vertexCapacity);
+	m_indexRanges.Grow(indexCapacity);
+	m_growCount++;
+
+	spdlog::debug("Mesh buffer grown to {} vertices and {} indices", vertexCapacity, indexCapacity);
+}
+
+void MeshBuffer::Write(VmaAllocator allocator, const ModelResource& model, uint32_t vertexOffset, uint32_t firstIndex)
+{
+	VkDeviceSize vertexSize = model.vertices.size() * sizeof(Vertex);
+	VkDeviceSize indexSize = model.indices.size() * sizeof(uint32_t);
+
+	SlimeUtil::WriteMapped(m_vertices.mappedData, vertexOffset * sizeof(Vertex), model.vertices.data(), vertexSize);
+	SlimeUtil::WriteMapped(m_indices.mappedData, firstIndex * sizeof(uint32_t), model.indices.data(), indexSize);
+
+	SlimeUtil::FlushMapped(allocator, m_vertices.allocation, vertexOffset * sizeof(Vertex), vertexSize);
+	SlimeUtil::FlushMapped(allocator, m_indices.allocation, firstIndex * sizeof(uint32_t), indexSize);
+}
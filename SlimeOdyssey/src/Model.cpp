@@ -1,5 +1,6 @@
 #include "Model.h"
 #include "imgui.h"
+#include "MeshBuffer.h"
 
 void PBRMaterial::ImGuiDebug()
 {
@@ -12,6 +13,7 @@ void PBRMaterial::ImGuiDebug()
     ImGui::DragFloat("Metallic", &materialResource->config.metallic, 0.1f);
     ImGui::DragFloat("Roughness", &materialResource->config.roughness, 0.1f);
     ImGui::DragFloat("AO", &materialResource->config.ao, 0.1f);
+    ImGui::Checkbox("Receive Shadows", &materialResource->receiveShadows);
 }
 
 void BasicMaterial::ImGuiDebug()
@@ -29,6 +31,7 @@ void Model::ImGuiDebug()
     ImGui::Text("Pipeline: %s", modelResource->pipelineName.c_str());
     ImGui::Text("Vertex Count: %d", modelResource->vertices.size());
     ImGui::Text("Index Count: %d", modelResource->indices.size());
+    ImGui::Text("Mesh Memory: %s", modelResource->meshBuffer ? MeshMemoryName(modelResource->meshBuffer->GetMemory()) : "Not uploaded");
 }
 
 void Transform::ImGuiDebug()
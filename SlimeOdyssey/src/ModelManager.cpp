@@ -1,5 +1,6 @@
 #include "ModelManager.h"
 
+#include <algorithm>
 #include <spdlog/spdlog.h>
 #include <stdexcept>
 #include <vk_mem_alloc.h>
@@ -288,21 +289,36 @@ void ModelManager::CalculateTangentSpace(Vertex& v0, Vertex& v1, Vertex& v2)
 	v2.bitangent += glm::cross(v2.normal, tangent);
 }
 
-void ModelManager::CreateBuffersForMesh(VmaAllocator allocator, ModelResource& model)
+void ModelManager::CreateBuffersForMesh(vkb::DispatchTable& disp, VkQueue graphicsQueue, VkCommandPool commandPool, VmaAllocator allocator, ModelResource& model)
 {
-	// Create vertex and index buffers
-	SlimeUtil::CreateBuffer("Vertex Buffer", allocator, model.vertices.size() * sizeof(Vertex), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, model.vertexBuffer, model.vertexAllocation);
-	SlimeUtil::CreateBuffer("Index Buffer", allocator, model.indices.size() * sizeof(uint32_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, model.indexBuffer, model.indexAllocation);
-
-	// Copy vertex and index data to buffers
-	void* data;
-	vmaMapMemory(allocator, model.vertexAllocation, &data);
-	memcpy(data, model.vertices.data(), model.vertices.size() * sizeof(Vertex));
-	vmaUnmapMemory(allocator, model.vertexAllocation);
-
-	vmaMapMemory(allocator, model.indexAllocation, &data);
-	memcpy(data, model.indices.data(), model.indices.size() * sizeof(uint32_t));
-	vmaUnmapMemory(allocator, model.indexAllocation);
+	model.CalculateBounds();
+	model.pipelineId = model.pipelineName.empty() ? INVALID_PIPELINE_ID : GetPipelineId(model.pipelineName);
+
+	// Cached meshes (CreateCube etc.) are handed out again on scene reload, they are already uploaded
+	if (model.meshBuffer)
+	{
+		return;
+	}
+
+	MeshBuffer& meshBuffer = model.dynamic ? m_dynamicMeshBuffer : m_meshBuffer;
+	if (meshBuffer.Upload(disp, graphicsQueue, commandPool, allocator, model))
+	{
+		model.meshId = m_nextMeshId++;
+	}
+}
+
+void ModelManager::UnloadModel(const std::string& name)
+{
+	auto it = m_modelResources.find(name);
+	if (it == m_modelResources.end())
+	{
+		spdlog::warn("Model {} is not loaded", name);
+		return;
+	}
+
+	m_meshBuffer.Free(it->second);
+	m_dynamicMeshBuffer.Free(it->second);
+	m_modelResources.erase(it);
 }
 
 ModelResource* ModelManager::LoadModel(const std::string& name, const std::string& pipelineName)
@@ -372,13 +388,11 @@ TextureResource* ModelManager::LoadTexture(vkb::DispatchTable& disp, VkQueue gra
 	// Create staging buffer
 	VkBuffer stagingBuffer;
 	VmaAllocation stagingAllocation;
-	SlimeUtil::CreateBuffer("Load Texture Staging Buffer", allocator, imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, stagingBuffer, stagingAllocation);
+	void* data = SlimeUtil::CreateMappedBuffer("Load Texture Staging Buffer", allocator, imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBuffer, stagingAllocation);
 
 	// Copy pixel data to staging buffer
-	void* data;
-	vmaMapMemory(allocator, stagingAllocation, &data);
-	memcpy(data, pixels, static_cast<size_t>(imageSize));
-	vmaUnmapMemory(allocator, stagingAllocation);
+	SlimeUtil::WriteMapped(data, 0, pixels, imageSize);
+	SlimeUtil::FlushMapped(allocator, stagingAllocation, 0, imageSize);
 
 	stbi_image_free(pixels);
 
@@ -429,11 +443,8 @@ const TextureResource* ModelManager::GetTexture(const std::string& name) const
 
 void ModelManager::UnloadAllResources(vkb::DispatchTable& disp, VmaAllocator allocator)
 {
-	for (const auto& model: m_modelResources)
-	{
-		vmaDestroyBuffer(allocator, model.second.vertexBuffer, model.second.vertexAllocation);
-		vmaDestroyBuffer(allocator, model.second.indexBuffer, model.second.indexAllocation);
-	}
+	m_meshBuffer.Cleanup(allocator);
+	m_dynamicMeshBuffer.Cleanup(allocator);
 	m_modelResources.clear();
 
 	for (const auto& texture: m_textures)
@@ -452,14 +463,66 @@ std::map<std::string, PipelineConfig>& ModelManager::GetPipelines()
 	return m_pipelines;
 }
 
+uint32_t ModelManager::GetPipelineId(const std::string& pipelineName)
+{
+	auto it = m_pipelineIds.find(pipelineName);
+	if (it != m_pipelineIds.end())
+	{
+		return it->second;
+	}
+
+	uint32_t pipelineId = static_cast<uint32_t>(m_pipelinesById.size());
+	if (pipelineId >= MAX_PIPELINE_IDS)
+	{
+		spdlog::warn("More than {} pipelines registered, draws of '{}' may not sort together", MAX_PIPELINE_IDS, pipelineName);
+	}
+
+	// A pipeline still compiling is registered by WaitForPipelines
+	auto pipelineIt = m_pipelines.find(pipelineName);
+	bool created = pipelineIt != m_pipelines.end() && pipelineIt->second.pipeline != VK_NULL_HANDLE;
+	m_pipelinesById.push_back(created ? &pipelineIt->second : nullptr);
+	m_pipelineIds[pipelineName] = pipelineId;
+	return pipelineId;
+}
+
+PipelineConfig* ModelManager::GetPipeline(uint32_t pipelineId) const
+{
+	return pipelineId < m_pipelinesById.size() ? m_pipelinesById[pipelineId] : nullptr;
+}
+
 void ModelManager::CleanUpAllPipelines(vkb::DispatchTable& disp)
 {
+	WaitForPipelines();
+
+	// Reloads still compiling and replaced pipelines go with the rest
+	std::vector<std::string> reloading;
+	for (const ReloadingPipeline& reload: m_reloadingPipelines)
+	{
+		reloading.push_back(reload.pending.name);
+	}
+	FinishReloadingPipelines(disp, reloading);
+	DropPipelineVariants(disp, {});
+	if (m_variantSpirv.valid())
+	{
+		m_variantSpirv.wait();
+		m_variantSpirv = {};
+	}
+
+	for (const RetiredPipeline& retired: m_retiredPipelines)
+	{
+		disp.destroyPipeline(retired.pipeline, nullptr);
+	}
+	m_retiredPipelines.clear();
+	m_pipelineRecipes.clear();
+
 	for (auto& [name, pipeline]: m_pipelines)
 	{
 		disp.destroyPipeline(pipeline.pipeline, nullptr);
-		disp.destroyPipelineLayout(pipeline.pipelineLayout, nullptr);
 	}
 	m_pipelines.clear();
+
+	// Keep the ids, meshes hold on to them across scene reloads
+	std::fill(m_pipelinesById.begin(), m_pipelinesById.end(), nullptr);
 }
 
 VkImageView ModelManager::CreateImageView(vkb::DispatchTable& disp, VkImage image, VkFormat format)
@@ -694,99 +757,35 @@ void ModelManager::CreateShadowMapPipeline(VulkanContext& vulkanContext, ShaderM
 		return;
 	}
 
-	std::vector<std::pair<std::string, VkShaderStageFlagBits>> shaderPaths = {
+	PipelineRecipe recipe;
+	recipe.shaderPaths = {
 		{ResourcePathManager::GetShaderPath("shadowmap.vert.spv"),   VK_SHADER_STAGE_VERTEX_BIT},
         {ResourcePathManager::GetShaderPath("shadowmap.frag.spv"), VK_SHADER_STAGE_FRAGMENT_BIT}
 	};
+	recipe.depthOnly = true;
+	recipe.cullMode = VK_CULL_MODE_FRONT_BIT;
+
+	m_pipelineRecipes[pipelineName] = recipe;
+	CompilePipelineAsync(pipelineName, CreatePipelineGenerator(pipelineName, vulkanContext, shaderManager, recipe));
+
+	// Point lights draw all six faces of their cube into the shadow atlas in one multiview pass
+	PipelineRecipe pointRecipe = recipe;
+	pointRecipe.shaderPaths[0].first = ResourcePathManager::GetShaderPath("shadowmap_point.vert.spv");
+	pointRecipe.depthFormat = VK_FORMAT_D16_UNORM;
+	pointRecipe.viewMask = 0b111111;
+	pointRecipe.cullMode = VK_CULL_MODE_NONE; // Lights sit inside of what they light, back faces have to cast too
+
+	m_pipelineRecipes["PointShadowMap"] = pointRecipe;
+	CompilePipelineAsync("PointShadowMap", CreatePipelineGenerator("PointShadowMap", vulkanContext, shaderManager, pointRecipe));
+
+	// Blurs the cascades of EVSM lights into their moments, until it is compiled they fall back to PCF
+	PipelineRecipe momentsRecipe;
+	momentsRecipe.shaderPaths = {
+		{ResourcePathManager::GetShaderPath("shadow_moments.comp.spv"), VK_SHADER_STAGE_COMPUTE_BIT}
+	};
 
-	// Load and parse shaders
-	std::vector<ShaderModule> shaderModules;
-	std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
-	for (const auto& [shaderPath, shaderStage]: shaderPaths)
-	{
-		auto shaderModule = shaderManager.LoadShader(vulkanContext.GetDispatchTable(), shaderPath, shaderStage);
-		shaderModules.push_back(shaderModule);
-		shaderStages.push_back({ .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, .stage = shaderStage, .module = shaderModule.handle, .pName = "main" });
-	}
-	auto combinedResources = shaderManager.CombineResources(shaderModules);
-
-	PipelineGenerator pipelineGenerator(vulkanContext);
-
-	pipelineGenerator.SetName(pipelineName);
-
-	// Set up rendering info for dynamic rendering
-	VkFormat depthFormat = VK_FORMAT_D32_SFLOAT;
-	VkPipelineRenderingCreateInfo renderingInfo{};
-	renderingInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
-	renderingInfo.depthAttachmentFormat = depthFormat;
-	renderingInfo.stencilAttachmentFormat = VK_FORMAT_UNDEFINED;
-	renderingInfo.colorAttachmentCount = 0;
-	renderingInfo.pColorAttachmentFormats = nullptr;
-	pipelineGenerator.SetRenderingInfo(renderingInfo);
-
-	pipelineGenerator.SetShaderStages(shaderStages);
-
-	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
-	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	vertexInputInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(combinedResources.bindingDescriptions.size());
-	vertexInputInfo.pVertexBindingDescriptions = combinedResources.bindingDescriptions.data();
-	vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(combinedResources.attributeDescriptions.size());
-	vertexInputInfo.pVertexAttributeDescriptions = combinedResources.attributeDescriptions.data();
-	pipelineGenerator.SetVertexInputState(vertexInputInfo);
-
-	pipelineGenerator.SetDefaultInputAssembly();
-	pipelineGenerator.SetDefaultViewportState();
-
-	VkPipelineRasterizationStateCreateInfo rasterizer{};
-	rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-	rasterizer.depthClampEnable = VK_FALSE;
-	rasterizer.rasterizerDiscardEnable = VK_FALSE;
-	rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
-	rasterizer.cullMode = VK_CULL_MODE_FRONT_BIT;
-	rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-	rasterizer.depthBiasEnable = VK_FALSE;
-	rasterizer.lineWidth = 1.0f;
-	pipelineGenerator.SetRasterizationState(rasterizer);
-
-	// Set up multisample state
-	VkPipelineMultisampleStateCreateInfo multisampling{};
-	multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-	multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-	multisampling.sampleShadingEnable = VK_FALSE;
-	multisampling.minSampleShading = 1.0f;
-	multisampling.pSampleMask = nullptr;
-	multisampling.alphaToCoverageEnable = VK_FALSE;
-	multisampling.alphaToOneEnable = VK_FALSE;
-	pipelineGenerator.SetMultisampleState(multisampling);
-
-	VkPipelineDepthStencilStateCreateInfo depthStencil{};
-	depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-	depthStencil.depthTestEnable = VK_TRUE;
-	depthStencil.depthWriteEnable = VK_TRUE;
-	depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
-	depthStencil.depthBoundsTestEnable = VK_FALSE;
-	depthStencil.stencilTestEnable = VK_FALSE;
-	pipelineGenerator.SetDepthStencilState(depthStencil);
-
-	// For shadow mapping, we typically don't use color attachments
-	VkPipelineColorBlendStateCreateInfo colorBlending{};
-	colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-	colorBlending.logicOpEnable = VK_FALSE;
-	colorBlending.attachmentCount = 0;
-	colorBlending.pAttachments = nullptr;
-	pipelineGenerator.SetColorBlendState(colorBlending);
-
-	std::vector<VkDynamicState> dynamicStates = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR, VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE_EXT, VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE_EXT, VK_DYNAMIC_STATE_DEPTH_COMPARE_OP_EXT, VK_DYNAMIC_STATE_LINE_WIDTH };
-	pipelineGenerator.SetDynamicState({ .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO, .dynamicStateCount = static_cast<uint32_t>(dynamicStates.size()), .pDynamicStates = dynamicStates.data() });
-
-	pipelineGenerator.SetPushConstantRanges(combinedResources.pushConstantRanges);
-
-	PipelineConfig config = pipelineGenerator.Build();
-
-	// Store the pipeline
-	m_pipelines[pipelineName] = config;
-
-	spdlog::debug("Created the Shadow Map Pipeline");
+	m_pipelineRecipes["ShadowMoments"] = momentsRecipe;
+	CompilePipelineAsync("ShadowMoments", CreatePipelineGenerator("ShadowMoments", vulkanContext, shaderManager, momentsRecipe));
 }
 
 void ModelManager::CreatePipeline(const std::string& pipelineName, VulkanContext& vulkanContext, ShaderManager& shaderManager, DescriptorManager& descriptorManager, const std::vector<std::pair<std::string, VkShaderStageFlagBits>>& shaderPaths, bool depthTestEnabled, VkCullModeFlags cullMode, VkPolygonMode polygonMode)
@@ -797,10 +796,22 @@ void ModelManager::CreatePipeline(const std::string& pipelineName, VulkanContext
 		return;
 	}
 
+	PipelineRecipe recipe;
+	recipe.shaderPaths = shaderPaths;
+	recipe.depthTestEnabled = depthTestEnabled;
+	recipe.cullMode = cullMode;
+	recipe.polygonMode = polygonMode;
+
+	m_pipelineRecipes[pipelineName] = recipe;
+	CompilePipelineAsync(pipelineName, CreatePipelineGenerator(pipelineName, vulkanContext, shaderManager, recipe));
+}
+
+std::unique_ptr<PipelineGenerator> ModelManager::CreatePipelineGenerator(const std::string& pipelineName, VulkanContext& vulkanContext, ShaderManager& shaderManager, const PipelineRecipe& recipe)
+{
 	// Load and parse shaders
 	std::vector<ShaderModule> shaderModules;
 	std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
-	for (const auto& [shaderPath, shaderStage]: shaderPaths)
+	for (const auto& [shaderPath, shaderStage]: recipe.shaderPaths)
 	{
 		auto shaderModule = shaderManager.LoadShader(vulkanContext.GetDispatchTable(), shaderPath, shaderStage);
 		shaderModules.push_back(shaderModule);
@@ -808,28 +819,60 @@ void ModelManager::CreatePipeline(const std::string& pipelineName, VulkanContext
 	}
 	auto combinedResources = shaderManager.CombineResources(shaderModules);
 
-	// Set up descriptor set layout
+	// Set up descriptor set layout, for the shadow map set 0 only holds the instance buffer
 	std::vector<VkDescriptorSetLayout> descriptorSetLayouts = shaderManager.CreateDescriptorSetLayouts(vulkanContext.GetDispatchTable(), combinedResources);
 
 	VkFormat colorFormat = VK_FORMAT_B8G8R8A8_UNORM;
-	VkFormat depthFormat = VK_FORMAT_D32_SFLOAT;
+	VkFormat depthFormat = recipe.depthFormat;
 
-	PipelineGenerator pipelineGenerator(vulkanContext);
+	auto generator = std::make_unique<PipelineGenerator>(vulkanContext);
+	PipelineGenerator& pipelineGenerator = *generator;
 
 	pipelineGenerator.SetName(pipelineName);
 
+	pipelineGenerator.SetShaderStages(shaderStages);
+
+	// Variants turn off the keywords that are specialization constants here, the others are already left out of their SPIR-V
+	if (recipe.keywords != ALL_SHADER_KEYWORDS)
+	{
+		for (const ShaderModule& shaderModule: shaderModules)
+		{
+			std::vector<VkSpecializationMapEntry> entries;
+			std::vector<uint8_t> data;
+			for (const auto& constant: shaderManager.ParseShader(shaderModule).keywordConstants)
+			{
+				VkBool32 value = (recipe.keywords & constant.keyword) ? VK_TRUE : VK_FALSE;
+				entries.push_back({ constant.constantId, static_cast<uint32_t>(data.size()), sizeof(VkBool32) });
+				data.insert(data.end(), reinterpret_cast<const uint8_t*>(&value), reinterpret_cast<const uint8_t*>(&value) + sizeof(value));
+			}
+			if (!entries.empty())
+			{
+				pipelineGenerator.SetSpecialization(shaderModule.stage, entries, data);
+			}
+		}
+	}
+
+	// Compute pipelines only need their layout, everything below is graphics state
+	if (shaderStages.size() == 1 && shaderStages[0].stage == VK_SHADER_STAGE_COMPUTE_BIT)
+	{
+		pipelineGenerator.SetDescriptorSetLayouts(descriptorSetLayouts);
+		pipelineGenerator.SetPushConstantRanges(combinedResources.pushConstantRanges);
+		pipelineGenerator.SetLayoutRegistry(shaderManager.GetLayoutRegistry());
+		return generator;
+	}
+
+	// Set up rendering info for dynamic rendering, the shadow map pass has no colour attachment
 	VkPipelineRenderingCreateInfo renderingInfo{};
 	renderingInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
-	renderingInfo.colorAttachmentCount = 1;
-	renderingInfo.pColorAttachmentFormats = &colorFormat;
+	renderingInfo.colorAttachmentCount = recipe.depthOnly ? 0 : 1;
+	renderingInfo.pColorAttachmentFormats = recipe.depthOnly ? nullptr : &colorFormat;
 	renderingInfo.depthAttachmentFormat = depthFormat;
 	renderingInfo.stencilAttachmentFormat = VK_FORMAT_UNDEFINED;
+	renderingInfo.viewMask = recipe.viewMask;
 	pipelineGenerator.SetRenderingInfo(renderingInfo);
 
-	pipelineGenerator.SetShaderStages(shaderStages);
-
 	// Set vertex input state only if vertex shader is present
-	if (std::find_if(shaderPaths.begin(), shaderPaths.end(), [](const auto& pair) { return pair.second == VK_SHADER_STAGE_VERTEX_BIT; }) != shaderPaths.end())
+	if (std::find_if(recipe.shaderPaths.begin(), recipe.shaderPaths.end(), [](const auto& pair) { return pair.second == VK_SHADER_STAGE_VERTEX_BIT; }) != recipe.shaderPaths.end())
 	{
 		VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
 		vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
@@ -847,8 +890,8 @@ void ModelManager::CreatePipeline(const std::string& pipelineName, VulkanContext
 	rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
 	rasterizer.depthClampEnable = VK_FALSE;
 	rasterizer.rasterizerDiscardEnable = VK_FALSE;
-	rasterizer.polygonMode = polygonMode;
-	rasterizer.cullMode = cullMode;
+	rasterizer.polygonMode = recipe.polygonMode;
+	rasterizer.cullMode = recipe.cullMode;
 	rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
 	rasterizer.depthBiasEnable = VK_FALSE;
 	rasterizer.lineWidth = 1.0f;
@@ -858,9 +901,9 @@ void ModelManager::CreatePipeline(const std::string& pipelineName, VulkanContext
 
 	VkPipelineDepthStencilStateCreateInfo depthStencil{};
 	depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-	depthStencil.depthTestEnable = depthTestEnabled;
-	depthStencil.depthWriteEnable = depthTestEnabled;
-	depthStencil.depthCompareOp = VK_COMPARE_OP_GREATER_OR_EQUAL; // Assuming reverse-Z
+	depthStencil.depthTestEnable = recipe.depthTestEnabled;
+	depthStencil.depthWriteEnable = recipe.depthTestEnabled;
+	depthStencil.depthCompareOp = recipe.depthOnly ? VK_COMPARE_OP_LESS : VK_COMPARE_OP_GREATER_OR_EQUAL; // Reverse-Z except for the shadow map
 	depthStencil.depthBoundsTestEnable = VK_FALSE;
 	depthStencil.stencilTestEnable = VK_FALSE;
 	pipelineGenerator.SetDepthStencilState(depthStencil);
@@ -878,8 +921,8 @@ void ModelManager::CreatePipeline(const std::string& pipelineName, VulkanContext
 	VkPipelineColorBlendStateCreateInfo colorBlending{};
 	colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
 	colorBlending.logicOpEnable = VK_FALSE;
-	colorBlending.attachmentCount = 1;
-	colorBlending.pAttachments = &colorBlendAttachment;
+	colorBlending.attachmentCount = recipe.depthOnly ? 0 : 1;
+	colorBlending.pAttachments = recipe.depthOnly ? nullptr : &colorBlendAttachment;
 	pipelineGenerator.SetColorBlendState(colorBlending);
 
 	std::vector<VkDynamicState> dynamicStates = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR, VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE_EXT, VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE_EXT, VK_DYNAMIC_STATE_DEPTH_COMPARE_OP_EXT, VK_DYNAMIC_STATE_LINE_WIDTH };
@@ -887,13 +930,432 @@ void ModelManager::CreatePipeline(const std::string& pipelineName, VulkanContext
 
 	pipelineGenerator.SetDescriptorSetLayouts(descriptorSetLayouts);
 	pipelineGenerator.SetPushConstantRanges(combinedResources.pushConstantRanges);
+	pipelineGenerator.SetLayoutRegistry(shaderManager.GetLayoutRegistry());
+
+	return generator;
+}
+
+void ModelManager::CompilePipelineAsync(const std::string& pipelineName, std::unique_ptr<PipelineGenerator> generator)
+{
+	// Layouts are needed right away (the scene allocates descriptor sets from them), only the pipeline can wait
+	PipelineConfig& config = m_pipelines[pipelineName] = generator->BuildLayout();
+
+	// What GetPipelineVariant can leave out, read from the shaders' sources once
+	for (const auto& [shaderPath, shaderStage]: m_pipelineRecipes[pipelineName].shaderPaths)
+	{
+		config.variantKeywords |= m_shaderVariants.GetDeclaredKeywords(shaderPath);
+	}
+
+	// One thread per pipeline, a scene creates a handful and the compile is most of their lifetime
+	PipelineGenerator* compileGenerator = generator.get();
+	std::future<VkPipeline> pipeline = std::async(std::launch::async, [compileGenerator]() { return compileGenerator->CompilePipeline(); });
+
+	m_pendingPipelines.push_back({ pipelineName, std::move(generator), std::move(pipeline) });
+}
+
+void ModelManager::WaitForPipelines()
+{
+	for (PendingPipeline& pending: m_pendingPipelines)
+	{
+		PipelineConfig& config = m_pipelines[pending.name];
+		config.pipeline = pending.pipeline.get();
+
+		// Only now visible to the renderer
+		m_pipelinesById[GetPipelineId(pending.name)] = &config;
+
+		spdlog::debug("Created pipeline: {}", pending.name);
+	}
+
+	m_pendingPipelines.clear();
+}
+
+void ModelManager::ReloadShaders(VulkanContext& vulkanContext, ShaderManager& shaderManager, const std::vector<std::string>& spirvPaths)
+{
+	auto usesChangedShader = [&spirvPaths](const PipelineRecipe& recipe)
+	{
+		return std::any_of(recipe.shaderPaths.begin(), recipe.shaderPaths.end(), [&spirvPaths](const auto& shader) { return std::find(spirvPaths.begin(), spirvPaths.end(), shader.first) != spirvPaths.end(); });
+	};
+
+	std::vector<std::string> rebuilds;
+	for (const auto& [name, recipe]: m_pipelineRecipes)
+	{
+		if (recipe.variantOf.empty() && m_pipelines.contains(name) && usesChangedShader(recipe))
+		{
+			rebuilds.push_back(name);
+		}
+	}
+	if (rebuilds.empty())
+	{
+		return;
+	}
+
+	vkb::DispatchTable& disp = vulkanContext.GetDispatchTable();
+
+	// The modules are about to be replaced, nothing may still be compiling from them
+	WaitForPipelines();
+	FinishReloadingPipelines(disp, rebuilds);
+
+	// Variants are built again from the new source the next time they are drawn, until then the base pipeline
+	// draws. Their loaded SPIR-V is about to be out of date.
+	for (const auto& [variantPath, shaderStage]: DropPipelineVariants(disp, rebuilds))
+	{
+		shaderManager.UnloadShader(disp, variantPath);
+	}
+
+	std::vector<std::string> reloaded;
+	for (const std::string& name: rebuilds)
+	{
+		for (const auto& [shaderPath, shaderStage]: m_pipelineRecipes[name].shaderPaths)
+		{
+			if (std::find(spirvPaths.begin(), spirvPaths.end(), shaderPath) != spirvPaths.end() && std::find(reloaded.begin(), reloaded.end(), shaderPath) == reloaded.end())
+			{
+				shaderManager.ReloadShader(disp, shaderPath, shaderStage);
+				reloaded.push_back(shaderPath);
+			}
+		}
+	}
 
-	PipelineConfig config = pipelineGenerator.Build();
+	for (const std::string& name: rebuilds)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		std::unique_ptr<PipelineGenerator> generator = CreatePipelineGenerator(name, vulkanContext, shaderManager, m_pipelineRecipes[name]);
+		PipelineConfig config = generator->BuildLayout();
+
+		// Scenes and the renderer hold descriptor sets allocated from the current set layouts
+		if (config.descriptorSetLayouts != m_pipelines[name].descriptorSetLayouts)
+		{
+			spdlog::warn("Not reloading pipeline {}: its descriptor sets changed, restart to pick that up", name);
+			continue;
+		}
+
+		PipelineGenerator* compileGenerator = generator.get();
+		std::future<VkPipeline> pipeline = std::async(std::launch::async, [compileGenerator]() { return compileGenerator->CompilePipeline(); });
+		m_reloadingPipelines.push_back({ { name, std::move(generator), std::move(pipeline) }, config, start });
+	}
+}
+
+void ModelManager::UpdateReloadedPipelines(vkb::DispatchTable& disp)
+{
+	// Called once per frame after its fence, by now the frames that could have drawn with these are done
+	for (auto it = m_retiredPipelines.begin(); it != m_retiredPipelines.end();)
+	{
+		if (--it->framesLeft == 0)
+		{
+			disp.destroyPipeline(it->pipeline, nullptr);
+			it = m_retiredPipelines.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	for (auto it = m_reloadingPipelines.begin(); it != m_reloadingPipelines.end();)
+	{
+		if (it->pending.pipeline.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		{
+			++it;
+			continue;
+		}
+
+		VkPipeline pipeline = it->pending.pipeline.get();
+		auto live = m_pipelines.find(it->pending.name);
+		if (pipeline == VK_NULL_HANDLE || live == m_pipelines.end())
+		{
+			spdlog::warn("Failed to reload pipeline {}, keeping the old one", it->pending.name);
+			disp.destroyPipeline(pipeline, nullptr);
+			it = m_reloadingPipelines.erase(it);
+			continue;
+		}
+
+		// Swapped in place, m_pipelinesById and the renderer keep pointing at the same config
+		m_retiredPipelines.push_back({ live->second.pipeline, MAX_FRAMES_IN_FLIGHT });
+		live->second.pipeline = pipeline;
+		live->second.pipelineLayout = it->config.pipelineLayout;
+
+		double reloadMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - it->start).count();
+		spdlog::info("Reloaded pipeline {} in {:.0f} ms", it->pending.name, reloadMs);
+
+		it = m_reloadingPipelines.erase(it);
+	}
+}
+
+void ModelManager::FinishReloadingPipelines(vkb::DispatchTable& disp, const std::vector<std::string>& discard)
+{
+	for (auto it = m_reloadingPipelines.begin(); it != m_reloadingPipelines.end();)
+	{
+		it->pending.pipeline.wait();
+		if (std::find(discard.begin(), discard.end(), it->pending.name) == discard.end())
+		{
+			++it;
+			continue;
+		}
+
+		// Never drawn with, it would only be swapped in to be replaced right after
+		disp.destroyPipeline(it->pending.pipeline.get(), nullptr);
+		it = m_reloadingPipelines.erase(it);
+	}
+}
+
+uint32_t ModelManager::GetPipelineVariant(uint32_t pipelineId, uint32_t keywords)
+{
+	// Called per draw, a hit is one hash lookup
+	PipelineConfig* base = GetPipeline(pipelineId);
+	if (!base || (keywords & base->variantKeywords) == base->variantKeywords)
+	{
+		return pipelineId;
+	}
+
+	uint64_t key = (static_cast<uint64_t>(pipelineId) << 32) | (keywords & base->variantKeywords);
+	auto it = m_variantIds.find(key);
+	if (it == m_variantIds.end())
+	{
+		RequestVariant(key, base->name);
+		return pipelineId;
+	}
+	return it->second != INVALID_PIPELINE_ID ? it->second : pipelineId;
+}
+
+void ModelManager::PrecompileVariants(const std::string& pipelineName, const std::vector<uint32_t>& keywordSets)
+{
+	auto base = m_pipelines.find(pipelineName);
+	if (base == m_pipelines.end())
+	{
+		spdlog::warn("Can't precompile variants of pipeline {}, it doesn't exist", pipelineName);
+		return;
+	}
+
+	uint32_t pipelineId = GetPipelineId(pipelineName);
+	uint32_t variantKeywords = base->second.variantKeywords;
+	for (uint32_t keywords: keywordSets)
+	{
+		if ((keywords & variantKeywords) != variantKeywords)
+		{
+			RequestVariant((static_cast<uint64_t>(pipelineId) << 32) | (keywords & variantKeywords), pipelineName);
+		}
+	}
+}
+
+void ModelManager::RequestVariant(uint64_t key, const std::string& baseName)
+{
+	if (m_variantIds.try_emplace(key, INVALID_PIPELINE_ID).second)
+	{
+		m_variantRequests.push_back({ key, baseName });
+		m_shaderVariants.GetStats().requested++;
+	}
+}
+
+uint32_t ModelManager::GetCompiledKeywordMask(VulkanContext& vulkanContext, ShaderManager& shaderManager, const std::string& spirvPath, VkShaderStageFlagBits stage)
+{
+	uint32_t mask = m_shaderVariants.GetDeclaredKeywords(spirvPath);
+	if (mask == 0)
+	{
+		return 0;
+	}
+
+	ShaderModule shaderModule = shaderManager.LoadShader(vulkanContext.GetDispatchTable(), spirvPath, stage);
+	for (const auto& constant: shaderManager.ParseShader(shaderModule).keywordConstants)
+	{
+		mask &= ~constant.keyword;
+	}
+	return mask;
+}
+
+void ModelManager::UpdatePipelineVariants(VulkanContext& vulkanContext, ShaderManager& shaderManager)
+{
+	vkb::DispatchTable& disp = vulkanContext.GetDispatchTable();
+
+	// Compiled variants become drawable, GetPipelineVariant hands them out from now on
+	for (auto it = m_variantBuilds.begin(); it != m_variantBuilds.end();)
+	{
+		if (it->pipeline.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		{
+			++it;
+			continue;
+		}
+
+		VkPipeline pipeline = it->pipeline.get();
+		if (pipeline == VK_NULL_HANDLE)
+		{
+			spdlog::warn("Failed to create pipeline variant {}, drawing with {} instead", it->name, it->recipe.variantOf);
+			m_shaderVariants.GetStats().failed++;
+			it = m_variantBuilds.erase(it);
+			continue;
+		}
+
+		it->config.pipeline = pipeline;
+		PipelineConfig& config = m_pipelines[it->name] = it->config;
+		m_pipelineRecipes[it->name] = it->recipe;
+
+		uint32_t variantId = GetPipelineId(it->name);
+		m_pipelinesById[variantId] = &config;
+		m_variantIds[it->key] = variantId;
+		m_shaderVariants.GetStats().created++;
+
+		spdlog::debug("Created pipeline variant: {}", it->name);
+		it = m_variantBuilds.erase(it);
+	}
+
+	// Variant SPIR-V is on disk: the layouts are created here and the pipelines compile on worker threads
+	if (m_variantSpirv.valid() && m_variantSpirv.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+	{
+		std::vector<std::string> failed;
+		for (const VariantSpirv& spirv: m_variantSpirv.get())
+		{
+			m_shaderVariants.RecordBuild(spirv.result, spirv.milliseconds);
+			if (spirv.result == ShaderVariants::BuildResult::Failed)
+			{
+				std::string variantPath = ShaderVariants::GetVariantPath(spirv.spirvPath, spirv.compiledKeywords, spirv.compiledMask);
+				spdlog::warn("Failed to build shader variant {}:\n{}", variantPath, spirv.log);
+				failed.push_back(variantPath);
+			}
+		}
+
+		for (VariantBuild& build: m_variantSpirvBuilds)
+		{
+			// It stays on the base pipeline, until a hot reload of its shaders gives it another try
+			if (std::any_of(build.recipe.shaderPaths.begin(), build.recipe.shaderPaths.end(), [&failed](const auto& shader) { return std::find(failed.begin(), failed.end(), shader.first) != failed.end(); }))
+			{
+				continue;
+			}
+
+			build.generator = CreatePipelineGenerator(build.name, vulkanContext, shaderManager, build.recipe);
+			build.config = build.generator->BuildLayout();
 
-	// Store the pipeline
-	m_pipelines[pipelineName] = config;
+			// Drawn with the base pipeline's descriptor sets
+			auto base = m_pipelines.find(build.recipe.variantOf);
+			if (base == m_pipelines.end() || build.config.descriptorSetLayouts != base->second.descriptorSetLayouts)
+			{
+				spdlog::warn("Pipeline variant {} has other descriptor sets than {}, keep the variant's resources declared", build.name, build.recipe.variantOf);
+				m_shaderVariants.GetStats().failed++;
+				continue;
+			}
+
+			PipelineGenerator* compileGenerator = build.generator.get();
+			build.pipeline = std::async(std::launch::async, [compileGenerator]() { return compileGenerator->CompilePipeline(); });
+			m_variantBuilds.push_back(std::move(build));
+		}
+		m_variantSpirvBuilds.clear();
+	}
+
+	// Queued variants: one job builds the SPIR-V all of them are missing
+	if (m_variantSpirv.valid() || m_variantRequests.empty())
+	{
+		return;
+	}
+
+	std::vector<VariantSpirv> jobs;
+	for (const VariantRequest& request: m_variantRequests)
+	{
+		auto baseRecipe = m_pipelineRecipes.find(request.baseName);
+		if (baseRecipe == m_pipelineRecipes.end())
+		{
+			continue;
+		}
+
+		VariantBuild build;
+		build.key = request.key;
+		build.recipe = baseRecipe->second;
+		build.recipe.keywords = static_cast<uint32_t>(request.key);
+		build.recipe.variantOf = request.baseName;
+		build.name = request.baseName + "#" + std::to_string(build.recipe.keywords);
+
+		for (auto& [shaderPath, shaderStage]: build.recipe.shaderPaths)
+		{
+			uint32_t compiledMask = GetCompiledKeywordMask(vulkanContext, shaderManager, shaderPath, shaderStage);
+			std::string variantPath = ShaderVariants::GetVariantPath(shaderPath, build.recipe.keywords, compiledMask);
+			if (variantPath == shaderPath)
+			{
+				continue;
+			}
+
+			if (std::none_of(jobs.begin(), jobs.end(), [&variantPath](const VariantSpirv& job) { return ShaderVariants::GetVariantPath(job.spirvPath, job.compiledKeywords, job.compiledMask) == variantPath; }))
+			{
+				jobs.push_back({ shaderPath, build.recipe.keywords & compiledMask, compiledMask });
+			}
+			shaderPath = variantPath;
+		}
+
+		m_variantSpirvBuilds.push_back(std::move(build));
+	}
+	m_variantRequests.clear();
+
+	// Mostly disk hits after the first run, glslc only runs for new combinations and changed sources
+	m_variantSpirv = std::async(std::launch::async,
+	        [jobs = std::move(jobs)]() mutable
+	        {
+		        for (VariantSpirv& job: jobs)
+		        {
+			        auto start = std::chrono::high_resolution_clock::now();
+			        job.result = ShaderVariants::BuildVariant(job.spirvPath, job.compiledKeywords, job.compiledMask, job.log);
+			        job.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		        }
+		        return jobs;
+	        });
+}
+
+std::vector<std::pair<std::string, VkShaderStageFlagBits>> ModelManager::DropPipelineVariants(vkb::DispatchTable& disp, const std::vector<std::string>& baseNames)
+{
+	auto dropped = [&baseNames](const std::string& baseName) { return baseNames.empty() || std::find(baseNames.begin(), baseNames.end(), baseName) != baseNames.end(); };
+
+	m_variantRequests.erase(std::remove_if(m_variantRequests.begin(), m_variantRequests.end(), [&dropped](const VariantRequest& request) { return dropped(request.baseName); }), m_variantRequests.end());
+	m_variantSpirvBuilds.erase(std::remove_if(m_variantSpirvBuilds.begin(), m_variantSpirvBuilds.end(), [&dropped](const VariantBuild& build) { return dropped(build.recipe.variantOf); }), m_variantSpirvBuilds.end());
+
+	// Nothing may still compile from the modules the caller is about to replace
+	for (auto it = m_variantBuilds.begin(); it != m_variantBuilds.end();)
+	{
+		if (!dropped(it->recipe.variantOf))
+		{
+			++it;
+			continue;
+		}
+		disp.destroyPipeline(it->pipeline.get(), nullptr);
+		it = m_variantBuilds.erase(it);
+	}
+
+	std::vector<std::pair<std::string, VkShaderStageFlagBits>> variantShaders;
+	for (auto it = m_pipelineRecipes.begin(); it != m_pipelineRecipes.end();)
+	{
+		if (it->second.variantOf.empty() || !dropped(it->second.variantOf))
+		{
+			++it;
+			continue;
+		}
+
+		// Only the stages that had their own SPIR-V, the others share the base pipeline's modules
+		auto baseRecipe = m_pipelineRecipes.find(it->second.variantOf);
+		for (size_t i = 0; i < it->second.shaderPaths.size(); i++)
+		{
+			if (baseRecipe == m_pipelineRecipes.end() || baseRecipe->second.shaderPaths[i].first != it->second.shaderPaths[i].first)
+			{
+				variantShaders.push_back(it->second.shaderPaths[i]);
+			}
+		}
+
+		auto config = m_pipelines.find(it->first);
+		if (config != m_pipelines.end())
+		{
+			m_retiredPipelines.push_back({ config->second.pipeline, MAX_FRAMES_IN_FLIGHT });
+			m_pipelinesById[GetPipelineId(it->first)] = nullptr;
+			m_pipelines.erase(config);
+		}
+		it = m_pipelineRecipes.erase(it);
+	}
+
+	if (baseNames.empty())
+	{
+		m_variantIds.clear();
+	}
+	else
+	{
+		for (const std::string& baseName: baseNames)
+		{
+			uint64_t baseId = GetPipelineId(baseName);
+			std::erase_if(m_variantIds, [baseId](const auto& variant) { return (variant.first >> 32) == baseId; });
+		}
+	}
 
-	spdlog::debug("Created pipeline: {}", pipelineName);
+	return variantShaders;
 }
 
 ModelResource* ModelManager::CreateLinePlane(VmaAllocator allocator)
@@ -1241,11 +1703,8 @@ ModelResource* ModelManager::CreateCylinder(VmaAllocator allocator, float radius
 	return &m_modelResources[name];
 }
 
-int ModelManager::DrawModel(vkb::DispatchTable& disp, VkCommandBuffer& cmd, const ModelResource& model)
+int ModelManager::DrawModel(vkb::DispatchTable& disp, VkCommandBuffer& cmd, const ModelResource& model, uint32_t instanceCount, uint32_t firstInstance)
 {
-	VkDeviceSize offsets[] = { 0 };
-	disp.cmdBindVertexBuffers(cmd, 0, 1, &model.vertexBuffer, offsets);
-	disp.cmdBindIndexBuffer(cmd, model.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-	disp.cmdDrawIndexed(cmd, static_cast<uint32_t>(model.indices.size()), 1, 0, 0, 0);
+	disp.cmdDrawIndexed(cmd, model.indexCount, instanceCount, model.firstIndex, model.vertexOffset, firstInstance);
 	return 0;
 }
@@ -0,0 +1,138 @@
+#include "OffsetAllocator.h"
+
+#include <spdlog/spdlog.h>
+
+OffsetAllocator::OffsetAllocator(uint32_t capacity)
+{
+	Reset(capacity);
+}
+
+void OffsetAllocator::Reset(uint32_t capacity)
+{
+	m_freeByOffset.clear();
+	m_freeBySize.clear();
+	m_allocations.clear();
+
+	m_capacity = capacity;
+	m_used = 0;
+
+	if (capacity > 0)
+	{
+		InsertFreeRange(0, capacity);
+	}
+}
+
+void OffsetAllocator::Grow(uint32_t newCapacity)
+{
+	if (newCapacity <= m_capacity)
+	{
+		return;
+	}
+
+	uint32_t offset = m_capacity;
+	uint32_t size = newCapacity - m_capacity;
+	m_capacity = newCapacity;
+
+	// Merge with a free range touching the old end
+	auto last = m_freeByOffset.empty() ? m_freeByOffset.end() : std::prev(m_freeByOffset.end());
+	if (last != m_freeByOffset.end() && last->first + last->second == offset)
+	{
+		offset = last->first;
+		size += last->second;
+		EraseFreeRange(last);
+	}
+
+	InsertFreeRange(offset, size);
+}
+
+uint32_t OffsetAllocator::Allocate(uint32_t size)
+{
+	if (size == 0)
+	{
+		return INVALID_OFFSET;
+	}
+
+	// Smallest free range that fits, lowest offset on ties
+	auto best = m_freeBySize.lower_bound({ size, 0 });
+	if (best == m_freeBySize.end())
+	{
+		return INVALID_OFFSET;
+	}
+
+	uint32_t rangeSize = best->first;
+	uint32_t offset = best->second;
+	EraseFreeRange(m_freeByOffset.find(offset));
+
+	if (rangeSize > size)
+	{
+		InsertFreeRange(offset + size, rangeSize - size);
+	}
+
+	m_allocations[offset] = size;
+	m_used += size;
+	return offset;
+}
+
+void OffsetAllocator::Free(uint32_t offset)
+{
+	auto allocation = m_allocations.find(offset);
+	if (allocation == m_allocations.end())
+	{
+		spdlog::error("OffsetAllocator: freeing unknown offset {}", offset);
+		return;
+	}
+
+	uint32_t size = allocation->second;
+	m_allocations.erase(allocation);
+	m_used -= size;
+
+	// Merge with the free ranges on either side
+	auto next = m_freeByOffset.lower_bound(offset);
+	if (next != m_freeByOffset.end() && offset + size == next->first)
+	{
+		size += next->second;
+		next = EraseFreeRange(next);
+	}
+
+	if (next != m_freeByOffset.begin())
+	{
+		auto prev = std::prev(next);
+		if (prev->first + prev->second == offset)
+		{
+			offset = prev->first;
+			size += prev->second;
+			EraseFreeRange(prev);
+		}
+	}
+
+	InsertFreeRange(offset, size);
+}
+
+uint32_t OffsetAllocator::GetAllocationSize(uint32_t offset) const
+{
+	auto allocation = m_allocations.find(offset);
+	return allocation == m_allocations.end() ? 0 : allocation->second;
+}
+
+OffsetAllocator::Stats OffsetAllocator::GetStats() const
+{
+	Stats stats;
+	stats.capacity = m_capacity;
+	stats.used = m_used;
+	stats.allocations = static_cast<uint32_t>(m_allocations.size());
+	stats.freeRanges = static_cast<uint32_t>(m_freeByOffset.size());
+	stats.largestFreeRange = m_freeBySize.empty() ? 0 : m_freeBySize.rbegin()->first;
+	return stats;
+}
+
+void OffsetAllocator::InsertFreeRange(uint32_t offset, uint32_t size)
+{
+	m_freeByOffset[offset] = size;
+	m_freeBySize.insert({ size, offset });
+}
+
+std::map<uint32_t, uint32_t>::iterator OffsetAllocator::EraseFreeRange(std::map<uint32_t, uint32_t>::iterator it)
+{
+	m_freeBySize.erase({ it->second, it->first });
+	return m_freeByOffset.erase(it);
+}
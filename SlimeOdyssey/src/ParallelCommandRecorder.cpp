@@ -0,0 +1,234 @@
+#include "ParallelCommandRecorder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <spdlog/spdlog.h>
+#include <VkBootstrap.h>
+
+#include "VulkanUtil.h"
+
+// More threads than this rarely pays off, the primary still executes the chunks one after another
+constexpr uint32_t MAX_RECORDING_THREADS = 16;
+
+uint32_t ParallelCommandRecorder::DefaultThreadCount()
+{
+	return std::clamp(std::thread::hardware_concurrency(), 1u, MAX_RECORDING_THREADS);
+}
+
+ParallelCommandRecorder::~ParallelCommandRecorder()
+{
+	StopWorkers();
+}
+
+void ParallelCommandRecorder::Init(vkb::DispatchTable& disp, uint32_t queueFamilyIndex, uint32_t frameCount, uint32_t threadCount)
+{
+	m_threadCount = std::max(threadCount, 1u);
+	m_pools.resize(frameCount);
+
+	for (auto& framePools: m_pools)
+	{
+		framePools.resize(m_threadCount);
+		for (ThreadPool& threadPool: framePools)
+		{
+			VkCommandPoolCreateInfo poolInfo = {};
+			poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+			poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+			poolInfo.queueFamilyIndex = queueFamilyIndex;
+			VK_CHECK(disp.createCommandPool(&poolInfo, nullptr, &threadPool.pool));
+		}
+	}
+
+	// Thread 0 is whoever calls Record
+	m_stopping = false;
+	for (uint32_t threadIndex = 1; threadIndex < m_threadCount; threadIndex++)
+	{
+		m_workers.emplace_back(&ParallelCommandRecorder::WorkerLoop, this, threadIndex);
+	}
+
+	spdlog::debug("Recording command buffers on {} threads", m_threadCount);
+}
+
+void ParallelCommandRecorder::Cleanup(vkb::DispatchTable& disp)
+{
+	StopWorkers();
+
+	for (auto& framePools: m_pools)
+	{
+		for (ThreadPool& threadPool: framePools)
+		{
+			// Destroying the pool frees its command buffers
+			disp.destroyCommandPool(threadPool.pool, nullptr);
+		}
+	}
+
+	m_pools.clear();
+	m_commandBuffers.clear();
+	m_stats = {};
+}
+
+void ParallelCommandRecorder::BeginFrame(vkb::DispatchTable& disp, uint32_t frameIndex)
+{
+	m_frameIndex = frameIndex;
+
+	for (ThreadPool& threadPool: m_pools[frameIndex])
+	{
+		if (threadPool.used > 0)
+		{
+			VK_CHECK(disp.resetCommandPool(threadPool.pool, 0));
+			threadPool.used = 0;
+		}
+	}
+}
+
+const std::vector<VkCommandBuffer>& ParallelCommandRecorder::Record(vkb::DispatchTable& disp, const VkCommandBufferInheritanceRenderingInfo& renderingInfo, uint32_t itemCount, uint32_t minChunkSize, const RecordFunction& record)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	m_commandBuffers.clear();
+	m_stats.items = itemCount;
+	m_stats.chunks = 0;
+	if (itemCount == 0)
+	{
+		m_stats.recordMs = 0.0;
+		return m_commandBuffers;
+	}
+
+	minChunkSize = std::max(minChunkSize, 1u);
+	uint32_t chunkCount = std::min(m_threadCount, (itemCount + minChunkSize - 1) / minChunkSize);
+
+	m_commandBuffers.resize(chunkCount);
+
+	// Idle workers may still be looking at the job, so it is only changed under the lock
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_disp = &disp;
+		m_record = &record;
+		m_renderingInfo = renderingInfo;
+		m_renderingInfo.pNext = nullptr;
+		m_itemCount = itemCount;
+		m_chunkCount = chunkCount;
+
+		if (chunkCount > 1)
+		{
+			m_pendingChunks = chunkCount - 1;
+			m_generation++;
+		}
+	}
+
+	if (chunkCount > 1)
+	{
+		m_workReady.notify_all();
+	}
+
+	RecordChunk(0);
+
+	if (chunkCount > 1)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_workDone.wait(lock, [this] { return m_pendingChunks == 0; });
+	}
+
+	m_stats.chunks = chunkCount;
+	m_stats.commandBuffers = 0;
+	for (const auto& framePools: m_pools)
+	{
+		for (const ThreadPool& threadPool: framePools)
+		{
+			m_stats.commandBuffers += static_cast<uint32_t>(threadPool.buffers.size());
+		}
+	}
+	m_stats.recordMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+	return m_commandBuffers;
+}
+
+void ParallelCommandRecorder::WorkerLoop(uint32_t threadIndex)
+{
+	uint64_t seenGeneration = 0;
+
+	while (true)
+	{
+		uint32_t chunkCount;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_workReady.wait(lock, [&] { return m_stopping || m_generation != seenGeneration; });
+			if (m_stopping)
+			{
+				return;
+			}
+			seenGeneration = m_generation;
+			chunkCount = m_chunkCount;
+		}
+
+		// Small jobs don't have a chunk for every thread
+		if (threadIndex >= chunkCount)
+		{
+			continue;
+		}
+
+		RecordChunk(threadIndex);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (--m_pendingChunks == 0)
+		{
+			m_workDone.notify_one();
+		}
+	}
+}
+
+void ParallelCommandRecorder::RecordChunk(uint32_t chunkIndex)
+{
+	// Chunk i is always recorded by thread i, so it has the pool to itself
+	VkCommandBuffer cmd = AcquireCommandBuffer(chunkIndex);
+
+	VkCommandBufferInheritanceInfo inheritanceInfo = {};
+	inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritanceInfo.pNext = &m_renderingInfo;
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+	beginInfo.pInheritanceInfo = &inheritanceInfo;
+	VK_CHECK(m_disp->beginCommandBuffer(cmd, &beginInfo));
+
+	uint32_t firstItem = static_cast<uint32_t>(static_cast<uint64_t>(m_itemCount) * chunkIndex / m_chunkCount);
+	uint32_t endItem = static_cast<uint32_t>(static_cast<uint64_t>(m_itemCount) * (chunkIndex + 1) / m_chunkCount);
+	(*m_record)(cmd, firstItem, endItem - firstItem);
+
+	VK_CHECK(m_disp->endCommandBuffer(cmd));
+	m_commandBuffers[chunkIndex] = cmd;
+}
+
+VkCommandBuffer ParallelCommandRecorder::AcquireCommandBuffer(uint32_t threadIndex)
+{
+	ThreadPool& threadPool = m_pools[m_frameIndex][threadIndex];
+	if (threadPool.used == threadPool.buffers.size())
+	{
+		VkCommandBufferAllocateInfo allocInfo = {};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = threadPool.pool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+		allocInfo.commandBufferCount = 1;
+
+		VkCommandBuffer cmd;
+		VK_CHECK(m_disp->allocateCommandBuffers(&allocInfo, &cmd));
+		threadPool.buffers.push_back(cmd);
+	}
+
+	return threadPool.buffers[threadPool.used++];
+}
+
+void ParallelCommandRecorder::StopWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_workReady.notify_all();
+
+	for (std::thread& worker: m_workers)
+	{
+		worker.join();
+	}
+	m_workers.clear();
+}
@@ -0,0 +1,205 @@
+#include "PipelineCache.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <spdlog/spdlog.h>
+
+#include "VkBootstrapDispatch.h"
+#include "VulkanUtil.h"
+
+// "SLPC", bump the version whenever PipelineCacheFileHeader changes
+constexpr uint32_t PIPELINE_CACHE_MAGIC = 0x43504C53;
+constexpr uint32_t PIPELINE_CACHE_VERSION = 1;
+
+struct PipelineCacheFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	PipelineCache::DeviceIdentity identity;
+	uint64_t dataSize;
+	uint64_t dataHash;
+};
+
+static uint64_t HashPipelineCacheData(const uint8_t* data, size_t size)
+{
+	// FNV-1a, only there to catch truncated or corrupted files
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+void PipelineCache::Init(const vkb::DispatchTable& disp, const DeviceIdentity& identity, const std::string& path)
+{
+	m_identity = identity;
+	m_path = path;
+	m_stats = {};
+
+	std::vector<uint8_t> cacheData;
+	std::ifstream file(m_path, std::ios::binary);
+	if (file)
+	{
+		std::vector<uint8_t> fileData((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		std::string error;
+		if (Deserialize(fileData, m_identity, cacheData, error))
+		{
+			m_stats.loadedBytes = cacheData.size();
+			m_stats.loadResult = "Loaded " + m_path;
+		}
+		else
+		{
+			cacheData.clear();
+			m_stats.loadResult = "Discarded " + m_path + ": " + error;
+		}
+	}
+	else
+	{
+		m_stats.loadResult = "No cache at " + m_path;
+	}
+	spdlog::debug("Pipeline cache: {}", m_stats.loadResult);
+
+	VkPipelineCacheCreateInfo cacheInfo{};
+	cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	cacheInfo.initialDataSize = cacheData.size();
+	cacheInfo.pInitialData = cacheData.empty() ? nullptr : cacheData.data();
+
+	// Not externally synchronized, pipelines are compiled from several threads at once
+	if (disp.createPipelineCache(&cacheInfo, nullptr, &m_cache) != VK_SUCCESS && !cacheData.empty())
+	{
+		spdlog::warn("The driver rejected the pipeline cache, starting with an empty one");
+		cacheInfo.initialDataSize = 0;
+		cacheInfo.pInitialData = nullptr;
+		VK_CHECK(disp.createPipelineCache(&cacheInfo, nullptr, &m_cache));
+	}
+}
+
+void PipelineCache::Save(const vkb::DispatchTable& disp)
+{
+	if (m_cache == VK_NULL_HANDLE)
+	{
+		return;
+	}
+
+	size_t size = 0;
+	VK_CHECK(disp.getPipelineCacheData(m_cache, &size, nullptr));
+	std::vector<uint8_t> cacheData(size);
+	VK_CHECK(disp.getPipelineCacheData(m_cache, &size, cacheData.data()));
+	cacheData.resize(size);
+
+	std::vector<uint8_t> fileData = Serialize(m_identity, cacheData);
+
+	// Write next to the old file and swap it in, a crash mid write never leaves a half written cache behind
+	std::string tempPath = m_path + ".tmp";
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		if (!file.write(reinterpret_cast<const char*>(fileData.data()), static_cast<std::streamsize>(fileData.size())))
+		{
+			spdlog::warn("Failed to write the pipeline cache to {}", tempPath);
+			return;
+		}
+	}
+
+	std::error_code error;
+	std::filesystem::rename(tempPath, m_path, error);
+	if (error)
+	{
+		spdlog::warn("Failed to replace the pipeline cache at {}: {}", m_path, error.message());
+		return;
+	}
+
+	m_stats.savedBytes = cacheData.size();
+	spdlog::debug("Saved {} bytes of pipeline cache to {}", size, m_path);
+}
+
+void PipelineCache::Cleanup(const vkb::DispatchTable& disp)
+{
+	if (m_cache != VK_NULL_HANDLE)
+	{
+		disp.destroyPipelineCache(m_cache, nullptr);
+	}
+	m_cache = VK_NULL_HANDLE;
+}
+
+std::vector<uint8_t> PipelineCache::Serialize(const DeviceIdentity& identity, const std::vector<uint8_t>& cacheData)
+{
+	PipelineCacheFileHeader header{};
+	header.magic = PIPELINE_CACHE_MAGIC;
+	header.version = PIPELINE_CACHE_VERSION;
+	header.identity = identity;
+	header.dataSize = cacheData.size();
+	header.dataHash = HashPipelineCacheData(cacheData.data(), cacheData.size());
+
+	std::vector<uint8_t> file(sizeof(header) + cacheData.size());
+	std::memcpy(file.data(), &header, sizeof(header));
+	if (!cacheData.empty())
+	{
+		std::memcpy(file.data() + sizeof(header), cacheData.data(), cacheData.size());
+	}
+	return file;
+}
+
+bool PipelineCache::Deserialize(const std::vector<uint8_t>& file, const DeviceIdentity& identity, std::vector<uint8_t>& cacheData, std::string& error)
+{
+	PipelineCacheFileHeader header;
+	if (file.size() < sizeof(header))
+	{
+		error = "file too small";
+		return false;
+	}
+	std::memcpy(&header, file.data(), sizeof(header));
+
+	if (header.magic != PIPELINE_CACHE_MAGIC || header.version != PIPELINE_CACHE_VERSION)
+	{
+		error = "unknown format";
+		return false;
+	}
+	if (header.identity.vendorID != identity.vendorID || header.identity.deviceID != identity.deviceID)
+	{
+		error = "made on another device";
+		return false;
+	}
+	if (header.identity.driverVersion != identity.driverVersion || std::memcmp(header.identity.driverUUID, identity.driverUUID, VK_UUID_SIZE) != 0)
+	{
+		error = "made by another driver";
+		return false;
+	}
+	if (std::memcmp(header.identity.pipelineCacheUUID, identity.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+	{
+		error = "pipeline cache UUID changed";
+		return false;
+	}
+	if (header.dataSize != file.size() - sizeof(header))
+	{
+		error = "truncated";
+		return false;
+	}
+
+	const uint8_t* data = file.data() + sizeof(header);
+	if (HashPipelineCacheData(data, header.dataSize) != header.dataHash)
+	{
+		error = "checksum mismatch";
+		return false;
+	}
+
+	// The driver's own header should agree with ours, if it doesn't the blob came from somewhere else
+	VkPipelineCacheHeaderVersionOne driverHeader;
+	if (header.dataSize < sizeof(driverHeader))
+	{
+		error = "no driver header";
+		return false;
+	}
+	std::memcpy(&driverHeader, data, sizeof(driverHeader));
+	if (driverHeader.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE || driverHeader.vendorID != identity.vendorID || driverHeader.deviceID != identity.deviceID ||
+	        std::memcmp(driverHeader.pipelineCacheUUID, identity.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+	{
+		error = "driver header mismatch";
+		return false;
+	}
+
+	cacheData.assign(data, data + header.dataSize);
+	return true;
+}
@@ -2,6 +2,7 @@
 
 #include <stdexcept>
 
+#include "LayoutRegistry.h"
 #include "spdlog/spdlog.h"
 #include "VulkanContext.h"
 #include "VulkanUtil.h"
@@ -25,7 +26,12 @@ PipelineGenerator& PipelineGenerator::SetShaderStages(const std::vector<VkPipeli
 
 PipelineGenerator& PipelineGenerator::SetVertexInputState(const VkPipelineVertexInputStateCreateInfo& vertexInputInfo)
 {
+	m_vertexBindings.assign(vertexInputInfo.pVertexBindingDescriptions, vertexInputInfo.pVertexBindingDescriptions + vertexInputInfo.vertexBindingDescriptionCount);
+	m_vertexAttributes.assign(vertexInputInfo.pVertexAttributeDescriptions, vertexInputInfo.pVertexAttributeDescriptions + vertexInputInfo.vertexAttributeDescriptionCount);
+
 	m_vertexInputState = vertexInputInfo;
+	m_vertexInputState->pVertexBindingDescriptions = m_vertexBindings.data();
+	m_vertexInputState->pVertexAttributeDescriptions = m_vertexAttributes.data();
 	return *this;
 }
 
@@ -61,13 +67,19 @@ PipelineGenerator& PipelineGenerator::SetDepthStencilState(const VkPipelineDepth
 
 PipelineGenerator& PipelineGenerator::SetColorBlendState(const VkPipelineColorBlendStateCreateInfo& colorBlending)
 {
+	m_colorBlendAttachments.assign(colorBlending.pAttachments, colorBlending.pAttachments + colorBlending.attachmentCount);
+
 	m_colorBlendState = colorBlending;
+	m_colorBlendState->pAttachments = m_colorBlendAttachments.data();
 	return *this;
 }
 
 PipelineGenerator& PipelineGenerator::SetDynamicState(const VkPipelineDynamicStateCreateInfo& dynamicState)
 {
+	m_dynamicStates.assign(dynamicState.pDynamicStates, dynamicState.pDynamicStates + dynamicState.dynamicStateCount);
+
 	m_dynamicState = dynamicState;
+	m_dynamicState->pDynamicStates = m_dynamicStates.data();
 	return *this;
 }
 
@@ -77,6 +89,12 @@ PipelineGenerator& PipelineGenerator::SetLayout(VkPipelineLayout layout)
 	return *this;
 }
 
+PipelineGenerator& PipelineGenerator::SetLayoutRegistry(LayoutRegistry& layoutRegistry)
+{
+	m_layoutRegistry = &layoutRegistry;
+	return *this;
+}
+
 PipelineGenerator& PipelineGenerator::SetRenderPass(VkRenderPass renderPass, uint32_t subpass)
 {
 	m_renderPass = renderPass;
@@ -93,7 +111,10 @@ PipelineGenerator& PipelineGenerator::SetBasePipeline(VkPipeline basePipeline, i
 
 PipelineGenerator& PipelineGenerator::SetRenderingInfo(VkPipelineRenderingCreateInfo renderingInfo)
 {
+	m_colorAttachmentFormats.assign(renderingInfo.pColorAttachmentFormats, renderingInfo.pColorAttachmentFormats + renderingInfo.colorAttachmentCount);
+
 	m_renderingInfo = renderingInfo;
+	m_renderingInfo->pColorAttachmentFormats = m_colorAttachmentFormats.empty() ? nullptr : m_colorAttachmentFormats.data();
 	return *this;
 }
 
@@ -174,8 +195,7 @@ PipelineGenerator& PipelineGenerator::SetDefaultColorBlendState()
 	colorBlending.logicOpEnable = VK_FALSE;
 	colorBlending.attachmentCount = 1;
 	colorBlending.pAttachments = &colorBlendAttachment;
-	m_colorBlendState = colorBlending;
-	return *this;
+	return SetColorBlendState(colorBlending);
 }
 
 PipelineGenerator& PipelineGenerator::SetDefaultDynamicState()
@@ -186,8 +206,7 @@ PipelineGenerator& PipelineGenerator::SetDefaultDynamicState()
 	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
 	dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
 	dynamicState.pDynamicStates = dynamicStates.data();
-	m_dynamicState = dynamicState;
-	return *this;
+	return SetDynamicState(dynamicState);
 }
 
 PipelineGenerator& PipelineGenerator::AddDynamicState(VkDynamicState state)
@@ -196,10 +215,9 @@ PipelineGenerator& PipelineGenerator::AddDynamicState(VkDynamicState state)
 	{
 		SetDefaultDynamicState();
 	}
-	auto& dynamicStates = const_cast<std::vector<VkDynamicState>&>(*reinterpret_cast<const std::vector<VkDynamicState>*>(m_dynamicState->pDynamicStates));
-	dynamicStates.push_back(state);
-	m_dynamicState->dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
-	m_dynamicState->pDynamicStates = dynamicStates.data();
+	m_dynamicStates.push_back(state);
+	m_dynamicState->dynamicStateCount = static_cast<uint32_t>(m_dynamicStates.size());
+	m_dynamicState->pDynamicStates = m_dynamicStates.data();
 	return *this;
 }
 
@@ -259,7 +277,7 @@ PipelineGenerator& PipelineGenerator::SetBlendEnable(bool enable)
 	{
 		SetDefaultColorBlendState();
 	}
-	auto& attachment = const_cast<VkPipelineColorBlendAttachmentState&>(*m_colorBlendState->pAttachments);
+	auto& attachment = m_colorBlendAttachments[0];
 	attachment.blendEnable = enable ? VK_TRUE : VK_FALSE;
 	return *this;
 }
@@ -270,7 +288,7 @@ PipelineGenerator& PipelineGenerator::SetColorBlendOp(VkBlendOp op)
 	{
 		SetDefaultColorBlendState();
 	}
-	auto& attachment = const_cast<VkPipelineColorBlendAttachmentState&>(*m_colorBlendState->pAttachments);
+	auto& attachment = m_colorBlendAttachments[0];
 	attachment.colorBlendOp = op;
 	return *this;
 }
@@ -281,7 +299,7 @@ PipelineGenerator& PipelineGenerator::SetAlphaBlendOp(VkBlendOp op)
 	{
 		SetDefaultColorBlendState();
 	}
-	auto& attachment = const_cast<VkPipelineColorBlendAttachmentState&>(*m_colorBlendState->pAttachments);
+	auto& attachment = m_colorBlendAttachments[0];
 	attachment.alphaBlendOp = op;
 	return *this;
 }
@@ -298,8 +316,21 @@ PipelineGenerator& PipelineGenerator::SetPushConstantRanges(const std::vector<Vk
 	return *this;
 }
 
+PipelineGenerator& PipelineGenerator::SetSpecialization(VkShaderStageFlagBits stage, const std::vector<VkSpecializationMapEntry>& entries, const std::vector<uint8_t>& data)
+{
+	m_specializations[stage] = { entries, data };
+	return *this;
+}
+
 void PipelineGenerator::CreatePipelineLayout()
 {
+	// Shared with every pipeline that has the same sets and push constants, so it isn't named after this one
+	if (m_layoutRegistry)
+	{
+		m_layout = m_layoutRegistry->GetPipelineLayout(m_disp, m_descriptorSetLayouts, m_pushConstantRanges);
+		return;
+	}
+
 	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
 	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
 	pipelineLayoutInfo.setLayoutCount = static_cast<uint32_t>(m_descriptorSetLayouts.size());
@@ -311,12 +342,42 @@ void PipelineGenerator::CreatePipelineLayout()
 	m_vulkanContext.GetDebugUtils().SetObjectName(m_layout, m_name + " Pipeline Layout");
 }
 
-void PipelineGenerator::CreatePipeline()
+VkPipeline PipelineGenerator::CompilePipeline()
 {
+	// Stages with specialization constants point at infos local to this compile
+	std::vector<VkPipelineShaderStageCreateInfo> shaderStages = m_shaderStages;
+	std::vector<VkSpecializationInfo> specializationInfos(shaderStages.size());
+	for (size_t i = 0; i < shaderStages.size(); i++)
+	{
+		auto specialization = m_specializations.find(shaderStages[i].stage);
+		if (specialization != m_specializations.end())
+		{
+			specializationInfos[i].mapEntryCount = static_cast<uint32_t>(specialization->second.entries.size());
+			specializationInfos[i].pMapEntries = specialization->second.entries.data();
+			specializationInfos[i].dataSize = specialization->second.data.size();
+			specializationInfos[i].pData = specialization->second.data.data();
+			shaderStages[i].pSpecializationInfo = &specializationInfos[i];
+		}
+	}
+
+	// A lone compute stage is all a compute pipeline needs, none of the graphics state applies to it
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	if (shaderStages.size() == 1 && shaderStages[0].stage == VK_SHADER_STAGE_COMPUTE_BIT)
+	{
+		VkComputePipelineCreateInfo computeInfo{};
+		computeInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+		computeInfo.stage = shaderStages[0];
+		computeInfo.layout = m_layout;
+		VK_CHECK(m_disp.createComputePipelines(m_vulkanContext.GetPipelineCache(), 1, &computeInfo, nullptr, &pipeline));
+
+		m_vulkanContext.GetDebugUtils().SetObjectName(pipeline, (m_name + " Pipeline"));
+		return pipeline;
+	}
+
 	VkGraphicsPipelineCreateInfo pipelineInfo{};
 	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-	pipelineInfo.stageCount = static_cast<uint32_t>(m_shaderStages.size());
-	pipelineInfo.pStages = m_shaderStages.data();
+	pipelineInfo.stageCount = static_cast<uint32_t>(shaderStages.size());
+	pipelineInfo.pStages = shaderStages.data();
 	pipelineInfo.pVertexInputState = m_vertexInputState ? &*m_vertexInputState : nullptr;
 	pipelineInfo.pInputAssemblyState = m_inputAssemblyState ? &*m_inputAssemblyState : nullptr;
 	pipelineInfo.pViewportState = m_viewportState ? &*m_viewportState : nullptr;
@@ -330,27 +391,38 @@ void PipelineGenerator::CreatePipeline()
 	pipelineInfo.subpass = m_subpass;
 	pipelineInfo.basePipelineHandle = m_basePipeline;
 	pipelineInfo.basePipelineIndex = m_basePipelineIndex;
-	pipelineInfo.pNext = &m_renderingInfo;
+	pipelineInfo.pNext = m_renderingInfo ? &*m_renderingInfo : nullptr;
 
-	VK_CHECK(m_disp.createGraphicsPipelines(VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &m_basePipeline));
+	// Through the shared cache, a warm start finds most pipelines already compiled in there
+	VK_CHECK(m_disp.createGraphicsPipelines(m_vulkanContext.GetPipelineCache(), 1, &pipelineInfo, nullptr, &pipeline));
 
-	m_vulkanContext.GetDebugUtils().SetObjectName(m_basePipeline, (m_name + " Pipeline"));
+	// Fine from any thread, nothing else knows about the pipeline yet
+	m_vulkanContext.GetDebugUtils().SetObjectName(pipeline, (m_name + " Pipeline"));
+	return pipeline;
 }
 
 PipelineConfig PipelineGenerator::Build()
+{
+	PipelineConfig config = BuildLayout();
+
+	// Create the graphics or compute pipeline
+	config.pipeline = CompilePipeline();
+
+	return config;
+}
+
+PipelineConfig PipelineGenerator::BuildLayout()
 {
 	// Create pipeline layout
 	CreatePipelineLayout();
 
-	// Create the graphics pipeline
-	CreatePipeline();
-
-	// Create and return the PipelineConfig
+	// Create and return the PipelineConfig, the pipeline is filled in once compiled
 	PipelineConfig config;
 	config.name = m_name;
 	config.pipelineLayout = m_layout;
-	config.pipeline = m_basePipeline;
+	config.pipeline = VK_NULL_HANDLE;
 	config.descriptorSetLayouts = m_descriptorSetLayouts;
+	config.pushConstantRanges = m_pushConstantRanges;
 
 	return config;
 }
@@ -368,10 +440,18 @@ void PipelineGenerator::Reset()
 	m_colorBlendState.reset();
 	m_dynamicState.reset();
 	m_layout = VK_NULL_HANDLE;
+	m_layoutRegistry = nullptr;
 	m_renderPass = VK_NULL_HANDLE;
 	m_subpass = 0;
 	m_basePipeline = VK_NULL_HANDLE;
 	m_basePipelineIndex = -1;
+	m_renderingInfo.reset();
 	m_descriptorSetLayouts.clear();
 	m_pushConstantRanges.clear();
+	m_vertexBindings.clear();
+	m_vertexAttributes.clear();
+	m_colorBlendAttachments.clear();
+	m_dynamicStates.clear();
+	m_colorAttachmentFormats.clear();
+	m_specializations.clear();
 }
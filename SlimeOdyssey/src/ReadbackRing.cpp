@@ -0,0 +1,155 @@
+#include "ReadbackRing.h"
+
+#include <algorithm>
+#include <bit>
+#include <spdlog/spdlog.h>
+
+#include "imgui.h"
+#include "VulkanDebugUtils.h"
+#include "VulkanUtil.h"
+
+// Smallest per frame capacity, grows to the next power of two that fits after that
+constexpr VkDeviceSize MIN_READBACK_CAPACITY = 4 * 1024;
+// Copies to buffers of depth/stencil and block compressed images need offsets aligned to 4 and the texel size
+constexpr VkDeviceSize READBACK_ALIGNMENT = 16;
+
+void ReadbackRing::Cleanup(VmaAllocator allocator)
+{
+	for (Frame& frame: m_frames)
+	{
+		if (frame.buffer != VK_NULL_HANDLE)
+		{
+			vmaDestroyBuffer(allocator, frame.buffer, frame.allocation);
+		}
+	}
+
+	m_frames.clear();
+	m_requiredCapacity = 0;
+}
+
+void ReadbackRing::BeginFrame(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, VkFence frameFence, uint32_t frameIndex, uint32_t frameCount)
+{
+	if (m_frames.size() != frameCount)
+	{
+		// Only ever happens before anything was requested, Cleanup needs the device idle as well
+		Cleanup(allocator);
+		m_frames.resize(frameCount);
+	}
+
+	m_stats.delivered = 0;
+
+	// This frame was submitted first and its fence has been waited on. The ones after it may have finished
+	// too, they are delivered in submission order so callbacks never see an older result after a newer one.
+	Frame& frame = m_frames[frameIndex];
+	Deliver(allocator, frame);
+
+	for (uint32_t i = 1; i < frameCount; i++)
+	{
+		Frame& later = m_frames[(frameIndex + i) % frameCount];
+		if (later.pending.empty())
+		{
+			continue;
+		}
+		if (disp.getFenceStatus(later.fence) != VK_SUCCESS)
+		{
+			break;
+		}
+		Deliver(allocator, later);
+	}
+
+	// Nothing is left in this frame's buffer, it can grow without waiting for the device
+	if (frame.buffer == VK_NULL_HANDLE || frame.capacity < m_requiredCapacity)
+	{
+		if (frame.buffer != VK_NULL_HANDLE)
+		{
+			vmaDestroyBuffer(allocator, frame.buffer, frame.allocation);
+		}
+
+		frame.capacity = std::bit_ceil(std::max({ frame.capacity, m_requiredCapacity, MIN_READBACK_CAPACITY }));
+		frame.mappedData = static_cast<uint8_t*>(SlimeUtil::CreateMappedBuffer(m_name, allocator, frame.capacity, VK_BUFFER_USAGE_TRANSFER_DST_BIT, frame.buffer, frame.allocation, VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT));
+		debugUtils.SetObjectName(frame.buffer, m_name);
+		spdlog::debug("{} resized to {} bytes per frame", m_name, frame.capacity);
+	}
+
+	frame.fence = frameFence;
+	frame.used = 0;
+	m_frameIndex = frameIndex;
+
+	m_stats.requests = 0;
+	m_stats.refused = 0;
+	m_stats.capacity = frame.capacity;
+}
+
+bool ReadbackRing::Request(VkDeviceSize size, Callback callback, Region& region)
+{
+	Frame& frame = m_frames[m_frameIndex];
+	VkDeviceSize offset = (frame.used + READBACK_ALIGNMENT - 1) & ~(READBACK_ALIGNMENT - 1);
+	if (offset + size > frame.capacity)
+	{
+		m_requiredCapacity = std::max(m_requiredCapacity, offset + size);
+		m_stats.refused++;
+		return false;
+	}
+
+	frame.used = offset + size;
+	frame.pending.push_back({ offset, size, std::move(callback) });
+	region = { frame.buffer, offset };
+
+	m_stats.requests++;
+	return true;
+}
+
+bool ReadbackRing::ReadImage(vkb::DispatchTable& disp, VkCommandBuffer cmd, VkImage image, VkImageAspectFlags aspectMask, uint32_t layer, VkOffset3D offset, VkExtent3D extent, VkDeviceSize texelSize, Callback callback)
+{
+	Region region;
+	if (!Request(texelSize * extent.width * extent.height * extent.depth, std::move(callback), region))
+	{
+		return false;
+	}
+
+	VkBufferImageCopy copy = {};
+	copy.bufferOffset = region.offset;
+	copy.imageSubresource = { aspectMask, 0, layer, 1 };
+	copy.imageOffset = offset;
+	copy.imageExtent = extent;
+	disp.cmdCopyImageToBuffer(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, region.buffer, 1, &copy);
+
+	// Host reads wait on the fence, which covers the copy, the barrier only makes its writes visible to the host
+	VkMemoryBarrier2 barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+	barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+	barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+	barrier.dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT;
+	barrier.dstAccessMask = VK_ACCESS_2_HOST_READ_BIT;
+
+	VkDependencyInfo dependencyInfo = {};
+	dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+	dependencyInfo.memoryBarrierCount = 1;
+	dependencyInfo.pMemoryBarriers = &barrier;
+	disp.cmdPipelineBarrier2(cmd, &dependencyInfo);
+
+	return true;
+}
+
+void ReadbackRing::Deliver(VmaAllocator allocator, Frame& frame)
+{
+	if (frame.pending.empty())
+	{
+		return;
+	}
+
+	// No-op on host coherent memory
+	vmaInvalidateAllocation(allocator, frame.allocation, 0, frame.used);
+	for (const Pending& pending: frame.pending)
+	{
+		pending.callback(frame.mappedData + pending.offset, pending.size);
+	}
+
+	m_stats.delivered += static_cast<uint32_t>(frame.pending.size());
+	frame.pending.clear();
+}
+
+void ReadbackRing::ImGuiDebug() const
+{
+	ImGui::Text("%s: %u requests (%u refused), %u delivered, %llu bytes x %zu frames", m_name, m_stats.requests, m_stats.refused, m_stats.delivered, static_cast<unsigned long long>(m_stats.capacity), m_frames.size());
+}
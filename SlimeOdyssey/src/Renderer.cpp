@@ -1,5 +1,6 @@
 #include "Renderer.h"
 
+#include <algorithm>
 #include <backends/imgui_impl_glfw.h>
 #include <backends/imgui_impl_vulkan.h>
 #include <Camera.h>
@@ -14,14 +15,42 @@
 #include "VulkanContext.h"
 #include "VulkanUtil.h"
 
-void Renderer::SetUp(vkb::DispatchTable& disp, VmaAllocator allocator, vkb::Swapchain swapchain, VulkanDebugUtils& debugUtils)
+// Materials without a normal or AO map draw with the pbr variant that doesn't sample them
+static uint32_t PBRMaterialKeywords(const PBRMaterialResource& material)
+{
+	uint32_t keywords = 0;
+	keywords |= material.normalTex ? SHADER_KEYWORD_NORMAL_MAP : 0;
+	keywords |= material.aoTex ? SHADER_KEYWORD_AO_MAP : 0;
+	keywords |= material.receiveShadows ? SHADER_KEYWORD_RECEIVE_SHADOWS : 0;
+	return keywords;
+}
+
+void Renderer::SetUp(vkb::DispatchTable& disp, VmaAllocator allocator, vkb::Swapchain swapchain, VulkanDebugUtils& debugUtils, uint32_t graphicsQueueFamily)
 {
 	CreateDepthImage(disp, allocator, swapchain, debugUtils);
+	m_commandRecorder.Init(disp, graphicsQueueFamily, MAX_FRAMES_IN_FLIGHT);
 }
 
 void Renderer::CleanUp(vkb::DispatchTable& disp, VmaAllocator allocator)
 {
 	m_shadowSystem.Cleanup(disp, allocator);
+	m_instanceBatcher.Cleanup(allocator);
+	m_indirectDraws.Cleanup(allocator);
+	for (IndirectDrawBuffer& shadowIndirectDraws: m_shadowIndirectDraws)
+	{
+		shadowIndirectDraws.Cleanup(allocator);
+	}
+	for (IndirectDrawBuffer& staticShadowIndirectDraws: m_staticShadowIndirectDraws)
+	{
+		staticShadowIndirectDraws.Cleanup(allocator);
+	}
+	m_shadowIndirectDraws.clear();
+	m_staticShadowIndirectDraws.clear();
+	m_uniformUploads.Cleanup(allocator);
+	m_bindlessMaterials.Cleanup(disp, allocator);
+	m_clusteredLights.Cleanup(allocator);
+	m_readbacks.Cleanup(allocator);
+	m_commandRecorder.Cleanup(disp);
 	CleanupDepthImage(disp, allocator);
 }
 
@@ -30,18 +59,27 @@ int Renderer::Draw(vkb::DispatchTable& disp,
         ModelManager& modelManager,
         DescriptorManager& descriptorManager,
         VmaAllocator allocator,
-        VkCommandPool commandPool,
-        VkQueue graphicsQueue,
         VulkanDebugUtils& debugUtils,
         vkb::Swapchain swapchain,
         std::vector<VkImage>& swapchainImages,
         std::vector<VkImageView>& swapchainImageViews,
         uint32_t imageIndex,
+        uint32_t frameIndex,
+        VkFence frameFence,
         Scene* scene)
 {
 	if (SlimeUtil::BeginCommandBuffer(disp, cmd) != 0)
 		return -1;
 
+	// The frame's fence has been waited on, so its secondary command buffers can be reused
+	m_commandRecorder.BeginFrame(disp, frameIndex);
+	// and what it read back delivered, along with any other frame that has finished since
+	m_readbacks.BeginFrame(disp, allocator, debugUtils, frameFence, frameIndex, MAX_FRAMES_IN_FLIGHT);
+
+	// Everything written through mapped pointers since the last frame started
+	m_uploadStats = SlimeUtil::GetMappedUploadStats();
+	SlimeUtil::GetMappedUploadStats() = {};
+
 	// Generate shadow map
 	std::vector<std::shared_ptr<Light>> lights;
 	scene->m_entityManager.ForEachEntityWith<DirectionalLight>(
@@ -64,20 +102,89 @@ int Renderer::Draw(vkb::DispatchTable& disp,
 
 	std::shared_ptr<Camera> camera = scene->m_entityManager.GetEntityByName("MainCamera")->GetComponentShrPtr<Camera>();
 
-	std::function<void(vkb::DispatchTable, VulkanDebugUtils&, VkCommandBuffer&, ModelManager&, Scene*)> DrawModelsForShadowMap = std::bind(&Renderer::DrawModelsForShadowMap, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, scene);
+	if (m_shadowMapPipelineId == INVALID_PIPELINE_ID)
+	{
+		m_shadowMapPipelineId = modelManager.GetPipelineId("ShadowMap");
+		m_pointShadowPipelineId = modelManager.GetPipelineId("PointShadowMap");
+		m_shadowMomentsPipelineId = modelManager.GetPipelineId("ShadowMoments");
+		m_gridPipelineId = modelManager.GetPipelineId("InfiniteGrid");
+		m_pbrPipelineId = modelManager.GetPipelineId("pbr");
+		m_bindlessPipelineId = modelManager.GetPipelineId("pbr_bindless");
+	}
 
-	if (m_shadowSystem.UpdateShadowMaps(disp, cmd, modelManager, allocator, commandPool, graphicsQueue, debugUtils, scene, DrawModelsForShadowMap, lights, camera))
+	// Materials first, the batcher copies their bindless indices into the instance data
+	PipelineConfig* bindlessPipeline = modelManager.GetPipeline(m_bindlessPipelineId);
+	m_bindlessActive = m_useBindless && bindlessPipeline;
+	if (m_bindlessActive)
 	{
-		m_forceInvalidateDecriptorSets = true;
+		m_bindlessMaterials.Update(disp, allocator, debugUtils, scene->m_entityManager, bindlessPipeline->descriptorSetLayouts[1], bindlessPipeline->descriptorSetLayouts[2], frameIndex, MAX_FRAMES_IN_FLIGHT);
 	}
+	m_instanceBatcher.SetBindlessPipeline(m_bindlessActive ? m_pbrPipelineId : INVALID_PIPELINE_ID);
+
+	// Fit the cascades first, the batcher culls the casters of each one against its volume and skips the static
+	// ones of cascades whose static depth is cached. The index is brought up to date so that cache is too.
+	// A rebuilt shadow map only shows up in the per frame light sets, the material sets don't reference it.
+	scene->m_entityManager.UpdateSpatialIndex();
+	m_shadowSystem.SetMomentsPipeline(modelManager.GetPipeline(m_shadowMomentsPipelineId));
+	m_shadowSystem.SetDescriptorManager(&descriptorManager);
+	m_shadowSystem.UpdateShadowMaps(disp, allocator, debugUtils, lights, camera, scene->m_entityManager.GetSpatialIndex().GetStaticVersion());
+	m_instanceBatcher.SetShadowViews(m_shadowSystem.GetShadowViews());
+
+	// After the shadows so the point lights upload with this frame's place in the atlas. Recreated buffers are
+	// picked up when the light sets are written, those are fresh every frame.
+	m_clusteredLights.Update(disp, allocator, debugUtils, lights, *camera, frameIndex, MAX_FRAMES_IN_FLIGHT);
+
+	// Batch before the shadow pass, both passes read from this frame's instance data
+	Frustum frustum = Frustum::FromMatrix(camera->GetProjectionMatrix() * camera->GetViewMatrix());
+	bool instanceBufferRecreated = m_instanceBatcher.Build(disp, allocator, debugUtils, scene->m_entityManager, frustum, camera->GetPosition(), frameIndex, MAX_FRAMES_IN_FLIGHT);
+	UpdateInstanceDescriptors(modelManager, descriptorManager, debugUtils, instanceBufferRecreated);
+
+	if (m_useIndirectDraws)
+	{
+		m_indirectDraws.Build(disp, allocator, debugUtils, m_instanceBatcher.GetBatches(), true, frameIndex, MAX_FRAMES_IN_FLIGHT);
+
+		// Buffers per shadow view, each only holds the casters inside that view
+		uint32_t shadowViewCount = m_instanceBatcher.GetShadowViewCount();
+		while (m_shadowIndirectDraws.size() < shadowViewCount)
+		{
+			m_shadowIndirectDraws.emplace_back("Shadow Indirect Draw Buffer");
+			m_staticShadowIndirectDraws.emplace_back("Static Shadow Indirect Draw Buffer");
+		}
+		for (uint32_t view = 0; view < shadowViewCount; view++)
+		{
+			m_shadowIndirectDraws[view].Build(disp, allocator, debugUtils, m_instanceBatcher.GetShadowBatches(view), false, frameIndex, MAX_FRAMES_IN_FLIGHT);
+			m_staticShadowIndirectDraws[view].Build(disp, allocator, debugUtils, m_instanceBatcher.GetStaticShadowBatches(view), false, frameIndex, MAX_FRAMES_IN_FLIGHT);
+		}
+	}
+
+	ShadowSystem::DrawShadowCasters drawShadowCasters = std::bind(&Renderer::DrawModelsForShadowMap, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5, std::placeholders::_6, std::placeholders::_7);
+	m_shadowSystem.RecordShadowMaps(disp, cmd, modelManager, debugUtils, m_readbacks, drawShadowCasters);
 
 	SetupViewportAndScissor(swapchain, disp, cmd);
 	SlimeUtil::SetupDepthTestingAndLineWidth(disp, cmd);
 
-	// Transition color image to color attachment optimal
-	modelManager.TransitionImageLayout(disp, graphicsQueue, commandPool, swapchainImages[imageIndex], VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
-	// Transition depth image to depth attachment optimal
-	modelManager.TransitionImageLayout(disp, graphicsQueue, commandPool, m_depthImage, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
+	// Transition color image to color attachment optimal, after the acquire semaphore's wait at the same stage
+	SlimeUtil::ImageBarrier(disp,
+	        cmd,
+	        swapchainImages[imageIndex],
+	        VK_IMAGE_ASPECT_COLOR_BIT,
+	        VK_IMAGE_LAYOUT_UNDEFINED,
+	        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+	        VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+	        VK_ACCESS_2_NONE,
+	        VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+	        VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT);
+	// Transition depth image to depth attachment optimal, the previous frame in flight may still be writing to it
+	SlimeUtil::ImageBarrier(disp,
+	        cmd,
+	        m_depthImage,
+	        VK_IMAGE_ASPECT_DEPTH_BIT,
+	        VK_IMAGE_LAYOUT_UNDEFINED,
+	        VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+	        VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+	        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+	        VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+	        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT);
 
 	VkRenderingAttachmentInfo colorAttachmentInfo = {};
 	colorAttachmentInfo.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
@@ -108,7 +215,32 @@ int Renderer::Draw(vkb::DispatchTable& disp,
 	renderingInfo.pColorAttachments = &colorAttachmentInfo;
 	renderingInfo.pDepthAttachment = &depthAttachmentInfo;
 
+	// Everything that touches the descriptor caches happens up front, recording the draws only reads
+	if (scene)
+	{
+		PrepareDraws(disp, cmd, modelManager, descriptorManager, allocator, debugUtils, scene, frameIndex);
+	}
+
+	// The model draws are recorded on several threads into secondary command buffers. That part of the pass
+	// is suspended and then resumed, so the grid and ImGui still record inline into the same render pass.
+	bool recordInParallel = scene && m_parallelRecording && !m_preparedDraws.empty();
+	if (recordInParallel)
+	{
+		renderingInfo.flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT | VK_RENDERING_SUSPENDING_BIT;
+		disp.cmdBeginRendering(cmd, &renderingInfo);
+		RecordDrawsInParallel(disp, cmd, modelManager, debugUtils, swapchain, renderingInfo.flags);
+		disp.cmdEndRendering(cmd);
+
+		renderingInfo.flags = VK_RENDERING_RESUMING_BIT;
+	}
+
 	disp.cmdBeginRendering(cmd, &renderingInfo);
+	if (recordInParallel)
+	{
+		// Executing secondary command buffers leaves the primary's state undefined
+		SetupViewportAndScissor(swapchain, disp, cmd);
+		SlimeUtil::SetupDepthTestingAndLineWidth(disp, cmd);
+	}
 
 	// Start the Dear ImGui frame
 	ImGui_ImplVulkan_NewFrame();
@@ -121,13 +253,13 @@ int Renderer::Draw(vkb::DispatchTable& disp,
 
 	if (scene)
 	{
-		DrawModels(disp, cmd, modelManager, descriptorManager, allocator, commandPool, graphicsQueue, debugUtils, scene);
+		DrawModels(disp, cmd, modelManager, debugUtils, scene, !recordInParallel);
 
 		debugUtils.BeginDebugMarker(cmd, "Draw ImGui", debugUtil_BindDescriptorSetColour);
 		scene->Render();
 	}
 
-	DrawImguiDebugger(disp, allocator, commandPool, graphicsQueue, modelManager, debugUtils);
+	DrawImguiDebugger(disp, allocator, modelManager, descriptorManager, debugUtils);
 
 	ImGui::Render();
 	ImDrawData* drawData = ImGui::GetDrawData();
@@ -142,8 +274,17 @@ int Renderer::Draw(vkb::DispatchTable& disp,
 
 	disp.cmdEndRendering(cmd);
 
-	// Transition color image to present src layout
-	modelManager.TransitionImageLayout(disp, graphicsQueue, commandPool, swapchainImages[imageIndex], VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+	// Transition color image to present src layout, the present waits on the frame's semaphore
+	SlimeUtil::ImageBarrier(disp,
+	        cmd,
+	        swapchainImages[imageIndex],
+	        VK_IMAGE_ASPECT_COLOR_BIT,
+	        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+	        VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+	        VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+	        VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+	        VK_PIPELINE_STAGE_2_NONE,
+	        VK_ACCESS_2_NONE);
 
 	if (SlimeUtil::EndCommandBuffer(disp, cmd) != 0)
 		return -1;
@@ -172,25 +313,16 @@ void Renderer::SetupViewportAndScissor(vkb::Swapchain swapchain, vkb::DispatchTa
 	disp.cmdSetScissor(cmd, 0, 1, &scissor);
 }
 
-void Renderer::DrawModelsForShadowMap(vkb::DispatchTable disp, VulkanDebugUtils& debugUtils, VkCommandBuffer& cmd, ModelManager& modelManager, Scene* scene)
+void Renderer::DrawModelsForShadowMap(vkb::DispatchTable disp, VulkanDebugUtils& debugUtils, VkCommandBuffer& cmd, ModelManager& modelManager, const ShadowSystem::ShadowPass& pass, uint32_t view, bool staticCasters)
 {
-	EntityManager& entityManager = scene->m_entityManager;
-	auto modelEntities = entityManager.GetEntitiesWithComponents<Model, Transform>();
-
-	// Get the light entity and its transform
-	auto lightEntity = entityManager.GetEntityByName("Light");
-
-	if (!lightEntity)
+	const std::vector<InstanceBatch>& batches = staticCasters ? m_instanceBatcher.GetStaticShadowBatches(view) : m_instanceBatcher.GetShadowBatches(view);
+	if (batches.empty())
 	{
-		spdlog::error("Light entity not found, skipping shadow mapping.");
 		return;
 	}
 
-	DirectionalLight& light = lightEntity->GetComponent<DirectionalLight>();
-	Camera& camera = entityManager.GetEntityByName("MainCamera")->GetComponent<Camera>();
-
-	// Bind the shadow map pipeline
-	PipelineConfig* shadowMapPipeline = BindPipeline(disp, cmd, modelManager, "ShadowMap", debugUtils);
+	// Bind the shadow map pipeline, point lights draw their six faces with the multiview one
+	PipelineConfig* shadowMapPipeline = BindPipeline(disp, cmd, modelManager, pass.pointLight ? m_pointShadowPipelineId : m_shadowMapPipelineId, debugUtils);
 	if (!shadowMapPipeline)
 	{
 		debugUtils.EndDebugMarker(cmd);
@@ -206,123 +338,298 @@ void Renderer::DrawModelsForShadowMap(vkb::DispatchTable disp, VulkanDebugUtils&
 	VkCompareOp depthCompareOp = VK_COMPARE_OP_LESS;
 	disp.cmdSetDepthCompareOp(cmd, depthCompareOp);
 
-	for (const auto& entity: modelEntities)
+	if (m_shadowInstanceSet == VK_NULL_HANDLE)
 	{
-		ModelResource* model = entity->GetComponent<Model>().modelResource;
-		Transform& transform = entity->GetComponent<Transform>();
+		return;
+	}
 
-		debugUtils.BeginDebugMarker(cmd, ("Process Model for Shadow: " + entity->GetName()).c_str(), debugUtil_StartDrawColour);
+	// Both shadow pipelines have the same set 0 layout, so they share the set
+	disp.cmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, shadowMapPipeline->pipelineLayout, 0, 1, &m_shadowInstanceSet, 0, nullptr);
 
-		// Update push constants for shadow mapping
-		struct ShadowMapPushConstants
-		{
-			glm::mat4 lightSpaceMatrix;
-			glm::mat4 modelMatrix;
-		} pushConstants;
+	// Update push constants for shadow mapping, the model matrices come from the instance buffer
+	if (pass.pointLight)
+	{
+		disp.cmdPushConstants(cmd, shadowMapPipeline->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(glm::vec4), &pass.lightPositionRadius);
+	}
+	else
+	{
+		disp.cmdPushConstants(cmd, shadowMapPipeline->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(glm::mat4), &pass.lightSpaceMatrix);
+	}
 
-		pushConstants.lightSpaceMatrix = light.GetLightSpaceMatrix();
-		pushConstants.modelMatrix = transform.GetModelMatrix();
+	// Meshes live in the static or the dynamic MeshBuffer, batches are sorted so each is bound once
+	const MeshBuffer* boundMeshBuffer = nullptr;
 
-		disp.cmdPushConstants(cmd, shadowMapPipeline->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(ShadowMapPushConstants), &pushConstants);
+	if (m_useIndirectDraws)
+	{
+		// No materials in the depth pass, so there is one run per mesh buffer
+		IndirectDrawBuffer& shadowIndirectDraws = staticCasters ? m_staticShadowIndirectDraws[view] : m_shadowIndirectDraws[view];
+		for (const auto& run: shadowIndirectDraws.GetRuns())
+		{
+			debugUtils.BeginDebugMarker(cmd, "Draw Indirect for Shadow", debugUtil_DrawModelColour);
+			BindMeshBuffer(disp, cmd, run.firstBatch->model->meshBuffer, boundMeshBuffer);
+			shadowIndirectDraws.Draw(disp, cmd, run);
+			debugUtils.EndDebugMarker(cmd);
+		}
+		return;
+	}
 
-		debugUtils.BeginDebugMarker(cmd, "Draw Model for Shadow", debugUtil_DrawModelColour);
-		modelManager.DrawModel(disp, cmd, *model);
+	for (const auto& batch: batches)
+	{
+		debugUtils.BeginDebugMarker(cmd, "Draw Model Batch for Shadow", debugUtil_DrawModelColour);
+		BindMeshBuffer(disp, cmd, batch.model->meshBuffer, boundMeshBuffer);
+		modelManager.DrawModel(disp, cmd, *batch.model, batch.instanceCount, batch.firstInstance);
 		debugUtils.EndDebugMarker(cmd);
+	}
+}
 
-		debugUtils.EndDebugMarker(cmd);
+void Renderer::BindMeshBuffer(vkb::DispatchTable& disp, VkCommandBuffer cmd, const MeshBuffer* meshBuffer, const MeshBuffer*& boundMeshBuffer)
+{
+	if (meshBuffer != boundMeshBuffer)
+	{
+		meshBuffer->Bind(disp, cmd);
+		boundMeshBuffer = meshBuffer;
 	}
 }
 
-void Renderer::DrawModels(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ModelManager& modelManager, DescriptorManager& descriptorManager, VmaAllocator allocator, VkCommandPool commandPool, VkQueue graphicsQueue, VulkanDebugUtils& debugUtils, Scene* scene)
+void Renderer::PrepareDraws(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ModelManager& modelManager, DescriptorManager& descriptorManager, VmaAllocator allocator, VulkanDebugUtils& debugUtils, Scene* scene, uint32_t frameIndex)
 {
-	debugUtils.BeginDebugMarker(cmd, "Draw Models", debugUtil_BeginColour);
+	// Camera and light, then at most one material config per batch
+	constexpr VkDeviceSize maxUniformSize = std::max({ sizeof(CameraUBO), sizeof(LightUBO), sizeof(BasicMaterialResource::Config), sizeof(PBRMaterialResource::Config) });
+	uint32_t uniformCount = 2 + static_cast<uint32_t>(m_instanceBatcher.GetBatches().size());
+	if (m_uniformUploads.BeginFrame(disp, allocator, debugUtils, uniformCount, maxUniformSize, frameIndex, MAX_FRAMES_IN_FLIGHT))
+	{
+		// The material sets point at the old buffer, the device is idle so they can all go now
+		m_forceInvalidateDecriptorSets = true;
+	}
+	std::fill(m_materialOffsets.begin(), m_materialOffsets.end(), NO_MATERIAL_OFFSET);
+
+	// The light sets of this frame index were reset along with its transient descriptor pool
+	m_frameLightSets.clear();
+	m_lastMaterialCacheStats = m_materialCacheStats;
+	m_materialCacheStats = {};
+	m_materialCacheFrame++;
 
 	UpdateCommonBuffers(debugUtils, allocator, cmd, scene);
 
 	EntityManager& entityManager = scene->m_entityManager;
-	auto pbrModelEntities = entityManager.GetEntitiesWithComponents<Model, PBRMaterial, Transform>();
-	auto basicModelEntities = entityManager.GetEntitiesWithComponents<Model, BasicMaterial, Transform>();
 
-	std::vector<std::shared_ptr<Entity>> modelEntities = pbrModelEntities;
-	modelEntities.insert(modelEntities.end(), basicModelEntities.begin(), basicModelEntities.end());
+	if (m_bindlessActive)
+	{
+		m_bindlessMaterials.BindLightBuffer(disp, m_uniformUploads.GetBuffer(), sizeof(LightUBO));
+		if (auto lightEntity = entityManager.GetEntityByName("Light"))
+		{
+			std::shared_ptr<DirectionalLight> light = lightEntity->GetComponentShrPtr<DirectionalLight>();
+			TextureResource shadowMap = m_shadowSystem.GetShadowMap(light);
+			m_bindlessMaterials.BindShadowMap(disp, shadowMap, m_shadowSystem.GetShadowMoments(light));
 
-	std::sort(modelEntities.begin(), modelEntities.end(), [](const auto& a, const auto& b) { return a->template GetComponent<Model>().modelResource->pipelineName < b->template GetComponent<Model>().modelResource->pipelineName; });
+			// Without point lights there is no atlas, the shadow map stands in so the binding stays valid
+			TextureResource pointShadowAtlas = m_shadowSystem.GetPointShadowAtlas();
+			m_bindlessMaterials.BindPointLights(disp, m_clusteredLights, pointShadowAtlas.imageView != VK_NULL_HANDLE ? pointShadowAtlas : shadowMap);
+		}
+	}
 
 	// Get the shared descriptor set
 	std::pair<VkDescriptorSet, VkDescriptorSetLayout> sharedDescriptorSet = descriptorManager.GetSharedDescriptorSet();
 
 	// Update shared descriptors before the loop
 	UpdateSharedDescriptors(descriptorManager, sharedDescriptorSet.first, sharedDescriptorSet.second, entityManager, allocator);
+	m_preparedSharedSet = sharedDescriptorSet.first;
 
-	std::unordered_map<std::string, PipelineConfig*> pipelineCache;
-	PipelineConfig* pipelineConfig = nullptr;
-	std::string lastUsedPipeline;
-
-	for (const auto& entity: modelEntities)
-	{
-		ModelResource* model = entity->GetComponent<Model>().modelResource;
-		Transform& transform = entity->GetComponent<Transform>();
+	m_preparedDraws.clear();
+	m_preparedSets.clear();
+	m_preparedOffsets.clear();
 
-		debugUtils.BeginDebugMarker(cmd, ("Process Model: " + entity->GetName()).c_str(), debugUtil_StartDrawColour);
+	// Either one instanced draw per batch, or one indirect draw per run of batches sharing a pipeline and material
+	const std::vector<InstanceBatch>& batches = m_instanceBatcher.GetBatches();
+	const std::vector<IndirectDrawRun>& runs = m_indirectDraws.GetRuns();
+	size_t drawCount = m_useIndirectDraws ? runs.size() : batches.size();
 
-		std::string pipelineName = model->pipelineName;
+	for (size_t drawIndex = 0; drawIndex < drawCount; drawIndex++)
+	{
+		const InstanceBatch& batch = m_useIndirectDraws ? *runs[drawIndex].firstBatch : batches[drawIndex];
+		bool bindless = m_bindlessActive && batch.pipelineId == m_pbrPipelineId;
 
-		// Bind pipeline if it's different from the last one
-		if (lastUsedPipeline != pipelineName)
+		uint32_t pipelineId = bindless ? m_bindlessPipelineId : batch.pipelineId;
+		if (!bindless)
 		{
-			auto pipelineIt = pipelineCache.find(pipelineName);
-			if (pipelineIt == pipelineCache.end())
+			// The cheapest shader variant the material allows, every instance in the batch shares it
+			if (const PBRMaterial* pbrMaterial = batch.firstEntity->GetComponentPtr<PBRMaterial>(); pbrMaterial && pbrMaterial->materialResource)
 			{
-				pipelineConfig = BindPipeline(disp, cmd, modelManager, pipelineName, debugUtils);
-				pipelineCache[pipelineName] = pipelineConfig;
-			}
-			else
-			{
-				pipelineConfig = pipelineIt->second;
-				disp.cmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineConfig->pipeline);
+				pipelineId = modelManager.GetPipelineVariant(pipelineId, PBRMaterialKeywords(*pbrMaterial->materialResource));
 			}
+		}
+
+		PipelineConfig* pipelineConfig = modelManager.GetPipeline(pipelineId);
+		if (!pipelineConfig)
+		{
+			spdlog::error("Pipeline not found: {}", batch.pipelineId);
+			continue;
+		}
+
+		PreparedDraw draw = { pipelineConfig, &batch, m_useIndirectDraws ? &runs[drawIndex] : nullptr, static_cast<uint32_t>(m_preparedSets.size()), 0, static_cast<uint32_t>(m_preparedOffsets.size()), 0 };
 
-			if (!pipelineConfig)
+		if (bindless)
+		{
+			// The light and every material, the same for all bindless draws
+			const VkDescriptorSet* bindlessSets = m_bindlessMaterials.GetDescriptorSets();
+			m_preparedSets.insert(m_preparedSets.end(), bindlessSets, bindlessSets + 2);
+			m_preparedOffsets.push_back(m_lightOffset);
+		}
+		else
+		{
+			// Every instance in the batch (or run) shares the same material
+			for (size_t i = 1; i < pipelineConfig->descriptorSetLayouts.size(); i++)
 			{
-				debugUtils.EndDebugMarker(cmd);
-				continue;
+				m_preparedSets.push_back(GetOrUpdateDescriptorSet(entityManager, batch.firstEntity, pipelineConfig, descriptorManager, allocator, debugUtils, i));
+
+				uint32_t dynamicOffset;
+				if (GetDynamicOffset(batch.firstEntity, static_cast<int>(i), dynamicOffset))
+				{
+					m_preparedOffsets.push_back(dynamicOffset);
+				}
 			}
+		}
+		draw.setCount = static_cast<uint32_t>(m_preparedSets.size()) - draw.firstSet;
+		draw.offsetCount = static_cast<uint32_t>(m_preparedOffsets.size()) - draw.firstOffset;
 
-			lastUsedPipeline = pipelineName;
+		m_preparedDraws.push_back(draw);
+	}
 
-			// Bind shared descriptor set after binding the pipeline
-			disp.cmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineConfig->pipelineLayout, 0, 1, &sharedDescriptorSet.first, 0, nullptr);
-		}
+	m_uniformUploads.Flush(allocator);
+}
+
+void Renderer::DrawModels(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ModelManager& modelManager, VulkanDebugUtils& debugUtils, Scene* scene, bool recordDraws)
+{
+	debugUtils.BeginDebugMarker(cmd, "Draw Models", debugUtil_BeginColour);
+
+	if (recordDraws)
+	{
+		RecordDraws(disp, cmd, modelManager, debugUtils, 0, static_cast<uint32_t>(m_preparedDraws.size()));
+	}
+
+	PipelineConfig* infiniteGridPipeline = modelManager.GetPipeline(m_gridPipelineId);
+	if (infiniteGridPipeline && infiniteGridPipeline->pipeline != VK_NULL_HANDLE)
+	{
+		Camera& camera = scene->m_entityManager.GetEntityByName("MainCamera")->GetComponent<Camera>();
+		DrawInfiniteGrid(disp, cmd, camera, infiniteGridPipeline->pipeline, infiniteGridPipeline->pipelineLayout);
+	}
+
+	debugUtils.EndDebugMarker(cmd);
+}
+
+void Renderer::RecordDraws(vkb::DispatchTable& disp, VkCommandBuffer cmd, ModelManager& modelManager, VulkanDebugUtils& debugUtils, uint32_t firstDraw, uint32_t drawCount)
+{
+	// Each chunk starts with nothing bound, draws are sorted so pipelines and mesh buffers change rarely
+	const PipelineConfig* boundPipeline = nullptr;
+	const MeshBuffer* boundMeshBuffer = nullptr;
+
+	for (uint32_t drawIndex = firstDraw; drawIndex < firstDraw + drawCount; drawIndex++)
+	{
+		const PreparedDraw& draw = m_preparedDraws[drawIndex];
+
+		debugUtils.BeginDebugMarker(cmd, "Process Model Batch", debugUtil_StartDrawColour);
 
-		// Bind descriptor sets
-		for (size_t i = 1; i < pipelineConfig->descriptorSetLayouts.size(); i++)
+		// Sets bound with a compatible layout stay bound across a pipeline change, all of them with the same pipeline
+		uint32_t compatibleSets = CompatibleSetCount(boundPipeline, draw.pipeline);
+		if (draw.pipeline != boundPipeline)
 		{
-			VkDescriptorSet currentDescriptorSet = GetOrUpdateDescriptorSet(entityManager, entity.get(), pipelineConfig, descriptorManager, allocator, debugUtils, i);
-			disp.cmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineConfig->pipelineLayout, i, 1, &currentDescriptorSet, 0, nullptr);
+			disp.cmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, draw.pipeline->pipeline);
+			debugUtils.InsertDebugMarker(cmd, "Bind Pipeline", debugUtil_White);
+
+			// Bind shared descriptor set after binding the pipeline, the camera is its only dynamic buffer
+			if (compatibleSets == 0)
+			{
+				disp.cmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, draw.pipeline->pipelineLayout, 0, 1, &m_preparedSharedSet, 1, &m_cameraOffset);
+			}
+			boundPipeline = draw.pipeline;
 		}
 
-		UpdatePushConstants(disp, cmd, *pipelineConfig, transform, debugUtils);
+		// Draws sharing material sets (bindless ones all do) only bind them once
+		bool setsBound = compatibleSets >= 1 + draw.setCount && drawIndex > firstDraw && SharesDescriptorSets(m_preparedDraws[drawIndex - 1], draw);
+		if (draw.setCount > 0 && !setsBound)
+		{
+			disp.cmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, draw.pipeline->pipelineLayout, 1, draw.setCount, &m_preparedSets[draw.firstSet], draw.offsetCount, m_preparedOffsets.data() + draw.firstOffset);
+		}
 
 		debugUtils.BeginDebugMarker(cmd, "Draw Model", debugUtil_DrawModelColour);
-		modelManager.DrawModel(disp, cmd, *model);
+		BindMeshBuffer(disp, cmd, draw.batch->model->meshBuffer, boundMeshBuffer);
+		if (draw.run)
+		{
+			m_indirectDraws.Draw(disp, cmd, *draw.run);
+		}
+		else
+		{
+			modelManager.DrawModel(disp, cmd, *draw.batch->model, draw.batch->instanceCount, draw.batch->firstInstance);
+		}
 		debugUtils.EndDebugMarker(cmd);
 
 		debugUtils.EndDebugMarker(cmd);
 	}
+}
 
-	PipelineConfig& infiniteGridPipeline = modelManager.GetPipelines()["InfiniteGrid"];
-	if (infiniteGridPipeline.pipeline != VK_NULL_HANDLE)
+uint32_t Renderer::CompatibleSetCount(const PipelineConfig* bound, const PipelineConfig* next)
+{
+	if (!bound)
 	{
-		Camera& camera = scene->m_entityManager.GetEntityByName("MainCamera")->GetComponent<Camera>();
-		DrawInfiniteGrid(disp, cmd, camera, infiniteGridPipeline.pipeline, infiniteGridPipeline.pipelineLayout);
+		return 0;
+	}
+	if (bound->pipelineLayout == next->pipelineLayout)
+	{
+		return UINT32_MAX;
 	}
 
-	debugUtils.EndDebugMarker(cmd);
+	// Layouts come from the layout registry, equal handles mean equal layouts. Sets stay compatible up to the
+	// first one that differs, as long as the push constant ranges are the same.
+	if (bound->pushConstantRanges.size() != next->pushConstantRanges.size() ||
+	    !std::equal(bound->pushConstantRanges.begin(), bound->pushConstantRanges.end(), next->pushConstantRanges.begin(), [](const VkPushConstantRange& a, const VkPushConstantRange& b) { return a.stageFlags == b.stageFlags && a.offset == b.offset && a.size == b.size; }))
+	{
+		return 0;
+	}
+
+	auto mismatch = std::mismatch(bound->descriptorSetLayouts.begin(), bound->descriptorSetLayouts.end(), next->descriptorSetLayouts.begin(), next->descriptorSetLayouts.end());
+	return static_cast<uint32_t>(mismatch.first - bound->descriptorSetLayouts.begin());
+}
+
+bool Renderer::SharesDescriptorSets(const PreparedDraw& a, const PreparedDraw& b) const
+{
+	if (a.setCount != b.setCount || a.offsetCount != b.offsetCount)
+	{
+		return false;
+	}
+
+	return std::equal(m_preparedSets.begin() + a.firstSet, m_preparedSets.begin() + a.firstSet + a.setCount, m_preparedSets.begin() + b.firstSet) &&
+	       std::equal(m_preparedOffsets.begin() + a.firstOffset, m_preparedOffsets.begin() + a.firstOffset + a.offsetCount, m_preparedOffsets.begin() + b.firstOffset);
+}
+
+void Renderer::RecordDrawsInParallel(vkb::DispatchTable& disp, VkCommandBuffer cmd, ModelManager& modelManager, VulkanDebugUtils& debugUtils, const vkb::Swapchain& swapchain, VkRenderingFlags renderingFlags)
+{
+	// Has to match the attachments of the main pass
+	VkCommandBufferInheritanceRenderingInfo inheritanceInfo = {};
+	inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO;
+	inheritanceInfo.flags = renderingFlags & ~VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT;
+	inheritanceInfo.colorAttachmentCount = 1;
+	inheritanceInfo.pColorAttachmentFormats = &swapchain.image_format;
+	inheritanceInfo.depthAttachmentFormat = VK_FORMAT_D32_SFLOAT;
+	inheritanceInfo.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+	const std::vector<VkCommandBuffer>& commandBuffers = m_commandRecorder.Record(disp,
+	        inheritanceInfo,
+	        static_cast<uint32_t>(m_preparedDraws.size()),
+	        MIN_DRAWS_PER_CHUNK,
+	        [&](VkCommandBuffer chunkCmd, uint32_t firstDraw, uint32_t drawCount)
+	        {
+		        // Secondary command buffers start without any dynamic state
+		        SetupViewportAndScissor(swapchain, disp, chunkCmd);
+		        SlimeUtil::SetupDepthTestingAndLineWidth(disp, chunkCmd);
+		        RecordDraws(disp, chunkCmd, modelManager, debugUtils, firstDraw, drawCount);
+	        });
+
+	disp.cmdExecuteCommands(cmd, static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
 }
 
-void Renderer::DrawImguiDebugger(vkb::DispatchTable& disp, VmaAllocator allocator, VkCommandPool commandPool, VkQueue graphicsQueue, ModelManager& modelManager, VulkanDebugUtils& debugUtils)
+void Renderer::DrawImguiDebugger(vkb::DispatchTable& disp, VmaAllocator allocator, ModelManager& modelManager, DescriptorManager& descriptorManager, VulkanDebugUtils& debugUtils)
 {
-	m_shadowSystem.RenderShadowMapInspector(disp, allocator, commandPool, graphicsQueue, modelManager, debugUtils);
+	m_shadowSystem.RenderShadowMapInspector(disp, allocator, modelManager, debugUtils);
 
 	// Render the ImGui debugger
 	ImGui::Begin("Renderer Debugger");
@@ -330,6 +637,40 @@ void Renderer::DrawImguiDebugger(vkb::DispatchTable& disp, VmaAllocator allocato
 	// clear colour
 	ImGui::ColorEdit4("Clear Colour", &m_clearColour.r);
 
+	ImGui::Checkbox("Multi Draw Indirect", &m_useIndirectDraws);
+	ImGui::Checkbox("Parallel Recording", &m_parallelRecording);
+	ImGui::Checkbox("Bindless Materials", &m_useBindless);
+	if (m_bindlessActive)
+	{
+		m_bindlessMaterials.ImGuiDebug();
+	}
+	if (m_parallelRecording)
+	{
+		const ParallelCommandRecorder::Stats& recordStats = m_commandRecorder.GetStats();
+		ImGui::Text("Recording: %u draws in %u chunks on %u threads, %.3f ms", recordStats.items, recordStats.chunks, m_commandRecorder.GetThreadCount(), recordStats.recordMs);
+	}
+	m_instanceBatcher.ImGuiDebug();
+	m_clusteredLights.ImGuiDebug();
+	m_uniformUploads.ImGuiDebug();
+	m_readbacks.ImGuiDebug();
+	descriptorManager.ImGuiDebug();
+	ImGui::Text("Material sets: %zu cached, %u hits, %u misses, %u evictions", m_lruList.size(), m_lastMaterialCacheStats.hits, m_lastMaterialCacheStats.misses, m_lastMaterialCacheStats.evictions);
+	ImGui::Text("Mapped uploads: %u writes (map/unmap pairs saved), %u flushes, %llu bytes", m_uploadStats.writes, m_uploadStats.flushes, static_cast<unsigned long long>(m_uploadStats.bytes));
+	modelManager.GetMeshBuffer().ImGuiDebug();
+	modelManager.GetDynamicMeshBuffer().ImGuiDebug();
+	modelManager.GetShaderVariants().ImGuiDebug();
+	if (m_useIndirectDraws)
+	{
+		uint32_t shadowCommands = 0;
+		size_t shadowDraws = 0;
+		for (uint32_t view = 0; view < m_instanceBatcher.GetShadowViewCount() && view < m_shadowIndirectDraws.size(); view++)
+		{
+			shadowCommands += m_shadowIndirectDraws[view].GetCommandCount() + m_staticShadowIndirectDraws[view].GetCommandCount();
+			shadowDraws += m_shadowIndirectDraws[view].GetRuns().size() + m_staticShadowIndirectDraws[view].GetRuns().size();
+		}
+		ImGui::Text("Indirect: %u commands in %zu draws, shadow %u commands in %zu draws", m_indirectDraws.GetCommandCount(), m_indirectDraws.GetRuns().size(), shadowCommands, shadowDraws);
+	}
+
 	ImGui::End();
 }
 
@@ -340,15 +681,15 @@ void Renderer::UpdateCommonBuffers(VulkanDebugUtils& debugUtils, VmaAllocator al
 	EntityManager& entityManager = scene->m_entityManager;
 
 	// Light Buffer
-	UpdateLightBuffer(entityManager, allocator);
+	UpdateLightBuffer(entityManager);
 
 	// Camera Buffer
-	UpdateCameraBuffer(entityManager, allocator);
+	UpdateCameraBuffer(entityManager);
 
 	debugUtils.EndDebugMarker(cmd);
 }
 
-void Renderer::UpdateLightBuffer(EntityManager& entityManager, VmaAllocator allocator)
+void Renderer::UpdateLightBuffer(EntityManager& entityManager)
 {
 	auto lightEntity = entityManager.GetEntityByName("Light");
 	if (!lightEntity)
@@ -358,46 +699,32 @@ void Renderer::UpdateLightBuffer(EntityManager& entityManager, VmaAllocator allo
 	}
 
 	DirectionalLight& light = lightEntity->GetComponent<DirectionalLight>();
-	if (light.buffer == VK_NULL_HANDLE)
-	{
-		SlimeUtil::CreateBuffer("Light Buffer", allocator, light.GetBindingDataSize(), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, light.buffer, light.allocation);
-	}
-
-	auto bindingData = light.GetBindingData();
-	SlimeUtil::CopyStructToBuffer(bindingData, allocator, light.allocation);
+	LightUBO lightUBO = { light.GetBindingData(), m_clusteredLights.GetParams() };
+	m_lightOffset = m_uniformUploads.Push(lightUBO);
 }
 
-void Renderer::UpdateCameraBuffer(EntityManager& entityManager, VmaAllocator allocator)
+void Renderer::UpdateCameraBuffer(EntityManager& entityManager)
 {
 	Camera& camera = entityManager.GetEntityByName("MainCamera")->GetComponent<Camera>();
-	camera.UpdateCameraUBO(allocator);
-	SlimeUtil::CopyStructToBuffer(camera.GetCameraUBO(), allocator, camera.GetCameraUBOAllocation());
+	camera.UpdateCameraUBO();
+	m_cameraOffset = m_uniformUploads.Push(camera.GetCameraUBO());
 }
 
-PipelineConfig* Renderer::BindPipeline(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ModelManager& modelManager, const std::string& pipelineName, VulkanDebugUtils& debugUtils)
+PipelineConfig* Renderer::BindPipeline(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ModelManager& modelManager, uint32_t pipelineId, VulkanDebugUtils& debugUtils)
 {
-	auto pipelineIt = modelManager.GetPipelines().find(pipelineName);
-	if (pipelineIt == modelManager.GetPipelines().end())
+	PipelineConfig* pipelineConfig = modelManager.GetPipeline(pipelineId);
+	if (!pipelineConfig)
 	{
-		spdlog::error("Pipeline not found: {}", pipelineName);
+		spdlog::error("Pipeline not found: {}", pipelineId);
 		return nullptr;
 	}
 
-	PipelineConfig* pipelineConfig = &pipelineIt->second;
 	disp.cmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineConfig->pipeline);
 	debugUtils.InsertDebugMarker(cmd, "Bind Pipeline", debugUtil_White);
 
 	return pipelineConfig;
 }
 
-void Renderer::UpdatePushConstants(vkb::DispatchTable& disp, VkCommandBuffer& cmd, PipelineConfig& pipelineConfig, Transform& transform, VulkanDebugUtils& debugUtils)
-{
-	m_mvp.model = transform.GetModelMatrix();
-	m_mvp.normalMatrix = glm::transpose(glm::inverse(glm::mat3(m_mvp.model)));
-	disp.cmdPushConstants(cmd, pipelineConfig.pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(m_mvp), &m_mvp);
-	debugUtils.InsertDebugMarker(cmd, "Update Push Constants", debugUtil_White);
-}
-
 void Renderer::DrawInfiniteGrid(vkb::DispatchTable& disp, VkCommandBuffer commandBuffer, const Camera& camera, VkPipeline gridPipeline, VkPipelineLayout gridPipelineLayout)
 {
 	disp.cmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, gridPipeline);
@@ -418,11 +745,125 @@ void Renderer::DrawInfiniteGrid(vkb::DispatchTable& disp, VkCommandBuffer comman
 	disp.cmdDraw(commandBuffer, 6, 1, 0, 0);
 }
 
-// Right now it is only camera ubo
+// Right now it is only camera ubo, the offset changes every frame but the set only when the buffer or set does
 void Renderer::UpdateSharedDescriptors(DescriptorManager& descriptorManager, VkDescriptorSet sharedSet, VkDescriptorSetLayout setLayout, EntityManager& entityManager, VmaAllocator allocator)
 {
-	Camera& camera = entityManager.GetEntityByName("MainCamera")->GetComponent<Camera>();
-	descriptorManager.BindBuffer(sharedSet, 0, camera.GetCameraUBOBuffer(), 0, sizeof(CameraUBO));
+	VkBuffer uniformBuffer = m_uniformUploads.GetBuffer();
+	if (sharedSet == m_boundCameraSet && uniformBuffer == m_boundUniformBuffer)
+	{
+		return;
+	}
+
+	descriptorManager.BindBuffer(sharedSet, 0, uniformBuffer, 0, sizeof(CameraUBO), VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+	m_boundCameraSet = sharedSet;
+	m_boundUniformBuffer = uniformBuffer;
+}
+
+uint32_t Renderer::GetMaterialOffset(Entity* entity)
+{
+	const MaterialResource* material = nullptr;
+	if (BasicMaterial* basicMaterial = entity->GetComponentPtr<BasicMaterial>())
+	{
+		material = basicMaterial->materialResource.get();
+	}
+	else if (PBRMaterial* pbrMaterial = entity->GetComponentPtr<PBRMaterial>())
+	{
+		material = pbrMaterial->materialResource.get();
+	}
+
+	// Id 0 is a material the DescriptorManager didn't create, it is pushed for every batch using it
+	uint32_t id = material ? material->id : 0;
+	if (id >= m_materialOffsets.size())
+	{
+		m_materialOffsets.resize(std::max<size_t>(id + 1, m_materialOffsets.size() * 2), NO_MATERIAL_OFFSET);
+	}
+	if (id != 0 && m_materialOffsets[id] != NO_MATERIAL_OFFSET)
+	{
+		return m_materialOffsets[id];
+	}
+
+	uint32_t offset = 0;
+	if (BasicMaterial* basicMaterial = entity->GetComponentPtr<BasicMaterial>())
+	{
+		offset = m_uniformUploads.Push(basicMaterial->materialResource->config);
+	}
+	else if (PBRMaterial* pbrMaterial = entity->GetComponentPtr<PBRMaterial>())
+	{
+		offset = m_uniformUploads.Push(pbrMaterial->materialResource->config);
+	}
+
+	m_materialOffsets[id] = offset;
+	return offset;
+}
+
+bool Renderer::GetDynamicOffset(Entity* entity, int setIndex, uint32_t& offset)
+{
+	// Matches the sets written in UpdateBasicMaterialDescriptors, UpdatePBRMaterialDescriptors and GetFrameLightSet
+	if (entity->HasComponent<BasicMaterial>() && setIndex == 1)
+	{
+		offset = GetMaterialOffset(entity);
+		return true;
+	}
+
+	if (entity->HasComponent<PBRMaterial>())
+	{
+		if (setIndex == 1)
+		{
+			offset = m_lightOffset;
+			return true;
+		}
+		if (setIndex == 2)
+		{
+			offset = GetMaterialOffset(entity);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//
+/// INSTANCING ///////////////////////////////////
+//
+void Renderer::UpdateInstanceDescriptors(ModelManager& modelManager, DescriptorManager& descriptorManager, VulkanDebugUtils& debugUtils, bool bufferRecreated)
+{
+	VkBuffer instanceBuffer = m_instanceBatcher.GetBuffer();
+	bool bufferChanged = bufferRecreated || instanceBuffer != m_boundInstanceBuffer;
+	m_boundInstanceBuffer = instanceBuffer;
+
+	// Binding 1 of the shared set
+	VkDescriptorSet sharedSet = descriptorManager.GetSharedDescriptorSet().first;
+	if (sharedSet != VK_NULL_HANDLE && (bufferChanged || sharedSet != m_boundSharedSet))
+	{
+		descriptorManager.BindBuffer(sharedSet, 1, instanceBuffer, 0, VK_WHOLE_SIZE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+		m_boundSharedSet = sharedSet;
+	}
+
+	// The shadow map pipeline has its own set 0 with only the instance buffer in it
+	PipelineConfig* shadowPipeline = modelManager.GetPipeline(m_shadowMapPipelineId);
+	if (!shadowPipeline || shadowPipeline->descriptorSetLayouts.empty())
+	{
+		return;
+	}
+
+	VkDescriptorSetLayout shadowSetLayout = shadowPipeline->descriptorSetLayouts[0];
+	if (shadowSetLayout != m_shadowInstanceSetLayout)
+	{
+		if (m_shadowInstanceSet != VK_NULL_HANDLE)
+		{
+			descriptorManager.FreeDescriptorSet(m_shadowInstanceSet);
+		}
+
+		m_shadowInstanceSet = descriptorManager.AllocateDescriptorSet(shadowSetLayout);
+		m_shadowInstanceSetLayout = shadowSetLayout;
+		debugUtils.SetObjectName(m_shadowInstanceSet, "Shadow Instance Descriptor Set");
+		bufferChanged = true;
+	}
+
+	if (bufferChanged)
+	{
+		descriptorManager.BindBuffer(m_shadowInstanceSet, 1, instanceBuffer, 0, VK_WHOLE_SIZE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+	}
 }
 
 //
@@ -430,106 +871,193 @@ void Renderer::UpdateSharedDescriptors(DescriptorManager& descriptorManager, VkD
 //
 VkDescriptorSet Renderer::GetOrUpdateDescriptorSet(EntityManager& entityManager, Entity* entity, PipelineConfig* pipelineConfig, DescriptorManager& descriptorManager, VmaAllocator allocator, VulkanDebugUtils& debugUtils, int setIndex)
 {
-	size_t descriptorHash = GenerateDescriptorHash(entity, setIndex);
+	VkDescriptorSetLayout layout = pipelineConfig->descriptorSetLayouts[setIndex];
+
+	// The light and shadow map change every frame, they get a fresh set each frame rather than a cached one
+	if (entity->HasComponent<PBRMaterial>() && setIndex == 1)
+	{
+		return GetFrameLightSet(entityManager, descriptorManager, layout, debugUtils);
+	}
 
 	if (m_forceInvalidateDecriptorSets)
 	{
 		m_forceInvalidateDecriptorSets = false;
 
-		for (auto& entry: m_materialDescriptorCache)
+		for (auto& entry: m_lruList)
 		{
-			descriptorManager.FreeDescriptorSet(entry.second->descriptorSet);
+			descriptorManager.FreeDescriptorSet(entry.descriptorSet);
 		}
 
 		m_materialDescriptorCache.clear();
 		m_lruList.clear();
 	}
 
-	auto it = m_materialDescriptorCache.find(descriptorHash);
+	MaterialSetKey key = GetMaterialSetKey(entity, layout);
+
+	// Equal hashes are compared field by field, so two materials can never share a set by accident
+	auto it = m_materialDescriptorCache.find(key);
 	if (it != m_materialDescriptorCache.end())
 	{
 		// Move the accessed item to the front of the LRU list
 		m_lruList.splice(m_lruList.begin(), m_lruList, it->second);
+		it->second->lastUsedFrame = m_materialCacheFrame;
+		m_materialCacheStats.hits++;
 		return it->second->descriptorSet;
 	}
+	m_materialCacheStats.misses++;
 
 	// If not found in cache, create a new descriptor set
-	VkDescriptorSet newDescriptorSet = descriptorManager.AllocateDescriptorSet(pipelineConfig->descriptorSetLayouts[setIndex]);
+	VkDescriptorSet newDescriptorSet = descriptorManager.AllocateDescriptorSet(layout);
 	debugUtils.SetObjectName(newDescriptorSet, pipelineConfig->name + " Material Descriptor Set");
 
-	// Update the new descriptor set
+	// Gather every write of the new set and apply them in one call
 	if (entity->HasComponent<BasicMaterial>())
 	{
-		UpdateBasicMaterialDescriptors(entityManager, descriptorManager, newDescriptorSet, entity, allocator, setIndex);
+		UpdateBasicMaterialDescriptors(m_descriptorWriter, setIndex);
 	}
 	else if (entity->HasComponent<PBRMaterial>())
 	{
-		UpdatePBRMaterialDescriptors(entityManager, descriptorManager, newDescriptorSet, entity, allocator, setIndex);
+		UpdatePBRMaterialDescriptors(m_descriptorWriter, entity, setIndex);
 	}
+	descriptorManager.UpdateDescriptorSet(newDescriptorSet, m_descriptorWriter, layout);
 
-	// If cache is full, remove the least recently used item
-	if (m_materialDescriptorCache.size() >= MAX_CACHE_SIZE)
+	// Over the limit, free the least recently used sets that no frame in flight can still be drawing with. Ones
+	// bound this frame or by the frame before are kept, the cache grows past the limit instead.
+	while (m_materialDescriptorCache.size() >= MATERIAL_CACHE_SOFT_LIMIT && m_lruList.back().lastUsedFrame + MAX_FRAMES_IN_FLIGHT <= m_materialCacheFrame)
 	{
-		auto last = m_lruList.back(); // This is the least recently used item
-		m_materialDescriptorCache.erase(last.hash);
+		const LRUCacheEntry& last = m_lruList.back(); // This is the least recently used item
+		m_materialDescriptorCache.erase(last.key);
 		descriptorManager.FreeDescriptorSet(last.descriptorSet);
 		m_lruList.pop_back();
+		m_materialCacheStats.evictions++;
 	}
 
 	// Add the new item to the front of the LRU list (most recently used)
-	m_lruList.push_front({ descriptorHash, newDescriptorSet });
-	m_materialDescriptorCache[descriptorHash] = m_lruList.begin();
+	m_lruList.push_front({ key, newDescriptorSet, m_materialCacheFrame });
+	m_materialDescriptorCache[key] = m_lruList.begin();
 
 	return newDescriptorSet;
 }
 
-void Renderer::UpdateBasicMaterialDescriptors(EntityManager& entityManager, DescriptorManager& descriptorManager, VkDescriptorSet materialSet, Entity* entity, VmaAllocator allocator, int setIndex)
+Renderer::MaterialSetKey Renderer::GetMaterialSetKey(const Entity* entity, VkDescriptorSetLayout layout) const
 {
-	if (setIndex == 1) // Material
+	// Everything written by UpdateBasicMaterialDescriptors and UpdatePBRMaterialDescriptors, configs are dynamic offsets
+	MaterialSetKey key = {};
+	key.layout = layout;
+	key.buffer = m_uniformUploads.GetBuffer();
+
+	if (const PBRMaterial* pbrMaterial = entity->GetComponentPtr<PBRMaterial>())
 	{
-		BasicMaterialResource& materialResource = *entity->GetComponent<BasicMaterial>().materialResource;
-		SlimeUtil::CopyStructToBuffer(materialResource.config, allocator, materialResource.configAllocation);
-		descriptorManager.BindBuffer(materialSet, 0, materialResource.configBuffer, 0, sizeof(BasicMaterialResource::Config));
+		const PBRMaterialResource& material = *pbrMaterial->materialResource;
+		const TextureResource* textures[] = { material.albedoTex, material.normalTex, material.metallicTex, material.roughnessTex, material.aoTex };
+		for (size_t i = 0; i < std::size(textures); i++)
+		{
+			if (textures[i])
+			{
+				key.imageViews[i] = textures[i]->imageView;
+				key.samplers[i] = textures[i]->sampler;
+			}
+		}
 	}
+
+	return key;
 }
 
-void Renderer::UpdatePBRMaterialDescriptors(EntityManager& entityManager, DescriptorManager& descriptorManager, VkDescriptorSet descSet, Entity* entity, VmaAllocator allocator, int setIndex)
+size_t Renderer::MaterialSetKeyHash::operator()(const MaterialSetKey& key) const
 {
+	// Combined in order, unlike xor equal textures in different slots don't cancel out
+	size_t hash = std::hash<const void*>{}(key.layout);
+	auto combine = [&hash](const void* handle)
+	{
+		hash ^= std::hash<const void*>{}(handle) + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+	};
+
+	combine(key.buffer);
+	for (size_t i = 0; i < std::size(key.imageViews); i++)
+	{
+		combine(key.imageViews[i]);
+		combine(key.samplers[i]);
+	}
+
+	return hash;
+}
+
+VkDescriptorSet Renderer::GetFrameLightSet(EntityManager& entityManager, DescriptorManager& descriptorManager, VkDescriptorSetLayout layout, VulkanDebugUtils& debugUtils)
+{
+	for (const auto& [frameLayout, frameSet]: m_frameLightSets)
+	{
+		if (frameLayout == layout)
+		{
+			return frameSet;
+		}
+	}
+
 	auto lightEntity = entityManager.GetEntityByName("Light");
 	if (!lightEntity)
 	{
-		spdlog::critical("Light entity not found in UpdatePBRMaterialDescriptors.");
-		return;
+		spdlog::critical("Light entity not found in GetFrameLightSet.");
+		return VK_NULL_HANDLE;
 	}
 
 	auto light = lightEntity->GetComponentShrPtr<DirectionalLight>();
-	if (setIndex == 1) // Light
+
+	// From this frame's transient pool, it is reset as a whole once the frame has finished on the GPU
+	VkDescriptorSet frameSet = descriptorManager.AllocateTransientDescriptorSet(layout);
+	debugUtils.SetObjectName(frameSet, "Light Descriptor Set");
+
+	// Point lights go through the clusters, their shadows all share one atlas. Without point lights there is no
+	// atlas, and without EVSM no moments, the shadow map stands in for both so the bindings stay valid.
+	TextureResource shadowMap = m_shadowSystem.GetShadowMap(light);
+	TextureResource pointShadowAtlas = m_shadowSystem.GetPointShadowAtlas();
+	if (pointShadowAtlas.imageView == VK_NULL_HANDLE)
 	{
-		descriptorManager.BindBuffer(descSet, 0, light->buffer, 0, light->GetBindingDataSize());
+		pointShadowAtlas = shadowMap;
 	}
-	else if (setIndex == 2) // Material
+	TextureResource shadowMoments = m_shadowSystem.GetShadowMoments(light);
+	if (shadowMoments.imageView == VK_NULL_HANDLE)
 	{
-		PBRMaterial& pbrMaterial = entity->GetComponent<PBRMaterial>();
-		PBRMaterialResource& materialResource = *pbrMaterial.materialResource;
+		shadowMoments = shadowMap;
+	}
+	m_descriptorWriter.WriteBuffer(0, m_uniformUploads.GetBuffer(), 0, sizeof(LightUBO), VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+	m_descriptorWriter.WriteImage(1, shadowMap.imageView, shadowMap.sampler);
+	m_descriptorWriter.WriteBuffer(2, m_clusteredLights.GetLightBuffer(), 0, VK_WHOLE_SIZE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+	m_descriptorWriter.WriteBuffer(3, m_clusteredLights.GetClusterBuffer(), 0, VK_WHOLE_SIZE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+	m_descriptorWriter.WriteBuffer(4, m_clusteredLights.GetIndexBuffer(), 0, VK_WHOLE_SIZE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+	m_descriptorWriter.WriteImage(5, pointShadowAtlas.imageView, pointShadowAtlas.sampler);
+	m_descriptorWriter.WriteImage(6, shadowMoments.imageView, shadowMoments.sampler);
+	descriptorManager.UpdateDescriptorSet(frameSet, m_descriptorWriter, layout);
+
+	m_frameLightSets.emplace_back(layout, frameSet);
+	return frameSet;
+}
 
-		SlimeUtil::CopyStructToBuffer(materialResource.config, allocator, materialResource.configAllocation);
-		descriptorManager.BindBuffer(descSet, 0, materialResource.configBuffer, 0, sizeof(PBRMaterialResource::Config));
+void Renderer::UpdateBasicMaterialDescriptors(DescriptorWriter& writer, int setIndex)
+{
+	if (setIndex == 1) // Material
+	{
+		writer.WriteBuffer(0, m_uniformUploads.GetBuffer(), 0, sizeof(BasicMaterialResource::Config), VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+	}
+}
 
-		// TODO add support for multiple shadow maps
-		auto shadowMap = m_shadowSystem.GetShadowMap(light);
+void Renderer::UpdatePBRMaterialDescriptors(DescriptorWriter& writer, Entity* entity, int setIndex)
+{
+	if (setIndex == 2) // Material
+	{
+		PBRMaterial& pbrMaterial = entity->GetComponent<PBRMaterial>();
+		PBRMaterialResource& materialResource = *pbrMaterial.materialResource;
 
-		descriptorManager.BindImage(descSet, 1, shadowMap.imageView, shadowMap.sampler);
+		writer.WriteBuffer(0, m_uniformUploads.GetBuffer(), 0, sizeof(PBRMaterialResource::Config), VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
 
 		if (materialResource.albedoTex)
-			descriptorManager.BindImage(descSet, 2, materialResource.albedoTex->imageView, materialResource.albedoTex->sampler);
+			writer.WriteImage(1, materialResource.albedoTex->imageView, materialResource.albedoTex->sampler);
 		if (materialResource.normalTex)
-			descriptorManager.BindImage(descSet, 3, materialResource.normalTex->imageView, materialResource.normalTex->sampler);
+			writer.WriteImage(2, materialResource.normalTex->imageView, materialResource.normalTex->sampler);
 		if (materialResource.metallicTex)
-			descriptorManager.BindImage(descSet, 4, materialResource.metallicTex->imageView, materialResource.metallicTex->sampler);
+			writer.WriteImage(3, materialResource.metallicTex->imageView, materialResource.metallicTex->sampler);
 		if (materialResource.roughnessTex)
-			descriptorManager.BindImage(descSet, 5, materialResource.roughnessTex->imageView, materialResource.roughnessTex->sampler);
+			writer.WriteImage(4, materialResource.roughnessTex->imageView, materialResource.roughnessTex->sampler);
 		if (materialResource.aoTex)
-			descriptorManager.BindImage(descSet, 6, materialResource.aoTex->imageView, materialResource.aoTex->sampler);
+			writer.WriteImage(5, materialResource.aoTex->imageView, materialResource.aoTex->sampler);
 	}
 }
 
@@ -590,45 +1118,3 @@ void Renderer::CleanupDepthImage(vkb::DispatchTable& disp, VmaAllocator allocato
 	vmaDestroyImage(allocator, m_depthImage, m_depthImageAllocation);
 	disp.destroyImageView(m_depthImageView, nullptr);
 }
-
-// Helper function to generate a hash for a material
-// Helper function to generate a hash for all descriptor types
-inline size_t Renderer::GenerateDescriptorHash(const Entity* entity, int setIndex)
-{
-	size_t hash = std::hash<int>{}(setIndex); // Include setIndex in the hash
-
-	switch (setIndex)
-	{
-		case 0:
-		{
-			spdlog::error("You shouldnt of hit this!, This is a shared resource set and should be the same for all calls.");
-			break;
-		}
-		case 1:
-		{
-			if (entity->HasComponent<BasicMaterial>())
-			{
-				const auto& material = entity->GetComponent<BasicMaterial>().materialResource;
-				hash ^= std::hash<BasicMaterialResource::Config>{}(material->config);
-			}
-			break;
-		}
-		case 2:
-		{
-			if (entity->HasComponent<PBRMaterial>())
-			{
-				const auto& material = entity->GetComponent<PBRMaterial>().materialResource;
-				hash ^= std::hash<PBRMaterialResource::Config>{}(material->config);
-				// Include texture pointers in the hash
-				hash ^= std::hash<const void*>{}(material->albedoTex);
-				hash ^= std::hash<const void*>{}(material->normalTex);
-				hash ^= std::hash<const void*>{}(material->metallicTex);
-				hash ^= std::hash<const void*>{}(material->roughnessTex);
-				hash ^= std::hash<const void*>{}(material->aoTex);
-			}
-			break;
-		}
-	}
-
-	return hash;
-}
@@ -0,0 +1,272 @@
+#include "ShaderHotReload.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <set>
+#include <spdlog/spdlog.h>
+
+#ifdef __linux__
+	#include <poll.h>
+	#include <sys/inotify.h>
+	#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+	#define SLIME_POPEN _popen
+	#define SLIME_PCLOSE _pclose
+#else
+	#define SLIME_POPEN popen
+	#define SLIME_PCLOSE pclose
+#endif
+
+// How long the watcher sleeps between checks for Stop, and how long it lets an editor finish saving
+constexpr int SHADER_WATCH_POLL_MS = 100;
+constexpr int SHADER_WATCH_SETTLE_MS = 30;
+
+ShaderHotReload::~ShaderHotReload()
+{
+	Stop();
+}
+
+bool ShaderHotReload::Start(const std::string& shaderDirectory)
+{
+#ifndef SLIME_GLSLC_EXECUTABLE
+	spdlog::info("Shader hot reload is off, the build didn't provide glslc");
+	return false;
+#else
+	Stop();
+
+	m_directory = shaderDirectory;
+	while (!m_directory.empty() && (m_directory.back() == '/' || m_directory.back() == '\\'))
+	{
+		m_directory.pop_back();
+	}
+
+	std::error_code error;
+	if (!std::filesystem::is_directory(m_directory, error))
+	{
+		spdlog::warn("Shader hot reload is off, {} is not a directory", m_directory);
+		return false;
+	}
+
+	#ifdef __linux__
+	m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	// Editors either write in place or save to a temporary file and rename it over the source
+	if (m_inotify < 0 || inotify_add_watch(m_inotify, m_directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		spdlog::warn("Shader hot reload is off, can't watch {}", m_directory);
+		if (m_inotify >= 0)
+		{
+			close(m_inotify);
+			m_inotify = -1;
+		}
+		return false;
+	}
+	#else
+	m_writeTimes.clear();
+	for (const auto& entry: std::filesystem::directory_iterator(m_directory, error))
+	{
+		if (IsShaderSource(entry.path().string()))
+		{
+			m_writeTimes[entry.path().string()] = entry.last_write_time(error);
+		}
+	}
+	#endif
+
+	m_running = true;
+	m_thread = std::thread(&ShaderHotReload::WatchLoop, this);
+
+	spdlog::info("Watching {} for shader changes", m_directory);
+	return true;
+#endif
+}
+
+void ShaderHotReload::Stop()
+{
+	m_running = false;
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+
+#ifdef __linux__
+	if (m_inotify >= 0)
+	{
+		close(m_inotify);
+		m_inotify = -1;
+	}
+#endif
+}
+
+std::vector<std::string> ShaderHotReload::TakeCompiledShaders()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::vector<std::string> compiled;
+	compiled.swap(m_compiled);
+	return compiled;
+}
+
+ShaderHotReload::Stats ShaderHotReload::GetStats() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats;
+}
+
+bool ShaderHotReload::IsShaderSource(const std::string& path)
+{
+	// The same extensions cmake/compile_shaders.cmake compiles
+	static const std::array<const char*, 7> extensions = { ".vert", ".frag", ".comp", ".geom", ".tesc", ".tese", ".mesh" };
+
+	std::string extension = std::filesystem::path(path).extension().string();
+	return std::find(extensions.begin(), extensions.end(), extension) != extensions.end();
+}
+
+bool ShaderHotReload::CompileShader(const std::string& sourcePath, std::string& log)
+{
+	return CompileShader(sourcePath, sourcePath + ".spv", {}, log);
+}
+
+bool ShaderHotReload::CompileShader(const std::string& sourcePath, const std::string& outputPath, const std::vector<std::string>& defines, std::string& log)
+{
+	log.clear();
+#ifndef SLIME_GLSLC_EXECUTABLE
+	log = "No glslc available";
+	return false;
+#else
+	std::string tempPath = outputPath + ".tmp";
+
+	// Same flags as the build
+	std::string command = "\"" SLIME_GLSLC_EXECUTABLE "\" --target-env=vulkan1.3";
+	for (const std::string& define: defines)
+	{
+		command += " -D" + define;
+	}
+	command += " -o \"" + tempPath + "\" \"" + sourcePath + "\" 2>&1";
+	#ifdef _WIN32
+	// cmd strips the outer quotes of the whole command line
+	command = "\"" + command + "\"";
+	#endif
+
+	FILE* pipe = SLIME_POPEN(command.c_str(), "r");
+	if (!pipe)
+	{
+		log = "Failed to run glslc";
+		return false;
+	}
+
+	std::array<char, 256> buffer;
+	while (fgets(buffer.data(), static_cast<int>(buffer.size()), pipe))
+	{
+		log += buffer.data();
+	}
+	int result = SLIME_PCLOSE(pipe);
+
+	std::error_code error;
+	if (result != 0)
+	{
+		std::filesystem::remove(tempPath, error);
+		return false;
+	}
+
+	std::filesystem::rename(tempPath, outputPath, error);
+	if (error)
+	{
+		log = "Failed to replace " + outputPath + ": " + error.message();
+		return false;
+	}
+	return true;
+#endif
+}
+
+void ShaderHotReload::WatchLoop()
+{
+	while (m_running)
+	{
+		std::set<std::string> changed;
+
+#ifdef __linux__
+		pollfd pollInfo{ m_inotify, POLLIN, 0 };
+		if (poll(&pollInfo, 1, SHADER_WATCH_POLL_MS) <= 0)
+		{
+			continue;
+		}
+
+		// Saving a file often comes as a burst of events, collect until it goes quiet so each source compiles once
+		alignas(inotify_event) char buffer[4096];
+		do
+		{
+			ssize_t length;
+			while ((length = read(m_inotify, buffer, sizeof(buffer))) > 0)
+			{
+				for (char* cursor = buffer; cursor < buffer + length;)
+				{
+					const inotify_event* event = reinterpret_cast<const inotify_event*>(cursor);
+					if (event->len > 0 && IsShaderSource(event->name))
+					{
+						changed.insert(m_directory + "/" + event->name);
+					}
+					cursor += sizeof(inotify_event) + event->len;
+				}
+			}
+		} while (poll(&pollInfo, 1, SHADER_WATCH_SETTLE_MS) > 0);
+#else
+		std::this_thread::sleep_for(std::chrono::milliseconds(SHADER_WATCH_POLL_MS));
+
+		std::error_code error;
+		for (const auto& entry: std::filesystem::directory_iterator(m_directory, error))
+		{
+			std::string path = entry.path().string();
+			if (!IsShaderSource(path))
+			{
+				continue;
+			}
+
+			std::filesystem::file_time_type writeTime = entry.last_write_time(error);
+			auto it = m_writeTimes.find(path);
+			if (it == m_writeTimes.end() || it->second != writeTime)
+			{
+				m_writeTimes[path] = writeTime;
+				changed.insert(path);
+			}
+		}
+		if (!changed.empty())
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(SHADER_WATCH_SETTLE_MS));
+		}
+#endif
+
+		if (!changed.empty())
+		{
+			CompileChanged(std::vector<std::string>(changed.begin(), changed.end()));
+		}
+	}
+}
+
+void ShaderHotReload::CompileChanged(const std::vector<std::string>& sourcePaths)
+{
+	for (const std::string& sourcePath: sourcePaths)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		std::string log;
+		bool compiled = CompileShader(sourcePath, log);
+		double compileMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stats.lastCompileMs = compileMs;
+		if (compiled)
+		{
+			m_stats.compiled++;
+			m_compiled.push_back(sourcePath + ".spv");
+			spdlog::info("Recompiled {} in {:.0f} ms", sourcePath, compileMs);
+		}
+		else
+		{
+			// The old module stays in use until the shader compiles again
+			m_stats.failed++;
+			m_stats.lastError = log;
+			spdlog::warn("Failed to recompile {}:\n{}", sourcePath, log);
+		}
+	}
+}
@@ -3,12 +3,42 @@
 //
 #include "ShaderManager.h"
 
+#include <chrono>
+#include <cstring>
 #include <fstream>
 #include <stdexcept>
 
+#include "ShaderVariants.h"
 #include "spdlog/spdlog.h"
 #include "spirv_cross.hpp"
-#include "spirv_glsl.hpp"
+
+// "SLRF", bump the version whenever the sidecar layout or what Reflect produces changes
+constexpr uint32_t REFLECTION_SIDECAR_MAGIC = 0x46524C53;
+constexpr uint32_t REFLECTION_SIDECAR_VERSION = 3;
+
+struct ReflectionSidecarHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t spirvHash;
+	uint32_t stage;
+	uint32_t attributeCount;
+	uint32_t vertexBindingCount;
+	uint32_t descriptorBindingCount;
+	uint32_t pushConstantCount;
+	uint32_t keywordConstantCount;
+};
+
+// Flattened ShaderResources::DescriptorSetLayoutBinding, the real one holds a pointer
+struct ReflectionSidecarBinding
+{
+	uint32_t set;
+	uint32_t binding;
+	uint32_t descriptorType;
+	uint32_t descriptorCount;
+	uint32_t stageFlags;
+	uint32_t flags;
+};
 
 void ShaderManager::CleanUp(vkb::DispatchTable disp)
 {
@@ -27,15 +57,86 @@ ShaderModule ShaderManager::LoadShader(vkb::DispatchTable disp, const std::strin
 	std::vector<uint32_t> code = ReadFile(path);
 	VkShaderModule shaderModule = CreateShaderModule(disp, code);
 	ShaderModule module(shaderModule, std::move(code), stage);
+	module.path = path;
+	module.spirvHash = HashSpirv(module.spirvCode);
 	m_shaderModules[path] = module;
 
 	return module;
 }
 
+ShaderModule ShaderManager::ReloadShader(vkb::DispatchTable disp, const std::string& path, VkShaderStageFlagBits stage)
+{
+	UnloadShader(disp, path);
+
+	// New SPIR-V hashes differently, so ParseShader reflects it again and rewrites the sidecar
+	return LoadShader(disp, path, stage);
+}
+
+void ShaderManager::UnloadShader(vkb::DispatchTable disp, const std::string& path)
+{
+	auto it = m_shaderModules.find(path);
+	if (it != m_shaderModules.end())
+	{
+		disp.destroyShaderModule(it->second.handle, nullptr);
+		m_shaderModules.erase(it);
+	}
+}
+
 ShaderManager::ShaderResources ShaderManager::ParseShader(const ShaderModule& shaderModule)
 {
+	uint64_t spirvHash = shaderModule.spirvHash != 0 ? shaderModule.spirvHash : HashSpirv(shaderModule.spirvCode);
+	uint64_t key = spirvHash ^ (static_cast<uint64_t>(shaderModule.stage) * 0x9E3779B97F4A7C15ull);
+
+	auto cached = m_reflectionCache.find(key);
+	if (cached != m_reflectionCache.end())
+	{
+		m_reflectionStats.memoryHits++;
+		return cached->second;
+	}
+
+	ShaderResources resources;
+	std::string sidecarPath = shaderModule.path.empty() ? std::string() : GetSidecarPath(shaderModule.path);
+	if (!sidecarPath.empty())
+	{
+		std::ifstream file(sidecarPath, std::ios::binary);
+		if (file)
+		{
+			std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+			if (DeserializeResources(data, spirvHash, shaderModule.stage, resources))
+			{
+				m_reflectionStats.sidecarHits++;
+				m_reflectionCache[key] = resources;
+				return resources;
+			}
+			spdlog::debug("Reflection sidecar {} is stale, reflecting again", sidecarPath);
+		}
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+	resources = Reflect(shaderModule);
+	m_reflectionStats.reflectMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	m_reflectionStats.reflected++;
+
+	// A read only resource directory only costs us the warm start
+	if (!sidecarPath.empty())
+	{
+		std::vector<uint8_t> data = SerializeResources(spirvHash, shaderModule.stage, resources);
+		std::ofstream file(sidecarPath, std::ios::binary | std::ios::trunc);
+		if (!file.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size())))
+		{
+			spdlog::debug("Failed to write reflection sidecar {}", sidecarPath);
+		}
+	}
+
+	m_reflectionCache[key] = resources;
+	return resources;
+}
+
+ShaderManager::ShaderResources ShaderManager::Reflect(const ShaderModule& shaderModule)
+{
+	// Only reflection is needed, the plain Compiler skips everything CompilerGLSL sets up for cross compiling
 	ShaderResources resources;
-	spirv_cross::CompilerGLSL compiler(shaderModule.spirvCode);
+	spirv_cross::Compiler compiler(shaderModule.spirvCode);
 	spirv_cross::ShaderResources shaderResources = compiler.get_shader_resources();
 
 	// Parse vertex input attributes
@@ -85,7 +186,7 @@ ShaderManager::ShaderResources ShaderManager::ParseShader(const ShaderModule& sh
 		resources.bindingDescriptions = std::move(bindingDescriptions);
 	}
 
-	// Parse uniform buffers
+	// Parse uniform buffers, all of them hold per frame data in the renderer's upload ring and are bound with a dynamic offset
 	for (const auto& resource: shaderResources.uniform_buffers)
 	{
 		uint32_t binding = compiler.get_decoration(resource.id, spv::DecorationBinding);
@@ -94,7 +195,7 @@ ShaderManager::ShaderResources ShaderManager::ParseShader(const ShaderModule& sh
 		// Check if we already have a binding for this set and binding number
 		auto it = std::find_if(resources.descriptorSetLayoutBindings.begin(),
 		        resources.descriptorSetLayoutBindings.end(),
-		        [binding, set](const ShaderResources::DescriptorSetLayoutBinding& existingBinding) { return existingBinding.binding.binding == binding && existingBinding.set == set && existingBinding.binding.descriptorType == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER; });
+		        [binding, set](const ShaderResources::DescriptorSetLayoutBinding& existingBinding) { return existingBinding.binding.binding == binding && existingBinding.set == set && existingBinding.binding.descriptorType == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC; });
 
 		if (it != resources.descriptorSetLayoutBindings.end())
 		{
@@ -106,7 +207,7 @@ ShaderManager::ShaderResources ShaderManager::ParseShader(const ShaderModule& sh
 			// Create a new binding
 			VkDescriptorSetLayoutBinding layoutBinding{};
 			layoutBinding.binding = binding;
-			layoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+			layoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 			layoutBinding.descriptorCount = 1;
 			layoutBinding.stageFlags = shaderModule.stage;
 			layoutBinding.pImmutableSamplers = nullptr; // Only relevant for samplers
@@ -115,6 +216,33 @@ ShaderManager::ShaderResources ShaderManager::ParseShader(const ShaderModule& sh
 		}
 	}
 
+	// Parse storage buffers
+	for (const auto& resource: shaderResources.storage_buffers)
+	{
+		uint32_t binding = compiler.get_decoration(resource.id, spv::DecorationBinding);
+		uint32_t set = compiler.get_decoration(resource.id, spv::DecorationDescriptorSet);
+
+		auto it = std::find_if(resources.descriptorSetLayoutBindings.begin(),
+		        resources.descriptorSetLayoutBindings.end(),
+		        [binding, set](const ShaderResources::DescriptorSetLayoutBinding& existingBinding) { return existingBinding.binding.binding == binding && existingBinding.set == set && existingBinding.binding.descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER; });
+
+		if (it != resources.descriptorSetLayoutBindings.end())
+		{
+			it->binding.stageFlags |= shaderModule.stage;
+		}
+		else
+		{
+			VkDescriptorSetLayoutBinding layoutBinding{};
+			layoutBinding.binding = binding;
+			layoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			layoutBinding.descriptorCount = 1;
+			layoutBinding.stageFlags = shaderModule.stage;
+			layoutBinding.pImmutableSamplers = nullptr;
+
+			resources.descriptorSetLayoutBindings.push_back({ set, layoutBinding });
+		}
+	}
+
 	// Parse combined image samplers
 	for (const auto& resource: shaderResources.sampled_images)
 	{
@@ -143,6 +271,46 @@ ShaderManager::ShaderResources ShaderManager::ParseShader(const ShaderModule& sh
 			layoutBinding.stageFlags = shaderModule.stage;
 			layoutBinding.pImmutableSamplers = nullptr;
 
+			// Unsized arrays are bindless, slots are filled in as they are needed and never while in use
+			VkDescriptorBindingFlags flags = 0;
+			const spirv_cross::SPIRType& type = compiler.get_type(resource.type_id);
+			if (!type.array.empty() && type.array[0] == 0)
+			{
+				layoutBinding.descriptorCount = BINDLESS_DESCRIPTOR_CAPACITY;
+				flags = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT | VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT;
+			}
+			else if (!type.array.empty())
+			{
+				layoutBinding.descriptorCount = type.array[0];
+			}
+
+			resources.descriptorSetLayoutBindings.push_back({ set, layoutBinding, flags });
+		}
+	}
+
+	// Parse storage images, written by compute shaders
+	for (const auto& resource: shaderResources.storage_images)
+	{
+		uint32_t binding = compiler.get_decoration(resource.id, spv::DecorationBinding);
+		uint32_t set = compiler.get_decoration(resource.id, spv::DecorationDescriptorSet);
+
+		auto it = std::find_if(resources.descriptorSetLayoutBindings.begin(),
+		        resources.descriptorSetLayoutBindings.end(),
+		        [binding, set](const ShaderResources::DescriptorSetLayoutBinding& existingBinding) { return existingBinding.binding.binding == binding && existingBinding.set == set && existingBinding.binding.descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE; });
+
+		if (it != resources.descriptorSetLayoutBindings.end())
+		{
+			it->binding.stageFlags |= shaderModule.stage;
+		}
+		else
+		{
+			VkDescriptorSetLayoutBinding layoutBinding{};
+			layoutBinding.binding = binding;
+			layoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+			layoutBinding.descriptorCount = 1;
+			layoutBinding.stageFlags = shaderModule.stage;
+			layoutBinding.pImmutableSamplers = nullptr;
+
 			resources.descriptorSetLayoutBindings.push_back({ set, layoutBinding });
 		}
 	}
@@ -198,6 +366,16 @@ ShaderManager::ShaderResources ShaderManager::ParseShader(const ShaderModule& sh
 		}
 	}
 
+	// Keyword toggles, glslang names spec constants after the GLSL constant
+	for (const spirv_cross::SpecializationConstant& constant: compiler.get_specialization_constants())
+	{
+		uint32_t keyword = ShaderVariants::GetKeyword(compiler.get_name(constant.id));
+		if (keyword != 0)
+		{
+			resources.keywordConstants.push_back({ constant.constant_id, keyword });
+		}
+	}
+
 	return resources;
 }
 
@@ -241,66 +419,149 @@ ShaderManager::ShaderResources ShaderManager::CombineResources(const std::vector
 	return combinedResources;
 }
 
-std::string HashBindings(const std::vector<VkDescriptorSetLayoutBinding>& bindings)
-{
-	std::string hash = "descriptor_set_layout";
-	for (const auto& binding: bindings)
-	{
-		hash += std::to_string(binding.binding) + std::to_string(binding.descriptorType) + std::to_string(binding.descriptorCount) + std::to_string(binding.stageFlags);
-	}
-	return hash;
-}
-
 std::vector<VkDescriptorSetLayout> ShaderManager::CreateDescriptorSetLayouts(vkb::DispatchTable disp, const ShaderResources& resources)
 {
 	std::map<uint32_t, std::vector<VkDescriptorSetLayoutBinding>> setBindings;
+	std::map<uint32_t, std::vector<VkDescriptorBindingFlags>> setBindingFlags;
 
 	// Group bindings by set
 	for (const auto& binding: resources.descriptorSetLayoutBindings)
 	{
 		setBindings[binding.set].push_back(binding.binding);
+		setBindingFlags[binding.set].push_back(binding.flags);
 	}
 
+	// Pipelines declaring the same set get the same layout, whatever order their shaders list the bindings in
 	std::vector<VkDescriptorSetLayout> descriptorSetLayouts;
 	descriptorSetLayouts.reserve(setBindings.size());
+	for (const auto& [set, bindings]: setBindings)
+	{
+		descriptorSetLayouts.push_back(m_layoutRegistry.GetDescriptorSetLayout(disp, bindings, setBindingFlags[set]));
+	}
 
-	std::vector<VkDescriptorSetLayoutCreateInfo> descriptorSetLayoutInfos;
-	descriptorSetLayoutInfos.reserve(setBindings.size());
+	return descriptorSetLayouts;
+}
 
-	for (const auto& [set, bindings]: setBindings)
+uint64_t ShaderManager::HashSpirv(const std::vector<uint32_t>& spirvCode)
+{
+	// FNV-1a a word at a time
+	uint64_t hash = 14695981039346656037ull;
+	for (uint32_t word: spirvCode)
 	{
-		std::string hash = HashBindings(bindings);
+		hash ^= word;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
 
-		if (m_descriptorSetLayouts.find(hash) != m_descriptorSetLayouts.end())
+std::vector<uint8_t> ShaderManager::SerializeResources(uint64_t spirvHash, VkShaderStageFlagBits stage, const ShaderResources& resources)
+{
+	ReflectionSidecarHeader header{};
+	header.magic = REFLECTION_SIDECAR_MAGIC;
+	header.version = REFLECTION_SIDECAR_VERSION;
+	header.spirvHash = spirvHash;
+	header.stage = static_cast<uint32_t>(stage);
+	header.attributeCount = static_cast<uint32_t>(resources.attributeDescriptions.size());
+	header.vertexBindingCount = static_cast<uint32_t>(resources.bindingDescriptions.size());
+	header.descriptorBindingCount = static_cast<uint32_t>(resources.descriptorSetLayoutBindings.size());
+	header.pushConstantCount = static_cast<uint32_t>(resources.pushConstantRanges.size());
+	header.keywordConstantCount = static_cast<uint32_t>(resources.keywordConstants.size());
+
+	std::vector<uint8_t> data;
+	data.reserve(sizeof(header) + header.attributeCount * sizeof(VkVertexInputAttributeDescription) + header.vertexBindingCount * sizeof(VkVertexInputBindingDescription) +
+	        header.descriptorBindingCount * sizeof(ReflectionSidecarBinding) + header.pushConstantCount * sizeof(VkPushConstantRange) + header.keywordConstantCount * sizeof(ShaderResources::KeywordConstant));
+
+	auto append = [&data](const void* source, size_t size)
+	{
+		size_t offset = data.size();
+		data.resize(offset + size);
+		if (size > 0)
 		{
-			descriptorSetLayouts.push_back(m_descriptorSetLayouts[hash]);
-			continue;
+			std::memcpy(data.data() + offset, source, size);
 		}
+	};
 
-		VkDescriptorSetLayoutCreateInfo layoutInfo{};
-		layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-		layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
-		layoutInfo.pBindings = bindings.data();
+	append(&header, sizeof(header));
+	append(resources.attributeDescriptions.data(), resources.attributeDescriptions.size() * sizeof(VkVertexInputAttributeDescription));
+	append(resources.bindingDescriptions.data(), resources.bindingDescriptions.size() * sizeof(VkVertexInputBindingDescription));
+	for (const auto& binding: resources.descriptorSetLayoutBindings)
+	{
+		ReflectionSidecarBinding flat{ binding.set, binding.binding.binding, static_cast<uint32_t>(binding.binding.descriptorType), binding.binding.descriptorCount, binding.binding.stageFlags, binding.flags };
+		append(&flat, sizeof(flat));
+	}
+	append(resources.pushConstantRanges.data(), resources.pushConstantRanges.size() * sizeof(VkPushConstantRange));
+	append(resources.keywordConstants.data(), resources.keywordConstants.size() * sizeof(ShaderResources::KeywordConstant));
 
-		descriptorSetLayoutInfos.push_back(layoutInfo);
+	return data;
+}
 
-		VkDescriptorSetLayout descriptorSetLayout;
-		if (disp.createDescriptorSetLayout(&layoutInfo, nullptr, &descriptorSetLayout) != VK_SUCCESS)
-		{
-			throw std::runtime_error("failed to create descriptor set layout!");
-		}
+bool ShaderManager::DeserializeResources(const std::vector<uint8_t>& data, uint64_t spirvHash, VkShaderStageFlagBits stage, ShaderResources& resources)
+{
+	ReflectionSidecarHeader header;
+	if (data.size() < sizeof(header))
+	{
+		return false;
+	}
+	std::memcpy(&header, data.data(), sizeof(header));
 
-		m_descriptorSetLayouts[hash] = descriptorSetLayout;
-		descriptorSetLayouts.push_back(descriptorSetLayout);
+	if (header.magic != REFLECTION_SIDECAR_MAGIC || header.version != REFLECTION_SIDECAR_VERSION || header.spirvHash != spirvHash || header.stage != static_cast<uint32_t>(stage))
+	{
+		return false;
+	}
+
+	size_t expectedSize = sizeof(header) + static_cast<size_t>(header.attributeCount) * sizeof(VkVertexInputAttributeDescription) +
+	        static_cast<size_t>(header.vertexBindingCount) * sizeof(VkVertexInputBindingDescription) + static_cast<size_t>(header.descriptorBindingCount) * sizeof(ReflectionSidecarBinding) +
+	        static_cast<size_t>(header.pushConstantCount) * sizeof(VkPushConstantRange) + static_cast<size_t>(header.keywordConstantCount) * sizeof(ShaderResources::KeywordConstant);
+	if (data.size() != expectedSize)
+	{
+		return false;
+	}
 
-		spdlog::debug("Created descriptor set layout for set {}", set);
-		for (const auto& binding: bindings)
+	const uint8_t* cursor = data.data() + sizeof(header);
+	auto read = [&cursor](void* destination, size_t size)
+	{
+		if (size > 0)
 		{
-			spdlog::debug("  Binding {}: type {}, count {}, stage flags {}", binding.binding, static_cast<int>(binding.descriptorType), binding.descriptorCount, static_cast<int>(binding.stageFlags));
+			std::memcpy(destination, cursor, size);
 		}
+		cursor += size;
+	};
+
+	ShaderResources result;
+	result.attributeDescriptions.resize(header.attributeCount);
+	read(result.attributeDescriptions.data(), header.attributeCount * sizeof(VkVertexInputAttributeDescription));
+	result.bindingDescriptions.resize(header.vertexBindingCount);
+	read(result.bindingDescriptions.data(), header.vertexBindingCount * sizeof(VkVertexInputBindingDescription));
+
+	result.descriptorSetLayoutBindings.reserve(header.descriptorBindingCount);
+	for (uint32_t i = 0; i < header.descriptorBindingCount; i++)
+	{
+		ReflectionSidecarBinding flat;
+		read(&flat, sizeof(flat));
+
+		ShaderResources::DescriptorSetLayoutBinding binding{};
+		binding.set = flat.set;
+		binding.binding.binding = flat.binding;
+		binding.binding.descriptorType = static_cast<VkDescriptorType>(flat.descriptorType);
+		binding.binding.descriptorCount = flat.descriptorCount;
+		binding.binding.stageFlags = flat.stageFlags;
+		binding.binding.pImmutableSamplers = nullptr;
+		binding.flags = flat.flags;
+		result.descriptorSetLayoutBindings.push_back(binding);
 	}
 
-	return descriptorSetLayouts;
+	result.pushConstantRanges.resize(header.pushConstantCount);
+	read(result.pushConstantRanges.data(), header.pushConstantCount * sizeof(VkPushConstantRange));
+	result.keywordConstants.resize(header.keywordConstantCount);
+	read(result.keywordConstants.data(), header.keywordConstantCount * sizeof(ShaderResources::KeywordConstant));
+
+	resources = std::move(result);
+	return true;
+}
+
+std::string ShaderManager::GetSidecarPath(const std::string& spirvPath)
+{
+	return spirvPath + ".refl";
 }
 
 void ShaderManager::CleanupShaderModules(vkb::DispatchTable disp)
@@ -314,11 +575,8 @@ void ShaderManager::CleanupShaderModules(vkb::DispatchTable disp)
 
 void ShaderManager::CleanupDescriptorSetLayouts(vkb::DispatchTable disp)
 {
-	for (const auto& [hash, descriptorSetLayout]: m_descriptorSetLayouts)
-	{
-		disp.destroyDescriptorSetLayout(descriptorSetLayout, nullptr);
-	}
-	m_descriptorSetLayouts.clear();
+	// Pipeline layouts too, they are deduplicated in the same registry
+	m_layoutRegistry.Cleanup(disp);
 }
 
 std::vector<uint32_t> ShaderManager::ReadFile(const std::string& filename)
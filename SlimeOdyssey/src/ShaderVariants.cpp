@@ -0,0 +1,164 @@
+#include "ShaderVariants.h"
+
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include "imgui.h"
+#include "ShaderHotReload.h"
+
+// Indexed by bit, the names double as the GLSL defines and specialization constant names
+static const std::array<const char*, SHADER_KEYWORD_COUNT> SHADER_KEYWORD_NAMES = { "NORMAL_MAP", "AO_MAP", "RECEIVE_SHADOWS" };
+
+static std::string SpirvSourcePath(const std::string& spirvPath)
+{
+	const std::string extension = ".spv";
+	if (spirvPath.size() > extension.size() && spirvPath.compare(spirvPath.size() - extension.size(), extension.size(), extension) == 0)
+	{
+		return spirvPath.substr(0, spirvPath.size() - extension.size());
+	}
+	return spirvPath;
+}
+
+const char* ShaderVariants::GetKeywordName(uint32_t keyword)
+{
+	for (uint32_t i = 0; i < SHADER_KEYWORD_COUNT; i++)
+	{
+		if (keyword == (1u << i))
+		{
+			return SHADER_KEYWORD_NAMES[i];
+		}
+	}
+	return nullptr;
+}
+
+uint32_t ShaderVariants::GetKeyword(const std::string& name)
+{
+	for (uint32_t i = 0; i < SHADER_KEYWORD_COUNT; i++)
+	{
+		if (name == SHADER_KEYWORD_NAMES[i])
+		{
+			return 1u << i;
+		}
+	}
+	return 0;
+}
+
+uint32_t ShaderVariants::ParseDeclaredKeywords(const std::string& source)
+{
+	const std::string marker = "@keywords";
+
+	uint32_t keywords = 0;
+	std::istringstream lines(source);
+	std::string line;
+	while (std::getline(lines, line))
+	{
+		size_t comment = line.find("//");
+		size_t position = line.find(marker);
+		if (comment == std::string::npos || position == std::string::npos || position < comment)
+		{
+			continue;
+		}
+
+		std::istringstream names(line.substr(position + marker.size()));
+		std::string name;
+		while (names >> name)
+		{
+			keywords |= GetKeyword(name);
+		}
+	}
+	return keywords;
+}
+
+uint32_t ShaderVariants::GetDeclaredKeywords(const std::string& spirvPath)
+{
+	auto it = m_declaredKeywords.find(spirvPath);
+	if (it != m_declaredKeywords.end())
+	{
+		return it->second;
+	}
+
+	// Without the source (a shipped build with only SPIR-V) there are no variants, the base shader has everything
+	std::ifstream file(SpirvSourcePath(spirvPath));
+	std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	uint32_t keywords = ParseDeclaredKeywords(source);
+	m_declaredKeywords[spirvPath] = keywords;
+	return keywords;
+}
+
+std::string ShaderVariants::GetVariantPath(const std::string& spirvPath, uint32_t compiledKeywords, uint32_t compiledMask)
+{
+	compiledKeywords &= compiledMask;
+	if (compiledKeywords == compiledMask)
+	{
+		return spirvPath;
+	}
+
+	std::filesystem::path path(SpirvSourcePath(spirvPath));
+	return (path.parent_path() / "variants" / (path.filename().string() + "." + std::to_string(compiledKeywords) + ".spv")).string();
+}
+
+std::vector<std::string> ShaderVariants::GetVariantDefines(uint32_t compiledKeywords)
+{
+	std::vector<std::string> defines = { "SLIME_VARIANT" };
+	for (uint32_t i = 0; i < SHADER_KEYWORD_COUNT; i++)
+	{
+		if (compiledKeywords & (1u << i))
+		{
+			defines.push_back(SHADER_KEYWORD_NAMES[i]);
+		}
+	}
+	return defines;
+}
+
+ShaderVariants::BuildResult ShaderVariants::BuildVariant(const std::string& spirvPath, uint32_t compiledKeywords, uint32_t compiledMask, std::string& log)
+{
+	log.clear();
+	std::string variantPath = GetVariantPath(spirvPath, compiledKeywords, compiledMask);
+	if (variantPath == spirvPath)
+	{
+		return BuildResult::DiskHit;
+	}
+
+	std::string sourcePath = SpirvSourcePath(spirvPath);
+	std::error_code error;
+	std::filesystem::file_time_type sourceTime = std::filesystem::last_write_time(sourcePath, error);
+	if (error)
+	{
+		log = "Missing shader source " + sourcePath;
+		return BuildResult::Failed;
+	}
+
+	std::filesystem::file_time_type variantTime = std::filesystem::last_write_time(variantPath, error);
+	if (!error && variantTime >= sourceTime)
+	{
+		return BuildResult::DiskHit;
+	}
+
+	std::filesystem::create_directories(std::filesystem::path(variantPath).parent_path(), error);
+	return ShaderHotReload::CompileShader(sourcePath, variantPath, GetVariantDefines(compiledKeywords & compiledMask), log) ? BuildResult::Compiled : BuildResult::Failed;
+}
+
+void ShaderVariants::RecordBuild(BuildResult result, double milliseconds)
+{
+	switch (result)
+	{
+		case BuildResult::DiskHit:
+			m_stats.diskHits++;
+			break;
+		case BuildResult::Compiled:
+			m_stats.compiled++;
+			m_stats.compileMilliseconds += milliseconds;
+			break;
+		case BuildResult::Failed:
+			m_stats.failed++;
+			break;
+	}
+}
+
+void ShaderVariants::ImGuiDebug() const
+{
+	ImGui::Text("Shader variants: %u requested, %u ready, SPIR-V %u compiled (%.0f ms), %u from disk, %u failed", m_stats.requested, m_stats.created, m_stats.compiled, m_stats.compileMilliseconds, m_stats.diskHits, m_stats.failed);
+}
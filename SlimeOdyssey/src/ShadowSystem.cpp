@@ -1,9 +1,14 @@
 #include "ShadowSystem.h"
 
+#include <algorithm>
 #include <backends/imgui_impl_vulkan.h>
-#include <glm/gtx/norm.hpp>
+#include <bit>
+#include <cmath>
+#include <glm/gtc/matrix_transform.hpp>
+#include <numeric>
 #include <Scene.h>
 
+#include "DescriptorManager.h"
 #include "ModelManager.h"
 #include "VulkanDebugUtils.h"
 #include "VulkanUtil.h"
@@ -20,19 +25,18 @@ void ShadowSystem::Cleanup(vkb::DispatchTable& disp, VmaAllocator allocator)
 		CleanupShadowMap(disp, allocator, light);
 	}
 	m_shadowData.clear();
+
+	if (m_pointShadowAtlas.image != VK_NULL_HANDLE)
+	{
+		vmaDestroyImage(allocator, m_pointShadowAtlas.image, m_pointShadowAtlas.allocation);
+		disp.destroyImageView(m_pointShadowAtlas.imageView, nullptr);
+		disp.destroySampler(m_pointShadowAtlas.sampler, nullptr);
+		m_pointShadowAtlas = TextureResource();
+	}
+	m_pointShadows.clear();
 }
 
-bool ShadowSystem::UpdateShadowMaps(vkb::DispatchTable& disp,
-        VkCommandBuffer& cmd,
-        ModelManager& modelManager,
-        VmaAllocator allocator,
-        VkCommandPool commandPool,
-        VkQueue graphicsQueue,
-        VulkanDebugUtils& debugUtils,
-        Scene* scene,
-        std::function<void(vkb::DispatchTable, VulkanDebugUtils&, VkCommandBuffer&, ModelManager&, Scene*)> drawModels,
-        const std::vector<std::shared_ptr<Light>>& lights,
-        std::shared_ptr<Camera> camera)
+bool ShadowSystem::UpdateShadowMaps(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, const std::vector<std::shared_ptr<Light>>& lights, std::shared_ptr<Camera> camera, uint32_t staticCasterVersion)
 {
 	bool invalidateDescriptors = false;
 
@@ -43,19 +47,430 @@ bool ShadowSystem::UpdateShadowMaps(vkb::DispatchTable& disp,
 		ReconstructShadowMaps(disp, allocator, debugUtils);
 	}
 
+	m_views.clear();
+	m_casterViews.clear();
+
 	for (const auto light: lights)
 	{
+		// The cascades of directional lights, point lights get their atlas tiles in AllocatePointShadows below
+		if (light->GetType() != LightType::Directional)
+		{
+			continue;
+		}
+
 		if (m_shadowData.find(light) == m_shadowData.end())
 		{
 			CreateShadowMap(disp, allocator, debugUtils, light);
+			invalidateDescriptors = true;
+		}
+		else if (m_shadowData.at(light).filter != GetEffectiveShadowFilter(light))
+		{
+			// Moments come and go with the filter, so the map is made again
+			disp.deviceWaitIdle();
+			RebuildShadowMap(disp, allocator, debugUtils, light);
+			invalidateDescriptors = true;
+		}
+
+		ShadowData& shadowData = m_shadowData.at(light);
+		if (shadowData.staticCasterVersion != staticCasterVersion || !m_cacheStaticCasters)
+		{
+			std::fill(std::begin(shadowData.staticCached), std::end(shadowData.staticCached), false);
+			shadowData.staticCasterVersion = staticCasterVersion;
 		}
-		CalculateLightSpaceMatrix(light, camera);
-		GenerateShadowMap(disp, cmd, modelManager, allocator, commandPool, graphicsQueue, debugUtils, scene, drawModels, light, camera);
+		CalculateCascades(light, camera);
+	}
+	m_refitCascades = false;
+
+	// The atlas is only made once there is a point light to put into it
+	bool pointLights = std::any_of(lights.begin(), lights.end(), [](const std::shared_ptr<Light>& light) { return light->GetType() == LightType::Point; });
+	if (pointLights && m_pointShadowAtlas.image == VK_NULL_HANDLE)
+	{
+		CreatePointShadowAtlas(disp, allocator, debugUtils);
+		invalidateDescriptors = true;
 	}
+	AllocatePointShadows(lights, camera);
 
 	return invalidateDescriptors;
 }
 
+void ShadowSystem::RecordShadowMaps(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ModelManager& modelManager, VulkanDebugUtils& debugUtils, ReadbackRing& readbacks, const DrawShadowCasters& drawCasters)
+{
+	m_staticRedraws = 0;
+
+	VkViewport viewport = { 0, 0, (float) m_shadowMapWidth, (float) m_shadowMapHeight, 0.0f, 1.0f };
+	VkRect2D scissor = {
+		{		       0,		         0},
+		{m_shadowMapWidth, m_shadowMapHeight}
+	};
+
+	VkRenderingAttachmentInfo depthAttachmentInfo = {};
+	depthAttachmentInfo.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+	depthAttachmentInfo.imageLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL;
+	depthAttachmentInfo.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	depthAttachmentInfo.clearValue.depthStencil.depth = 1.0f;
+
+	VkRenderingInfo renderingInfo = {};
+	renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+	renderingInfo.renderArea = scissor;
+	renderingInfo.layerCount = 1;
+	renderingInfo.pDepthAttachment = &depthAttachmentInfo;
+
+	// Views come grouped by light, cascades in order
+	for (uint32_t viewIndex = 0; viewIndex < m_views.size(); viewIndex++)
+	{
+		const ShadowView& view = m_views[viewIndex];
+		ShadowData& shadowData = m_shadowData.at(view.light);
+		uint32_t cascade = view.cascade;
+		ShadowPass pass;
+		pass.lightSpaceMatrix = shadowData.cascadeMatrices[cascade];
+
+		debugUtils.BeginDebugMarker(cmd, "Draw Models for Shadow Map", debugUtil_BeginColour);
+
+		// Static casters into the cache, once the copy out of it last time is done
+		if (!shadowData.staticCached[cascade])
+		{
+			SlimeUtil::ImageBarrier(disp,
+			        cmd,
+			        shadowData.staticImage,
+			        VK_IMAGE_ASPECT_DEPTH_BIT,
+			        VK_IMAGE_LAYOUT_UNDEFINED,
+			        VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+			        VK_PIPELINE_STAGE_2_COPY_BIT,
+			        VK_ACCESS_2_NONE,
+			        VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+			        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+			        1,
+			        cascade);
+
+			depthAttachmentInfo.imageView = shadowData.staticCascadeViews[cascade];
+			depthAttachmentInfo.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+			disp.cmdBeginRendering(cmd, &renderingInfo);
+			disp.cmdSetViewport(cmd, 0, 1, &viewport);
+			disp.cmdSetScissor(cmd, 0, 1, &scissor);
+			drawCasters(disp, debugUtils, cmd, modelManager, pass, viewIndex, true);
+			disp.cmdEndRendering(cmd);
+
+			SlimeUtil::ImageBarrier(disp,
+			        cmd,
+			        shadowData.staticImage,
+			        VK_IMAGE_ASPECT_DEPTH_BIT,
+			        VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+			        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			        VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+			        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+			        VK_PIPELINE_STAGE_2_COPY_BIT,
+			        VK_ACCESS_2_TRANSFER_READ_BIT,
+			        1,
+			        cascade);
+
+			shadowData.staticCached[cascade] = m_cacheStaticCasters;
+			m_staticRedraws++;
+		}
+
+		// Start from the cached depth, once the previous frame is done sampling the layer
+		SlimeUtil::ImageBarrier(disp,
+		        cmd,
+		        shadowData.shadowMap.image,
+		        VK_IMAGE_ASPECT_DEPTH_BIT,
+		        VK_IMAGE_LAYOUT_UNDEFINED,
+		        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		        VK_ACCESS_2_NONE,
+		        VK_PIPELINE_STAGE_2_COPY_BIT,
+		        VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		        1,
+		        cascade);
+
+		VkImageCopy copyRegion = {};
+		copyRegion.srcSubresource = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, cascade, 1 };
+		copyRegion.dstSubresource = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, cascade, 1 };
+		copyRegion.extent = { m_shadowMapWidth, m_shadowMapHeight, 1 };
+		disp.cmdCopyImage(cmd, shadowData.staticImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, shadowData.shadowMap.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+
+		SlimeUtil::ImageBarrier(disp,
+		        cmd,
+		        shadowData.shadowMap.image,
+		        VK_IMAGE_ASPECT_DEPTH_BIT,
+		        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		        VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+		        VK_PIPELINE_STAGE_2_COPY_BIT,
+		        VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		        VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+		        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+		        1,
+		        cascade);
+
+		// Only the dynamic casters culled against this cascade go on top
+		depthAttachmentInfo.imageView = shadowData.cascadeViews[cascade];
+		depthAttachmentInfo.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+		disp.cmdBeginRendering(cmd, &renderingInfo);
+		disp.cmdSetViewport(cmd, 0, 1, &viewport);
+		disp.cmdSetScissor(cmd, 0, 1, &scissor);
+		drawCasters(disp, debugUtils, cmd, modelManager, pass, viewIndex, false);
+		disp.cmdEndRendering(cmd);
+
+		if (m_pixelRequest.valid && m_pixelRequest.light == view.light.get() && m_pixelRequest.cascade == cascade)
+		{
+			RecordPixelReadback(disp, cmd, readbacks, shadowData, cascade);
+		}
+		else
+		{
+			// Transition the cascade to shader read-only optimal for the main pass, or the moment blur
+			SlimeUtil::ImageBarrier(disp,
+			        cmd,
+			        shadowData.shadowMap.image,
+			        VK_IMAGE_ASPECT_DEPTH_BIT,
+			        VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+			        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+			        VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+			        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+			        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+			        VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+			        1,
+			        cascade);
+		}
+
+		debugUtils.EndDebugMarker(cmd);
+
+		// Every cascade of the light is drawn once its last one is
+		if (shadowData.filter == ShadowFilter::EVSM && cascade == shadowData.cascadeCount - 1)
+		{
+			RecordMomentBlur(disp, cmd, debugUtils, shadowData);
+		}
+	}
+
+	RecordPointShadows(disp, cmd, modelManager, debugUtils, drawCasters);
+}
+
+void ShadowSystem::RecordPointShadows(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ModelManager& modelManager, VulkanDebugUtils& debugUtils, const DrawShadowCasters& drawCasters)
+{
+	if (m_pointShadowAtlas.image == VK_NULL_HANDLE)
+	{
+		return;
+	}
+
+	// Every tile is drawn again, what the atlas held only matters until the last frame is done sampling it
+	SlimeUtil::ImageBarrier(disp,
+	        cmd,
+	        m_pointShadowAtlas.image,
+	        VK_IMAGE_ASPECT_DEPTH_BIT,
+	        VK_IMAGE_LAYOUT_UNDEFINED,
+	        VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+	        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+	        VK_ACCESS_2_NONE,
+	        VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+	        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+	        6);
+
+	// The clear only touches the render area, so the other lights' tiles are left alone
+	VkRenderingAttachmentInfo depthAttachmentInfo = {};
+	depthAttachmentInfo.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+	depthAttachmentInfo.imageView = m_pointShadowAtlas.imageView;
+	depthAttachmentInfo.imageLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL;
+	depthAttachmentInfo.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	depthAttachmentInfo.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	depthAttachmentInfo.clearValue.depthStencil.depth = 1.0f;
+
+	// One view per cube face, each into its own layer
+	VkRenderingInfo renderingInfo = {};
+	renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+	renderingInfo.viewMask = 0b111111;
+	renderingInfo.pDepthAttachment = &depthAttachmentInfo;
+
+	for (const PointShadow& pointShadow: m_pointShadows)
+	{
+		const AtlasTile& tile = pointShadow.tile;
+		VkViewport viewport = { (float) tile.x, (float) tile.y, (float) tile.size, (float) tile.size, 0.0f, 1.0f };
+		VkRect2D scissor = {
+			{ static_cast<int32_t>(tile.x), static_cast<int32_t>(tile.y) },
+			{                    tile.size,                    tile.size }
+		};
+		renderingInfo.renderArea = scissor;
+
+		ShadowPass pass;
+		pass.lightPositionRadius = glm::vec4(pointShadow.light->GetPosition(), pointShadow.light->GetRadius());
+		pass.pointLight = true;
+
+		// Nothing is cached for point lights, the static and the dynamic casters both go in every frame
+		debugUtils.BeginDebugMarker(cmd, "Draw Models for Point Shadow", debugUtil_BeginColour);
+		disp.cmdBeginRendering(cmd, &renderingInfo);
+		disp.cmdSetViewport(cmd, 0, 1, &viewport);
+		disp.cmdSetScissor(cmd, 0, 1, &scissor);
+		drawCasters(disp, debugUtils, cmd, modelManager, pass, pointShadow.view, true);
+		drawCasters(disp, debugUtils, cmd, modelManager, pass, pointShadow.view, false);
+		disp.cmdEndRendering(cmd);
+		debugUtils.EndDebugMarker(cmd);
+	}
+
+	SlimeUtil::ImageBarrier(disp,
+	        cmd,
+	        m_pointShadowAtlas.image,
+	        VK_IMAGE_ASPECT_DEPTH_BIT,
+	        VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+	        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+	        VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+	        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+	        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+	        VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+	        6);
+}
+
+void ShadowSystem::RecordMomentBlur(vkb::DispatchTable& disp, VkCommandBuffer& cmd, VulkanDebugUtils& debugUtils, ShadowData& shadowData)
+{
+	const PipelineConfig& pipeline = *m_momentsPipeline;
+
+	// The views never change until the map is rebuilt, which frees the sets, so they are written once
+	if (shadowData.blurSets[0][0] == VK_NULL_HANDLE)
+	{
+		VkDescriptorSetLayout layout = pipeline.descriptorSetLayouts[0];
+		for (uint32_t cascade = 0; cascade < shadowData.cascadeCount; cascade++)
+		{
+			VkDescriptorSet* sets = shadowData.blurSets[cascade];
+			sets[0] = m_descriptorManager->AllocateDescriptorSet(layout);
+			sets[1] = m_descriptorManager->AllocateDescriptorSet(layout);
+			debugUtils.SetObjectName(sets[0], "ShadowMomentsHorizontalSet");
+			debugUtils.SetObjectName(sets[1], "ShadowMomentsVerticalSet");
+
+			// Depth into the scratch image, then the scratch image into mip 0 of the cascade's moments
+			m_blurWriter.WriteImage(0, shadowData.cascadeViews[cascade], shadowData.shadowMap.sampler);
+			m_blurWriter.WriteImage(1, shadowData.blurView, VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+			m_descriptorManager->UpdateDescriptorSet(sets[0], m_blurWriter, layout);
+
+			m_blurWriter.WriteImage(0, shadowData.blurView, shadowData.moments.sampler, VK_IMAGE_LAYOUT_GENERAL);
+			m_blurWriter.WriteImage(1, shadowData.momentLayerViews[cascade], VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+			m_descriptorManager->UpdateDescriptorSet(sets[1], m_blurWriter, layout);
+		}
+	}
+
+	debugUtils.BeginDebugMarker(cmd, "Blur Shadow Moments", debugUtil_BeginColour);
+	disp.cmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.pipeline);
+
+	uint32_t groupsX = (m_shadowMapWidth + 7) / 8;
+	uint32_t groupsY = (m_shadowMapHeight + 7) / 8;
+
+	// Mip 0 of every cascade is written again, once the previous frame is done sampling it
+	SlimeUtil::ImageBarrier(disp,
+	        cmd,
+	        shadowData.moments.image,
+	        VK_IMAGE_ASPECT_COLOR_BIT,
+	        VK_IMAGE_LAYOUT_UNDEFINED,
+	        VK_IMAGE_LAYOUT_GENERAL,
+	        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+	        VK_ACCESS_2_NONE,
+	        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+	        VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+	        shadowData.cascadeCount);
+
+	for (uint32_t cascade = 0; cascade < shadowData.cascadeCount; cascade++)
+	{
+		// The scratch image is reused, once the vertical pass of the cascade before is done reading it
+		SlimeUtil::ImageBarrier(disp,
+		        cmd,
+		        shadowData.blurImage,
+		        VK_IMAGE_ASPECT_COLOR_BIT,
+		        VK_IMAGE_LAYOUT_UNDEFINED,
+		        VK_IMAGE_LAYOUT_GENERAL,
+		        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		        VK_ACCESS_2_NONE,
+		        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		        VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+		MomentBlurConstants constants = { glm::ivec2(1, 0), static_cast<int32_t>(m_momentBlurRadius), 1 };
+		disp.cmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.pipelineLayout, 0, 1, &shadowData.blurSets[cascade][0], 0, nullptr);
+		disp.cmdPushConstants(cmd, pipeline.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+		disp.cmdDispatch(cmd, groupsX, groupsY, 1);
+
+		SlimeUtil::ImageBarrier(disp,
+		        cmd,
+		        shadowData.blurImage,
+		        VK_IMAGE_ASPECT_COLOR_BIT,
+		        VK_IMAGE_LAYOUT_GENERAL,
+		        VK_IMAGE_LAYOUT_GENERAL,
+		        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		        VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		        VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
+
+		constants = { glm::ivec2(0, 1), static_cast<int32_t>(m_momentBlurRadius), 0 };
+		disp.cmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.pipelineLayout, 0, 1, &shadowData.blurSets[cascade][1], 0, nullptr);
+		disp.cmdPushConstants(cmd, pipeline.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+		disp.cmdDispatch(cmd, groupsX, groupsY, 1);
+	}
+
+	// Every mip is blitted from the one above it, all cascades at once
+	SlimeUtil::ImageBarrier(disp,
+	        cmd,
+	        shadowData.moments.image,
+	        VK_IMAGE_ASPECT_COLOR_BIT,
+	        VK_IMAGE_LAYOUT_GENERAL,
+	        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+	        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+	        VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+	        VK_PIPELINE_STAGE_2_BLIT_BIT,
+	        VK_ACCESS_2_TRANSFER_READ_BIT,
+	        shadowData.cascadeCount);
+
+	int32_t mipWidth = static_cast<int32_t>(m_shadowMapWidth);
+	int32_t mipHeight = static_cast<int32_t>(m_shadowMapHeight);
+	for (uint32_t level = 1; level < shadowData.momentMipLevels; level++)
+	{
+		SlimeUtil::ImageBarrier(disp,
+		        cmd,
+		        shadowData.moments.image,
+		        VK_IMAGE_ASPECT_COLOR_BIT,
+		        VK_IMAGE_LAYOUT_UNDEFINED,
+		        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+		        VK_ACCESS_2_NONE,
+		        VK_PIPELINE_STAGE_2_BLIT_BIT,
+		        VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		        shadowData.cascadeCount,
+		        0,
+		        1,
+		        level);
+
+		VkImageBlit blit = {};
+		blit.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 0, shadowData.cascadeCount };
+		blit.srcOffsets[1] = { mipWidth, mipHeight, 1 };
+		mipWidth = std::max(mipWidth / 2, 1);
+		mipHeight = std::max(mipHeight / 2, 1);
+		blit.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, shadowData.cascadeCount };
+		blit.dstOffsets[1] = { mipWidth, mipHeight, 1 };
+		disp.cmdBlitImage(cmd, shadowData.moments.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, shadowData.moments.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+
+		SlimeUtil::ImageBarrier(disp,
+		        cmd,
+		        shadowData.moments.image,
+		        VK_IMAGE_ASPECT_COLOR_BIT,
+		        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		        VK_PIPELINE_STAGE_2_BLIT_BIT,
+		        VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		        VK_PIPELINE_STAGE_2_BLIT_BIT,
+		        VK_ACCESS_2_TRANSFER_READ_BIT,
+		        shadowData.cascadeCount,
+		        0,
+		        1,
+		        level);
+	}
+
+	SlimeUtil::ImageBarrier(disp,
+	        cmd,
+	        shadowData.moments.image,
+	        VK_IMAGE_ASPECT_COLOR_BIT,
+	        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+	        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+	        VK_PIPELINE_STAGE_2_BLIT_BIT,
+	        VK_ACCESS_2_TRANSFER_WRITE_BIT,
+	        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+	        VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+	        shadowData.cascadeCount,
+	        0,
+	        shadowData.momentMipLevels);
+
+	debugUtils.EndDebugMarker(cmd);
+}
+
 TextureResource ShadowSystem::GetShadowMap(const std::shared_ptr<Light> light) const
 {
 	auto it = m_shadowData.find(light);
@@ -66,160 +481,227 @@ TextureResource ShadowSystem::GetShadowMap(const std::shared_ptr<Light> light) c
 	return TextureResource(); // Return an empty TextureResource if not found
 }
 
+TextureResource ShadowSystem::GetShadowMoments(const std::shared_ptr<Light> light) const
+{
+	auto it = m_shadowData.find(light);
+	if (it != m_shadowData.end() && it->second.filter == ShadowFilter::EVSM)
+	{
+		return it->second.moments;
+	}
+	return TextureResource();
+}
+
+TextureResource ShadowSystem::GetShadowCascade(const std::shared_ptr<Light> light, uint32_t cascade) const
+{
+	auto it = m_shadowData.find(light);
+	if (it == m_shadowData.end() || cascade >= it->second.cascadeCount)
+	{
+		return TextureResource();
+	}
+
+	TextureResource cascadeMap = it->second.shadowMap;
+	cascadeMap.imageView = it->second.cascadeViews[cascade];
+	return cascadeMap;
+}
+
 glm::mat4 ShadowSystem::GetLightSpaceMatrix(const std::shared_ptr<Light> light) const
 {
 	auto it = m_shadowData.find(light);
-	if (it != m_shadowData.end())
+	if (it != m_shadowData.end() && it->second.cascadeCount > 0)
 	{
-		return it->second.lightSpaceMatrix;
+		return it->second.cascadeMatrices[0];
 	}
 	return glm::mat4(1.0f); // Return identity matrix if not found
 }
 
 void ShadowSystem::SetShadowMapResolution(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, uint32_t width, uint32_t height, bool reconstructImmediately)
 {
-	if (width != m_shadowMapWidth || height != m_shadowMapHeight)
+	m_pendingShadowMapWidth = width;
+	m_pendingShadowMapHeight = height;
+	m_shadowMapNeedsReconstruction = m_pendingCascadeCount != m_cascadeCount || m_pendingShadowMapWidth != m_shadowMapWidth || m_pendingShadowMapHeight != m_shadowMapHeight;
+
+	if (reconstructImmediately && m_shadowMapNeedsReconstruction)
 	{
-		if (reconstructImmediately)
-		{
-			m_shadowMapWidth = width;
-			m_shadowMapHeight = height;
-			ReconstructShadowMaps(disp, allocator, debugUtils);
-		}
-		else
-		{
-			m_pendingShadowMapWidth = width;
-			m_pendingShadowMapHeight = height;
-			m_shadowMapNeedsReconstruction = true;
-		}
+		ReconstructShadowMaps(disp, allocator, debugUtils);
 	}
 }
 
 void ShadowSystem::ReconstructShadowMaps(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils)
 {
-	if (m_shadowMapNeedsReconstruction)
-	{
-		m_shadowMapWidth = m_pendingShadowMapWidth;
-		m_shadowMapHeight = m_pendingShadowMapHeight;
-		m_shadowMapNeedsReconstruction = false;
-	}
+	m_shadowMapWidth = m_pendingShadowMapWidth;
+	m_shadowMapHeight = m_pendingShadowMapHeight;
+	m_cascadeCount = m_pendingCascadeCount;
+	m_shadowMapNeedsReconstruction = false;
 
 	// Reconstruct all shadow maps
 	for (auto& [light, shadowData]: m_shadowData)
 	{
-		// Clean up existing shadow map
-		CleanupShadowMap(disp, allocator, light);
+		RebuildShadowMap(disp, allocator, debugUtils, light);
+	}
+}
 
-		// clear the imgui id
-		if (shadowData.textureId != 0)
+void ShadowSystem::RebuildShadowMap(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, const std::shared_ptr<Light> light)
+{
+	// Clean up existing shadow map
+	CleanupShadowMap(disp, allocator, light);
+
+	// clear the imgui ids
+	for (ImTextureID& textureId: m_shadowData.at(light).textureIds)
+	{
+		if (textureId != 0)
 		{
-			ImGui_ImplVulkan_RemoveTexture((VkDescriptorSet) shadowData.textureId);
-			shadowData.textureId = 0;
+			ImGui_ImplVulkan_RemoveTexture((VkDescriptorSet) textureId);
+			textureId = 0;
 		}
-
-		// Create new shadow map with updated size
-		CreateShadowMap(disp, allocator, debugUtils, light);
 	}
+
+	// Create new shadow map with the current size and filter
+	CreateShadowMap(disp, allocator, debugUtils, light);
+}
+
+void ShadowSystem::SetCascadeCount(uint32_t count)
+{
+	m_pendingCascadeCount = std::clamp(count, 1u, MAX_SHADOW_CASCADES);
+	m_shadowMapNeedsReconstruction = m_pendingCascadeCount != m_cascadeCount || m_pendingShadowMapWidth != m_shadowMapWidth || m_pendingShadowMapHeight != m_shadowMapHeight;
+}
+
+void ShadowSystem::SetCascadeSplitLambda(float lambda)
+{
+	m_cascadeSplitLambda = std::clamp(lambda, 0.0f, 1.0f);
+	m_refitCascades = true;
 }
 
 void ShadowSystem::SetShadowNearPlane(float near)
 {
 	m_shadowNear = near;
+	m_refitCascades = true;
 }
 
 void ShadowSystem::SetShadowFarPlane(float far)
 {
 	m_shadowFar = far;
+	m_refitCascades = true;
 }
 
 void ShadowSystem::SetDirectionalLightDistance(float distance)
 {
 	m_directionalLightDistance = distance;
-
-	for (auto& [light, shadowData]: m_shadowData)
-	{
-		if (light->GetType() == LightType::Directional)
-		{
-			shadowData.lastCameraPosition = glm::vec3(std::numeric_limits<float>::max());
-		}
-	}
+	m_refitCascades = true;
 }
 
-inline float ShadowSystem::GetDirectionalLightDistance() const
+float ShadowSystem::GetDirectionalLightDistance() const
 {
 	return m_directionalLightDistance;
 }
 
-float ShadowSystem::GetShadowMapPixelValue(vkb::DispatchTable& disp, VmaAllocator allocator, VkCommandPool commandPool, VkQueue graphicsQueue, const std::shared_ptr<Light> light, int x, int y) const
+void ShadowSystem::SetShadowFilter(const std::shared_ptr<Light> light, ShadowFilter filter)
+{
+	m_shadowFilters[light] = filter;
+}
+
+ShadowFilter ShadowSystem::GetShadowFilter(const std::shared_ptr<Light> light) const
+{
+	auto it = m_shadowFilters.find(light);
+	return it != m_shadowFilters.end() ? it->second : m_defaultShadowFilter;
+}
+
+void ShadowSystem::SetDefaultShadowFilter(ShadowFilter filter)
+{
+	m_defaultShadowFilter = filter;
+}
+
+void ShadowSystem::SetMomentBlurRadius(uint32_t radius)
+{
+	m_momentBlurRadius = radius;
+}
+
+void ShadowSystem::SetLightBleedReduction(float reduction)
+{
+	m_lightBleedReduction = std::clamp(reduction, 0.0f, 0.99f);
+}
+
+ShadowFilter ShadowSystem::GetEffectiveShadowFilter(const std::shared_ptr<Light> light) const
+{
+	bool momentsReady = m_momentsPipeline != nullptr && m_momentsPipeline->pipeline != VK_NULL_HANDLE;
+	return GetShadowFilter(light) == ShadowFilter::EVSM && momentsReady ? ShadowFilter::EVSM : ShadowFilter::PCF;
+}
+
+bool ShadowSystem::GetShadowMapPixelValue(const std::shared_ptr<Light> light, uint32_t cascade, int x, int y, float& value)
 {
 	auto it = m_shadowData.find(light);
-	if (it == m_shadowData.end())
+	if (it == m_shadowData.end() || cascade >= it->second.cascadeCount)
 	{
-		return 1.0f; // Return max depth if shadow map not found
+		return false;
 	}
 
-	const auto& shadowData = it->second;
-
 	// Ensure x and y are within bounds
 	x = std::clamp(x, 0, static_cast<int>(m_shadowMapWidth) - 1);
 	y = std::clamp(y, 0, static_cast<int>(m_shadowMapHeight) - 1);
 
-	// Create command buffer for copy operation
-	VkCommandBuffer commandBuffer = SlimeUtil::BeginSingleTimeCommands(disp, commandPool);
-
-	// Transition shadow map image layout for transfer
-	VkImageMemoryBarrier barrier = {};
-	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-	barrier.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	barrier.image = shadowData.shadowMap.image;
-	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-	barrier.subresourceRange.baseMipLevel = 0;
-	barrier.subresourceRange.levelCount = 1;
-	barrier.subresourceRange.baseArrayLayer = 0;
-	barrier.subresourceRange.layerCount = 1;
-	barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
-	barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-
-	disp.cmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
-
-	// Copy image to buffer
-	VkBufferImageCopy region{};
-	region.bufferOffset = 0;
-	region.bufferRowLength = 0;
-	region.bufferImageHeight = 0;
-	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-	region.imageSubresource.mipLevel = 0;
-	region.imageSubresource.baseArrayLayer = 0;
-	region.imageSubresource.layerCount = 1;
-	region.imageOffset = { x, y, 0 };
-	region.imageExtent = { 1, 1, 1 };
-
-	disp.cmdCopyImageToBuffer(commandBuffer, shadowData.shadowMap.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, shadowData.stagingBuffer, 1, &region);
-
-	// Transition shadow map image layout back
-	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-	barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-	disp.cmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
-
-	SlimeUtil::EndSingleTimeCommands(disp, graphicsQueue, commandPool, commandBuffer);
-
-	// Read data from staging buffer
-	float pixelValue;
-	void* data;
-	vmaMapMemory(allocator, shadowData.stagingBufferAllocation, &data);
-	memcpy(&pixelValue, data, sizeof(float));
-	vmaUnmapMemory(allocator, shadowData.stagingBufferAllocation);
-
-	return pixelValue;
-}
-
-void ShadowSystem::RenderShadowMapInspector(vkb::DispatchTable& disp, VmaAllocator allocator, VkCommandPool commandPool, VkQueue graphicsQueue, ModelManager& modelManager, VulkanDebugUtils& debugUtils)
+	// Asked again every frame the texel is wanted, so the value follows the casters moving over it
+	m_pixelRequest = { light.get(), cascade, x, y, 1.0f, true };
+
+	if (!m_pixelValue.valid || m_pixelValue.light != light.get() || m_pixelValue.cascade != cascade || m_pixelValue.x != x || m_pixelValue.y != y)
+	{
+		return false;
+	}
+
+	value = m_pixelValue.value;
+	return true;
+}
+
+void ShadowSystem::RecordPixelReadback(vkb::DispatchTable& disp, VkCommandBuffer& cmd, ReadbackRing& readbacks, const ShadowData& shadowData, uint32_t cascade)
+{
+	SlimeUtil::ImageBarrier(disp,
+	        cmd,
+	        shadowData.shadowMap.image,
+	        VK_IMAGE_ASPECT_DEPTH_BIT,
+	        VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+	        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+	        VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+	        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+	        VK_PIPELINE_STAGE_2_COPY_BIT,
+	        VK_ACCESS_2_TRANSFER_READ_BIT,
+	        1,
+	        cascade);
+
+	// The shadow maps are D32_SFLOAT, a depth texel copies out as one float
+	PixelReadback request = m_pixelRequest;
+	bool recorded = readbacks.ReadImage(disp,
+	        cmd,
+	        shadowData.shadowMap.image,
+	        VK_IMAGE_ASPECT_DEPTH_BIT,
+	        cascade,
+	        { request.x, request.y, 0 },
+	        { 1, 1, 1 },
+	        sizeof(float),
+	        [this, request](const void* data, VkDeviceSize size)
+	        {
+		        m_pixelValue = request;
+		        memcpy(&m_pixelValue.value, data, sizeof(float));
+	        });
+
+	// Cleared so the inspector closing stops the copies, a refused one is asked for again next frame anyway
+	if (recorded)
+	{
+		m_pixelRequest.valid = false;
+	}
+
+	SlimeUtil::ImageBarrier(disp,
+	        cmd,
+	        shadowData.shadowMap.image,
+	        VK_IMAGE_ASPECT_DEPTH_BIT,
+	        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+	        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+	        VK_PIPELINE_STAGE_2_COPY_BIT,
+	        VK_ACCESS_2_TRANSFER_READ_BIT,
+	        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+	        VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+	        1,
+	        cascade);
+}
+
+void ShadowSystem::RenderShadowMapInspector(vkb::DispatchTable& disp, VmaAllocator allocator, ModelManager& modelManager, VulkanDebugUtils& debugUtils)
 {
 	ImGui::Begin("Shadow Map Inspector", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
 
@@ -238,7 +720,15 @@ void ShadowSystem::RenderShadowMapInspector(vkb::DispatchTable& disp, VmaAllocat
 		ImGui::EndCombo();
 	}
 
+	if (m_shadowData.empty())
+	{
+		ImGui::Text("No shadow casting lights");
+		ImGui::End();
+		return;
+	}
+
 	// Get the selected shadow map
+	currentItem = std::min(currentItem, static_cast<int>(m_shadowData.size()) - 1);
 	auto it = m_shadowData.begin();
 	std::advance(it, currentItem);
 	auto light = it->first;
@@ -246,6 +736,23 @@ void ShadowSystem::RenderShadowMapInspector(vkb::DispatchTable& disp, VmaAllocat
 
 	ImGui::Text("Light Type: %s", light->GetType() == LightType::Directional ? "Directional" : "Point");
 
+	// Cascade Selection
+	static int currentCascade = 0;
+	currentCascade = std::min(currentCascade, static_cast<int>(lightData.cascadeCount) - 1);
+	if (ImGui::BeginCombo("Select Cascade", std::to_string(currentCascade).c_str()))
+	{
+		for (int i = 0; i < static_cast<int>(lightData.cascadeCount); i++)
+		{
+			bool isSelected = (currentCascade == i);
+			if (ImGui::Selectable(std::to_string(i).c_str(), isSelected))
+				currentCascade = i;
+			if (isSelected)
+				ImGui::SetItemDefaultFocus();
+		}
+		ImGui::EndCombo();
+	}
+	ImGui::Text("Covers view depth %.2f to %.2f", currentCascade == 0 ? m_shadowNear : lightData.cascadeSplits[currentCascade - 1], lightData.cascadeSplits[currentCascade]);
+
 	ImGui::Separator();
 
 	// Shadow Map Settings
@@ -254,7 +761,7 @@ void ShadowSystem::RenderShadowMapInspector(vkb::DispatchTable& disp, VmaAllocat
 		ImGui::PushStyleVar(ImGuiStyleVar_FramePadding, ImVec2(5, 5));
 
 		// Shadow map size controls
-		ImGui::Text("Shadow Map Size:");
+		ImGui::Text("Cascade Size:");
 		ImGui::SameLine();
 		ImGui::PushItemWidth(100);
 
@@ -282,22 +789,70 @@ void ShadowSystem::RenderShadowMapInspector(vkb::DispatchTable& disp, VmaAllocat
 			}
 		}
 
+		// Cascade controls, the count takes effect when the shadow maps are rebuilt next frame
+		int cascadeCount = static_cast<int>(m_pendingCascadeCount);
+		if (ImGui::SliderInt("Cascades", &cascadeCount, 1, static_cast<int>(MAX_SHADOW_CASCADES)))
+		{
+			SetCascadeCount(static_cast<uint32_t>(cascadeCount));
+		}
+
+		float splitLambda = m_cascadeSplitLambda;
+		if (ImGui::SliderFloat("Split Lambda (uniform - log)", &splitLambda, 0.0f, 1.0f, "%.2f"))
+		{
+			SetCascadeSplitLambda(splitLambda);
+		}
+
 		// Shadow near and far plane controls
 		ImGui::Text("Shadow Planes:");
 		ImGui::SameLine();
 		ImGui::PushItemWidth(100);
-		ImGui::DragFloat("Near##ShadowPlane", &m_shadowNear, 0.1f, 0.1f, m_shadowFar - 0.1f, "%.2f");
+		m_refitCascades |= ImGui::DragFloat("Near##ShadowPlane", &m_shadowNear, 0.1f, 0.1f, m_shadowFar - 0.1f, "%.2f");
 		ImGui::SameLine();
-		ImGui::DragFloat("Far##ShadowPlane", &m_shadowFar, 0.1f, m_shadowNear + 0.1f, 1000.0f, "%.2f");
+		m_refitCascades |= ImGui::DragFloat("Far##ShadowPlane", &m_shadowFar, 0.1f, m_shadowNear + 0.1f, 1000.0f, "%.2f");
 		ImGui::PopItemWidth();
 
 		// Directional light distance control
 		float lightDistance = GetDirectionalLightDistance();
-		if (ImGui::SliderFloat("Directional Light Distance", &lightDistance, 10.0f, 500.0f, "%.1f"))
+		if (ImGui::SliderFloat("Caster Distance", &lightDistance, 10.0f, 500.0f, "%.1f"))
 		{
 			SetDirectionalLightDistance(lightDistance);
 		}
 
+		// Static casters are only redrawn when their cascade or the casters themselves change
+		ImGui::Checkbox("Cache Static Casters", &m_cacheStaticCasters);
+		m_refitCascades |= ImGui::SliderFloat("Cascade Padding", &m_cascadePadding, 0.0f, 0.5f, "%.2f");
+		ImGui::Text("Static casters redrawn in %u cascades last frame", m_staticRedraws);
+
+		// Filtering of the selected light, its map is rebuilt next frame when this changes
+		const char* filterNames[] = { "PCF", "EVSM" };
+		int filter = static_cast<int>(GetShadowFilter(light));
+		if (ImGui::Combo("Filter", &filter, filterNames, IM_ARRAYSIZE(filterNames)))
+		{
+			SetShadowFilter(light, static_cast<ShadowFilter>(filter));
+		}
+
+		if (lightData.filter == ShadowFilter::EVSM)
+		{
+			int blurRadius = static_cast<int>(m_momentBlurRadius);
+			if (ImGui::SliderInt("Blur Radius", &blurRadius, 0, 8))
+			{
+				SetMomentBlurRadius(static_cast<uint32_t>(blurRadius));
+			}
+
+			float bleedReduction = m_lightBleedReduction;
+			if (ImGui::SliderFloat("Light Bleed Reduction", &bleedReduction, 0.0f, 0.95f, "%.2f"))
+			{
+				SetLightBleedReduction(bleedReduction);
+			}
+		}
+		else if (GetShadowFilter(light) == ShadowFilter::EVSM)
+		{
+			ImGui::TextDisabled("EVSM needs the ShadowMoments pipeline, using PCF");
+		}
+
+		ImGui::Text("Point light atlas: %ux%u, tiles %u to %u", m_pointShadowAtlasSize, m_pointShadowAtlasSize, m_minPointShadowTile, m_maxPointShadowTile);
+		ImGui::Text("Point lights shadowed: %zu, didn't fit: %u", m_pointShadows.size(), m_droppedPointShadows);
+
 		ImGui::PopStyleVar();
 	}
 
@@ -359,12 +914,13 @@ void ShadowSystem::RenderShadowMapInspector(vkb::DispatchTable& disp, VmaAllocat
 	imageSize.y *= zoom;
 
 	ImGui::BeginChild("ShadowMapRegion", windowSize, true, ImGuiWindowFlags_HorizontalScrollbar);
-	if (lightData.textureId == 0)
+	ImTextureID& textureId = lightData.textureIds[currentCascade];
+	if (textureId == 0)
 	{
-		lightData.textureId = ImGui_ImplVulkan_AddTexture(lightData.shadowMap.sampler, lightData.shadowMap.imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+		textureId = ImGui_ImplVulkan_AddTexture(lightData.shadowMap.sampler, lightData.cascadeViews[currentCascade], VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 	}
 
-	ImGui::Image(lightData.textureId, imageSize, ImVec2(0, 0), ImVec2(1, 1), ImVec4(1, 1, 1, 1), ImVec4(0, 0, 0, 0));
+	ImGui::Image(textureId, imageSize, ImVec2(0, 0), ImVec2(1, 1), ImVec4(1, 1, 1, 1), ImVec4(0, 0, 0, 0));
 
 	// Pixel info on hover
 	if (ImGui::IsItemHovered())
@@ -376,20 +932,28 @@ void ShadowSystem::RenderShadowMapInspector(vkb::DispatchTable& disp, VmaAllocat
 		int pixelX = static_cast<int>((relativePos.x / imageSize.x) * m_shadowMapWidth);
 		int pixelY = static_cast<int>((relativePos.y / imageSize.y) * m_shadowMapHeight);
 
-		float pixelValue = GetShadowMapPixelValue(disp, allocator, commandPool, graphicsQueue, light, pixelX, pixelY);
-
-		// Apply contrast enhancement
-		float enhancedValue = std::pow((pixelValue - 0.5f) * contrast + 0.5f, 2.2f);
-		enhancedValue = std::clamp(enhancedValue, 0.0f, 1.0f);
-
 		ImGui::BeginTooltip();
 		ImGui::Text("Pixel: (%d, %d)", pixelX, pixelY);
-		ImGui::Text("Depth: %.3f", pixelValue);
-		ImGui::Text("Enhanced: %.3f", enhancedValue);
 
-		// Display a color swatch representing the depth
-		ImVec4 depthColor(enhancedValue, enhancedValue, enhancedValue, 1.0f);
-		ImGui::ColorButton("Depth Color", depthColor, 0, ImVec2(40, 20));
+		// Read back over the next few frames, nothing waits on the GPU for it
+		float pixelValue;
+		if (GetShadowMapPixelValue(light, static_cast<uint32_t>(currentCascade), pixelX, pixelY, pixelValue))
+		{
+			// Apply contrast enhancement
+			float enhancedValue = std::pow((pixelValue - 0.5f) * contrast + 0.5f, 2.2f);
+			enhancedValue = std::clamp(enhancedValue, 0.0f, 1.0f);
+
+			ImGui::Text("Depth: %.3f", pixelValue);
+			ImGui::Text("Enhanced: %.3f", enhancedValue);
+
+			// Display a color swatch representing the depth
+			ImVec4 depthColor(enhancedValue, enhancedValue, enhancedValue, 1.0f);
+			ImGui::ColorButton("Depth Color", depthColor, 0, ImVec2(40, 20));
+		}
+		else
+		{
+			ImGui::TextDisabled("Reading back...");
+		}
 
 		ImGui::EndTooltip();
 	}
@@ -400,9 +964,12 @@ void ShadowSystem::RenderShadowMapInspector(vkb::DispatchTable& disp, VmaAllocat
 
 void ShadowSystem::CreateShadowMap(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, const std::shared_ptr<Light> light)
 {
+	// Rebuilt maps start over, nothing is fitted or cached for them yet
 	ShadowData& shadowData = m_shadowData[light];
+	shadowData = ShadowData();
+	shadowData.cascadeCount = m_cascadeCount;
 
-	// Create Shadow map image
+	// Create Shadow map image, one layer per cascade
 	VkImageCreateInfo shadowMapImageInfo = {};
 	shadowMapImageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 	shadowMapImageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -410,11 +977,11 @@ void ShadowSystem::CreateShadowMap(vkb::DispatchTable& disp, VmaAllocator alloca
 	shadowMapImageInfo.extent.height = m_shadowMapHeight;
 	shadowMapImageInfo.extent.depth = 1;
 	shadowMapImageInfo.mipLevels = 1;
-	shadowMapImageInfo.arrayLayers = 1;
+	shadowMapImageInfo.arrayLayers = shadowData.cascadeCount;
 	shadowMapImageInfo.format = VK_FORMAT_D32_SFLOAT;
 	shadowMapImageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
 	shadowMapImageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	shadowMapImageInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	shadowMapImageInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 	shadowMapImageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
 	shadowMapImageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
@@ -424,27 +991,123 @@ void ShadowSystem::CreateShadowMap(vkb::DispatchTable& disp, VmaAllocator alloca
 	VK_CHECK(vmaCreateImage(allocator, &shadowMapImageInfo, &shadowMapAllocInfo, &shadowData.shadowMap.image, &shadowData.shadowMap.allocation, nullptr));
 	debugUtils.SetObjectName(shadowData.shadowMap.image, "ShadowMapImage");
 
-	// Create the shadow map image view
+	// The static casters' cache is only rendered into and copied from
+	shadowMapImageInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	VK_CHECK(vmaCreateImage(allocator, &shadowMapImageInfo, &shadowMapAllocInfo, &shadowData.staticImage, &shadowData.staticAllocation, nullptr));
+	debugUtils.SetObjectName(shadowData.staticImage, "StaticShadowMapImage");
+	shadowData.shadowMap.width = m_shadowMapWidth;
+	shadowData.shadowMap.height = m_shadowMapHeight;
+
+	// Create the shadow map image view, every cascade for sampling
 	VkImageViewCreateInfo shadowMapImageViewInfo = {};
 	shadowMapImageViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
 	shadowMapImageViewInfo.image = shadowData.shadowMap.image;
-	shadowMapImageViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	shadowMapImageViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
 	shadowMapImageViewInfo.format = VK_FORMAT_D32_SFLOAT;
 	shadowMapImageViewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
 	shadowMapImageViewInfo.subresourceRange.baseMipLevel = 0;
 	shadowMapImageViewInfo.subresourceRange.levelCount = 1;
 	shadowMapImageViewInfo.subresourceRange.baseArrayLayer = 0;
-	shadowMapImageViewInfo.subresourceRange.layerCount = 1;
+	shadowMapImageViewInfo.subresourceRange.layerCount = shadowData.cascadeCount;
 
 	VK_CHECK(disp.createImageView(&shadowMapImageViewInfo, nullptr, &shadowData.shadowMap.imageView));
 	debugUtils.SetObjectName(shadowData.shadowMap.imageView, "ShadowMapImageView");
 
+	// And each cascade on its own to render into
+	shadowMapImageViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	shadowMapImageViewInfo.subresourceRange.layerCount = 1;
+	for (uint32_t cascade = 0; cascade < shadowData.cascadeCount; cascade++)
+	{
+		shadowMapImageViewInfo.subresourceRange.baseArrayLayer = cascade;
+		shadowMapImageViewInfo.image = shadowData.shadowMap.image;
+		VK_CHECK(disp.createImageView(&shadowMapImageViewInfo, nullptr, &shadowData.cascadeViews[cascade]));
+		debugUtils.SetObjectName(shadowData.cascadeViews[cascade], "ShadowMapCascadeImageView");
+
+		shadowMapImageViewInfo.image = shadowData.staticImage;
+		VK_CHECK(disp.createImageView(&shadowMapImageViewInfo, nullptr, &shadowData.staticCascadeViews[cascade]));
+		debugUtils.SetObjectName(shadowData.staticCascadeViews[cascade], "StaticShadowMapCascadeImageView");
+	}
+
 	// Create the shadow map sampler
 	shadowData.shadowMap.sampler = SlimeUtil::CreateSampler(disp);
 	debugUtils.SetObjectName(shadowData.shadowMap.sampler, "ShadowMapSampler");
 
-	shadowData.stagingBufferSize = sizeof(float);
-	SlimeUtil::CreateBuffer("ShadowMapPixelStagingBuffer", allocator, shadowData.stagingBufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, shadowData.stagingBuffer, shadowData.stagingBufferAllocation);
+	shadowData.filter = GetEffectiveShadowFilter(light);
+	if (shadowData.filter == ShadowFilter::EVSM)
+	{
+		CreateShadowMoments(disp, allocator, debugUtils, shadowData);
+	}
+}
+
+void ShadowSystem::CreateShadowMoments(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils, ShadowData& shadowData)
+{
+	// Positive and negative warped depth and their squares, a layer per cascade with mips down to 1x1
+	shadowData.momentMipLevels = static_cast<uint32_t>(std::bit_width(std::max(m_shadowMapWidth, m_shadowMapHeight)));
+
+	VkImageCreateInfo momentsImageInfo = {};
+	momentsImageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	momentsImageInfo.imageType = VK_IMAGE_TYPE_2D;
+	momentsImageInfo.extent = { m_shadowMapWidth, m_shadowMapHeight, 1 };
+	momentsImageInfo.mipLevels = shadowData.momentMipLevels;
+	momentsImageInfo.arrayLayers = shadowData.cascadeCount;
+	momentsImageInfo.format = VK_FORMAT_R16G16B16A16_SFLOAT;
+	momentsImageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	momentsImageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	momentsImageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	momentsImageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	momentsImageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	VmaAllocationCreateInfo momentsAllocInfo = {};
+	momentsAllocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+
+	VK_CHECK(vmaCreateImage(allocator, &momentsImageInfo, &momentsAllocInfo, &shadowData.moments.image, &shadowData.moments.allocation, nullptr));
+	debugUtils.SetObjectName(shadowData.moments.image, "ShadowMomentsImage");
+	shadowData.moments.width = m_shadowMapWidth;
+	shadowData.moments.height = m_shadowMapHeight;
+
+	// The horizontal pass of one cascade at a time
+	momentsImageInfo.mipLevels = 1;
+	momentsImageInfo.arrayLayers = 1;
+	momentsImageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+	VK_CHECK(vmaCreateImage(allocator, &momentsImageInfo, &momentsAllocInfo, &shadowData.blurImage, &shadowData.blurAllocation, nullptr));
+	debugUtils.SetObjectName(shadowData.blurImage, "ShadowMomentsBlurImage");
+
+	// Every cascade and mip for sampling
+	VkImageViewCreateInfo momentsViewInfo = {};
+	momentsViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	momentsViewInfo.image = shadowData.moments.image;
+	momentsViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+	momentsViewInfo.format = VK_FORMAT_R16G16B16A16_SFLOAT;
+	momentsViewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, shadowData.momentMipLevels, 0, shadowData.cascadeCount };
+	VK_CHECK(disp.createImageView(&momentsViewInfo, nullptr, &shadowData.moments.imageView));
+	debugUtils.SetObjectName(shadowData.moments.imageView, "ShadowMomentsImageView");
+
+	// Mip 0 of each cascade on its own to blur into
+	momentsViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	for (uint32_t cascade = 0; cascade < shadowData.cascadeCount; cascade++)
+	{
+		momentsViewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, cascade, 1 };
+		VK_CHECK(disp.createImageView(&momentsViewInfo, nullptr, &shadowData.momentLayerViews[cascade]));
+		debugUtils.SetObjectName(shadowData.momentLayerViews[cascade], "ShadowMomentsCascadeImageView");
+	}
+
+	momentsViewInfo.image = shadowData.blurImage;
+	momentsViewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	VK_CHECK(disp.createImageView(&momentsViewInfo, nullptr, &shadowData.blurView));
+	debugUtils.SetObjectName(shadowData.blurView, "ShadowMomentsBlurImageView");
+
+	// Trilinear over the whole chain, clamped so cascades don't pick up moments from their opposite edge
+	VkSamplerCreateInfo samplerInfo = {};
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.magFilter = VK_FILTER_LINEAR;
+	samplerInfo.minFilter = VK_FILTER_LINEAR;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+	VK_CHECK(disp.createSampler(&samplerInfo, nullptr, &shadowData.moments.sampler));
+	debugUtils.SetObjectName(shadowData.moments.sampler, "ShadowMomentsSampler");
 }
 
 void ShadowSystem::CleanupShadowMap(vkb::DispatchTable& disp, VmaAllocator allocator, const std::shared_ptr<Light> light)
@@ -454,175 +1117,333 @@ void ShadowSystem::CleanupShadowMap(vkb::DispatchTable& disp, VmaAllocator alloc
 	{
 		ShadowData& shadowData = it->second;
 		vmaDestroyImage(allocator, shadowData.shadowMap.image, shadowData.shadowMap.allocation);
+		vmaDestroyImage(allocator, shadowData.staticImage, shadowData.staticAllocation);
 		disp.destroyImageView(shadowData.shadowMap.imageView, nullptr);
+		for (uint32_t cascade = 0; cascade < MAX_SHADOW_CASCADES; cascade++)
+		{
+			disp.destroyImageView(shadowData.cascadeViews[cascade], nullptr);
+			disp.destroyImageView(shadowData.staticCascadeViews[cascade], nullptr);
+			disp.destroyImageView(shadowData.momentLayerViews[cascade], nullptr);
+			shadowData.cascadeViews[cascade] = VK_NULL_HANDLE;
+			shadowData.staticCascadeViews[cascade] = VK_NULL_HANDLE;
+			shadowData.momentLayerViews[cascade] = VK_NULL_HANDLE;
+		}
 		disp.destroySampler(shadowData.shadowMap.sampler, nullptr);
-		vmaDestroyBuffer(allocator, shadowData.stagingBuffer, shadowData.stagingBufferAllocation);
+
+		// Nothing of these exists for PCF lights, destroying null handles does nothing
+		vmaDestroyImage(allocator, shadowData.moments.image, shadowData.moments.allocation);
+		vmaDestroyImage(allocator, shadowData.blurImage, shadowData.blurAllocation);
+		disp.destroyImageView(shadowData.moments.imageView, nullptr);
+		disp.destroyImageView(shadowData.blurView, nullptr);
+		disp.destroySampler(shadowData.moments.sampler, nullptr);
+		for (auto& sets: shadowData.blurSets)
+		{
+			for (VkDescriptorSet& set: sets)
+			{
+				if (set != VK_NULL_HANDLE)
+				{
+					m_descriptorManager->FreeDescriptorSet(set);
+					set = VK_NULL_HANDLE;
+				}
+			}
+		}
 	}
 }
 
-void ShadowSystem::GenerateShadowMap(vkb::DispatchTable& disp,
-        VkCommandBuffer& cmd,
-        ModelManager& modelManager,
-        VmaAllocator allocator,
-        VkCommandPool commandPool,
-        VkQueue graphicsQueue,
-        VulkanDebugUtils& debugUtils,
-        Scene* scene,
-        std::function<void(vkb::DispatchTable, VulkanDebugUtils&, VkCommandBuffer&, ModelManager&, Scene*)> drawModels,
-        const std::shared_ptr<Light> light,
-        const std::shared_ptr<Camera> camera)
+void ShadowSystem::CalculateCascades(const std::shared_ptr<Light> light, const std::shared_ptr<Camera> camera)
 {
-	debugUtils.BeginDebugMarker(cmd, "Draw Models for Shadow Map", debugUtil_BeginColour);
+	ShadowData& shadowData = m_shadowData.at(light);
+	DirectionalLight* dirLight = static_cast<DirectionalLight*>(light.get());
 
-	auto shadowMap = GetShadowMap(light);
+	// Same convention as before cascades, the shadow map looks along the opposite of the light's direction
+	glm::vec3 lightDirection = glm::normalize(-dirLight->GetDirection());
 
-	// Transition shadow map image to depth attachment optimal
-	modelManager.TransitionImageLayout(disp, graphicsQueue, commandPool, shadowMap.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
+	CalculateCascadeSplits(m_shadowNear, m_shadowFar, shadowData.cascadeCount, m_cascadeSplitLambda, shadowData.cascadeSplits);
 
-	VkRenderingAttachmentInfo depthAttachmentInfo = {};
-	depthAttachmentInfo.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
-	depthAttachmentInfo.imageView = shadowMap.imageView;
-	depthAttachmentInfo.imageLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL;
-	depthAttachmentInfo.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-	depthAttachmentInfo.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-	depthAttachmentInfo.clearValue.depthStencil.depth = 1.0f;
+	// A turned light invalidates every cascade
+	bool refit = m_refitCascades || shadowData.fittedLightDirection != lightDirection;
+	shadowData.fittedLightDirection = lightDirection;
 
-	VkRenderingInfo renderingInfo = {};
-	renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
-	renderingInfo.renderArea = {
-		.offset = {               0,                 0},
-          .extent = {m_shadowMapWidth, m_shadowMapHeight}
-	};
-	renderingInfo.layerCount = 1;
-	renderingInfo.pDepthAttachment = &depthAttachmentInfo;
-
-	disp.cmdBeginRendering(cmd, &renderingInfo);
-
-	// Set viewport and scissor for shadow map
-	VkViewport viewport = { 0, 0, (float) m_shadowMapWidth, (float) m_shadowMapHeight, 0.0f, 1.0f };
-	VkRect2D scissor = {
-		{		       0,		         0},
-        {m_shadowMapWidth, m_shadowMapHeight}
-	};
-	disp.cmdSetViewport(cmd, 0, 1, &viewport);
-	disp.cmdSetScissor(cmd, 0, 1, &scissor);
+	float sliceNear = m_shadowNear;
+	for (uint32_t cascade = 0; cascade < shadowData.cascadeCount; cascade++)
+	{
+		float sliceFar = shadowData.cascadeSplits[cascade];
+		std::vector<glm::vec3> sliceCorners = CalculateFrustumCorners(camera->GetFOV(), camera->GetAspectRatio(), sliceNear, sliceFar, camera->GetPosition(), camera->GetForward(), camera->GetUp(), camera->GetRight());
 
-	// Draw models for shadow map
-	drawModels(disp, debugUtils, cmd, modelManager, scene);
+		// Keeping the projection keeps the cached static depth, so only refit once the slice leaves it
+		if (refit || !CascadeContains(shadowData.cullingMatrices[cascade], sliceCorners))
+		{
+			Cascade fitted = FitCascade(lightDirection, sliceCorners, m_shadowMapWidth, m_shadowMapHeight, m_directionalLightDistance, m_cascadePadding);
+			shadowData.cascadeMatrices[cascade] = fitted.lightSpaceMatrix;
+			shadowData.cullingMatrices[cascade] = fitted.cullingMatrix;
+			shadowData.staticCached[cascade] = false;
+		}
 
-	disp.cmdEndRendering(cmd);
+		m_views.push_back({ light, cascade });
+		m_casterViews.push_back({ Frustum::FromMatrix(shadowData.cullingMatrices[cascade]), shadowData.staticCached[cascade] });
 
-	// Transition shadow map image to shader read-only optimal
-	modelManager.TransitionImageLayout(disp, graphicsQueue, commandPool, shadowMap.image, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+		sliceNear = sliceFar;
+	}
 
-	debugUtils.EndDebugMarker(cmd);
+	dirLight->SetShadowCascades(shadowData.cascadeMatrices, shadowData.cascadeSplits, shadowData.cascadeCount);
+	dirLight->SetShadowFilter(shadowData.filter, m_lightBleedReduction);
 }
 
-void ShadowSystem::CalculateLightSpaceMatrix(const std::shared_ptr<Light> light, const std::shared_ptr<Camera> camera)
+void ShadowSystem::CreatePointShadowAtlas(vkb::DispatchTable& disp, VmaAllocator allocator, VulkanDebugUtils& debugUtils)
 {
-	auto it = m_shadowData.find(light);
-	if (it == m_shadowData.end())
-		return;
-	ShadowData& shadowData = it->second;
+	// A layer per cube face, 16 bit depth is plenty for the short range of a point light
+	VkImageCreateInfo atlasImageInfo = {};
+	atlasImageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	atlasImageInfo.imageType = VK_IMAGE_TYPE_2D;
+	atlasImageInfo.extent = { m_pointShadowAtlasSize, m_pointShadowAtlasSize, 1 };
+	atlasImageInfo.mipLevels = 1;
+	atlasImageInfo.arrayLayers = 6;
+	atlasImageInfo.format = VK_FORMAT_D16_UNORM;
+	atlasImageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	atlasImageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	atlasImageInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+	atlasImageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	atlasImageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	VmaAllocationCreateInfo atlasAllocInfo = {};
+	atlasAllocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+
+	VK_CHECK(vmaCreateImage(allocator, &atlasImageInfo, &atlasAllocInfo, &m_pointShadowAtlas.image, &m_pointShadowAtlas.allocation, nullptr));
+	debugUtils.SetObjectName(m_pointShadowAtlas.image, "PointShadowAtlasImage");
+	m_pointShadowAtlas.width = m_pointShadowAtlasSize;
+	m_pointShadowAtlas.height = m_pointShadowAtlasSize;
+
+	// Rendered into with multiview and sampled through the same view
+	VkImageViewCreateInfo atlasImageViewInfo = {};
+	atlasImageViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	atlasImageViewInfo.image = m_pointShadowAtlas.image;
+	atlasImageViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+	atlasImageViewInfo.format = VK_FORMAT_D16_UNORM;
+	atlasImageViewInfo.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 6 };
+
+	VK_CHECK(disp.createImageView(&atlasImageViewInfo, nullptr, &m_pointShadowAtlas.imageView));
+	debugUtils.SetObjectName(m_pointShadowAtlas.imageView, "PointShadowAtlasImageView");
+
+	m_pointShadowAtlas.sampler = SlimeUtil::CreateSampler(disp);
+	debugUtils.SetObjectName(m_pointShadowAtlas.sampler, "PointShadowAtlasSampler");
+}
 
-	// Check if the camera has moved outside the light's frustum
-	float distanceSquared = glm::length2(camera->GetPosition() - shadowData.lastCameraPosition);
-	if (distanceSquared < shadowData.frustumRadius * shadowData.frustumRadius)
+void ShadowSystem::AllocatePointShadows(const std::vector<std::shared_ptr<Light>>& lights, const std::shared_ptr<Camera> camera)
+{
+	m_pointShadows.clear();
+	m_droppedPointShadows = 0;
+	if (m_pointShadowAtlas.image == VK_NULL_HANDLE)
 	{
-		// Camera is still inside the light's frustum, no need to recalculate
 		return;
 	}
 
-	// Update the last known camera position
-	shadowData.lastCameraPosition = camera->GetPosition();
+	// A light whose sphere is out of view can't light anything on screen, so it gets no tile
+	Frustum frustum = Frustum::FromMatrix(camera->GetProjectionMatrix() * camera->GetViewMatrix());
+	std::vector<std::shared_ptr<PointLight>> pointLights;
+	std::vector<uint32_t> tileSizes;
+	std::vector<float> importance;
+	for (const auto& light: lights)
+	{
+		if (light->GetType() != LightType::Point)
+		{
+			continue;
+		}
 
-	float fov = camera->GetFOV();
-	float aspect = camera->GetAspectRatio();
+		std::shared_ptr<PointLight> pointLight = std::static_pointer_cast<PointLight>(light);
+		pointLight->SetShadowAtlasRect(glm::vec4(0.0f));
 
-	// Calculate the corners of the view frustum in world space
-	std::vector<glm::vec3> frustumCorners = CalculateFrustumCorners(fov, aspect, m_shadowNear, m_shadowFar, camera->GetPosition(), camera->GetForward(), camera->GetUp(), camera->GetRight());
+		glm::vec3 position = pointLight->GetPosition();
+		float radius = pointLight->GetRadius();
+		if (!frustum.Intersects(AABB(position - glm::vec3(radius), position + glm::vec3(radius))))
+		{
+			continue;
+		}
 
-	// Calculate the bounding sphere of the frustum
-	glm::vec3 frustumCenter;
-	float frustumRadius;
-	CalculateFrustumSphere(frustumCorners, frustumCenter, frustumRadius);
+		float lightImportance = CalculatePointLightImportance(position, radius, camera->GetPosition(), camera->GetFOV());
+		pointLights.push_back(pointLight);
+		importance.push_back(lightImportance);
+		tileSizes.push_back(CalculatePointShadowTileSize(lightImportance, m_minPointShadowTile, m_maxPointShadowTile));
+	}
 
-	// Store the frustum radius for future checks
-	shadowData.frustumRadius = frustumRadius;
+	std::vector<AtlasTile> tiles = AllocateAtlasTiles(tileSizes, importance, m_pointShadowAtlasSize, m_minPointShadowTile);
+	float atlasTexel = 1.0f / static_cast<float>(m_pointShadowAtlasSize);
+	for (size_t i = 0; i < pointLights.size(); i++)
+	{
+		const AtlasTile& tile = tiles[i];
+		if (tile.size == 0)
+		{
+			m_droppedPointShadows++;
+			continue;
+		}
+		pointLights[i]->SetShadowAtlasRect(glm::vec4(tile.x, tile.y, tile.size, tile.size) * atlasTexel);
 
-	glm::vec3 lightDir;
-	glm::vec3 lightPos;
+		// Casters are culled against the box around the light's sphere, the faces clip whatever else is in it
+		glm::vec3 position = pointLights[i]->GetPosition();
+		float radius = pointLights[i]->GetRadius();
+		glm::mat4 sphereBox = glm::ortho(-radius, radius, -radius, radius, -radius, radius) * glm::translate(glm::mat4(1.0f), -position);
 
-	if (light->GetType() == LightType::Directional)
-	{
-		const DirectionalLight* dirLight = static_cast<const DirectionalLight*>(light.get());
-		lightDir = glm::normalize(-dirLight->GetDirection());
-		lightPos = frustumCenter - lightDir * frustumRadius; // Use frustumRadius as a base distance
-	}
-	else if (light->GetType() == LightType::Point)
-	{
-		const PointLight* pointLight = static_cast<const PointLight*>(light.get());
-		lightPos = pointLight->GetPosition();
-		lightDir = glm::normalize(frustumCenter - lightPos);
+		m_pointShadows.push_back({ pointLights[i], tile, static_cast<uint32_t>(m_casterViews.size()) });
+		m_casterViews.push_back({ Frustum::FromMatrix(sphereBox), false });
 	}
-	else
+}
+
+float ShadowSystem::CalculatePointLightImportance(const glm::vec3& lightPosition, float radius, const glm::vec3& cameraPosition, float fov)
+{
+	float distance = glm::length(lightPosition - cameraPosition);
+	if (distance <= radius)
 	{
-		spdlog::error("Unsupported light type");
-		return;
+		return 1.0f;
 	}
 
-	// Create the light's view matrix
-	glm::mat4 lightView = glm::lookAt(lightPos, frustumCenter, glm::vec3(0.0f, 1.0f, 0.0f));
+	// The sphere's projected radius over half the screen's height
+	float projectedRadius = radius / std::sqrt(distance * distance - radius * radius);
+	return std::min(1.0f, projectedRadius / std::tan(glm::radians(fov * 0.5f)));
+}
 
-	// Transform frustum corners to light space
-	std::vector<glm::vec3> lightSpaceCorners;
-	for (const auto& corner: frustumCorners)
+uint32_t ShadowSystem::CalculatePointShadowTileSize(float importance, uint32_t minTileSize, uint32_t maxTileSize)
+{
+	// Rounded down, a light covering the whole screen gets the largest tile
+	uint32_t size = std::bit_floor(static_cast<uint32_t>(std::clamp(importance, 0.0f, 1.0f) * static_cast<float>(maxTileSize)));
+	return std::clamp(size, minTileSize, maxTileSize);
+}
+
+// Every other bit of a Morton index, one of its two coordinates
+static uint32_t CompactMortonBits(uint32_t bits)
+{
+	bits &= 0x55555555;
+	bits = (bits | (bits >> 1)) & 0x33333333;
+	bits = (bits | (bits >> 2)) & 0x0F0F0F0F;
+	bits = (bits | (bits >> 4)) & 0x00FF00FF;
+	bits = (bits | (bits >> 8)) & 0x0000FFFF;
+	return bits;
+}
+
+std::vector<ShadowSystem::AtlasTile> ShadowSystem::AllocateAtlasTiles(const std::vector<uint32_t>& tileSizes, const std::vector<float>& importance, uint32_t atlasSize, uint32_t minTileSize)
+{
+	std::vector<AtlasTile> tiles(tileSizes.size());
+
+	// Most important first, so the tiles to shrink or drop are the ones at the end
+	std::vector<size_t> order(tileSizes.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return importance[a] > importance[b] || (importance[a] == importance[b] && tileSizes[a] > tileSizes[b]); });
+
+	// Importance only ever asks for the same or smaller tiles further down, keep it that way
+	std::vector<uint32_t> sizes(order.size());
+	uint64_t area = 0;
+	for (size_t i = 0; i < order.size(); i++)
 	{
-		lightSpaceCorners.push_back(glm::vec3(lightView * glm::vec4(corner, 1.0f)));
+		sizes[i] = std::clamp(tileSizes[order[i]], minTileSize, i > 0 ? sizes[i - 1] : atlasSize);
+		area += static_cast<uint64_t>(sizes[i]) * sizes[i];
 	}
 
-	// Calculate the bounding box in light space
-	glm::vec3 minBounds(std::numeric_limits<float>::max());
-	glm::vec3 maxBounds(std::numeric_limits<float>::lowest());
-	for (const auto& corner: lightSpaceCorners)
+	// Over budget every tile is halved in turn, from the least important up, until they fit. That leaves the sizes
+	// in order. Once all are down to the smallest size the least important are dropped instead.
+	const uint64_t atlasArea = static_cast<uint64_t>(atlasSize) * atlasSize;
+	size_t count = sizes.size();
+	size_t next = count;
+	bool shrunk = false;
+	while (area > atlasArea)
 	{
-		minBounds = glm::min(minBounds, corner);
-		maxBounds = glm::max(maxBounds, corner);
+		if (next == 0)
+		{
+			if (!shrunk)
+			{
+				count--;
+				area -= static_cast<uint64_t>(sizes[count]) * sizes[count];
+			}
+			next = count;
+			shrunk = false;
+			continue;
+		}
+
+		next--;
+		if (sizes[next] > minTileSize)
+		{
+			uint64_t size = sizes[next];
+			sizes[next] /= 2;
+			area -= size * size - static_cast<uint64_t>(sizes[next]) * sizes[next];
+			shrunk = true;
+		}
 	}
 
-	// Adjust the orthographic projection based on the directional light distance
-	if (light->GetType() == LightType::Directional)
+	// Largest first, along a Z order curve of the smallest tiles every tile starts on a multiple of its own
+	// size, so consecutive tiles pack without gaps
+	uint64_t cell = 0;
+	for (size_t i = 0; i < count; i++)
 	{
-		float scaleFactor = m_directionalLightDistance / frustumRadius;
-		minBounds.x *= scaleFactor;
-		maxBounds.x *= scaleFactor;
-		minBounds.y *= scaleFactor;
-		maxBounds.y *= scaleFactor;
+		uint32_t cellsPerSide = sizes[i] / minTileSize;
+		AtlasTile& tile = tiles[order[i]];
+		tile.x = CompactMortonBits(static_cast<uint32_t>(cell)) * minTileSize;
+		tile.y = CompactMortonBits(static_cast<uint32_t>(cell >> 1)) * minTileSize;
+		tile.size = sizes[i];
+		cell += static_cast<uint64_t>(cellsPerSide) * cellsPerSide;
 	}
+	return tiles;
+}
 
-	// Add some padding to the bounding box
-	float padding = (maxBounds.z - minBounds.z) * 0.1f; // 10% of the depth range as padding
-	minBounds -= glm::vec3(padding);
-	maxBounds += glm::vec3(padding);
-
-	// Adjust the Z range for Vulkan's depth range [0, 1]
-	float zNear = -maxBounds.z;
-	float zFar = -minBounds.z;
+void ShadowSystem::CalculateCascadeSplits(float near, float far, uint32_t count, float lambda, float* splitDepths)
+{
+	// Logarithmic splits keep the texel to pixel ratio even but crowd everything near the camera, uniform
+	// ones waste resolution up close. Lambda blends between the two.
+	for (uint32_t i = 1; i <= count; i++)
+	{
+		float fraction = static_cast<float>(i) / static_cast<float>(count);
+		float logarithmic = near * std::pow(far / near, fraction);
+		float uniform = near + (far - near) * fraction;
+		splitDepths[i - 1] = lambda * logarithmic + (1.0f - lambda) * uniform;
+	}
+}
 
-	// Create the light's orthographic projection matrix
-	glm::mat4 lightProjection = glm::ortho(minBounds.x, maxBounds.x, minBounds.y, maxBounds.y, zNear, zFar);
+ShadowSystem::Cascade ShadowSystem::FitCascade(const glm::vec3& lightDirection, const std::vector<glm::vec3>& sliceCorners, uint32_t width, uint32_t height, float casterDistance, float padding)
+{
+	// A sphere doesn't change size as the camera turns, rounded up so float noise can't change it either
+	glm::vec3 center;
+	float radius;
+	CalculateFrustumSphere(sliceCorners, center, radius);
+	radius = std::ceil(radius * (1.0f + padding) * 16.0f) / 16.0f;
+
+	// Rooted at the origin, so light space only changes when the light does
+	glm::vec3 up = std::abs(lightDirection.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+	glm::mat4 lightView = glm::lookAt(glm::vec3(0.0f), lightDirection, up);
+
+	// Moving the projection in whole texels keeps static edges on the same texels as the camera moves
+	glm::vec3 lightCenter = glm::vec3(lightView * glm::vec4(center, 1.0f));
+	glm::vec2 texelSize = glm::vec2(2.0f * radius / static_cast<float>(width), 2.0f * radius / static_cast<float>(height));
+	lightCenter.x = std::floor(lightCenter.x / texelSize.x) * texelSize.x;
+	lightCenter.y = std::floor(lightCenter.y / texelSize.y) * texelSize.y;
+
+	// Light space looks down -z, the range reaches casterDistance past the sphere towards the light so casters
+	// outside of the view still land in the map
+	float zNear = -(lightCenter.z + radius + casterDistance);
+	float zFar = -(lightCenter.z - radius);
+	glm::mat4 lightProjection = glm::ortho(lightCenter.x - radius, lightCenter.x + radius, lightCenter.y - radius, lightCenter.y + radius, zNear, zFar);
 
 	glm::mat4 vulkanNdcAdjustment = glm::mat4(1.0f);
 	vulkanNdcAdjustment[1][1] = -1.0f;
 	vulkanNdcAdjustment[2][2] = 0.5f;
 	vulkanNdcAdjustment[3][2] = 0.5f;
 
-	// Combine view and projection matrices
-	shadowData.lightSpaceMatrix = vulkanNdcAdjustment * lightProjection * lightView;
-	light->SetLightSpaceMatrix(shadowData.lightSpaceMatrix);
+	Cascade cascade;
+	cascade.cullingMatrix = lightProjection * lightView;
+	cascade.lightSpaceMatrix = vulkanNdcAdjustment * cascade.cullingMatrix;
+	return cascade;
+}
+
+bool ShadowSystem::CascadeContains(const glm::mat4& cullingMatrix, const std::vector<glm::vec3>& sliceCorners)
+{
+	for (const glm::vec3& corner: sliceCorners)
+	{
+		// Orthographic, w stays 1
+		glm::vec4 clip = cullingMatrix * glm::vec4(corner, 1.0f);
+		if (std::abs(clip.x) > 1.0f || std::abs(clip.y) > 1.0f || std::abs(clip.z) > 1.0f)
+		{
+			return false;
+		}
+	}
+	return true;
 }
 
-std::vector<glm::vec3> ShadowSystem::CalculateFrustumCorners(float fov, float aspect, float near, float far, const glm::vec3& position, const glm::vec3& forward, const glm::vec3& up, const glm::vec3& right) const
+std::vector<glm::vec3> ShadowSystem::CalculateFrustumCorners(float fov, float aspect, float near, float far, const glm::vec3& position, const glm::vec3& forward, const glm::vec3& up, const glm::vec3& right)
 {
 	float tanHalfFov = tan(glm::radians(fov * 0.5f));
 	glm::vec3 nearCenter = position + forward * near;
@@ -646,7 +1467,7 @@ std::vector<glm::vec3> ShadowSystem::CalculateFrustumCorners(float fov, float as
 	return corners;
 }
 
-void ShadowSystem::CalculateFrustumSphere(const std::vector<glm::vec3>& frustumCorners, glm::vec3& center, float& radius) const
+void ShadowSystem::CalculateFrustumSphere(const std::vector<glm::vec3>& frustumCorners, glm::vec3& center, float& radius)
 {
 	center = glm::vec3(0.0f);
 	for (const auto& corner: frustumCorners)
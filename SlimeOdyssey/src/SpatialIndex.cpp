@@ -0,0 +1,582 @@
+#include "SpatialIndex.h"
+
+#include <algorithm>
+
+#include "Entity.h"
+#include "EntityManager.h"
+#include "imgui.h"
+#include "Model.h"
+
+//
+/// AABB TREE ///////////////////////////////////
+//
+AABBTree::AABBTree(float fatMargin)
+      : m_fatMargin(fatMargin)
+{
+}
+
+int AABBTree::AllocateNode()
+{
+	if (m_freeList == NULL_NODE)
+	{
+		m_nodes.emplace_back();
+		m_freeList = static_cast<int>(m_nodes.size()) - 1;
+	}
+
+	int index = m_freeList;
+	m_freeList = m_nodes[index].next;
+
+	Node& node = m_nodes[index];
+	node = Node();
+	node.height = 0;
+	++m_nodeCount;
+	return index;
+}
+
+void AABBTree::FreeNode(int index)
+{
+	m_nodes[index].next = m_freeList;
+	m_nodes[index].height = -1;
+	m_freeList = index;
+	--m_nodeCount;
+}
+
+int AABBTree::CreateProxy(const AABB& aabb, uint32_t userData)
+{
+	int proxyId = AllocateNode();
+	m_nodes[proxyId].aabb = aabb.Inflate(m_fatMargin);
+	m_nodes[proxyId].userData = userData;
+
+	InsertLeaf(proxyId);
+	++m_proxyCount;
+	return proxyId;
+}
+
+void AABBTree::DestroyProxy(int proxyId)
+{
+	RemoveLeaf(proxyId);
+	FreeNode(proxyId);
+	--m_proxyCount;
+}
+
+bool AABBTree::MoveProxy(int proxyId, const AABB& aabb)
+{
+	const AABB& fatAABB = m_nodes[proxyId].aabb;
+
+	// Still inside the fat box, and the fat box hasn't become much bigger than needed (e.g. after a shrink)
+	if (fatAABB.Contains(aabb) && aabb.Inflate(m_fatMargin * 4.0f).Contains(fatAABB))
+	{
+		return false;
+	}
+
+	RemoveLeaf(proxyId);
+	m_nodes[proxyId].aabb = aabb.Inflate(m_fatMargin);
+	InsertLeaf(proxyId);
+	return true;
+}
+
+void AABBTree::Clear()
+{
+	m_nodes.clear();
+	m_root = NULL_NODE;
+	m_freeList = NULL_NODE;
+	m_nodeCount = 0;
+	m_proxyCount = 0;
+}
+
+float AABBTree::GetAreaRatio() const
+{
+	if (m_root == NULL_NODE)
+	{
+		return 0.0f;
+	}
+
+	float rootArea = m_nodes[m_root].aabb.GetSurfaceArea();
+	float totalArea = 0.0f;
+	for (const auto& node: m_nodes)
+	{
+		if (node.height > 0)
+		{
+			totalArea += node.aabb.GetSurfaceArea();
+		}
+	}
+
+	return rootArea > 0.0f ? totalArea / rootArea : 0.0f;
+}
+
+void AABBTree::InsertLeaf(int leaf)
+{
+	if (m_root == NULL_NODE)
+	{
+		m_root = leaf;
+		m_nodes[leaf].parent = NULL_NODE;
+		return;
+	}
+
+	// Walk down picking the cheapest sibling by surface area
+	AABB leafAABB = m_nodes[leaf].aabb;
+	int index = m_root;
+	while (!m_nodes[index].IsLeaf())
+	{
+		int child1 = m_nodes[index].child1;
+		int child2 = m_nodes[index].child2;
+
+		float area = m_nodes[index].aabb.GetSurfaceArea();
+		float combinedArea = AABB::Union(m_nodes[index].aabb, leafAABB).GetSurfaceArea();
+
+		// Cost of making a new parent for this node and the leaf
+		float cost = 2.0f * combinedArea;
+
+		// Minimum cost of pushing the leaf further down
+		float inheritanceCost = 2.0f * (combinedArea - area);
+
+		auto descendCost = [&](int child)
+		{
+			float newArea = AABB::Union(leafAABB, m_nodes[child].aabb).GetSurfaceArea();
+			if (m_nodes[child].IsLeaf())
+			{
+				return newArea + inheritanceCost;
+			}
+			return (newArea - m_nodes[child].aabb.GetSurfaceArea()) + inheritanceCost;
+		};
+
+		float cost1 = descendCost(child1);
+		float cost2 = descendCost(child2);
+
+		if (cost < cost1 && cost < cost2)
+		{
+			break;
+		}
+
+		index = cost1 < cost2 ? child1 : child2;
+	}
+
+	int sibling = index;
+
+	// Create a new parent (this may grow m_nodes, so no references are held across it)
+	int oldParent = m_nodes[sibling].parent;
+	int newParent = AllocateNode();
+	m_nodes[newParent].parent = oldParent;
+	m_nodes[newParent].aabb = AABB::Union(leafAABB, m_nodes[sibling].aabb);
+	m_nodes[newParent].height = m_nodes[sibling].height + 1;
+	m_nodes[newParent].child1 = sibling;
+	m_nodes[newParent].child2 = leaf;
+	m_nodes[sibling].parent = newParent;
+	m_nodes[leaf].parent = newParent;
+
+	if (oldParent != NULL_NODE)
+	{
+		if (m_nodes[oldParent].child1 == sibling)
+		{
+			m_nodes[oldParent].child1 = newParent;
+		}
+		else
+		{
+			m_nodes[oldParent].child2 = newParent;
+		}
+	}
+	else
+	{
+		m_root = newParent;
+	}
+
+	// Walk back up refitting boxes and rebalancing
+	index = m_nodes[leaf].parent;
+	while (index != NULL_NODE)
+	{
+		index = Balance(index);
+
+		Node& node = m_nodes[index];
+		node.height = 1 + std::max(m_nodes[node.child1].height, m_nodes[node.child2].height);
+		node.aabb = AABB::Union(m_nodes[node.child1].aabb, m_nodes[node.child2].aabb);
+
+		index = node.parent;
+	}
+}
+
+void AABBTree::RemoveLeaf(int leaf)
+{
+	if (leaf == m_root)
+	{
+		m_root = NULL_NODE;
+		return;
+	}
+
+	int parent = m_nodes[leaf].parent;
+	int grandParent = m_nodes[parent].parent;
+	int sibling = m_nodes[parent].child1 == leaf ? m_nodes[parent].child2 : m_nodes[parent].child1;
+
+	if (grandParent == NULL_NODE)
+	{
+		m_root = sibling;
+		m_nodes[sibling].parent = NULL_NODE;
+		FreeNode(parent);
+		return;
+	}
+
+	// Replace the parent with the sibling
+	if (m_nodes[grandParent].child1 == parent)
+	{
+		m_nodes[grandParent].child1 = sibling;
+	}
+	else
+	{
+		m_nodes[grandParent].child2 = sibling;
+	}
+	m_nodes[sibling].parent = grandParent;
+	FreeNode(parent);
+
+	int index = grandParent;
+	while (index != NULL_NODE)
+	{
+		index = Balance(index);
+
+		Node& node = m_nodes[index];
+		node.height = 1 + std::max(m_nodes[node.child1].height, m_nodes[node.child2].height);
+		node.aabb = AABB::Union(m_nodes[node.child1].aabb, m_nodes[node.child2].aabb);
+
+		index = node.parent;
+	}
+}
+
+// Rotates the taller child up if the subtree at iA is imbalanced, returns the new subtree root
+int AABBTree::Balance(int iA)
+{
+	Node& A = m_nodes[iA];
+	if (A.IsLeaf() || A.height < 2)
+	{
+		return iA;
+	}
+
+	int iB = A.child1;
+	int iC = A.child2;
+	Node& B = m_nodes[iB];
+	Node& C = m_nodes[iC];
+
+	int balance = C.height - B.height;
+
+	// Rotate C up
+	if (balance > 1)
+	{
+		int iF = C.child1;
+		int iG = C.child2;
+		Node& F = m_nodes[iF];
+		Node& G = m_nodes[iG];
+
+		C.child1 = iA;
+		C.parent = A.parent;
+		A.parent = iC;
+
+		if (C.parent != NULL_NODE)
+		{
+			if (m_nodes[C.parent].child1 == iA)
+			{
+				m_nodes[C.parent].child1 = iC;
+			}
+			else
+			{
+				m_nodes[C.parent].child2 = iC;
+			}
+		}
+		else
+		{
+			m_root = iC;
+		}
+
+		if (F.height > G.height)
+		{
+			C.child2 = iF;
+			A.child2 = iG;
+			G.parent = iA;
+			A.aabb = AABB::Union(B.aabb, G.aabb);
+			C.aabb = AABB::Union(A.aabb, F.aabb);
+			A.height = 1 + std::max(B.height, G.height);
+			C.height = 1 + std::max(A.height, F.height);
+		}
+		else
+		{
+			C.child2 = iG;
+			A.child2 = iF;
+			F.parent = iA;
+			A.aabb = AABB::Union(B.aabb, F.aabb);
+			C.aabb = AABB::Union(A.aabb, G.aabb);
+			A.height = 1 + std::max(B.height, F.height);
+			C.height = 1 + std::max(A.height, G.height);
+		}
+
+		return iC;
+	}
+
+	// Rotate B up
+	if (balance < -1)
+	{
+		int iD = B.child1;
+		int iE = B.child2;
+		Node& D = m_nodes[iD];
+		Node& E = m_nodes[iE];
+
+		B.child1 = iA;
+		B.parent = A.parent;
+		A.parent = iB;
+
+		if (B.parent != NULL_NODE)
+		{
+			if (m_nodes[B.parent].child1 == iA)
+			{
+				m_nodes[B.parent].child1 = iB;
+			}
+			else
+			{
+				m_nodes[B.parent].child2 = iB;
+			}
+		}
+		else
+		{
+			m_root = iB;
+		}
+
+		if (D.height > E.height)
+		{
+			B.child2 = iD;
+			A.child1 = iE;
+			E.parent = iA;
+			A.aabb = AABB::Union(C.aabb, E.aabb);
+			B.aabb = AABB::Union(A.aabb, D.aabb);
+			A.height = 1 + std::max(C.height, E.height);
+			B.height = 1 + std::max(A.height, D.height);
+		}
+		else
+		{
+			B.child2 = iE;
+			A.child1 = iD;
+			D.parent = iA;
+			A.aabb = AABB::Union(C.aabb, D.aabb);
+			B.aabb = AABB::Union(A.aabb, E.aabb);
+			A.height = 1 + std::max(C.height, D.height);
+			B.height = 1 + std::max(A.height, E.height);
+		}
+
+		return iB;
+	}
+
+	return iA;
+}
+
+//
+/// SPATIAL INDEX ///////////////////////////////////
+//
+static AABB CalculateWorldBounds(ModelResource& model, const Transform& transform)
+{
+	if (!model.bounds.IsValid())
+	{
+		model.CalculateBounds();
+	}
+
+	return model.bounds.Transform(transform.GetModelMatrix());
+}
+
+void SpatialIndex::Update(EntityManager& entityManager)
+{
+	m_stats = Stats();
+	++m_stamp;
+
+	size_t visited = 0;
+	entityManager.ForEachEntityWith<Transform, Model>(
+	        [&](Entity& entity)
+	        {
+		        const Transform& transform = entity.GetComponent<Transform>();
+		        ModelResource* modelResource = entity.GetComponent<Model>().modelResource;
+		        if (!modelResource)
+		        {
+			        return;
+		        }
+
+		        ++visited;
+		        auto it = m_proxies.find(entity.GetId());
+		        if (it == m_proxies.end())
+		        {
+			        Proxy proxy;
+			        proxy.entity = &entity;
+			        proxy.modelResource = modelResource;
+			        proxy.position = transform.position;
+			        proxy.rotation = transform.rotation;
+			        proxy.scale = transform.scale;
+			        proxy.worldBounds = CalculateWorldBounds(*modelResource, transform);
+			        proxy.proxyId = m_tree.CreateProxy(proxy.worldBounds, entity.GetId());
+			        proxy.stamp = m_stamp;
+			        proxy.movedStamp = m_stamp;
+			        m_proxies.emplace(entity.GetId(), proxy);
+			        ++m_stats.inserted;
+			        return;
+		        }
+
+		        Proxy& proxy = it->second;
+		        proxy.entity = &entity;
+		        proxy.stamp = m_stamp;
+
+		        if (proxy.modelResource == modelResource && proxy.position == transform.position && proxy.rotation == transform.rotation && proxy.scale == transform.scale)
+		        {
+			        if (!proxy.isStatic && !modelResource->dynamic && m_stamp - proxy.movedStamp >= STATIC_AFTER_UPDATES)
+			        {
+				        proxy.isStatic = true;
+				        ++m_staticVersion;
+			        }
+			        m_stats.staticEntities += proxy.isStatic ? 1 : 0;
+			        return;
+		        }
+
+		        proxy.movedStamp = m_stamp;
+		        if (proxy.isStatic)
+		        {
+			        proxy.isStatic = false;
+			        ++m_staticVersion;
+		        }
+
+		        proxy.modelResource = modelResource;
+		        proxy.position = transform.position;
+		        proxy.rotation = transform.rotation;
+		        proxy.scale = transform.scale;
+		        proxy.worldBounds = CalculateWorldBounds(*modelResource, transform);
+		        ++m_stats.refitted;
+
+		        if (m_tree.MoveProxy(proxy.proxyId, proxy.worldBounds))
+		        {
+			        ++m_stats.reinserted;
+		        }
+	        });
+
+	// Anything we didn't visit lost its Transform/Model or left the manager without going through RemoveEntity
+	if (visited == m_proxies.size())
+	{
+		return;
+	}
+
+	for (auto it = m_proxies.begin(); it != m_proxies.end();)
+	{
+		if (it->second.stamp != m_stamp)
+		{
+			m_staticVersion += it->second.isStatic ? 1 : 0;
+			m_tree.DestroyProxy(it->second.proxyId);
+			it = m_proxies.erase(it);
+			++m_stats.removed;
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+void SpatialIndex::Remove(unsigned int entityId)
+{
+	auto it = m_proxies.find(entityId);
+	if (it == m_proxies.end())
+	{
+		return;
+	}
+
+	m_staticVersion += it->second.isStatic ? 1 : 0;
+	m_tree.DestroyProxy(it->second.proxyId);
+	m_proxies.erase(it);
+	++m_stats.removed;
+}
+
+void SpatialIndex::Clear()
+{
+	m_tree.Clear();
+	m_proxies.clear();
+	m_stats = Stats();
+	++m_staticVersion;
+}
+
+void SpatialIndex::QueryBox(const AABB& box, std::vector<Entity*>& outResults) const
+{
+	outResults.clear();
+	m_tree.Query(box,
+	        [&](uint32_t entityId, int)
+	        {
+		        const Proxy& proxy = m_proxies.at(entityId);
+		        if (proxy.worldBounds.Overlaps(box))
+		        {
+			        outResults.push_back(proxy.entity);
+		        }
+		        return true;
+	        });
+}
+
+void SpatialIndex::QuerySphere(const glm::vec3& center, float radius, std::vector<Entity*>& outResults) const
+{
+	outResults.clear();
+	m_tree.QuerySphere(center,
+	        radius,
+	        [&](uint32_t entityId, int)
+	        {
+		        const Proxy& proxy = m_proxies.at(entityId);
+		        if (proxy.worldBounds.OverlapsSphere(center, radius))
+		        {
+			        outResults.push_back(proxy.entity);
+		        }
+		        return true;
+	        });
+}
+
+void SpatialIndex::QueryFrustum(const Frustum& frustum, std::vector<Entity*>& outResults) const
+{
+	outResults.clear();
+	m_tree.QueryFrustum(frustum,
+	        [&](uint32_t entityId, int)
+	        {
+		        const Proxy& proxy = m_proxies.at(entityId);
+		        if (frustum.Intersects(proxy.worldBounds))
+		        {
+			        outResults.push_back(proxy.entity);
+		        }
+		        return true;
+	        });
+}
+
+Entity* SpatialIndex::Raycast(const Ray& ray, float maxDistance, float* outDistance) const
+{
+	glm::vec3 invDirection = 1.0f / ray.direction;
+	Entity* closest = nullptr;
+	float closestDistance = maxDistance;
+
+	m_tree.Raycast(ray,
+	        maxDistance,
+	        [&](uint32_t entityId, int, float)
+	        {
+		        const Proxy& proxy = m_proxies.at(entityId);
+		        float t;
+		        if (Ray::IntersectAABB(ray.origin, invDirection, proxy.worldBounds, closestDistance, t))
+		        {
+			        closest = proxy.entity;
+			        closestDistance = t;
+		        }
+		        return closestDistance;
+	        });
+
+	if (closest && outDistance)
+	{
+		*outDistance = closestDistance;
+	}
+
+	return closest;
+}
+
+const AABB* SpatialIndex::GetWorldBounds(unsigned int entityId) const
+{
+	auto it = m_proxies.find(entityId);
+	return it != m_proxies.end() ? &it->second.worldBounds : nullptr;
+}
+
+bool SpatialIndex::IsStatic(unsigned int entityId) const
+{
+	auto it = m_proxies.find(entityId);
+	return it != m_proxies.end() && it->second.isStatic;
+}
+
+void SpatialIndex::ImGuiDebug() const
+{
+	ImGui::Text("Spatial Index: %zu proxies, %zu nodes, height %d", m_tree.GetProxyCount(), m_tree.GetNodeCount(), m_tree.GetHeight());
+	ImGui::Text("Last update: %zu inserted, %zu removed, %zu refitted, %zu reinserted, %zu static", m_stats.inserted, m_stats.removed, m_stats.refitted, m_stats.reinserted, m_stats.staticEntities);
+}
@@ -4,6 +4,7 @@
 
 #include "VulkanContext.h"
 
+#include <cstring>
 #include <GLFW/glfw3.h>
 #include <spdlog/spdlog.h>
 #include <string>
@@ -19,8 +20,6 @@
 #include "Scene.h"
 #include "VulkanUtil.h"
 
-#define MAX_FRAMES_IN_FLIGHT 2
-
 // IMGUI
 #include "backends/imgui_impl_glfw.h"
 #include "backends/imgui_impl_vulkan.h"
@@ -50,7 +49,7 @@ int VulkanContext::CreateContext(SlimeWindow* window)
 	if (InitImGui(window) != 0) // Add this line
 		return -1;
 
-	m_renderer.SetUp(m_disp, m_allocator, m_swapchain, m_debugUtils);
+	m_renderer.SetUp(m_disp, m_allocator, m_swapchain, m_debugUtils, m_device.get_queue_index(vkb::QueueType::graphics).value());
 
 	return 0;
 }
@@ -165,6 +164,13 @@ int VulkanContext::DeviceInit(SlimeWindow* window)
 	features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
 	features12.bufferDeviceAddress = VK_TRUE;
 	features12.descriptorIndexing = VK_TRUE;
+	features12.runtimeDescriptorArray = VK_TRUE; // Bindless materials
+	features12.descriptorBindingPartiallyBound = VK_TRUE;
+	features12.descriptorBindingVariableDescriptorCount = VK_TRUE;
+	features12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+	features12.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+	features12.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+	features12.drawIndirectCount = VK_TRUE;
 	features12.pNext = &features13;
 
 	// Enable Vulkan 1.1 features
@@ -179,6 +185,7 @@ int VulkanContext::DeviceInit(SlimeWindow* window)
 	features2.features.fillModeNonSolid = VK_TRUE;
 	features2.features.wideLines = VK_TRUE;
 	features2.features.geometryShader = VK_TRUE;
+	features2.features.multiDrawIndirect = VK_TRUE;
 	features2.pNext = &features11;
 
 	vkb::PhysicalDeviceSelector phys_device_selector(m_instance);
@@ -258,6 +265,28 @@ int VulkanContext::DeviceInit(SlimeWindow* window)
 
 	m_debugUtils.SetObjectName(m_device.device, "MainDevice");
 
+	// A saved pipeline cache is only used on the exact device and driver it was written by
+	VkPhysicalDeviceIDProperties idProperties = {};
+	idProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+	VkPhysicalDeviceProperties2 properties2 = {};
+	properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+	properties2.pNext = &idProperties;
+	m_instDisp.getPhysicalDeviceProperties2(physical_device.physical_device, &properties2);
+
+	PipelineCache::DeviceIdentity identity;
+	identity.vendorID = properties2.properties.vendorID;
+	identity.deviceID = properties2.properties.deviceID;
+	identity.driverVersion = properties2.properties.driverVersion;
+	std::memcpy(identity.driverUUID, idProperties.driverUUID, VK_UUID_SIZE);
+	std::memcpy(identity.pipelineCacheUUID, properties2.properties.pipelineCacheUUID, VK_UUID_SIZE);
+	m_pipelineCache.Init(m_disp, identity, ResourcePathManager::GetRootDirectory() + "/pipeline_cache.bin");
+
+	// Debug builds link the resources to the source tree, so saving a shader there recompiles and reloads it.
+	// Release builds copy them, nothing edits the copies.
+#ifndef NDEBUG
+	m_shaderHotReload.Start(ResourcePathManager::GetShaderPath(""));
+#endif
+
 	return 0;
 }
 
@@ -553,7 +582,7 @@ int VulkanContext::InitImGui(SlimeWindow* window)
 	initInfo.Device = m_device.device;
 	initInfo.QueueFamily = m_device.get_queue_index(vkb::QueueType::graphics).value();
 	initInfo.Queue = m_graphicsQueue;
-	initInfo.PipelineCache = VK_NULL_HANDLE;
+	initInfo.PipelineCache = m_pipelineCache.Get();
 	initInfo.DescriptorPool = m_imguiDescriptorPool;
 	initInfo.Subpass = 0;
 	initInfo.MinImageCount = m_swapchain.image_count;
@@ -583,7 +612,7 @@ int VulkanContext::InitImGui(SlimeWindow* window)
 	return 0;
 }
 
-int VulkanContext::RenderFrame(ModelManager& modelManager, DescriptorManager& descriptorManager, SlimeWindow* window, Scene* scene)
+int VulkanContext::RenderFrame(ModelManager& modelManager, ShaderManager& shaderManager, DescriptorManager& descriptorManager, SlimeWindow* window, Scene* scene)
 {
 	if (window->WindowSuspended())
 	{
@@ -594,6 +623,26 @@ int VulkanContext::RenderFrame(ModelManager& modelManager, DescriptorManager& de
 	// Wait for the frame to be finished
 	VK_CHECK(m_disp.waitForFences(1, &m_inFlightFences[m_currentFrame], VK_TRUE, UINT64_MAX));
 
+	// Nothing still in flight uses this frame's transient descriptor sets anymore
+	descriptorManager.BeginFrame(static_cast<uint32_t>(m_currentFrame));
+
+	// Pipelines the scene asked for have been compiling since it entered, the first frame needs them
+	if (modelManager.HasPendingPipelines())
+	{
+		modelManager.WaitForPipelines();
+	}
+
+	// Shaders recompiled in the background get their pipelines rebuilt, which swap in once compiled
+	std::vector<std::string> changedShaders = m_shaderHotReload.TakeCompiledShaders();
+	if (!changedShaders.empty())
+	{
+		modelManager.ReloadShaders(*this, shaderManager, changedShaders);
+	}
+	modelManager.UpdateReloadedPipelines(m_disp);
+
+	// Shader variants asked for last frame start building, finished ones replace the full shader from this frame on
+	modelManager.UpdatePipelineVariants(*this, shaderManager);
+
 	uint32_t imageIndex;
 	VkResult result = m_disp.acquireNextImageKHR(m_swapchain, UINT64_MAX, m_availableSemaphores[m_currentFrame], VK_NULL_HANDLE, &imageIndex);
 
@@ -620,7 +669,7 @@ int VulkanContext::RenderFrame(ModelManager& modelManager, DescriptorManager& de
 	// Begin command buffer recording
 	VkCommandBuffer cmd = m_renderCommandBuffers[imageIndex];
 
-	if (m_renderer.Draw(m_disp, cmd, modelManager, descriptorManager, m_allocator, m_commandPool, m_graphicsQueue, m_debugUtils, m_swapchain, m_swapchainImages, m_swapchainImageViews, imageIndex, scene) != 0)
+	if (m_renderer.Draw(m_disp, cmd, modelManager, descriptorManager, m_allocator, m_debugUtils, m_swapchain, m_swapchainImages, m_swapchainImageViews, imageIndex, static_cast<uint32_t>(m_currentFrame), m_inFlightFences[m_currentFrame], scene) != 0)
 		return -1;
 
 	VkSubmitInfo submit_info = {};
@@ -681,8 +730,13 @@ int VulkanContext::Cleanup(ShaderManager& shaderManager, ModelManager& modelMana
 {
 	spdlog::debug("Cleaning up...");
 
+	m_shaderHotReload.Stop();
+	modelManager.WaitForPipelines();
 	m_disp.deviceWaitIdle();
 
+	// Everything the scene compiled this run, the next start loads it back
+	m_pipelineCache.Save(m_disp);
+
 	// Cleanup ImGui
 	ImGui_ImplVulkan_Shutdown();
 	ImGui_ImplGlfw_Shutdown();
@@ -708,14 +762,17 @@ int VulkanContext::Cleanup(ShaderManager& shaderManager, ModelManager& modelMana
 
 	shaderManager.CleanupDescriptorSetLayouts(m_disp);
 
-	descriptorManager.Cleanup();
-
+	// The renderer first, the shadow system gives its sets back to the descriptor manager
 	m_renderer.CleanUp(m_disp, m_allocator);
 
+	descriptorManager.Cleanup();
+
 	shaderManager.CleanupShaderModules(m_disp);
 
 	m_disp.destroyCommandPool(m_commandPool, nullptr);
 
+	m_pipelineCache.Cleanup(m_disp);
+
 	vkb::destroy_swapchain(m_swapchain);
 	vkb::destroy_surface(m_instance, m_surface);
 
@@ -762,6 +819,11 @@ VkCommandPool VulkanContext::GetCommandPool() const
 	return m_commandPool;
 }
 
+VkPipelineCache VulkanContext::GetPipelineCache() const
+{
+	return m_pipelineCache.Get();
+}
+
 VmaAllocator VulkanContext::GetAllocator() const
 {
 	return m_allocator;
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "ClusteredLights.h"
+#include "TestHarness.h"
+#include <glm/gtc/matrix_transform.hpp>
+#include <spdlog/spdlog.h>
+
+// Checks the clustered light assignment against a brute force test: every light whose sphere holds a point in
+// view has to be in that point's cluster, and lights outside of the frustum in none. Then times the binning
+// for a few hundred to a few thousand lights and how many lights a cluster ends up with compared to all of them.
+
+using Clock = std::chrono::high_resolution_clock;
+
+double MillisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+constexpr float FOV = 60.0f;
+constexpr float ASPECT = 16.0f / 9.0f;
+constexpr float NEAR_Z = 0.1f;
+constexpr float FAR_Z = 200.0f;
+
+const glm::mat4 VIEW = glm::lookAt(glm::vec3(3.0f, 4.0f, 10.0f), glm::vec3(0.0f, 0.0f, -20.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+// Lights spread through the space in front of the camera, a few of them large
+std::vector<glm::vec4> RandomLights(std::mt19937& rng, size_t count, float extent) {
+    std::uniform_real_distribution<float> side(-extent, extent);
+    std::uniform_real_distribution<float> depth(-extent * 2.0f, 5.0f);
+    std::uniform_real_distribution<float> radius(0.5f, 6.0f);
+    std::uniform_real_distribution<float> chance(0.0f, 1.0f);
+
+    std::vector<glm::vec4> lights(count);
+    for (auto& light : lights) {
+        float r = chance(rng) < 0.05f ? radius(rng) * 4.0f : radius(rng);
+        light = glm::vec4(side(rng), side(rng) * 0.5f, depth(rng), r);
+    }
+    return lights;
+}
+
+// A point inside the view frustum, in view space
+glm::vec3 RandomViewPoint(std::mt19937& rng) {
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> logDepth(std::log(NEAR_Z), std::log(FAR_Z));
+
+    float tanY = std::tan(glm::radians(FOV) * 0.5f);
+    float depth = std::exp(logDepth(rng));
+    return glm::vec3(unit(rng) * depth * tanY * ASPECT, unit(rng) * depth * tanY, -depth);
+}
+
+void TestCoverage() {
+    std::mt19937 rng(48);
+    std::vector<glm::vec4> lights = RandomLights(rng, 300, 40.0f);
+
+    ClusteredLights clusters;
+    clusters.Assign(VIEW, FOV, ASPECT, NEAR_Z, FAR_Z, lights);
+
+    glm::mat4 inverseView = glm::inverse(VIEW);
+    size_t checked = 0;
+    for (int sample = 0; sample < 20000; sample++) {
+        glm::vec3 viewPoint = RandomViewPoint(rng);
+        glm::vec3 worldPoint = glm::vec3(inverseView * glm::vec4(viewPoint, 1.0f));
+
+        const ClusteredLights::Cluster& cluster = clusters.GetClusters()[clusters.GetClusterIndex(viewPoint)];
+        const uint32_t* first = clusters.GetLightIndices().data() + cluster.offset;
+        const uint32_t* last = first + cluster.count;
+
+        for (uint32_t i = 0; i < lights.size(); i++) {
+            if (glm::length(worldPoint - glm::vec3(lights[i])) < lights[i].w * 0.999f) {
+                Expect(std::find(first, last, i) != last, "A light that reaches a point is missing from its cluster");
+                checked++;
+            }
+        }
+    }
+    Expect(checked > 1000, "Too few points were lit to tell anything");
+}
+
+void TestCulling() {
+    glm::mat4 inverseView = glm::inverse(VIEW);
+    std::vector<glm::vec4> lights = {
+        glm::vec4(glm::vec3(inverseView * glm::vec4(0.0f, 0.0f, 5.0f, 1.0f)), 2.0f),     // Behind the camera
+        glm::vec4(glm::vec3(inverseView * glm::vec4(0.0f, 0.0f, -250.0f, 1.0f)), 10.0f), // Past the far plane
+        glm::vec4(glm::vec3(inverseView * glm::vec4(60.0f, 0.0f, -20.0f, 1.0f)), 3.0f),  // Far off to the right
+        glm::vec4(glm::vec3(inverseView * glm::vec4(0.0f, -40.0f, -20.0f, 1.0f)), 3.0f), // Below the view
+        glm::vec4(glm::vec3(inverseView * glm::vec4(0.0f, 0.0f, -20.0f, 1.0f)), 1.0f),   // In the middle of it
+    };
+
+    ClusteredLights clusters;
+    clusters.Assign(VIEW, FOV, ASPECT, NEAR_Z, FAR_Z, lights);
+
+    Expect(clusters.GetStats().culledLights == 4, "Lights outside of the view weren't culled");
+    for (uint32_t index : clusters.GetLightIndices()) {
+        Expect(index == 4, "A culled light is in a cluster");
+    }
+
+    // A small light in the middle only covers a few clusters around the center of the screen
+    Expect(clusters.GetStats().lightIndices > 0 && clusters.GetStats().lightIndices <= 27, "The visible light covers too many clusters");
+    const ClusteredLights::Cluster& center = clusters.GetClusters()[clusters.GetClusterIndex(glm::vec3(0.0f, 0.0f, -20.0f))];
+    Expect(center.count == 1, "The visible light isn't in the cluster at its center");
+}
+
+void BenchmarkAssignment() {
+    std::mt19937 rng(7);
+    const size_t counts[] = { 100, 500, 1000, 4000 };
+    for (size_t count : counts) {
+        std::vector<glm::vec4> lights = RandomLights(rng, count, 8.0f * std::cbrt(static_cast<float>(count)));
+
+        ClusteredLights clusters;
+        const int iterations = 50;
+        auto start = Clock::now();
+        for (int i = 0; i < iterations; i++) {
+            clusters.Assign(VIEW, FOV, ASPECT, NEAR_Z, FAR_Z, lights);
+        }
+        double assignMs = MillisecondsSince(start) / iterations;
+
+        const ClusteredLights::Stats& stats = clusters.GetStats();
+        float average = stats.occupiedClusters > 0 ? static_cast<float>(stats.lightIndices) / stats.occupiedClusters : 0.0f;
+        spdlog::info("{} lights: assigned in {:.3f} ms, {} culled, {} of {} clusters lit, {:.1f} lights per lit cluster ({} at most)",
+            count, assignMs, stats.culledLights, stats.occupiedClusters, ClusteredLights::CLUSTER_COUNT, average, stats.maxClusterLights);
+
+        Expect(stats.maxClusterLights < count - stats.culledLights || count - stats.culledLights <= 1, "Some cluster has every light in it");
+    }
+}
+
+int main() {
+    spdlog::set_level(spdlog::level::info);
+
+    std::vector<TestResult> results;
+    results.push_back(RunTest("Cluster coverage", TestCoverage));
+    results.push_back(RunTest("Light culling", TestCulling));
+    results.push_back(RunTest("Assignment benchmark", BenchmarkAssignment));
+
+    return ReportResults(results);
+}
@@ -0,0 +1,141 @@
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "DepthPass.h"
+#include "HeadlessContext.h"
+#include "Entity.h"
+#include "EntityManager.h"
+#include "IndirectDrawBuffer.h"
+#include "InstanceBatcher.h"
+#include "ModelManager.h"
+#include "TestHarness.h"
+#include <glm/gtc/matrix_transform.hpp>
+
+// Renders a grid of cubes and spheres into a 64x64 depth image with the shadow map shaders, going through
+// the shared MeshBuffer, the InstanceBatcher and a single vkCmdDrawIndexedIndirectCount, then reads the
+// depth back to check every object landed where it should and nothing else was drawn.
+
+constexpr uint32_t TARGET_SIZE = 64;
+constexpr float GRID_COORDS[] = { -6.0f, -2.0f, 2.0f, 6.0f };
+constexpr float ORTHO_EXTENT = 8.0f;
+
+// Batches the shadow casters, draws them with one indirect call per run and returns the depth image
+std::vector<float> RenderDepth(HeadlessContext& ctx, DepthPass& depthPass, EntityManager& entityManager, InstanceBatcher& batcher, IndirectDrawBuffer& indirectDraws, size_t expectedCommands) {
+    glm::mat4 lightSpaceMatrix = glm::orthoRH_ZO(-ORTHO_EXTENT, ORTHO_EXTENT, -ORTHO_EXTENT, ORTHO_EXTENT, 0.1f, 20.0f) * glm::lookAt(glm::vec3(0.0f, 0.0f, 10.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+    entityManager.UpdateSpatialIndex();
+    if (batcher.Build(ctx.disp, ctx.allocator, ctx.debugUtils, entityManager, Frustum::FromMatrix(lightSpaceMatrix), glm::vec3(0.0f, 0.0f, 10.0f), 0, 1)) {
+        depthPass.BindInstanceBuffer(ctx, batcher.GetBuffer());
+    }
+    indirectDraws.Build(ctx.disp, ctx.allocator, ctx.debugUtils, batcher.GetShadowBatches(), false, 0, 1);
+
+    if (indirectDraws.GetRuns().size() != 1) {
+        throw std::runtime_error("Expected a single indirect run, got " + std::to_string(indirectDraws.GetRuns().size()));
+    }
+    if (indirectDraws.GetCommandCount() != expectedCommands) {
+        throw std::runtime_error("Expected " + std::to_string(expectedCommands) + " indirect commands, got " + std::to_string(indirectDraws.GetCommandCount()));
+    }
+
+    ctx.Submit([&](VkCommandBuffer cmd) {
+        depthPass.Record(ctx, cmd, lightSpaceMatrix, [&](VkCommandBuffer drawCmd) {
+            const IndirectDrawRun& run = indirectDraws.GetRuns()[0];
+            run.firstBatch->model->meshBuffer->Bind(ctx.disp, drawCmd);
+            indirectDraws.Draw(ctx.disp, drawCmd, run);
+        });
+    });
+
+    return depthPass.ReadDepth(ctx);
+}
+
+uint32_t ToPixel(float coord) {
+    return static_cast<uint32_t>((coord / ORTHO_EXTENT * 0.5f + 0.5f) * TARGET_SIZE);
+}
+
+// The grid is symmetric in y and columns only hold one kind of mesh, so a flipped y axis doesn't matter
+void CheckColumn(const std::vector<float>& depth, float x, bool expectDrawn) {
+    for (float y : GRID_COORDS) {
+        float value = depth[ToPixel(y) * TARGET_SIZE + ToPixel(x)];
+        bool drawn = value < 1.0f;
+        if (drawn != expectDrawn) {
+            throw std::runtime_error("Object at (" + std::to_string(x) + ", " + std::to_string(y) + ") " + (expectDrawn ? "missing" : "should not be drawn") + ", depth " + std::to_string(value));
+        }
+    }
+}
+
+void CheckBackground(const std::vector<float>& depth) {
+    float value = depth[(TARGET_SIZE / 2) * TARGET_SIZE + TARGET_SIZE / 2];
+    if (value != 1.0f) {
+        throw std::runtime_error("Empty space between objects was drawn, depth " + std::to_string(value));
+    }
+}
+
+int main() {
+    spdlog::set_level(spdlog::level::info);
+
+    HeadlessContext ctx;
+    if (!ctx.Create()) {
+        spdlog::warn("Skipping, no Vulkan device available");
+        return TEST_SKIPPED;
+    }
+
+    ShaderManager shaderManager;
+    ModelManager modelManager;
+    EntityManager entityManager;
+    InstanceBatcher batcher;
+    IndirectDrawBuffer indirectDraws;
+    DepthPass depthPass;
+    depthPass.Create(ctx, shaderManager, TARGET_SIZE);
+
+    // Even columns hold cubes, odd columns spheres, both meshes live in the shared MeshBuffer
+    ModelResource* cube = modelManager.CreateCube(ctx.allocator, 1.0f);
+    modelManager.CreateBuffersForMesh(ctx.disp, ctx.queue, ctx.commandPool, ctx.allocator, *cube);
+    ModelResource* sphere = modelManager.CreateSphere(ctx.allocator, 0.5f);
+    modelManager.CreateBuffersForMesh(ctx.disp, ctx.queue, ctx.commandPool, ctx.allocator, *sphere);
+
+    std::vector<std::shared_ptr<Entity>> spheres;
+    for (int column = 0; column < 4; column++) {
+        for (int row = 0; row < 4; row++) {
+            auto entity = std::make_shared<Entity>("Grid" + std::to_string(column) + "_" + std::to_string(row));
+            entity->AddComponent<Model>(column % 2 == 0 ? cube : sphere);
+            auto& transform = entity->AddComponent<Transform>();
+            transform.position = glm::vec3(GRID_COORDS[column], GRID_COORDS[row], 0.0f);
+            entityManager.AddEntity(entity);
+            if (column % 2 == 1) {
+                spheres.push_back(entity);
+            }
+        }
+    }
+
+    std::vector<TestResult> results;
+
+    results.push_back(RunTest("Indirect draw of cubes and spheres", [&]() {
+        std::vector<float> depth = RenderDepth(ctx, depthPass, entityManager, batcher, indirectDraws, 2);
+        for (float x : GRID_COORDS) {
+            CheckColumn(depth, x, true);
+        }
+        CheckBackground(depth);
+    }));
+
+    results.push_back(RunTest("Indirect draw after removing the spheres", [&]() {
+        for (auto& entity : spheres) {
+            entityManager.RemoveEntity(entity);
+        }
+        std::vector<float> depth = RenderDepth(ctx, depthPass, entityManager, batcher, indirectDraws, 1);
+        for (int column = 0; column < 4; column++) {
+            CheckColumn(depth, GRID_COORDS[column], column % 2 == 0);
+        }
+        CheckBackground(depth);
+    }));
+
+    ctx.disp.deviceWaitIdle();
+    indirectDraws.Cleanup(ctx.allocator);
+    batcher.Cleanup(ctx.allocator);
+    depthPass.Destroy(ctx);
+    modelManager.UnloadAllResources(ctx.disp, ctx.allocator);
+    shaderManager.CleanUp(ctx.disp);
+    ctx.Destroy();
+
+    return ReportResults(results);
+}
@@ -0,0 +1,67 @@
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "LayoutRegistry.h"
+#include "TestHarness.h"
+#include <spdlog/spdlog.h>
+
+// Checks the descriptions the layout registry dedups descriptor set and pipeline layouts by: everything that
+// makes two layouts incompatible has to change the description, so they are never handed out as one.
+
+void TestSetLayoutDescriptions() {
+    std::vector<VkDescriptorSetLayoutBinding> bindings = {
+        { 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, nullptr },
+        { 1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, nullptr },
+    };
+    std::vector<VkDescriptorBindingFlags> flags = { 0, 0 };
+    std::vector<uint32_t> description = LayoutRegistry::DescribeSetLayout(bindings, flags);
+
+    Expect(description == LayoutRegistry::DescribeSetLayout(bindings, {}), "Missing binding flags aren't the same as none");
+
+    // Every field that changes the layout changes its description
+    auto changed = [&](auto change) {
+        std::vector<VkDescriptorSetLayoutBinding> other = bindings;
+        change(other[1]);
+        return LayoutRegistry::DescribeSetLayout(other, flags) != description;
+    };
+    Expect(changed([](VkDescriptorSetLayoutBinding& b) { b.binding = 2; }), "Binding number ignored");
+    Expect(changed([](VkDescriptorSetLayoutBinding& b) { b.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER; }), "Descriptor type ignored");
+    Expect(changed([](VkDescriptorSetLayoutBinding& b) { b.descriptorCount = 4; }), "Descriptor count ignored");
+    Expect(changed([](VkDescriptorSetLayoutBinding& b) { b.stageFlags = VK_SHADER_STAGE_VERTEX_BIT; }), "Stage flags ignored");
+
+    std::vector<VkDescriptorBindingFlags> bindless = { 0, VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT };
+    Expect(LayoutRegistry::DescribeSetLayout(bindings, bindless) != description, "Binding flags ignored");
+
+    // One binding's fields can't run into the next one's
+    Expect(LayoutRegistry::DescribeSetLayout({ bindings[0] }, {}) != description, "A subset describes the same layout");
+}
+
+void TestPipelineLayoutDescriptions() {
+    // Set layouts are only compared by handle, any distinct values will do
+    VkDescriptorSetLayout shared = reinterpret_cast<VkDescriptorSetLayout>(uint64_t(0x1000));
+    VkDescriptorSetLayout material = reinterpret_cast<VkDescriptorSetLayout>(uint64_t(0x2000));
+    VkDescriptorSetLayout far = reinterpret_cast<VkDescriptorSetLayout>(uint64_t(0x1000) | (uint64_t(1) << 40));
+    VkPushConstantRange range = { VK_SHADER_STAGE_VERTEX_BIT, 0, 64 };
+
+    std::vector<uint32_t> description = LayoutRegistry::DescribePipelineLayout({ shared, material }, { range });
+    Expect(description == LayoutRegistry::DescribePipelineLayout({ shared, material }, { range }), "Equal layouts described differently");
+    Expect(description != LayoutRegistry::DescribePipelineLayout({ material, shared }, { range }), "Set order ignored");
+    Expect(description != LayoutRegistry::DescribePipelineLayout({ shared }, { range }), "Set count ignored");
+    Expect(description != LayoutRegistry::DescribePipelineLayout({ far, material }, { range }), "High bits of a handle ignored");
+
+    VkPushConstantRange larger = range;
+    larger.size = 128;
+    Expect(description != LayoutRegistry::DescribePipelineLayout({ shared, material }, { larger }), "Push constant size ignored");
+    Expect(description != LayoutRegistry::DescribePipelineLayout({ shared, material }, {}), "Push constants ignored");
+}
+
+int main() {
+    spdlog::set_level(spdlog::level::info);
+
+    std::vector<TestResult> results;
+    results.push_back(RunTest("Set layout descriptions", TestSetLayoutDescriptions));
+    results.push_back(RunTest("Pipeline layout descriptions", TestPipelineLayoutDescriptions));
+
+    return ReportResults(results);
+}
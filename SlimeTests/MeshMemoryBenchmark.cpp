@@ -0,0 +1,148 @@
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "DepthPass.h"
+#include "HeadlessContext.h"
+#include "Entity.h"
+#include "EntityManager.h"
+#include "InstanceBatcher.h"
+#include "MeshBuffer.h"
+#include "ModelManager.h"
+#include "TestHarness.h"
+#include <glm/gtc/matrix_transform.hpp>
+
+// Measures GPU time of a large static scene drawn from a static (device local, staged) MeshBuffer versus
+// a dynamic (host visible or ReBAR) one, using timestamp queries around the pass. Both have to produce the
+// same depth image. On integrated GPUs and software drivers there is little to no difference expected.
+
+constexpr uint32_t BENCHMARK_TARGET_SIZE = 512;
+constexpr int GRID_SIZE = 32;         // 1024 spheres
+constexpr int SPHERE_SEGMENTS = 64;   // ~8k triangles each
+constexpr int WARMUP_FRAMES = 2;
+constexpr int MEASURED_FRAMES = 10;
+
+struct BenchmarkResult {
+    MeshMemory memory;
+    double averageMs = 0.0;
+    std::vector<float> depth;
+};
+
+BenchmarkResult RunBenchmark(HeadlessContext& ctx, DepthPass& depthPass, VkQueryPool queryPool, float timestampPeriod, const ModelResource& sourceMesh, bool dynamic) {
+    ModelResource mesh = sourceMesh;
+    mesh.meshBuffer = nullptr;
+    mesh.dynamic = dynamic;
+
+    MeshBuffer meshBuffer(dynamic);
+    if (!meshBuffer.Upload(ctx.disp, ctx.queue, ctx.commandPool, ctx.allocator, mesh)) {
+        throw std::runtime_error("Failed to upload the mesh");
+    }
+
+    EntityManager entityManager;
+    for (int x = 0; x < GRID_SIZE; x++) {
+        for (int y = 0; y < GRID_SIZE; y++) {
+            auto entity = std::make_shared<Entity>("Sphere" + std::to_string(x) + "_" + std::to_string(y));
+            entity->AddComponent<Model>(&mesh);
+            auto& transform = entity->AddComponent<Transform>();
+            transform.position = glm::vec3(x - GRID_SIZE / 2 + 0.5f, y - GRID_SIZE / 2 + 0.5f, 0.0f);
+            entityManager.AddEntity(entity);
+        }
+    }
+
+    float extent = GRID_SIZE / 2.0f;
+    glm::mat4 viewProjection = glm::orthoRH_ZO(-extent, extent, -extent, extent, 0.1f, 20.0f) * glm::lookAt(glm::vec3(0.0f, 0.0f, 10.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+    InstanceBatcher batcher;
+    entityManager.UpdateSpatialIndex();
+    batcher.Build(ctx.disp, ctx.allocator, ctx.debugUtils, entityManager, Frustum::FromMatrix(viewProjection), glm::vec3(0.0f, 0.0f, 10.0f), 0, 1);
+    depthPass.BindInstanceBuffer(ctx, batcher.GetBuffer());
+
+    BenchmarkResult result;
+    result.memory = meshBuffer.GetMemory();
+
+    for (int frame = 0; frame < WARMUP_FRAMES + MEASURED_FRAMES; frame++) {
+        ctx.Submit([&](VkCommandBuffer cmd) {
+            ctx.disp.cmdResetQueryPool(cmd, queryPool, 0, 2);
+            ctx.disp.cmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, queryPool, 0);
+            depthPass.Record(ctx, cmd, viewProjection, [&](VkCommandBuffer drawCmd) {
+                meshBuffer.Bind(ctx.disp, drawCmd);
+                for (const InstanceBatch& batch : batcher.GetShadowBatches()) {
+                    ctx.disp.cmdDrawIndexed(drawCmd, batch.model->indexCount, batch.instanceCount, batch.model->firstIndex, batch.model->vertexOffset, batch.firstInstance);
+                }
+            });
+            ctx.disp.cmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT, queryPool, 1);
+        });
+
+        uint64_t timestamps[2];
+        VK_CHECK(ctx.disp.getQueryPoolResults(queryPool, 0, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+        if (frame >= WARMUP_FRAMES) {
+            result.averageMs += static_cast<double>(timestamps[1] - timestamps[0]) * timestampPeriod / 1e6 / MEASURED_FRAMES;
+        }
+    }
+
+    result.depth = depthPass.ReadDepth(ctx);
+
+    batcher.Cleanup(ctx.allocator);
+    meshBuffer.Cleanup(ctx.allocator);
+    return result;
+}
+
+int main() {
+    spdlog::set_level(spdlog::level::info);
+
+    HeadlessContext ctx;
+    if (!ctx.Create()) {
+        spdlog::warn("Skipping, no Vulkan device available");
+        return TEST_SKIPPED;
+    }
+
+    uint32_t queueFamily = ctx.device.get_queue_index(vkb::QueueType::graphics).value();
+    if (ctx.device.queue_families[queueFamily].timestampValidBits == 0) {
+        spdlog::warn("Skipping, the graphics queue doesn't support timestamps");
+        ctx.Destroy();
+        return TEST_SKIPPED;
+    }
+    float timestampPeriod = ctx.device.physical_device.properties.limits.timestampPeriod;
+
+    VkQueryPoolCreateInfo queryPoolInfo = {};
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = 2;
+    VkQueryPool queryPool;
+    VK_CHECK(ctx.disp.createQueryPool(&queryPoolInfo, nullptr, &queryPool));
+
+    ShaderManager shaderManager;
+    ModelManager modelManager;
+    DepthPass depthPass;
+    depthPass.Create(ctx, shaderManager, BENCHMARK_TARGET_SIZE);
+
+    const ModelResource* sphere = modelManager.CreateSphere(ctx.allocator, 0.45f, SPHERE_SEGMENTS, SPHERE_SEGMENTS);
+    spdlog::info("Drawing {} spheres of {} triangles into {}x{}", GRID_SIZE * GRID_SIZE, sphere->indices.size() / 3, BENCHMARK_TARGET_SIZE, BENCHMARK_TARGET_SIZE);
+
+    std::vector<TestResult> results;
+
+    results.push_back(RunTest("Static vs dynamic mesh memory", [&]() {
+        BenchmarkResult staticResult = RunBenchmark(ctx, depthPass, queryPool, timestampPeriod, *sphere, false);
+        BenchmarkResult dynamicResult = RunBenchmark(ctx, depthPass, queryPool, timestampPeriod, *sphere, true);
+
+        spdlog::info("Static mesh buffer ({}): {:.3f} ms", MeshMemoryName(staticResult.memory), staticResult.averageMs);
+        spdlog::info("Dynamic mesh buffer ({}): {:.3f} ms", MeshMemoryName(dynamicResult.memory), dynamicResult.averageMs);
+
+        if (staticResult.memory != MeshMemory::DeviceLocal) {
+            throw std::runtime_error("Static mesh buffer should be device local");
+        }
+        if (staticResult.depth != dynamicResult.depth) {
+            throw std::runtime_error("Static and dynamic mesh buffers rendered different images");
+        }
+    }));
+
+    ctx.disp.deviceWaitIdle();
+    depthPass.Destroy(ctx);
+    modelManager.UnloadAllResources(ctx.disp, ctx.allocator);
+    shaderManager.CleanUp(ctx.disp);
+    ctx.disp.destroyQueryPool(queryPool, nullptr);
+    ctx.Destroy();
+
+    return ReportResults(results);
+}
@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "OffsetAllocator.h"
+#include "TestHarness.h"
+#include <spdlog/spdlog.h>
+
+// Checks the free list allocator behind the MeshBuffer: best fit, merging freed neighbours, growing,
+// and a random allocate/free run compared against a simple occupancy map.
+
+void TestBestFit() {
+    OffsetAllocator allocator(100);
+    uint32_t a = allocator.Allocate(10);
+    uint32_t b = allocator.Allocate(30);
+    uint32_t c = allocator.Allocate(10);
+    uint32_t d = allocator.Allocate(20);
+    Expect(a == 0 && b == 10 && c == 40 && d == 50, "Allocations should be packed from the start");
+
+    // Holes of 10 at 0 and 40, plus 30 at the end
+    allocator.Free(a);
+    allocator.Free(c);
+    Expect(allocator.GetStats().freeRanges == 3, "Expected three free ranges");
+
+    uint32_t e = allocator.Allocate(8);
+    Expect(e == 0, "Best fit should pick the lowest 10 wide hole, got " + std::to_string(e));
+    uint32_t f = allocator.Allocate(25);
+    Expect(f == 70, "Only the range at the end fits 25, got " + std::to_string(f));
+
+    Expect(allocator.Allocate(11) == OffsetAllocator::INVALID_OFFSET, "Nothing 11 wide should be left");
+    Expect(allocator.Allocate(0) == OffsetAllocator::INVALID_OFFSET, "Zero sized allocations are invalid");
+    Expect(allocator.GetAllocationSize(b) == 30, "Allocation size should be tracked");
+}
+
+void TestMerging() {
+    OffsetAllocator allocator(64);
+    std::vector<uint32_t> offsets;
+    for (int i = 0; i < 8; i++) {
+        offsets.push_back(allocator.Allocate(8));
+    }
+    Expect(allocator.GetStats().used == 64 && allocator.GetStats().freeRanges == 0, "Allocator should be full");
+
+    // Free every other block, then the rest, out of order
+    for (int i : { 1, 5, 3, 7 }) {
+        allocator.Free(offsets[i]);
+    }
+    Expect(allocator.GetStats().freeRanges == 4, "Non adjacent frees shouldn't merge");
+    Expect(allocator.GetStats().Fragmentation() > 0.5f, "Four separate holes should report fragmentation");
+
+    for (int i : { 6, 0, 4, 2 }) {
+        allocator.Free(offsets[i]);
+    }
+
+    OffsetAllocator::Stats stats = allocator.GetStats();
+    Expect(stats.freeRanges == 1 && stats.largestFreeRange == 64, "Everything should merge back into one range");
+    Expect(stats.used == 0 && stats.allocations == 0, "Nothing should be in use");
+    Expect(stats.Fragmentation() == 0.0f, "One free range isn't fragmented");
+}
+
+void TestGrow() {
+    OffsetAllocator allocator(16);
+    uint32_t a = allocator.Allocate(12);
+    Expect(allocator.Allocate(8) == OffsetAllocator::INVALID_OFFSET, "8 shouldn't fit in the remaining 4");
+
+    allocator.Grow(32);
+    uint32_t b = allocator.Allocate(8);
+    Expect(b == 12, "Grown space should merge with the free tail, got " + std::to_string(b));
+    Expect(allocator.GetAllocationSize(a) == 12, "Existing allocations survive growing");
+
+    allocator.Free(a);
+    allocator.Free(b);
+    Expect(allocator.GetStats().largestFreeRange == 32, "Everything should merge after growing");
+}
+
+void TestRandom() {
+    constexpr uint32_t capacity = 1 << 16;
+    OffsetAllocator allocator(capacity);
+    std::vector<int> owner(capacity, -1);
+    std::vector<std::pair<uint32_t, uint32_t>> live;
+
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<uint32_t> size(1, 2048);
+
+    for (int i = 0; i < 20000; i++) {
+        bool allocate = live.empty() || rng() % 3 != 0;
+        if (allocate) {
+            uint32_t count = size(rng);
+            uint32_t offset = allocator.Allocate(count);
+            if (offset == OffsetAllocator::INVALID_OFFSET) {
+                Expect(allocator.GetStats().largestFreeRange < count, "Allocation failed with a large enough range free");
+                continue;
+            }
+
+            Expect(offset + count <= capacity, "Allocation out of range");
+            for (uint32_t j = offset; j < offset + count; j++) {
+                Expect(owner[j] == -1, "Allocation overlaps another at " + std::to_string(j));
+                owner[j] = i;
+            }
+            live.push_back({ offset, count });
+        } else {
+            size_t index = rng() % live.size();
+            auto [offset, count] = live[index];
+            for (uint32_t j = offset; j < offset + count; j++) {
+                owner[j] = -1;
+            }
+            allocator.Free(offset);
+            live[index] = live.back();
+            live.pop_back();
+        }
+    }
+
+    uint32_t used = 0;
+    for (const auto& allocation : live) {
+        used += allocation.second;
+    }
+    OffsetAllocator::Stats stats = allocator.GetStats();
+    Expect(stats.used == used, "Used count doesn't match the live allocations");
+    Expect(stats.allocations == live.size(), "Allocation count doesn't match");
+
+    spdlog::info("After random run: {} allocations, {} / {} used, {} free ranges, fragmentation {:.1f}%",
+            stats.allocations, stats.used, stats.capacity, stats.freeRanges, stats.Fragmentation() * 100.0f);
+
+    for (const auto& allocation : live) {
+        allocator.Free(allocation.first);
+    }
+    Expect(allocator.GetStats().freeRanges == 1, "Freeing everything should leave one range");
+}
+
+int main() {
+    spdlog::set_level(spdlog::level::info);
+
+    std::vector<TestResult> results;
+    results.push_back(RunTest("Best fit", TestBestFit));
+    results.push_back(RunTest("Merging freed ranges", TestMerging));
+    results.push_back(RunTest("Growing", TestGrow));
+    results.push_back(RunTest("Random allocate and free", TestRandom));
+
+    return ReportResults(results);
+}
@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "DepthPass.h"
+#include "HeadlessContext.h"
+#include "Entity.h"
+#include "EntityManager.h"
+#include "InstanceBatcher.h"
+#include "ModelManager.h"
+#include "ParallelCommandRecorder.h"
+#include "TestHarness.h"
+#include <glm/gtc/matrix_transform.hpp>
+
+// Draws a grid of cubes one draw call each (no instancing, so there are tens of thousands of draws) into a
+// depth image, first recorded inline into the primary, then split over secondary command buffers recorded
+// on 1..N threads. Every image has to match the inline one. Logs the CPU recording time per thread count.
+
+constexpr uint32_t TARGET_SIZE = 256;
+constexpr int GRID_SIZE = 160; // 25600 draws
+constexpr uint32_t MIN_DRAWS_PER_CHUNK = 256;
+constexpr int MEASURED_FRAMES = 5;
+
+struct RecordResult {
+    double recordMs = 0.0;
+    std::vector<float> depth;
+};
+
+void RecordDrawRange(HeadlessContext& ctx, VkCommandBuffer cmd, const InstanceBatch& batch, uint32_t firstDraw, uint32_t drawCount) {
+    for (uint32_t i = firstDraw; i < firstDraw + drawCount; i++) {
+        ctx.disp.cmdDrawIndexed(cmd, batch.model->indexCount, 1, batch.model->firstIndex, batch.model->vertexOffset, batch.firstInstance + i);
+    }
+}
+
+RecordResult RecordInline(HeadlessContext& ctx, DepthPass& depthPass, const glm::mat4& viewProjection, const InstanceBatch& batch) {
+    RecordResult result;
+    for (int frame = 0; frame < MEASURED_FRAMES; frame++) {
+        ctx.Submit([&](VkCommandBuffer cmd) {
+            depthPass.Record(ctx, cmd, viewProjection, [&](VkCommandBuffer drawCmd) {
+                batch.model->meshBuffer->Bind(ctx.disp, drawCmd);
+                auto start = std::chrono::high_resolution_clock::now();
+                RecordDrawRange(ctx, drawCmd, batch, 0, batch.instanceCount);
+                result.recordMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / MEASURED_FRAMES;
+            });
+        });
+    }
+    result.depth = depthPass.ReadDepth(ctx);
+    return result;
+}
+
+RecordResult RecordInParallel(HeadlessContext& ctx, DepthPass& depthPass, const glm::mat4& viewProjection, const InstanceBatch& batch, uint32_t threadCount) {
+    uint32_t queueFamily = ctx.device.get_queue_index(vkb::QueueType::graphics).value();
+    ParallelCommandRecorder recorder;
+    recorder.Init(ctx.disp, queueFamily, 1, threadCount);
+
+    RecordResult result;
+    size_t chunks = 0;
+    for (int frame = 0; frame < MEASURED_FRAMES; frame++) {
+        // Submit waits for the queue, so the single frame's pools are free again
+        recorder.BeginFrame(ctx.disp, 0);
+        ctx.Submit([&](VkCommandBuffer cmd) {
+            depthPass.Record(ctx, cmd, viewProjection, [&](VkCommandBuffer drawCmd) {
+                const std::vector<VkCommandBuffer>& commandBuffers = recorder.Record(ctx.disp, depthPass.InheritanceInfo(), batch.instanceCount, MIN_DRAWS_PER_CHUNK,
+                        [&](VkCommandBuffer chunkCmd, uint32_t firstDraw, uint32_t drawCount) {
+                            depthPass.Bind(ctx, chunkCmd, viewProjection);
+                            batch.model->meshBuffer->Bind(ctx.disp, chunkCmd);
+                            RecordDrawRange(ctx, chunkCmd, batch, firstDraw, drawCount);
+                        });
+                ctx.disp.cmdExecuteCommands(drawCmd, static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+                chunks = commandBuffers.size();
+            }, VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT);
+        });
+        result.recordMs += recorder.GetStats().recordMs / MEASURED_FRAMES;
+    }
+    result.depth = depthPass.ReadDepth(ctx);
+
+    if (chunks != std::min<size_t>(threadCount, (batch.instanceCount + MIN_DRAWS_PER_CHUNK - 1) / MIN_DRAWS_PER_CHUNK)) {
+        throw std::runtime_error("Expected one chunk per thread, got " + std::to_string(chunks));
+    }
+    if (recorder.GetStats().commandBuffers != chunks) {
+        throw std::runtime_error("Secondary command buffers should be reused between frames");
+    }
+
+    recorder.Cleanup(ctx.disp);
+    return result;
+}
+
+int main() {
+    spdlog::set_level(spdlog::level::info);
+
+    HeadlessContext ctx;
+    if (!ctx.Create()) {
+        spdlog::warn("Skipping, no Vulkan device available");
+        return TEST_SKIPPED;
+    }
+
+    ShaderManager shaderManager;
+    ModelManager modelManager;
+    EntityManager entityManager;
+    InstanceBatcher batcher;
+    DepthPass depthPass;
+    depthPass.Create(ctx, shaderManager, TARGET_SIZE);
+
+    ModelResource* cube = modelManager.CreateCube(ctx.allocator, 0.5f);
+    modelManager.CreateBuffersForMesh(ctx.disp, ctx.queue, ctx.commandPool, ctx.allocator, *cube);
+
+    for (int x = 0; x < GRID_SIZE; x++) {
+        for (int y = 0; y < GRID_SIZE; y++) {
+            auto entity = std::make_shared<Entity>("Cube" + std::to_string(x) + "_" + std::to_string(y));
+            entity->AddComponent<Model>(cube);
+            auto& transform = entity->AddComponent<Transform>();
+            transform.position = glm::vec3(x - GRID_SIZE / 2 + 0.5f, y - GRID_SIZE / 2 + 0.5f, (x + y) % 3 * -0.5f);
+            entityManager.AddEntity(entity);
+        }
+    }
+
+    float extent = GRID_SIZE / 2.0f;
+    glm::mat4 viewProjection = glm::orthoRH_ZO(-extent, extent, -extent, extent, 0.1f, 20.0f) * glm::lookAt(glm::vec3(0.0f, 0.0f, 10.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+    // Only used for the instance buffer, the batch is then drawn one instance at a time
+    entityManager.UpdateSpatialIndex();
+    batcher.Build(ctx.disp, ctx.allocator, ctx.debugUtils, entityManager, Frustum::FromMatrix(viewProjection), glm::vec3(0.0f, 0.0f, 10.0f), 0, 1);
+    depthPass.BindInstanceBuffer(ctx, batcher.GetBuffer());
+    const InstanceBatch& batch = batcher.GetShadowBatches().front();
+
+    std::vector<TestResult> results;
+
+    RecordResult reference;
+    results.push_back(RunTest("Inline recording", [&]() {
+        reference = RecordInline(ctx, depthPass, viewProjection, batch);
+        spdlog::info("{} draws inline: {:.3f} ms", batch.instanceCount, reference.recordMs);
+        if (std::all_of(reference.depth.begin(), reference.depth.end(), [](float value) { return value == 1.0f; })) {
+            throw std::runtime_error("Nothing was drawn");
+        }
+    }));
+
+    std::vector<uint32_t> threadCounts = { 1, 2, 4, ParallelCommandRecorder::DefaultThreadCount() };
+    std::sort(threadCounts.begin(), threadCounts.end());
+    threadCounts.erase(std::unique(threadCounts.begin(), threadCounts.end()), threadCounts.end());
+
+    for (uint32_t threadCount : threadCounts) {
+        results.push_back(RunTest("Parallel recording on " + std::to_string(threadCount) + " threads", [&]() {
+            RecordResult result = RecordInParallel(ctx, depthPass, viewProjection, batch, threadCount);
+            spdlog::info("{} draws on {} threads: {:.3f} ms", batch.instanceCount, threadCount, result.recordMs);
+            if (result.depth != reference.depth) {
+                throw std::runtime_error("Depth differs from the inline recording");
+            }
+        }));
+    }
+
+    ctx.disp.deviceWaitIdle();
+    batcher.Cleanup(ctx.allocator);
+    depthPass.Destroy(ctx);
+    modelManager.UnloadAllResources(ctx.disp, ctx.allocator);
+    shaderManager.CleanUp(ctx.disp);
+    ctx.Destroy();
+
+    return ReportResults(results);
+}
@@ -0,0 +1,126 @@
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "PipelineCache.h"
+#include "TestHarness.h"
+#include <spdlog/spdlog.h>
+
+// Checks the on disk format of the pipeline cache: a file only round trips on the device and driver that
+// wrote it, and anything damaged or foreign is rejected before the driver would see it.
+
+PipelineCache::DeviceIdentity MakeIdentity() {
+    PipelineCache::DeviceIdentity identity;
+    identity.vendorID = 0x10DE;
+    identity.deviceID = 0x2684;
+    identity.driverVersion = 0x89C34000;
+    for (uint32_t i = 0; i < VK_UUID_SIZE; i++) {
+        identity.driverUUID[i] = static_cast<uint8_t>(i * 3 + 1);
+        identity.pipelineCacheUUID[i] = static_cast<uint8_t>(i * 7 + 2);
+    }
+    return identity;
+}
+
+// What a driver would hand back from vkGetPipelineCacheData: its own header, then opaque data
+std::vector<uint8_t> MakeDriverBlob(const PipelineCache::DeviceIdentity& identity, size_t payloadSize) {
+    VkPipelineCacheHeaderVersionOne header{};
+    header.headerSize = sizeof(header);
+    header.headerVersion = VK_PIPELINE_CACHE_HEADER_VERSION_ONE;
+    header.vendorID = identity.vendorID;
+    header.deviceID = identity.deviceID;
+    std::memcpy(header.pipelineCacheUUID, identity.pipelineCacheUUID, VK_UUID_SIZE);
+
+    std::vector<uint8_t> blob(sizeof(header) + payloadSize);
+    std::memcpy(blob.data(), &header, sizeof(header));
+    for (size_t i = 0; i < payloadSize; i++) {
+        blob[sizeof(header) + i] = static_cast<uint8_t>(i * 31);
+    }
+    return blob;
+}
+
+void ExpectRejected(const std::vector<uint8_t>& file, const PipelineCache::DeviceIdentity& identity, const std::string& what) {
+    std::vector<uint8_t> data;
+    std::string error;
+    Expect(!PipelineCache::Deserialize(file, identity, data, error), what + " was accepted");
+    Expect(!error.empty(), what + " was rejected without a reason");
+    Expect(data.empty(), what + " still returned data");
+}
+
+void TestRoundTrip() {
+    PipelineCache::DeviceIdentity identity = MakeIdentity();
+    std::vector<uint8_t> blob = MakeDriverBlob(identity, 4096);
+
+    std::vector<uint8_t> file = PipelineCache::Serialize(identity, blob);
+    std::vector<uint8_t> data;
+    std::string error;
+    Expect(PipelineCache::Deserialize(file, identity, data, error), "Round trip rejected: " + error);
+    Expect(data == blob, "Round trip changed the driver data");
+}
+
+void TestOtherDeviceOrDriver() {
+    PipelineCache::DeviceIdentity identity = MakeIdentity();
+    std::vector<uint8_t> file = PipelineCache::Serialize(identity, MakeDriverBlob(identity, 256));
+
+    PipelineCache::DeviceIdentity other = identity;
+    other.vendorID = 0x1002;
+    ExpectRejected(file, other, "Another vendor");
+
+    other = identity;
+    other.deviceID++;
+    ExpectRejected(file, other, "Another device");
+
+    other = identity;
+    other.driverVersion++;
+    ExpectRejected(file, other, "Another driver version");
+
+    other = identity;
+    other.driverUUID[5] ^= 0xFF;
+    ExpectRejected(file, other, "Another driver UUID");
+
+    other = identity;
+    other.pipelineCacheUUID[0] ^= 0xFF;
+    ExpectRejected(file, other, "Another pipeline cache UUID");
+}
+
+void TestDamagedFiles() {
+    PipelineCache::DeviceIdentity identity = MakeIdentity();
+    std::vector<uint8_t> file = PipelineCache::Serialize(identity, MakeDriverBlob(identity, 1024));
+
+    ExpectRejected({}, identity, "An empty file");
+    ExpectRejected(std::vector<uint8_t>(file.begin(), file.begin() + 16), identity, "A cut off header");
+    ExpectRejected(std::vector<uint8_t>(file.begin(), file.end() - 1), identity, "A truncated file");
+
+    std::vector<uint8_t> flipped = file;
+    flipped[flipped.size() - 10] ^= 0x01;
+    ExpectRejected(flipped, identity, "A flipped bit");
+
+    std::vector<uint8_t> badMagic = file;
+    badMagic[0] ^= 0xFF;
+    ExpectRejected(badMagic, identity, "A file with another magic");
+}
+
+void TestForeignDriverHeader() {
+    // Our header matches but the driver's blob claims another device, e.g. a file copied between machines
+    PipelineCache::DeviceIdentity identity = MakeIdentity();
+    PipelineCache::DeviceIdentity other = identity;
+    other.deviceID++;
+
+    std::vector<uint8_t> file = PipelineCache::Serialize(identity, MakeDriverBlob(other, 128));
+    ExpectRejected(file, identity, "A blob from another device");
+
+    ExpectRejected(PipelineCache::Serialize(identity, {}), identity, "An empty blob");
+}
+
+int main() {
+    spdlog::set_level(spdlog::level::info);
+
+    std::vector<TestResult> results;
+    results.push_back(RunTest("Round trip", TestRoundTrip));
+    results.push_back(RunTest("Other device or driver", TestOtherDeviceOrDriver));
+    results.push_back(RunTest("Damaged files", TestDamagedFiles));
+    results.push_back(RunTest("Foreign driver header", TestForeignDriverHeader));
+
+    return ReportResults(results);
+}
@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "ShadowSystem.h"
+#include "TestHarness.h"
+#include <spdlog/spdlog.h>
+
+// Checks how point lights share the shadow atlas: how important a light is from how much of the screen it
+// covers, the tile size that asks for, and that the tiles are packed without overlapping and stay inside the
+// atlas, shrinking and then dropping the least important lights when they don't all fit.
+
+constexpr uint32_t ATLAS_SIZE = 2048;
+constexpr uint32_t MIN_TILE = 64;
+constexpr uint32_t MAX_TILE = 1024;
+
+void ExpectPacked(const std::vector<ShadowSystem::AtlasTile>& tiles) {
+    for (size_t i = 0; i < tiles.size(); i++) {
+        const ShadowSystem::AtlasTile& a = tiles[i];
+        if (a.size == 0) {
+            continue;
+        }
+        Expect(a.x + a.size <= ATLAS_SIZE && a.y + a.size <= ATLAS_SIZE, "A tile is outside of the atlas");
+        Expect(a.x % a.size == 0 && a.y % a.size == 0, "A tile isn't aligned to its size");
+
+        for (size_t j = i + 1; j < tiles.size(); j++) {
+            const ShadowSystem::AtlasTile& b = tiles[j];
+            bool apart = b.size == 0 || a.x + a.size <= b.x || b.x + b.size <= a.x || a.y + a.size <= b.y || b.y + b.size <= a.y;
+            Expect(apart, "Two tiles overlap");
+        }
+    }
+}
+
+void TestImportance() {
+    glm::vec3 light(0.0f, 0.0f, -10.0f);
+    Expect(ShadowSystem::CalculatePointLightImportance(light, 12.0f, glm::vec3(0.0f), 60.0f) == 1.0f, "A camera inside the light isn't fully important");
+
+    float previous = 1.0f;
+    for (float distance = 10.0f; distance < 500.0f; distance *= 1.5f) {
+        float importance = ShadowSystem::CalculatePointLightImportance(glm::vec3(0.0f, 0.0f, -distance), 5.0f, glm::vec3(0.0f), 60.0f);
+        Expect(importance > 0.0f && importance <= previous, "Importance doesn't fall off with distance");
+        previous = importance;
+    }
+
+    // A narrower view makes the same light bigger on screen
+    float wide = ShadowSystem::CalculatePointLightImportance(glm::vec3(0.0f, 0.0f, -100.0f), 5.0f, glm::vec3(0.0f), 90.0f);
+    float narrow = ShadowSystem::CalculatePointLightImportance(glm::vec3(0.0f, 0.0f, -100.0f), 5.0f, glm::vec3(0.0f), 30.0f);
+    Expect(narrow > wide, "Zooming in didn't make the light more important");
+}
+
+void TestTileSizes() {
+    Expect(ShadowSystem::CalculatePointShadowTileSize(1.0f, MIN_TILE, MAX_TILE) == MAX_TILE, "A light covering the screen didn't get the largest tile");
+    Expect(ShadowSystem::CalculatePointShadowTileSize(0.0f, MIN_TILE, MAX_TILE) == MIN_TILE, "A tiny light didn't get the smallest tile");
+    Expect(ShadowSystem::CalculatePointShadowTileSize(0.3f, MIN_TILE, MAX_TILE) == 256, "A light on a third of the screen didn't round down to 256");
+
+    for (float importance = 0.0f; importance <= 1.0f; importance += 0.01f) {
+        uint32_t size = ShadowSystem::CalculatePointShadowTileSize(importance, MIN_TILE, MAX_TILE);
+        Expect((size & (size - 1)) == 0, "A tile size isn't a power of two");
+    }
+}
+
+void TestPacking() {
+    // Mixed sizes in no particular order, well within the atlas
+    std::vector<uint32_t> sizes = { 64, 1024, 256, 64, 512, 128, 256, 64, 512 };
+    std::vector<float> importance = { 0.05f, 1.0f, 0.3f, 0.06f, 0.6f, 0.15f, 0.35f, 0.07f, 0.55f };
+
+    std::vector<ShadowSystem::AtlasTile> tiles = ShadowSystem::AllocateAtlasTiles(sizes, importance, ATLAS_SIZE, MIN_TILE);
+    Expect(tiles.size() == sizes.size(), "Not a tile per light");
+    for (size_t i = 0; i < tiles.size(); i++) {
+        Expect(tiles[i].size == sizes[i], "A light didn't get the tile it asked for while there was room");
+    }
+    ExpectPacked(tiles);
+
+    // Exactly full still fits
+    std::vector<uint32_t> full(4, 1024);
+    std::vector<float> even(4, 1.0f);
+    tiles = ShadowSystem::AllocateAtlasTiles(full, even, ATLAS_SIZE, MIN_TILE);
+    for (const auto& tile : tiles) {
+        Expect(tile.size == 1024, "A full atlas shrank a tile");
+    }
+    ExpectPacked(tiles);
+}
+
+void TestOverBudget() {
+    // Far more than fits, the least important shrink first
+    std::vector<uint32_t> sizes(12, 1024);
+    std::vector<float> importance;
+    for (uint32_t i = 0; i < sizes.size(); i++) {
+        importance.push_back(1.0f - i * 0.05f);
+    }
+
+    std::vector<ShadowSystem::AtlasTile> tiles = ShadowSystem::AllocateAtlasTiles(sizes, importance, ATLAS_SIZE, MIN_TILE);
+    ExpectPacked(tiles);
+    Expect(tiles[0].size == 1024, "The most important light lost resolution");
+    for (size_t i = 1; i < tiles.size(); i++) {
+        Expect(tiles[i].size > 0 && tiles[i].size <= tiles[i - 1].size, "A less important light got a larger tile");
+    }
+
+    uint64_t area = 0;
+    for (const auto& tile : tiles) {
+        area += static_cast<uint64_t>(tile.size) * tile.size;
+    }
+    Expect(area <= static_cast<uint64_t>(ATLAS_SIZE) * ATLAS_SIZE, "The tiles take more than the atlas");
+
+    // More lights than smallest tiles fit, the least important are dropped
+    uint32_t smallestTiles = (ATLAS_SIZE / MIN_TILE) * (ATLAS_SIZE / MIN_TILE);
+    std::vector<uint32_t> many(smallestTiles + 10, MIN_TILE);
+    std::vector<float> manyImportance;
+    for (uint32_t i = 0; i < many.size(); i++) {
+        manyImportance.push_back(static_cast<float>(i));
+    }
+
+    tiles = ShadowSystem::AllocateAtlasTiles(many, manyImportance, ATLAS_SIZE, MIN_TILE);
+    uint32_t dropped = 0;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        if (tiles[i].size == 0) {
+            dropped++;
+            Expect(i < 10, "A more important light was dropped");
+        }
+    }
+    Expect(dropped == 10, "Wrong number of lights dropped");
+    ExpectPacked(tiles);
+}
+
+int main() {
+    spdlog::set_level(spdlog::level::info);
+
+    std::vector<TestResult> results;
+    results.push_back(RunTest("Point light importance", TestImportance));
+    results.push_back(RunTest("Tile sizes", TestTileSizes));
+    results.push_back(RunTest("Tile packing", TestPacking));
+    results.push_back(RunTest("Over budget", TestOverBudget));
+
+    return ReportResults(results);
+}
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "RadixSort.h"
+#include "TestHarness.h"
+#include <spdlog/spdlog.h>
+
+// Checks the radix sort behind the render queue against std::stable_sort, and times both on keys shaped
+// like draw packets (few pipelines and materials, many meshes and depths).
+
+struct Packet {
+    uint64_t key;
+    uint32_t order; // Insertion order, to check stability
+};
+
+std::vector<Packet> MakeDrawKeys(size_t count, std::mt19937_64& rng) {
+    std::vector<Packet> packets(count);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t pass = rng() % 2;
+        uint64_t pipeline = rng() % 4;
+        uint64_t material = rng() % 32;
+        uint64_t mesh = rng() % 200;
+        uint64_t depth = rng() & 0x3FFFF;
+        packets[i] = { pass << 60 | pipeline << 50 | material << 34 | mesh << 18 | depth, static_cast<uint32_t>(i) };
+    }
+    return packets;
+}
+
+void ExpectSameOrder(const std::vector<Packet>& sorted, std::vector<Packet> reference) {
+    std::stable_sort(reference.begin(), reference.end(), [](const Packet& a, const Packet& b) { return a.key < b.key; });
+    for (size_t i = 0; i < reference.size(); i++) {
+        Expect(sorted[i].key == reference[i].key && sorted[i].order == reference[i].order, "Mismatch with std::stable_sort at " + std::to_string(i));
+    }
+}
+
+void TestRandomKeys() {
+    std::mt19937_64 rng(42);
+    std::vector<Packet> scratch;
+    for (size_t count : { 0, 1, 2, 17, 1000, 65536 }) {
+        std::vector<Packet> packets(count);
+        for (size_t i = 0; i < count; i++) {
+            packets[i] = { rng(), static_cast<uint32_t>(i) };
+        }
+        std::vector<Packet> reference = packets;
+        RadixSort(packets, scratch);
+        ExpectSameOrder(packets, reference);
+    }
+}
+
+void TestStability() {
+    // Few distinct keys, so most of them tie
+    std::mt19937_64 rng(7);
+    std::vector<Packet> packets(5000);
+    for (size_t i = 0; i < packets.size(); i++) {
+        packets[i] = { (rng() % 8) << 50, static_cast<uint32_t>(i) };
+    }
+    std::vector<Packet> reference = packets;
+    std::vector<Packet> scratch;
+    RadixSort(packets, scratch);
+    ExpectSameOrder(packets, reference);
+}
+
+void TestDrawKeys() {
+    std::mt19937_64 rng(1234);
+    std::vector<Packet> packets = MakeDrawKeys(20000, rng);
+    std::vector<Packet> reference = packets;
+    std::vector<Packet> scratch;
+    RadixSort(packets, scratch);
+    ExpectSameOrder(packets, reference);
+
+    // Sorting again must not allocate, the scratch buffer is already big enough
+    const Packet* scratchData = scratch.data();
+    packets = MakeDrawKeys(20000, rng);
+    RadixSort(packets, scratch);
+    Expect(scratch.data() == scratchData || packets.data() == scratchData, "Sorting the same size again reallocated");
+}
+
+void BenchmarkDrawKeys() {
+    constexpr int REPEATS = 20;
+    std::mt19937_64 rng(99);
+    std::vector<Packet> scratch;
+
+    for (size_t count : { 1000, 10000, 100000 }) {
+        std::vector<Packet> source = MakeDrawKeys(count, rng);
+        std::vector<Packet> packets;
+        packets.reserve(count);
+
+        double radixMs = 0.0;
+        double stdMs = 0.0;
+        for (int i = 0; i < REPEATS; i++) {
+            packets.assign(source.begin(), source.end());
+            auto start = std::chrono::high_resolution_clock::now();
+            RadixSort(packets, scratch);
+            radixMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / REPEATS;
+
+            packets.assign(source.begin(), source.end());
+            start = std::chrono::high_resolution_clock::now();
+            std::sort(packets.begin(), packets.end(), [](const Packet& a, const Packet& b) { return a.key < b.key; });
+            stdMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / REPEATS;
+        }
+
+        spdlog::info("{:>6} draw keys: radix sort {:.3f} ms, std::sort {:.3f} ms", count, radixMs, stdMs);
+    }
+}
+
+int main() {
+    spdlog::set_level(spdlog::level::info);
+
+    std::vector<TestResult> results;
+    results.push_back(RunTest("Random keys", TestRandomKeys));
+    results.push_back(RunTest("Stable on equal keys", TestStability));
+    results.push_back(RunTest("Draw keys", TestDrawKeys));
+    results.push_back(RunTest("Draw key benchmark", BenchmarkDrawKeys));
+
+    return ReportResults(results);
+}
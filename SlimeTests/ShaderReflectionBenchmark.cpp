@@ -0,0 +1,186 @@
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "ResourcePathManager.h"
+#include "ShaderManager.h"
+#include "TestHarness.h"
+#include <spdlog/spdlog.h>
+#include <spirv_glsl.hpp>
+
+// Measures what reflecting each compiled shader costs: the CompilerGLSL setup ParseShader used to do, the plain
+// spirv_cross::Compiler it uses now, reading the .refl sidecar back on a warm start, and a hit in the in memory
+// cache. Every cached path has to give back exactly what reflection produced.
+
+using Clock = std::chrono::high_resolution_clock;
+
+constexpr int ITERATIONS = 50;
+
+double MicrosecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+struct ShaderFile {
+    std::string name;
+    std::filesystem::path path;
+    VkShaderStageFlagBits stage;
+};
+
+std::vector<ShaderFile> FindShaders() {
+    const std::pair<const char*, VkShaderStageFlagBits> stages[] = {
+        { ".vert.spv", VK_SHADER_STAGE_VERTEX_BIT },
+        { ".frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT },
+        { ".comp.spv", VK_SHADER_STAGE_COMPUTE_BIT },
+    };
+
+    std::vector<ShaderFile> shaders;
+    std::filesystem::path directory = std::filesystem::path(ResourcePathManager::GetShaderPath("")).parent_path();
+    if (!std::filesystem::exists(directory)) {
+        return shaders;
+    }
+
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        std::string name = entry.path().filename().string();
+        for (const auto& [suffix, stage] : stages) {
+            if (name.size() > std::strlen(suffix) && name.compare(name.size() - std::strlen(suffix), std::string::npos, suffix) == 0) {
+                shaders.push_back({ name, entry.path(), stage });
+            }
+        }
+    }
+    return shaders;
+}
+
+ShaderModule LoadModule(const ShaderFile& shader) {
+    std::ifstream file(shader.path, std::ios::ate | std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Failed to open " + shader.path.string());
+    }
+    std::vector<uint32_t> code(static_cast<size_t>(file.tellg()) / sizeof(uint32_t));
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(code.data()), static_cast<std::streamsize>(code.size() * sizeof(uint32_t)));
+
+    // No device needed, reflection only looks at the SPIR-V
+    ShaderModule module(VK_NULL_HANDLE, std::move(code), shader.stage);
+    module.spirvHash = ShaderManager::HashSpirv(module.spirvCode);
+    return module;
+}
+
+void ExpectSame(const ShaderManager::ShaderResources& a, const ShaderManager::ShaderResources& b, const std::string& what) {
+    bool same = a.attributeDescriptions.size() == b.attributeDescriptions.size() && a.bindingDescriptions.size() == b.bindingDescriptions.size() &&
+                a.descriptorSetLayoutBindings.size() == b.descriptorSetLayoutBindings.size() && a.pushConstantRanges.size() == b.pushConstantRanges.size() &&
+                a.keywordConstants.size() == b.keywordConstants.size();
+
+    for (size_t i = 0; same && i < a.attributeDescriptions.size(); i++) {
+        const auto& x = a.attributeDescriptions[i];
+        const auto& y = b.attributeDescriptions[i];
+        same = x.location == y.location && x.binding == y.binding && x.format == y.format && x.offset == y.offset;
+    }
+    for (size_t i = 0; same && i < a.bindingDescriptions.size(); i++) {
+        const auto& x = a.bindingDescriptions[i];
+        const auto& y = b.bindingDescriptions[i];
+        same = x.binding == y.binding && x.stride == y.stride && x.inputRate == y.inputRate;
+    }
+    for (size_t i = 0; same && i < a.descriptorSetLayoutBindings.size(); i++) {
+        const auto& x = a.descriptorSetLayoutBindings[i];
+        const auto& y = b.descriptorSetLayoutBindings[i];
+        same = x.set == y.set && x.flags == y.flags && x.binding.binding == y.binding.binding && x.binding.descriptorType == y.binding.descriptorType &&
+               x.binding.descriptorCount == y.binding.descriptorCount && x.binding.stageFlags == y.binding.stageFlags;
+    }
+    for (size_t i = 0; same && i < a.pushConstantRanges.size(); i++) {
+        const auto& x = a.pushConstantRanges[i];
+        const auto& y = b.pushConstantRanges[i];
+        same = x.stageFlags == y.stageFlags && x.offset == y.offset && x.size == y.size;
+    }
+    for (size_t i = 0; same && i < a.keywordConstants.size(); i++) {
+        same = a.keywordConstants[i].constantId == b.keywordConstants[i].constantId && a.keywordConstants[i].keyword == b.keywordConstants[i].keyword;
+    }
+
+    if (!same) {
+        throw std::runtime_error(what + " differs from reflection");
+    }
+}
+
+void BenchmarkShader(const ShaderFile& shader, const std::filesystem::path& scratch) {
+    ShaderModule module = LoadModule(shader);
+    ShaderManager shaderManager;
+
+    auto start = Clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        spirv_cross::CompilerGLSL compiler(module.spirvCode);
+        spirv_cross::ShaderResources resources = compiler.get_shader_resources();
+        (void) resources;
+    }
+    double glslTime = MicrosecondsSince(start) / ITERATIONS;
+
+    ShaderManager::ShaderResources reflected;
+    start = Clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        reflected = shaderManager.Reflect(module);
+    }
+    double reflectTime = MicrosecondsSince(start) / ITERATIONS;
+
+    // Cold start: reflects and writes the sidecar next to a copy of the .spv
+    std::filesystem::path copy = scratch / shader.name;
+    std::filesystem::copy_file(shader.path, copy, std::filesystem::copy_options::overwrite_existing);
+    module.path = copy.string();
+    ExpectSame(reflected, shaderManager.ParseShader(module), "Cold ParseShader");
+    if (shaderManager.GetReflectionStats().reflected != 1 || !std::filesystem::exists(copy.string() + ".refl")) {
+        throw std::runtime_error("Cold ParseShader didn't reflect and write a sidecar");
+    }
+
+    // Warm start: a fresh manager finds the sidecar
+    ShaderManager::ShaderResources fromSidecar;
+    start = Clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        ShaderManager warmManager;
+        fromSidecar = warmManager.ParseShader(module);
+        if (warmManager.GetReflectionStats().sidecarHits != 1) {
+            throw std::runtime_error("Warm ParseShader didn't use the sidecar");
+        }
+    }
+    double sidecarTime = MicrosecondsSince(start) / ITERATIONS;
+    ExpectSame(reflected, fromSidecar, "The sidecar");
+
+    ShaderManager::ShaderResources fromMemory;
+    start = Clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        fromMemory = shaderManager.ParseShader(module);
+    }
+    double memoryTime = MicrosecondsSince(start) / ITERATIONS;
+    ExpectSame(reflected, fromMemory, "The memory cache");
+
+    // Other SPIR-V at the same path must not pick up the old sidecar
+    ShaderModule changed = module;
+    changed.spirvHash ^= 1;
+    ShaderManager staleManager;
+    staleManager.ParseShader(changed);
+    if (staleManager.GetReflectionStats().reflected != 1) {
+        throw std::runtime_error("A sidecar for other SPIR-V was used");
+    }
+
+    spdlog::info("  {:<20} CompilerGLSL {:8.1f} us, Compiler {:8.1f} us, sidecar {:6.1f} us, memory {:5.2f} us", shader.name, glslTime, reflectTime, sidecarTime, memoryTime);
+}
+
+int main() {
+    std::vector<ShaderFile> shaders = FindShaders();
+    if (shaders.empty()) {
+        spdlog::warn("No compiled shaders found, skipping");
+        return 77;
+    }
+
+    std::filesystem::path scratch = std::filesystem::temp_directory_path() / "SlimeShaderReflectionBenchmark";
+    std::filesystem::create_directories(scratch);
+
+    std::vector<TestResult> testResults;
+    for (const auto& shader : shaders) {
+        testResults.push_back(RunTest(shader.name, [&] { BenchmarkShader(shader, scratch); }));
+    }
+
+    std::filesystem::remove_all(scratch);
+
+    return ReportResults(testResults);
+}
@@ -0,0 +1,84 @@
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "ShaderVariants.h"
+#include "TestHarness.h"
+#include <spdlog/spdlog.h>
+
+// Checks how shader variants are named and found: the keywords a source declares, where each combination's
+// SPIR-V lives, the defines it is compiled with, and that an up to date variant on disk is reused.
+
+void TestDeclaredKeywords() {
+    Expect(ShaderVariants::ParseDeclaredKeywords("#version 450\nvoid main() {}\n") == 0, "A shader without keywords declared some");
+
+    std::string source = "#version 450\n// @keywords NORMAL_MAP RECEIVE_SHADOWS UNKNOWN\nvoid main() {}\n";
+    Expect(ShaderVariants::ParseDeclaredKeywords(source) == (SHADER_KEYWORD_NORMAL_MAP | SHADER_KEYWORD_RECEIVE_SHADOWS), "Wrong keywords parsed");
+
+    // Only in a comment, the word on its own is not a declaration
+    Expect(ShaderVariants::ParseDeclaredKeywords("#define X 1 @keywords AO_MAP\n") == 0, "Keywords outside a comment were parsed");
+
+    for (uint32_t i = 0; i < SHADER_KEYWORD_COUNT; i++) {
+        uint32_t keyword = 1u << i;
+        Expect(ShaderVariants::GetKeyword(ShaderVariants::GetKeywordName(keyword)) == keyword, "Keyword names don't round trip");
+    }
+    Expect(ShaderVariants::GetKeywordName(SHADER_KEYWORD_NORMAL_MAP | SHADER_KEYWORD_AO_MAP) == nullptr, "A combination has a name");
+}
+
+void TestVariantPaths() {
+    std::filesystem::path spirv = std::filesystem::path("shaders") / "basic.frag.spv";
+    uint32_t mask = SHADER_KEYWORD_NORMAL_MAP | SHADER_KEYWORD_AO_MAP;
+
+    Expect(ShaderVariants::GetVariantPath(spirv.string(), ALL_SHADER_KEYWORDS, mask) == spirv.string(), "Every keyword on isn't the base shader");
+    Expect(ShaderVariants::GetVariantPath(spirv.string(), mask | SHADER_KEYWORD_RECEIVE_SHADOWS, mask) == spirv.string(), "A keyword outside the mask made a variant");
+
+    std::string variant = ShaderVariants::GetVariantPath(spirv.string(), SHADER_KEYWORD_AO_MAP, mask);
+    Expect(variant == (std::filesystem::path("shaders") / "variants" / "basic.frag.2.spv").string(), "Unexpected variant path " + variant);
+    Expect(ShaderVariants::GetVariantPath(spirv.string(), SHADER_KEYWORD_NORMAL_MAP, mask) != variant, "Two variants share a path");
+
+    std::vector<std::string> defines = ShaderVariants::GetVariantDefines(SHADER_KEYWORD_AO_MAP);
+    Expect(defines == std::vector<std::string>{ "SLIME_VARIANT", "AO_MAP" }, "Wrong variant defines");
+}
+
+void TestDiskVariants() {
+    std::filesystem::path scratch = std::filesystem::temp_directory_path() / "SlimeShaderVariantKeywords";
+    std::filesystem::remove_all(scratch);
+    std::filesystem::create_directories(scratch);
+
+    std::filesystem::path source = scratch / "test.frag";
+    std::ofstream(source) << "#version 450\n// @keywords NORMAL_MAP AO_MAP\nvoid main() {}\n";
+    std::string spirv = source.string() + ".spv";
+    uint32_t mask = SHADER_KEYWORD_NORMAL_MAP | SHADER_KEYWORD_AO_MAP;
+
+    ShaderVariants variants;
+    Expect(variants.GetDeclaredKeywords(spirv) == mask, "Declared keywords weren't read from the source");
+
+    // Newer than its source, so reused as is
+    std::filesystem::path variant = ShaderVariants::GetVariantPath(spirv, SHADER_KEYWORD_NORMAL_MAP, mask);
+    std::filesystem::create_directories(variant.parent_path());
+    std::ofstream(variant) << "spirv";
+    std::filesystem::last_write_time(variant, std::filesystem::last_write_time(source) + std::chrono::seconds(1));
+
+    std::string log;
+    Expect(ShaderVariants::BuildVariant(spirv, SHADER_KEYWORD_NORMAL_MAP, mask, log) == ShaderVariants::BuildResult::DiskHit, "An up to date variant wasn't reused");
+    Expect(ShaderVariants::BuildVariant(spirv, mask, mask, log) == ShaderVariants::BuildResult::DiskHit, "The base shader isn't a variant");
+
+    std::filesystem::remove(source);
+    Expect(ShaderVariants::BuildVariant(spirv, 0, mask, log) == ShaderVariants::BuildResult::Failed, "A variant was built without a source");
+    Expect(!log.empty(), "A failed build has no log");
+
+    std::filesystem::remove_all(scratch);
+}
+
+int main() {
+    spdlog::set_level(spdlog::level::info);
+
+    std::vector<TestResult> results;
+    results.push_back(RunTest("Declared keywords", TestDeclaredKeywords));
+    results.push_back(RunTest("Variant paths", TestVariantPaths));
+    results.push_back(RunTest("Disk variants", TestDiskVariants));
+
+    return ReportResults(results);
+}
@@ -0,0 +1,149 @@
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "Entity.h"
+#include "EntityManager.h"
+#include "ShadowSystem.h"
+#include "TestHarness.h"
+#include <spdlog/spdlog.h>
+
+// Checks how the cascades are laid out and fitted: the split depths, that a cascade's projection keeps its
+// size as the camera turns and only moves in whole texels as it moves, and that it covers its slice. Then
+// what the cached static shadow depth relies on: padded cascades are kept for small camera moves, and which
+// casters count as static.
+
+bool Near(float a, float b, float epsilon = 1e-3f) {
+    return std::abs(a - b) <= epsilon * std::max(1.0f, std::abs(b));
+}
+
+constexpr uint32_t SHADOW_MAP_SIZE = 2048;
+const glm::vec3 LIGHT_DIRECTION = glm::normalize(glm::vec3(0.3f, -1.0f, 0.4f));
+
+std::vector<glm::vec3> SliceCorners(const glm::vec3& position, float yaw) {
+    glm::vec3 forward = glm::normalize(glm::vec3(std::sin(yaw), 0.0f, -std::cos(yaw)));
+    glm::vec3 right = glm::normalize(glm::cross(forward, glm::vec3(0.0f, 1.0f, 0.0f)));
+    glm::vec3 up = glm::cross(right, forward);
+    return ShadowSystem::CalculateFrustumCorners(60.0f, 16.0f / 9.0f, 5.0f, 20.0f, position, forward, up, right);
+}
+
+void TestSplits() {
+    float splits[MAX_SHADOW_CASCADES];
+    ShadowSystem::CalculateCascadeSplits(0.1f, 100.0f, 4, 0.75f, splits);
+    for (uint32_t i = 1; i < 4; i++) {
+        Expect(splits[i] > splits[i - 1], "Splits aren't increasing");
+    }
+    Expect(Near(splits[3], 100.0f), "The last cascade doesn't end at far");
+
+    ShadowSystem::CalculateCascadeSplits(0.1f, 100.0f, 4, 0.0f, splits);
+    Expect(Near(splits[0], 0.1f + 99.9f * 0.25f), "Lambda 0 isn't uniform");
+
+    ShadowSystem::CalculateCascadeSplits(0.1f, 100.0f, 4, 1.0f, splits);
+    Expect(Near(splits[1], 0.1f * std::pow(1000.0f, 0.5f)), "Lambda 1 isn't logarithmic");
+}
+
+void TestStableSize() {
+    // Turning the camera moves the slice but must not rescale the cascade
+    ShadowSystem::Cascade first = ShadowSystem::FitCascade(LIGHT_DIRECTION, SliceCorners(glm::vec3(0.0f), 0.0f), SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 50.0f);
+    for (float yaw = 0.1f; yaw < 6.0f; yaw += 0.37f) {
+        ShadowSystem::Cascade turned = ShadowSystem::FitCascade(LIGHT_DIRECTION, SliceCorners(glm::vec3(0.0f), yaw), SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 50.0f);
+        Expect(turned.lightSpaceMatrix[0][0] == first.lightSpaceMatrix[0][0], "Cascade size changed as the camera turned");
+    }
+}
+
+void TestTexelSnapping() {
+    // A fixed point has to land on the same spot within a texel however far the camera moved
+    glm::vec3 point(3.0f, 0.0f, -7.0f);
+    ShadowSystem::Cascade first = ShadowSystem::FitCascade(LIGHT_DIRECTION, SliceCorners(glm::vec3(0.0f), 0.0f), SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 50.0f);
+    glm::vec4 firstClip = first.lightSpaceMatrix * glm::vec4(point, 1.0f);
+
+    for (float step = 0.013f; step < 2.0f; step += 0.171f) {
+        glm::vec3 position(step, 0.0f, -step * 0.5f);
+        ShadowSystem::Cascade moved = ShadowSystem::FitCascade(LIGHT_DIRECTION, SliceCorners(position, 0.0f), SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 50.0f);
+        glm::vec4 movedClip = moved.lightSpaceMatrix * glm::vec4(point, 1.0f);
+
+        glm::vec2 texels = (glm::vec2(movedClip) - glm::vec2(firstClip)) * 0.5f * static_cast<float>(SHADOW_MAP_SIZE);
+        Expect(std::abs(texels.x - std::round(texels.x)) < 0.01f && std::abs(texels.y - std::round(texels.y)) < 0.01f, "Cascade moved by part of a texel");
+    }
+}
+
+void TestCoverage() {
+    std::vector<glm::vec3> corners = SliceCorners(glm::vec3(1.0f, 2.0f, 3.0f), 0.8f);
+    ShadowSystem::Cascade cascade = ShadowSystem::FitCascade(LIGHT_DIRECTION, corners, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 50.0f);
+    Frustum frustum = Frustum::FromMatrix(cascade.cullingMatrix);
+
+    for (const glm::vec3& corner : corners) {
+        glm::vec4 clip = cascade.lightSpaceMatrix * glm::vec4(corner, 1.0f);
+        Expect(std::abs(clip.x) <= 1.0f && std::abs(clip.y) <= 1.0f && clip.z >= 0.0f && clip.z <= 1.0f, "A slice corner is outside of its cascade");
+        Expect(frustum.Intersects(AABB(corner - glm::vec3(0.01f), corner + glm::vec3(0.01f))), "A slice corner is culled");
+    }
+
+    // Casters between the slice and the light still throw shadows into it
+    glm::vec3 caster = corners[0] - LIGHT_DIRECTION * 40.0f;
+    Expect(frustum.Intersects(AABB(caster - glm::vec3(0.01f), caster + glm::vec3(0.01f))), "A caster towards the light is culled");
+}
+
+void TestPaddedCascadeKept() {
+    std::vector<glm::vec3> corners = SliceCorners(glm::vec3(0.0f), 0.0f);
+    ShadowSystem::Cascade padded = ShadowSystem::FitCascade(LIGHT_DIRECTION, corners, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 50.0f, 0.15f);
+    Expect(ShadowSystem::CascadeContains(padded.cullingMatrix, corners), "A cascade doesn't contain the slice it was fitted to");
+    Expect(ShadowSystem::CascadeContains(padded.cullingMatrix, SliceCorners(glm::vec3(0.5f, 0.0f, -0.5f), 0.0f)), "A small move left the padded cascade");
+    Expect(!ShadowSystem::CascadeContains(padded.cullingMatrix, SliceCorners(glm::vec3(30.0f, 0.0f, 0.0f), 0.0f)), "A large move stayed inside the cascade");
+}
+
+void TestStaticClassification() {
+    ModelResource mesh;
+    mesh.bounds = AABB(glm::vec3(-1.0f), glm::vec3(1.0f));
+    ModelResource dynamicMesh = mesh;
+    dynamicMesh.dynamic = true;
+
+    EntityManager entityManager;
+    auto still = std::make_shared<Entity>("Still");
+    still->AddComponent<Model>(&mesh);
+    still->AddComponent<Transform>();
+    entityManager.AddEntity(still);
+
+    auto moving = std::make_shared<Entity>("Moving");
+    moving->AddComponent<Model>(&mesh);
+    moving->AddComponent<Transform>();
+    entityManager.AddEntity(moving);
+
+    auto rewritten = std::make_shared<Entity>("Rewritten");
+    rewritten->AddComponent<Model>(&dynamicMesh);
+    rewritten->AddComponent<Transform>();
+    entityManager.AddEntity(rewritten);
+
+    const SpatialIndex& index = entityManager.GetSpatialIndex();
+    for (uint32_t i = 0; i <= SpatialIndex::STATIC_AFTER_UPDATES; i++) {
+        moving->GetComponent<Transform>().position.x += 1.0f;
+        entityManager.UpdateSpatialIndex();
+    }
+    Expect(index.IsStatic(still->GetId()), "An entity that stayed put isn't static");
+    Expect(!index.IsStatic(moving->GetId()), "A moving entity is static");
+    Expect(!index.IsStatic(rewritten->GetId()), "A dynamic mesh is static");
+
+    // Nothing changed, anything cached from the static entities is still good
+    uint32_t version = index.GetStaticVersion();
+    entityManager.UpdateSpatialIndex();
+    Expect(index.GetStaticVersion() == version, "The static version changed while nothing moved");
+
+    still->GetComponent<Transform>().position.y = 3.0f;
+    entityManager.UpdateSpatialIndex();
+    Expect(!index.IsStatic(still->GetId()), "A static entity that moved is still static");
+    Expect(index.GetStaticVersion() != version, "Moving a static entity didn't change the static version");
+}
+
+int main() {
+    spdlog::set_level(spdlog::level::info);
+
+    std::vector<TestResult> results;
+    results.push_back(RunTest("Cascade splits", TestSplits));
+    results.push_back(RunTest("Stable cascade size", TestStableSize));
+    results.push_back(RunTest("Texel snapping", TestTexelSnapping));
+    results.push_back(RunTest("Slice coverage", TestCoverage));
+    results.push_back(RunTest("Padded cascade kept", TestPaddedCascadeKept));
+    results.push_back(RunTest("Static classification", TestStaticClassification));
+
+    return ReportResults(results);
+}
@@ -0,0 +1,224 @@
+#include <chrono>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "SpatialIndex.h"
+#include "TestHarness.h"
+#include <glm/gtc/matrix_transform.hpp>
+#include <spdlog/spdlog.h>
+
+// Compares the AABBTree against a brute force scan (what PlatformerGame::CheckCollectibleCollisions used to do)
+// for box, sphere, frustum and ray queries, before and after moving a portion of the boxes.
+
+using Clock = std::chrono::high_resolution_clock;
+
+double MillisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+struct BenchmarkScene {
+    std::vector<AABB> boxes;
+    std::vector<bool> alive;
+    std::vector<int> proxies;
+    AABBTree tree;
+    float worldSize;
+};
+
+AABB RandomBox(std::mt19937& rng, float worldSize) {
+    std::uniform_real_distribution<float> position(-worldSize, worldSize);
+    std::uniform_real_distribution<float> size(0.25f, 2.0f);
+    glm::vec3 center(position(rng), position(rng), position(rng));
+    glm::vec3 extents(size(rng), size(rng), size(rng));
+    return AABB(center - extents, center + extents);
+}
+
+// Keeps density roughly constant so the number of hits per query doesn't explode with the entity count
+void BuildScene(BenchmarkScene& scene, size_t count, std::mt19937& rng) {
+    scene.worldSize = 4.0f * std::cbrt(static_cast<float>(count));
+    scene.boxes.resize(count);
+    scene.proxies.resize(count);
+    scene.alive.assign(count, true);
+
+    auto start = Clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        scene.boxes[i] = RandomBox(rng, scene.worldSize);
+        scene.proxies[i] = scene.tree.CreateProxy(scene.boxes[i], static_cast<uint32_t>(i));
+    }
+    spdlog::info("  build: {:.2f} ms (height {}, area ratio {:.1f})", MillisecondsSince(start), scene.tree.GetHeight(), scene.tree.GetAreaRatio());
+}
+
+// Queries test the fat boxes, so hits are filtered by the tight box like SpatialIndex does
+void CompareQueries(const BenchmarkScene& scene, std::mt19937& rng, size_t queryCount) {
+    std::uniform_real_distribution<float> position(-scene.worldSize, scene.worldSize);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+    std::vector<glm::vec3> centers(queryCount);
+    for (auto& center : centers) {
+        center = glm::vec3(position(rng), position(rng), position(rng));
+    }
+
+    const float radius = 3.0f;
+    size_t treeHits = 0;
+    size_t bruteHits = 0;
+
+    // Sphere
+    auto start = Clock::now();
+    for (const auto& center : centers) {
+        scene.tree.QuerySphere(center, radius, [&](uint32_t index, int) {
+            treeHits += scene.boxes[index].OverlapsSphere(center, radius) ? 1 : 0;
+            return true;
+        });
+    }
+    double treeTime = MillisecondsSince(start);
+
+    start = Clock::now();
+    for (const auto& center : centers) {
+        for (size_t i = 0; i < scene.boxes.size(); ++i) {
+            bruteHits += scene.alive[i] && scene.boxes[i].OverlapsSphere(center, radius) ? 1 : 0;
+        }
+    }
+    double bruteTime = MillisecondsSince(start);
+
+    spdlog::info("  sphere x{}: tree {:.2f} ms, brute force {:.2f} ms ({} hits)", queryCount, treeTime, bruteTime, treeHits);
+    if (treeHits != bruteHits) {
+        throw std::runtime_error("Sphere query mismatch: " + std::to_string(treeHits) + " vs " + std::to_string(bruteHits));
+    }
+
+    // Box
+    treeHits = bruteHits = 0;
+    start = Clock::now();
+    for (const auto& center : centers) {
+        AABB query(center - glm::vec3(radius), center + glm::vec3(radius));
+        scene.tree.Query(query, [&](uint32_t index, int) {
+            treeHits += scene.boxes[index].Overlaps(query) ? 1 : 0;
+            return true;
+        });
+    }
+    treeTime = MillisecondsSince(start);
+
+    start = Clock::now();
+    for (const auto& center : centers) {
+        AABB query(center - glm::vec3(radius), center + glm::vec3(radius));
+        for (size_t i = 0; i < scene.boxes.size(); ++i) {
+            bruteHits += scene.alive[i] && scene.boxes[i].Overlaps(query) ? 1 : 0;
+        }
+    }
+    bruteTime = MillisecondsSince(start);
+
+    spdlog::info("  box x{}: tree {:.2f} ms, brute force {:.2f} ms ({} hits)", queryCount, treeTime, bruteTime, treeHits);
+    if (treeHits != bruteHits) {
+        throw std::runtime_error("Box query mismatch: " + std::to_string(treeHits) + " vs " + std::to_string(bruteHits));
+    }
+
+    // Frustum, a narrow camera looking at the origin from the edge of the world
+    glm::mat4 projection = glm::perspective(glm::radians(30.0f), 16.0f / 9.0f, 0.1f, scene.worldSize);
+    glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 0.0f, -scene.worldSize), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    Frustum frustum = Frustum::FromMatrix(projection * view);
+
+    treeHits = bruteHits = 0;
+    start = Clock::now();
+    scene.tree.QueryFrustum(frustum, [&](uint32_t index, int) {
+        treeHits += frustum.Intersects(scene.boxes[index]) ? 1 : 0;
+        return true;
+    });
+    treeTime = MillisecondsSince(start);
+
+    start = Clock::now();
+    for (size_t i = 0; i < scene.boxes.size(); ++i) {
+        bruteHits += scene.alive[i] && frustum.Intersects(scene.boxes[i]) ? 1 : 0;
+    }
+    bruteTime = MillisecondsSince(start);
+
+    spdlog::info("  frustum x1: tree {:.2f} ms, brute force {:.2f} ms ({} visible)", treeTime, bruteTime, treeHits);
+    if (treeHits != bruteHits) {
+        throw std::runtime_error("Frustum query mismatch: " + std::to_string(treeHits) + " vs " + std::to_string(bruteHits));
+    }
+
+    // Closest hit raycasts
+    treeTime = bruteTime = 0.0;
+    for (const auto& center : centers) {
+        Ray ray;
+        ray.origin = center;
+        ray.direction = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)) + glm::vec3(0.0001f));
+        glm::vec3 invDirection = 1.0f / ray.direction;
+        const float maxDistance = scene.worldSize;
+
+        start = Clock::now();
+        float treeClosest = maxDistance;
+        scene.tree.Raycast(ray, maxDistance, [&](uint32_t index, int, float) {
+            float t;
+            if (Ray::IntersectAABB(ray.origin, invDirection, scene.boxes[index], treeClosest, t)) {
+                treeClosest = t;
+            }
+            return treeClosest;
+        });
+        treeTime += MillisecondsSince(start);
+
+        start = Clock::now();
+        float bruteClosest = maxDistance;
+        for (size_t i = 0; i < scene.boxes.size(); ++i) {
+            float t;
+            if (scene.alive[i] && Ray::IntersectAABB(ray.origin, invDirection, scene.boxes[i], bruteClosest, t)) {
+                bruteClosest = t;
+            }
+        }
+        bruteTime += MillisecondsSince(start);
+
+        if (treeClosest != bruteClosest) {
+            throw std::runtime_error("Raycast mismatch: " + std::to_string(treeClosest) + " vs " + std::to_string(bruteClosest));
+        }
+    }
+    spdlog::info("  raycast x{}: tree {:.2f} ms, brute force {:.2f} ms", queryCount, treeTime, bruteTime);
+}
+
+// Nudges 10% of the boxes, most stay inside their fat box and never touch the tree
+void MoveBoxes(BenchmarkScene& scene, std::mt19937& rng) {
+    std::uniform_int_distribution<size_t> pick(0, scene.boxes.size() - 1);
+    std::uniform_real_distribution<float> nudge(-0.15f, 0.15f);
+
+    size_t moveCount = scene.boxes.size() / 10;
+    size_t reinserted = 0;
+
+    auto start = Clock::now();
+    for (size_t i = 0; i < moveCount; ++i) {
+        size_t index = pick(rng);
+        glm::vec3 offset(nudge(rng), nudge(rng), nudge(rng));
+        scene.boxes[index] = AABB(scene.boxes[index].min + offset, scene.boxes[index].max + offset);
+        reinserted += scene.tree.MoveProxy(scene.proxies[index], scene.boxes[index]) ? 1 : 0;
+    }
+    spdlog::info("  refit {} moved: {:.2f} ms ({} reinserted)", moveCount, MillisecondsSince(start), reinserted);
+}
+
+void RunAtScale(size_t count, size_t queryCount) {
+    spdlog::info("{} entities", count);
+    std::mt19937 rng(1337);
+
+    BenchmarkScene scene;
+    BuildScene(scene, count, rng);
+    CompareQueries(scene, rng, queryCount);
+
+    MoveBoxes(scene, rng);
+    CompareQueries(scene, rng, queryCount);
+
+    // Remove half and make sure the tree is still consistent
+    for (size_t i = 0; i < count; i += 2) {
+        scene.tree.DestroyProxy(scene.proxies[i]);
+        scene.alive[i] = false;
+    }
+    if (scene.tree.GetProxyCount() != count / 2) {
+        throw std::runtime_error("Proxy count mismatch after removal");
+    }
+    CompareQueries(scene, rng, queryCount);
+}
+
+int main() {
+    std::vector<TestResult> testResults;
+    testResults.push_back(RunTest("1k", [] { RunAtScale(1000, 1000); }));
+    testResults.push_back(RunTest("10k", [] { RunAtScale(10000, 1000); }));
+    testResults.push_back(RunTest("100k", [] { RunAtScale(100000, 200); }));
+    testResults.push_back(RunTest("1M", [] { RunAtScale(1000000, 20); }));
+
+    return ReportResults(testResults);
+}
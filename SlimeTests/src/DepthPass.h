@@ -0,0 +1,275 @@
+#pragma once
+
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "HeadlessContext.h"
+#include "ResourcePathManager.h"
+#include "ShaderManager.h"
+
+// Offscreen depth only pass with the shadow map shaders: instance buffer at set 0 binding 1 and the view
+// projection as a push constant. Renders into a square D32 image and copies it to a readable buffer.
+struct DepthPass {
+    static constexpr VkFormat DEPTH_FORMAT = VK_FORMAT_D32_SFLOAT;
+
+    uint32_t size = 0;
+
+    VkImage image = VK_NULL_HANDLE;
+    VmaAllocation imageAllocation = VK_NULL_HANDLE;
+    VkImageView view = VK_NULL_HANDLE;
+    VkBuffer readback = VK_NULL_HANDLE;
+    VmaAllocation readbackAllocation = VK_NULL_HANDLE;
+
+    std::vector<VkDescriptorSetLayout> setLayouts;
+    VkPipelineLayout layout = VK_NULL_HANDLE;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+    VkDescriptorSet instanceSet = VK_NULL_HANDLE;
+
+    void Create(HeadlessContext& ctx, ShaderManager& shaderManager, uint32_t targetSize) {
+        size = targetSize;
+        CreateTarget(ctx);
+        CreatePipeline(ctx, shaderManager);
+    }
+
+    void Destroy(HeadlessContext& ctx) {
+        ctx.disp.destroyDescriptorPool(descriptorPool, nullptr);
+        ctx.disp.destroyPipeline(pipeline, nullptr);
+        ctx.disp.destroyPipelineLayout(layout, nullptr);
+        ctx.disp.destroyImageView(view, nullptr);
+        vmaDestroyImage(ctx.allocator, image, imageAllocation);
+        vmaDestroyBuffer(ctx.allocator, readback, readbackAllocation);
+    }
+
+    void BindInstanceBuffer(HeadlessContext& ctx, VkBuffer instanceBuffer) {
+        VkDescriptorBufferInfo bufferInfo = { instanceBuffer, 0, VK_WHOLE_SIZE };
+        VkWriteDescriptorSet write = {};
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = instanceSet;
+        write.dstBinding = 1;
+        write.descriptorCount = 1;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        write.pBufferInfo = &bufferInfo;
+        ctx.disp.updateDescriptorSets(1, &write, 0, nullptr);
+    }
+
+    // Clears, binds the pipeline and instance set, lets draw record the draws, then copies the depth out.
+    // With VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT nothing is bound, draw has to execute secondary
+    // command buffers that call Bind themselves.
+    void Record(HeadlessContext& ctx, VkCommandBuffer cmd, const glm::mat4& viewProjection, const std::function<void(VkCommandBuffer)>& draw, VkRenderingFlags renderingFlags = 0) {
+        Barrier(ctx, cmd, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+                VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+                VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT);
+
+        VkRenderingAttachmentInfo depthAttachment = {};
+        depthAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+        depthAttachment.imageView = view;
+        depthAttachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL;
+        depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+        depthAttachment.clearValue.depthStencil = { 1.0f, 0 };
+
+        VkRenderingInfo renderingInfo = {};
+        renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+        renderingInfo.flags = renderingFlags;
+        renderingInfo.renderArea = { { 0, 0 }, { size, size } };
+        renderingInfo.layerCount = 1;
+        renderingInfo.pDepthAttachment = &depthAttachment;
+
+        ctx.disp.cmdBeginRendering(cmd, &renderingInfo);
+        if (!(renderingFlags & VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT)) {
+            Bind(ctx, cmd, viewProjection);
+        }
+        draw(cmd);
+        ctx.disp.cmdEndRendering(cmd);
+
+        Barrier(ctx, cmd, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+
+        VkBufferImageCopy region = {};
+        region.imageSubresource = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 0, 1 };
+        region.imageExtent = { size, size, 1 };
+        ctx.disp.cmdCopyImageToBuffer(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readback, 1, &region);
+    }
+
+    void Bind(HeadlessContext& ctx, VkCommandBuffer cmd, const glm::mat4& viewProjection) {
+        ctx.disp.cmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        ctx.disp.cmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, 1, &instanceSet, 0, nullptr);
+        ctx.disp.cmdPushConstants(cmd, layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(glm::mat4), &viewProjection);
+    }
+
+    // What secondary command buffers continuing this pass inherit
+    VkCommandBufferInheritanceRenderingInfo InheritanceInfo() const {
+        VkCommandBufferInheritanceRenderingInfo inheritanceInfo = {};
+        inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO;
+        inheritanceInfo.depthAttachmentFormat = DEPTH_FORMAT;
+        inheritanceInfo.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+        return inheritanceInfo;
+    }
+
+    // Only valid once the recorded commands have finished
+    std::vector<float> ReadDepth(HeadlessContext& ctx) {
+        std::vector<float> depth(size * size);
+        void* mappedData;
+        VK_CHECK(vmaMapMemory(ctx.allocator, readbackAllocation, &mappedData));
+        vmaInvalidateAllocation(ctx.allocator, readbackAllocation, 0, VK_WHOLE_SIZE);
+        std::memcpy(depth.data(), mappedData, depth.size() * sizeof(float));
+        vmaUnmapMemory(ctx.allocator, readbackAllocation);
+        return depth;
+    }
+
+private:
+    void CreateTarget(HeadlessContext& ctx) {
+        VkImageCreateInfo imageInfo = {};
+        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageInfo.imageType = VK_IMAGE_TYPE_2D;
+        imageInfo.format = DEPTH_FORMAT;
+        imageInfo.extent = { size, size, 1 };
+        imageInfo.mipLevels = 1;
+        imageInfo.arrayLayers = 1;
+        imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+        imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imageInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+
+        VmaAllocationCreateInfo allocInfo = {};
+        allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+        VK_CHECK(vmaCreateImage(ctx.allocator, &imageInfo, &allocInfo, &image, &imageAllocation, nullptr));
+
+        VkImageViewCreateInfo viewInfo = {};
+        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewInfo.image = image;
+        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewInfo.format = DEPTH_FORMAT;
+        viewInfo.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1 };
+        VK_CHECK(ctx.disp.createImageView(&viewInfo, nullptr, &view));
+
+        SlimeUtil::CreateBuffer("Depth Readback", ctx.allocator, size * size * sizeof(float), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU, readback, readbackAllocation);
+    }
+
+    void CreatePipeline(HeadlessContext& ctx, ShaderManager& shaderManager) {
+        ShaderModule vertShader = shaderManager.LoadShader(ctx.disp, ResourcePathManager::GetShaderPath("shadowmap.vert.spv"), VK_SHADER_STAGE_VERTEX_BIT);
+        ShaderModule fragShader = shaderManager.LoadShader(ctx.disp, ResourcePathManager::GetShaderPath("shadowmap.frag.spv"), VK_SHADER_STAGE_FRAGMENT_BIT);
+        ShaderManager::ShaderResources resources = shaderManager.CombineResources({ vertShader, fragShader });
+        setLayouts = shaderManager.CreateDescriptorSetLayouts(ctx.disp, resources);
+        if (setLayouts.empty()) {
+            throw std::runtime_error("Shadow map shaders have no instance buffer layout");
+        }
+
+        VkPipelineLayoutCreateInfo layoutInfo = {};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        layoutInfo.setLayoutCount = static_cast<uint32_t>(setLayouts.size());
+        layoutInfo.pSetLayouts = setLayouts.data();
+        layoutInfo.pushConstantRangeCount = static_cast<uint32_t>(resources.pushConstantRanges.size());
+        layoutInfo.pPushConstantRanges = resources.pushConstantRanges.data();
+        VK_CHECK(ctx.disp.createPipelineLayout(&layoutInfo, nullptr, &layout));
+
+        VkPipelineShaderStageCreateInfo stages[2] = {};
+        stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+        stages[0].module = vertShader.handle;
+        stages[0].pName = "main";
+        stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+        stages[1].module = fragShader.handle;
+        stages[1].pName = "main";
+
+        VkPipelineVertexInputStateCreateInfo vertexInput = {};
+        vertexInput.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+        vertexInput.vertexBindingDescriptionCount = static_cast<uint32_t>(resources.bindingDescriptions.size());
+        vertexInput.pVertexBindingDescriptions = resources.bindingDescriptions.data();
+        vertexInput.vertexAttributeDescriptionCount = static_cast<uint32_t>(resources.attributeDescriptions.size());
+        vertexInput.pVertexAttributeDescriptions = resources.attributeDescriptions.data();
+
+        VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
+        inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+        inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+        VkViewport viewport = { 0.0f, 0.0f, static_cast<float>(size), static_cast<float>(size), 0.0f, 1.0f };
+        VkRect2D scissor = { { 0, 0 }, { size, size } };
+        VkPipelineViewportStateCreateInfo viewportState = {};
+        viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+        viewportState.viewportCount = 1;
+        viewportState.pViewports = &viewport;
+        viewportState.scissorCount = 1;
+        viewportState.pScissors = &scissor;
+
+        VkPipelineRasterizationStateCreateInfo rasterizer = {};
+        rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+        rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+        rasterizer.cullMode = VK_CULL_MODE_NONE;
+        rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+        rasterizer.lineWidth = 1.0f;
+
+        VkPipelineMultisampleStateCreateInfo multisampling = {};
+        multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+        multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+        VkPipelineDepthStencilStateCreateInfo depthStencil = {};
+        depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+        depthStencil.depthTestEnable = VK_TRUE;
+        depthStencil.depthWriteEnable = VK_TRUE;
+        depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+
+        VkPipelineColorBlendStateCreateInfo colorBlending = {};
+        colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+
+        VkPipelineRenderingCreateInfo renderingInfo = {};
+        renderingInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
+        renderingInfo.depthAttachmentFormat = DEPTH_FORMAT;
+
+        VkGraphicsPipelineCreateInfo pipelineInfo = {};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+        pipelineInfo.pNext = &renderingInfo;
+        pipelineInfo.stageCount = 2;
+        pipelineInfo.pStages = stages;
+        pipelineInfo.pVertexInputState = &vertexInput;
+        pipelineInfo.pInputAssemblyState = &inputAssembly;
+        pipelineInfo.pViewportState = &viewportState;
+        pipelineInfo.pRasterizationState = &rasterizer;
+        pipelineInfo.pMultisampleState = &multisampling;
+        pipelineInfo.pDepthStencilState = &depthStencil;
+        pipelineInfo.pColorBlendState = &colorBlending;
+        pipelineInfo.layout = layout;
+        VK_CHECK(ctx.disp.createGraphicsPipelines(VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline));
+
+        VkDescriptorPoolSize poolSize = { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 };
+        VkDescriptorPoolCreateInfo poolInfo = {};
+        poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        poolInfo.maxSets = 1;
+        poolInfo.poolSizeCount = 1;
+        poolInfo.pPoolSizes = &poolSize;
+        VK_CHECK(ctx.disp.createDescriptorPool(&poolInfo, nullptr, &descriptorPool));
+
+        VkDescriptorSetAllocateInfo setInfo = {};
+        setInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        setInfo.descriptorPool = descriptorPool;
+        setInfo.descriptorSetCount = 1;
+        setInfo.pSetLayouts = &setLayouts[0];
+        VK_CHECK(ctx.disp.allocateDescriptorSets(&setInfo, &instanceSet));
+    }
+
+    void Barrier(HeadlessContext& ctx, VkCommandBuffer cmd, VkImageLayout oldLayout, VkImageLayout newLayout, VkPipelineStageFlags2 srcStage, VkAccessFlags2 srcAccess, VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess) {
+        VkImageMemoryBarrier2 barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+        barrier.srcStageMask = srcStage;
+        barrier.srcAccessMask = srcAccess;
+        barrier.dstStageMask = dstStage;
+        barrier.dstAccessMask = dstAccess;
+        barrier.oldLayout = oldLayout;
+        barrier.newLayout = newLayout;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = image;
+        barrier.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1 };
+
+        VkDependencyInfo dependency = {};
+        dependency.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+        dependency.imageMemoryBarrierCount = 1;
+        dependency.pImageMemoryBarriers = &barrier;
+        ctx.disp.cmdPipelineBarrier2(cmd, &dependency);
+    }
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <functional>
+#include <spdlog/spdlog.h>
+#include <vk_mem_alloc.h>
+#include <VkBootstrap.h>
+
+#include "VulkanDebugUtils.h"
+#include "VulkanUtil.h"
+
+// Vulkan device without a window or swapchain, for tests that render offscreen. Works on a software
+// implementation, e.g. run with VK_ICD_FILENAMES pointing at lavapipe's lvp_icd json on CI machines.
+
+// CTest reports this return code as skipped (SKIP_RETURN_CODE), used when there is no Vulkan device at all
+constexpr int TEST_SKIPPED = 77;
+
+struct HeadlessContext {
+    vkb::Instance instance;
+    vkb::InstanceDispatchTable instDisp;
+    vkb::Device device;
+    vkb::DispatchTable disp;
+    VmaAllocator allocator = VK_NULL_HANDLE;
+    VkQueue queue = VK_NULL_HANDLE;
+    VkCommandPool commandPool = VK_NULL_HANDLE;
+    VulkanDebugUtils debugUtils;
+
+    bool Create() {
+        vkb::InstanceBuilder instanceBuilder;
+        auto instanceRet = instanceBuilder.set_headless(true).require_api_version(1, 3, 0).build();
+        if (!instanceRet) {
+            spdlog::warn("No Vulkan 1.3 instance: {}", instanceRet.error().message());
+            return false;
+        }
+        instance = instanceRet.value();
+        instDisp = instance.make_table();
+
+        // Only what the engine's offscreen paths need, so software implementations qualify
+        VkPhysicalDeviceVulkan13Features features13 = {};
+        features13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+        features13.dynamicRendering = VK_TRUE;
+        features13.synchronization2 = VK_TRUE;
+
+        VkPhysicalDeviceVulkan12Features features12 = {};
+        features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+        features12.drawIndirectCount = VK_TRUE;
+
+        VkPhysicalDeviceFeatures features = {};
+        features.multiDrawIndirect = VK_TRUE;
+
+        vkb::PhysicalDeviceSelector selector(instance);
+        auto physicalDeviceRet = selector.set_minimum_version(1, 3)
+                                         .set_required_features(features)
+                                         .set_required_features_12(features12)
+                                         .set_required_features_13(features13)
+                                         .select();
+        if (!physicalDeviceRet) {
+            spdlog::warn("No suitable physical device: {}", physicalDeviceRet.error().message());
+            vkb::destroy_instance(instance);
+            return false;
+        }
+        spdlog::info("Running on {}", physicalDeviceRet.value().properties.deviceName);
+
+        vkb::DeviceBuilder deviceBuilder{ physicalDeviceRet.value() };
+        auto deviceRet = deviceBuilder.build();
+        if (!deviceRet) {
+            spdlog::warn("Failed to create device: {}", deviceRet.error().message());
+            vkb::destroy_instance(instance);
+            return false;
+        }
+        device = deviceRet.value();
+        disp = device.make_table();
+        queue = device.get_queue(vkb::QueueType::graphics).value();
+
+        VkCommandPoolCreateInfo poolInfo = {};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        poolInfo.queueFamilyIndex = device.get_queue_index(vkb::QueueType::graphics).value();
+        VK_CHECK(disp.createCommandPool(&poolInfo, nullptr, &commandPool));
+
+        // The rest of the functions are fetched by VMA through these two
+        VmaVulkanFunctions vulkanFunctions = {};
+        vulkanFunctions.vkGetInstanceProcAddr = instance.fp_vkGetInstanceProcAddr;
+        vulkanFunctions.vkGetDeviceProcAddr = device.fp_vkGetDeviceProcAddr;
+
+        VmaAllocatorCreateInfo allocatorInfo = {};
+        allocatorInfo.physicalDevice = device.physical_device.physical_device;
+        allocatorInfo.device = device.device;
+        allocatorInfo.instance = instance.instance;
+        allocatorInfo.pVulkanFunctions = &vulkanFunctions;
+        VK_CHECK(vmaCreateAllocator(&allocatorInfo, &allocator));
+
+        debugUtils = VulkanDebugUtils(instDisp, device);
+        return true;
+    }
+
+    void Destroy() {
+        disp.deviceWaitIdle();
+        vmaDestroyAllocator(allocator);
+        disp.destroyCommandPool(commandPool, nullptr);
+        vkb::destroy_device(device);
+        vkb::destroy_instance(instance);
+    }
+
+    // Records, submits and waits for a one time command buffer
+    void Submit(const std::function<void(VkCommandBuffer)>& record) {
+        VkCommandBuffer cmd = SlimeUtil::BeginSingleTimeCommands(disp, commandPool);
+        record(cmd);
+        SlimeUtil::EndSingleTimeCommands(disp, queue, commandPool, cmd);
+    }
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <functional>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Scaffolding shared by the test executables: each test is a function that throws on failure, RunTest
+// catches that into a result and ReportResults logs them all and gives main its return code.
+
+struct TestResult {
+    std::string testName;
+    bool passed;
+    std::string errorMessage;
+};
+
+inline TestResult RunTest(const std::string& testName, std::function<void()> testFunction) {
+    try {
+        testFunction();
+        return { testName, true, "" };
+    } catch (const std::exception& e) {
+        return { testName, false, e.what() };
+    } catch (...) {
+        return { testName, false, "Unknown exception occurred" };
+    }
+}
+
+inline void Expect(bool condition, const std::string& message) {
+    if (!condition) {
+        throw std::runtime_error(message);
+    }
+}
+
+inline int ReportResults(const std::vector<TestResult>& results) {
+    bool allPassed = true;
+    for (const auto& result : results) {
+        if (result.passed) {
+            spdlog::info("Test '{}' passed.", result.testName);
+        } else {
+            spdlog::error("Test '{}' failed: {}", result.testName, result.errorMessage);
+            allPassed = false;
+        }
+    }
+
+    return allPassed ? 0 : 1;
+}